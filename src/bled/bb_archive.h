@@ -213,9 +213,10 @@ typedef struct transformer_state_t {
 	int      src_fd;
 	/* Output */
 	int      dst_fd;
-	size_t   mem_output_size_max; /* if non-zero, decompress to RAM instead of fd */
+	size_t   mem_output_size_max; /* if non-zero, decompress to mem_output_buf instead of fd */
 	size_t   mem_output_size;
 	char     *mem_output_buf;
+	smallint mem_output_fixed;    /* if non-zero, mem_output_buf is caller provided and is never grown */
 
 	off_t    bytes_out;
 	off_t    bytes_in;  /* used in unzip code only: needs to know packed size */
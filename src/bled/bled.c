@@ -19,12 +19,14 @@ typedef long long int(*unpacker_t)(transformer_state_t *xstate);
 
 /* Globals */
 smallint bb_got_signal;
-uint64_t bb_total_rb;
+THREAD_LOCAL uint64_t bb_total_rb;
+THREAD_LOCAL mem_input_t bb_mem_input;
 printf_t bled_printf = NULL;
+write_t bled_write = NULL;
 progress_t bled_progress = NULL;
 unsigned long* bled_cancel_request;
 static bool bled_initialized = 0;
-jmp_buf bb_error_jmp;
+THREAD_LOCAL jmp_buf bb_error_jmp;
 
 static long long int unpack_none(transformer_state_t *xstate)
 {
@@ -89,6 +91,104 @@ err:
 	return -1;
 }
 
+/* Uncompress file 'src', compressed using 'type', to buffer 'buf' of size 'size'.
+ * Decompression stops once the buffer is full, so this can be used to access the
+ * header of a compressed image without having to decompress the whole stream.
+ * Returns the number of bytes written to the buffer, or -1 on error. */
+int64_t bled_uncompress_to_buffer(const char* src, char* buf, size_t size, int type)
+{
+	transformer_state_t xstate;
+	int64_t ret;
+
+	if (!bled_initialized)
+		return -1;
+
+	if ((buf == NULL) || (size == 0))
+		return -1;
+
+	bb_total_rb = 0;
+	init_transformer_state(&xstate);
+	xstate.src_fd = -1;
+	xstate.dst_fd = -1;
+	xstate.check_signature = 1;
+	xstate.mem_output_buf = buf;
+	xstate.mem_output_fixed = 1;
+	xstate.mem_output_size_max = size;
+
+	xstate.src_fd = _openU(src, _O_RDONLY | _O_BINARY, 0);
+	if (xstate.src_fd < 0) {
+		bb_printf("Could not open '%s' (errno: %d)", src, errno);
+		goto err;
+	}
+
+	if ((type < 0) || (type >= BLED_COMPRESSION_MAX)) {
+		bb_printf("unsupported compression format");
+		goto err;
+	}
+
+	if (setjmp(bb_error_jmp))
+		goto err;
+	ret = unpacker[type](&xstate);
+	_close(xstate.src_fd);
+	// A full buffer is reported as a short write by the unpacker, which is what we want
+	if (xstate.mem_output_size == size)
+		return (int64_t)size;
+	return (ret < 0) ? ret : (int64_t)xstate.mem_output_size;
+
+err:
+	if (xstate.src_fd > 0)
+		_close(xstate.src_fd);
+	return -1;
+}
+
+/* Uncompress buffer 'src' of length 'src_len', compressed using 'type', to buffer 'dst' of size 'dst_len'.
+ * As the error handling and input state are kept per thread, this can be called from several threads
+ * at once, which is what lets containers made of independently compressed chunks be processed in
+ * parallel. No progress is reported. Returns the number of bytes written to 'dst', or -1 on error. */
+int64_t bled_uncompress_from_buffer_to_buffer(const char* src, size_t src_len, char* dst, size_t dst_len, int type)
+{
+	transformer_state_t xstate;
+	int64_t ret;
+
+	if (!bled_initialized)
+		return -1;
+
+	if ((src == NULL) || (dst == NULL) || (dst_len == 0))
+		return -1;
+
+	if ((type < 0) || (type >= BLED_COMPRESSION_MAX)) {
+		bb_printf("unsupported compression format");
+		return -1;
+	}
+
+	init_transformer_state(&xstate);
+	xstate.src_fd = BB_MEM_INPUT_FD;
+	xstate.dst_fd = -1;
+	xstate.check_signature = 1;
+	xstate.mem_output_buf = dst;
+	xstate.mem_output_fixed = 1;
+	xstate.mem_output_size_max = dst_len;
+	// Raw deflate needs to be told how much data it can consume
+	xstate.bytes_in = src_len;
+	bb_mem_input.buf = src;
+	bb_mem_input.size = src_len;
+	bb_mem_input.pos = 0;
+
+	if (setjmp(bb_error_jmp)) {
+		ret = -1;
+		goto out;
+	}
+	ret = unpacker[type](&xstate);
+	if (xstate.mem_output_size == dst_len)
+		ret = (int64_t)dst_len;
+	else if (ret >= 0)
+		ret = (int64_t)xstate.mem_output_size;
+
+out:
+	bb_mem_input.buf = NULL;
+	return ret;
+}
+
 /* Uncompress using Windows handles */
 int64_t bled_uncompress_with_handles(HANDLE hSrc, HANDLE hDst, int type)
 {
@@ -129,18 +229,23 @@ int64_t bled_uncompress_with_handles(HANDLE hSrc, HANDLE hDst, int type)
  * When the parameters are not NULL you can:
  * - specify the printf-like function you want to use to output message
  *   void print_function(const char* format, ...);
+ * - specify the function you want to use to write the uncompressed data, instead of _write()
+ *   int write_function(int fd, const void* buf, unsigned int count);
  * - specify the function you want to use to display progress, based on number of source archive bytes read
  *   void progress_function(const uint64_t read_bytes);
  * - point to an unsigned long variable, to be used to cancel operations when set to non zero
  */
-int bled_init(printf_t print_function, progress_t progress_function, unsigned long* cancel_request)
+int bled_init(printf_t print_function, write_t write_function, progress_t progress_function, unsigned long* cancel_request)
 {
 	if (bled_initialized)
 		return -1;
 	bled_initialized = true;
 	bled_printf = print_function;
+	bled_write = write_function;
 	bled_progress = progress_function;
 	bled_cancel_request = cancel_request;
+	// Filled here rather than on first use, as the unpackers may run concurrently
+	global_crc32_table = crc32_filltable(NULL, 0);
 	return 0;
 }
 
@@ -148,9 +253,11 @@ int bled_init(printf_t print_function, progress_t progress_function, unsigned lo
 void bled_exit(void)
 {
 	bled_printf = NULL;
+	bled_write = NULL;
 	bled_progress = NULL;
 	bled_cancel_request = NULL;
 	if (global_crc32_table)
 		free(global_crc32_table);
+	global_crc32_table = NULL;
 	bled_initialized = false;
 }
@@ -16,6 +16,7 @@
 #endif
 
 typedef void (*printf_t) (const char* format, ...);
+typedef int (*write_t) (int fd, const void* buf, unsigned int count);
 typedef void (*progress_t) (const uint64_t read_bytes);
 
 typedef enum {
@@ -33,6 +34,14 @@ typedef enum {
 /* Uncompress file 'src', compressed using 'type', to file 'dst' */
 int64_t bled_uncompress(const char* src, const char* dst, int type);
 
+/* Uncompress file 'src', compressed using 'type', to buffer 'buf' of size 'size'
+ * Decompression stops once 'size' bytes have been produced */
+int64_t bled_uncompress_to_buffer(const char* src, char* buf, size_t size, int type);
+
+/* Uncompress buffer 'src' of length 'src_len', compressed using 'type', to buffer 'dst' of size 'dst_len'
+ * This can be called from multiple threads at once, once the library has been initialized */
+int64_t bled_uncompress_from_buffer_to_buffer(const char* src, size_t src_len, char* dst, size_t dst_len, int type);
+
 /* Uncompress using Windows handles */
 int64_t bled_uncompress_with_handles(HANDLE hSrc, HANDLE hDst, int type);
 
@@ -40,11 +49,13 @@ int64_t bled_uncompress_with_handles(HANDLE hSrc, HANDLE hDst, int type);
  * When the parameters are not NULL you can:
  * - specify the printf-like function you want to use to output message
  *   void print_function(const char* format, ...);
+ * - specify the function you want to use to write the uncompressed data, instead of _write()
+ *   int write_function(int fd, const void* buf, unsigned int count);
  * - specify the function you want to use to display progress, based on number of source archive bytes read
  *   void progress_function(const uint64_t read_bytes);
  * - point to an unsigned long variable, to be used to cancel operations when set to non zero
  */
-int bled_init(printf_t print_function, progress_t progress_function, unsigned long* cancel_request);
+int bled_init(printf_t print_function, write_t write_function, progress_t progress_function, unsigned long* cancel_request);
 
 /* This call frees any resource used by the library */
 void bled_exit(void);
@@ -53,6 +53,7 @@
 #define GROUP_SIZE          50      /* 64 would have been more efficient */
 #define MAX_HUFCODE_BITS    20      /* Longest Huffman code allowed */
 #define MAX_SYMBOLS         258     /* 256 literals + RUNA + RUNB */
+#define HUF_LOOKUP_BITS     10      /* Codes up to that many bits are decoded with a single lookup */
 #define SYMBOL_RUNA         0
 #define SYMBOL_RUNB         1
 
@@ -73,7 +74,10 @@
 struct group_data {
 	/* We have an extra slot at the end of limit[] for a sentinel value. */
 	int limit[MAX_HUFCODE_BITS+1], base[MAX_HUFCODE_BITS], permute[MAX_SYMBOLS];
-	int minLen, maxLen;
+	int minLen, maxLen, lookupBits;
+	/* Indexed by the first lookupBits bits of a code: (length << 9) | symbol,
+	 * or 0 if the code is longer than lookupBits */
+	uint16_t lookup[1 << HUF_LOOKUP_BITS];
 };
 
 /* Structure holding all the housekeeping data, including IO buffers and
@@ -96,8 +100,12 @@ struct bunzip_data {
 	/* The CRC values stored in the block header and calculated from the data */
 	uint32_t headerCRC, totalCRC, writeCRC;
 
-	/* Intermediate buffer and its size (in bytes) */
-	uint32_t *dbuf;
+	/* Intermediate buffers and their size (in entries):
+	 * dbuf holds the decoded symbols and the forward links of the inverse
+	 * Burrows-Wheeler transform, lfbuf the backward links, and obuf the
+	 * resulting bytes (which are all allocated along with dbuf) */
+	uint32_t *dbuf, *lfbuf;
+	uint8_t *obuf;
 	unsigned dbufSize;
 
 	/* For I/O error handling */
@@ -161,10 +169,13 @@ static int get_next_block(bunzip_data *bd)
 		i, j, t, runPos, symCount, symTotal, nSelectors, byteCount[256];
 	int runCnt;
 	uint8_t uc, symToByte[256], mtfSymbol[256], *selectors;
-	uint32_t *dbuf;
+	uint32_t *dbuf, *lfbuf;
+	uint8_t *obuf;
 	unsigned origPtr;
 
 	dbuf = bd->dbuf;
+	lfbuf = bd->lfbuf;
+	obuf = bd->obuf;
 	dbufSize = bd->dbufSize;
 	selectors = bd->selectors;
 
@@ -249,7 +260,7 @@ static int get_next_block(bunzip_data *bd)
 		uint8_t length[MAX_SYMBOLS];
 		/* 8 bits is ALMOST enough for temp[], see below */
 		unsigned temp[MAX_HUFCODE_BITS+1];
-		int minLen, maxLen, pp, len_m1;
+		int minLen, maxLen, pp, len_m1, lookupBits, code;
 
 		/* Read Huffman code lengths for each symbol.  They're stored in
 		   a way similar to mtf; record a starting value for the first symbol,
@@ -347,18 +358,47 @@ static int get_next_block(bunzip_data *bd)
 		limit[maxLen] = pp + temp[maxLen] - 1;
 		limit[maxLen+1] = INT_MAX; /* Sentinel value for reading next sym. */
 		base[minLen] = 0;
+
+		/* Build the lookup table, so that the short codes (which are also
+		 * the most frequent ones) can be decoded without walking limit[].
+		 * The codes are assigned in the same order as permute[], and a code
+		 * of length i fills 1 << (lookupBits - i) entries. If the lengths
+		 * describe an oversubscribed code, limit[] does not match canonical
+		 * codes, so we leave the table empty and let the walk deal with it. */
+		lookupBits = MIN(maxLen, HUF_LOOKUP_BITS);
+		memset(hufGroup->lookup, 0, sizeof(hufGroup->lookup[0]) << lookupBits);
+		pp = code = 0;
+		for (i = minLen; i <= maxLen && lookupBits != 0; i++) {
+			for (t = temp[i]; t > 0; t--, pp++, code++) {
+				unsigned k, entry;
+				if (code >= (1 << i)) {
+					memset(hufGroup->lookup, 0, sizeof(hufGroup->lookup[0]) << lookupBits);
+					lookupBits = 0;
+					break;
+				}
+				if (i > lookupBits)
+					continue;
+				entry = (i << 9) | hufGroup->permute[pp];
+				for (k = 0; k < (1U << (lookupBits - i)); k++)
+					hufGroup->lookup[(code << (lookupBits - i)) + k] = (uint16_t)entry;
+			}
+			code <<= 1;
+		}
+		hufGroup->lookupBits = lookupBits;
 	}
 
 	/* We've finished reading and digesting the block header.  Now read this
 	   block's Huffman coded symbols from the file and undo the Huffman coding
 	   and run length encoding, saving the result into dbuf[dbufCount++] = uc */
 
-	/* Initialize symbol occurrence counters and symbol Move To Front table */
+	/* Initialize symbol occurrence counters and symbol Move To Front table.
+	   Rather than symbol indexes, the MTF table holds the bytes they map to,
+	   so that a literal or a run takes its byte straight from the table. */
 	/*memset(byteCount, 0, sizeof(byteCount)); - smaller, but slower */
-	for (i = 0; i < 256; i++) {
+	for (i = 0; i < 256; i++)
 		byteCount[i] = 0;
-		mtfSymbol[i] = (uint8_t)i;
-	}
+	for (i = 0; i < symTotal; i++)
+		mtfSymbol[i] = symToByte[i];
 
 	/* Loop through compressed symbols. */
 
@@ -402,6 +442,14 @@ static int get_next_block(bunzip_data *bd)
 		} else { /* unoptimized equivalent */
 			nextSym = get_bits(bd, hufGroup->maxLen);
 		}
+		/* Short codes: get the symbol and its length from the lookup table */
+		t = hufGroup->lookup[nextSym >> (hufGroup->maxLen - hufGroup->lookupBits)];
+		if (t != 0) {
+			bd->inbufBitCount += hufGroup->maxLen - (t >> 9);
+			nextSym = t & 0x1ff;
+			goto got_huff_sym;
+		}
+
 		/* Figure how many bits are in next symbol and unget extras */
 		i = hufGroup->minLen;
 		while (nextSym > limit[i]) ++i;
@@ -415,6 +463,7 @@ static int get_next_block(bunzip_data *bd)
 		if ((unsigned)nextSym >= MAX_SYMBOLS)
 			return RETVAL_DATA_ERROR;
 		nextSym = hufGroup->permute[nextSym];
+ got_huff_sym:
 
 		/* We have now decoded the symbol, which indicates either a new literal
 		   byte, or a repeated run of the most recent literal byte.  First,
@@ -451,7 +500,7 @@ static int get_next_block(bunzip_data *bd)
 						dbufCount, runCnt, dbufCount + runCnt, dbufSize);
 				return RETVAL_DATA_ERROR;
 			}
-			tmp_byte = symToByte[mtfSymbol[0]];
+			tmp_byte = mtfSymbol[0];
 			byteCount[tmp_byte] += runCnt;
 			while (--runCnt >= 0) dbuf[dbufCount++] = (uint32_t)tmp_byte;
 			runPos = 0;
@@ -479,7 +528,6 @@ static int get_next_block(bunzip_data *bd)
 			mtfSymbol[i] = mtfSymbol[i-1];
 		} while (--i);
 		mtfSymbol[0] = uc;
-		uc = symToByte[uc];
 
 		/* We have our literal byte.  Save it into dbuf. */
 		byteCount[uc]++;
@@ -506,23 +554,43 @@ static int get_next_block(bunzip_data *bd)
 		j = tmp_count;
 	}
 
-	/* Figure out what order dbuf would be in if we sorted it. */
+	/* Figure out what order dbuf would be in if we sorted it. We also keep
+	   the reverse mapping, along with the byte, in lfbuf[]. */
 	for (i = 0; i < dbufCount; i++) {
 		uint8_t tmp_byte = (uint8_t)dbuf[i];
 		int tmp_count = byteCount[tmp_byte];
 		dbuf[tmp_count] |= (i << 8);
+		lfbuf[i] = (tmp_count << 8) | tmp_byte;
 		byteCount[tmp_byte] = tmp_count + 1;
 	}
 
-	/* Decode first byte by hand to initialize "previous" byte.  Note that it
-	   doesn't get output, and if the first three characters are identical
-	   it doesn't qualify as a run (hence writeRunCountdown=5). */
+	/* Follow the sequence vector to undo the transform into obuf[].  Each
+	   step depends on the result of the previous one, and since dbuf[] is
+	   much larger than the CPU caches, nearly every one of them is a cache
+	   miss, so that following a single chain is bound by memory latency.
+	   But the links form a single cycle, that ends where it starts (at
+	   origPtr), so we can also walk it backwards from the end, through
+	   lfbuf[], and have two independent chains of loads in flight.
+
+	   The first byte is decoded by hand to initialize "previous" byte.  Note
+	   that it doesn't get output, and if the first three characters are
+	   identical it doesn't qualify as a run (hence writeRunCountdown=5). */
 	if (dbufCount) {
-		uint32_t tmp;
+		uint32_t fwd, bwd;
 		if ((int)origPtr >= dbufCount) return RETVAL_DATA_ERROR;
-		tmp = dbuf[origPtr];
-		bd->writeCurrent = (uint8_t)tmp;
-		bd->writePos = (tmp >> 8);
+		fwd = dbuf[origPtr];
+		bwd = origPtr << 8;
+		obuf[0] = (uint8_t)fwd;
+		for (i = 1, j = dbufCount; i < j; i++, j--) {
+			fwd = dbuf[fwd >> 8];
+			bwd = lfbuf[bwd >> 8];
+			obuf[i] = (uint8_t)fwd;
+			obuf[j] = (uint8_t)bwd;
+		}
+		if (i == j)
+			obuf[i] = (uint8_t)dbuf[fwd >> 8];
+		bd->writeCurrent = obuf[0];
+		bd->writePos = 0;
 		bd->writeRunCountdown = 5;
 	}
 	bd->writeCount = dbufCount;
@@ -542,7 +610,7 @@ static int get_next_block(bunzip_data *bd)
 */
 int FAST_FUNC read_bunzip(bunzip_data *bd, char *outbuf, int len)
 {
-	const uint32_t *dbuf;
+	const uint8_t *obuf;
 	int pos, current, previous;
 	uint32_t CRC;
 
@@ -550,7 +618,7 @@ int FAST_FUNC read_bunzip(bunzip_data *bd, char *outbuf, int len)
 	if (bd->writeCount < 0)
 		return bd->writeCount;
 
-	dbuf = bd->dbuf;
+	obuf = bd->obuf;
 
 	/* Register-cached state (hopefully): */
 	pos = bd->writePos;
@@ -594,11 +662,9 @@ int FAST_FUNC read_bunzip(bunzip_data *bd, char *outbuf, int len)
 			if (--bd->writeCount < 0)
 				break; /* input block is fully consumed, need next one */
 
-			/* Follow sequence vector to undo Burrows-Wheeler transform */
+			/* Get the next byte of the inverse Burrows-Wheeler transform */
 			previous = current;
-			pos = dbuf[pos];
-			current = (uint8_t)pos;
-			pos >>= 8;
+			current = obuf[++pos];
 
 			/* After 3 consecutive copies of the same byte, the 4th
 			 * is a repeat count.  We count down from 4 instead
@@ -714,11 +780,13 @@ int FAST_FUNC start_bunzip(bunzip_data **bdp, int in_fd,
 	bd->dbufSize = 100000 * (i - h0);
 
 	/* Cannot use xmalloc - may leak bd in NOFORK case! */
-	bd->dbuf = malloc_or_warn(bd->dbufSize * sizeof(bd->dbuf[0]));
+	bd->dbuf = malloc_or_warn(bd->dbufSize * (sizeof(bd->dbuf[0]) + sizeof(bd->lfbuf[0]) + sizeof(bd->obuf[0])) + 1);
 	if (!bd->dbuf) {
 		free(bd);
 		xfunc_die();
 	}
+	bd->lfbuf = bd->dbuf + bd->dbufSize;
+	bd->obuf = (uint8_t*)(bd->lfbuf + bd->dbufSize);
 	return RETVAL_OK;
 }
 
@@ -28,11 +28,11 @@
 #include "bb_archive.h"
 
 
-/* Default input buffer size */
-#define IBUFSIZ 2048
+/* Input buffer size. Must be a multiple of 4 */
+#define IBUFSIZ 65536
 
-/* Default output buffer size */
-#define OBUFSIZ 2048
+/* Output buffer size. The buffer itself is larger, so that a whole string always fits */
+#define OBUFSIZ 131072
 
 /* Defines for third byte of header */
 #define BIT_MASK        0x1f    /* Mask for 'number of compresssion bits'       */
@@ -48,55 +48,115 @@
 
 #define INIT_BITS 9     /* initial number of bits/code */
 
-
-/* machine variants which require cc -Dmachine:  pdp11, z8000, DOS */
-#define HBITS      17   /* 50% occupancy */
-#define HSIZE      (1<<HBITS)
-#define HMASK      (HSIZE-1)    /* unused */
-#define HPRIME     9941         /* unused */
 #define BITS       16
 #define BITS_STR   "16"
-#undef  MAXSEG_64K              /* unused */
 #define MAXCODE(n) (1L << (n))
 
-#define htabof(i)               htab[i]
-#define codetabof(i)            codetab[i]
-#define tab_prefixof(i)         codetabof(i)
-#define tab_suffixof(i)         ((unsigned char *)(htab))[i]
-#define de_stack                ((unsigned char *)&(htab[HSIZE-1]))
-#define clear_tab_prefixof()    memset(codetab, 0, 256)
-
 /*
  * Decompress stdin to stdout.  This routine adapts to the codes in the
  * file building the "string" table on-the-fly; requiring no table to
  * be stored in the compressed file.
+ *
+ * Unlike the original, which unwinds every string one byte at a time
+ * through a stack, we keep the length of each string along with the
+ * (absolute) output position where it was last produced. As long as that
+ * position is still in our output buffer, the string is copied from there
+ * in one go. Only strings that have been flushed out need to be rebuilt
+ * from the prefix chain, and even then they are written in place, since
+ * we know how long they are.
+ *
+ * Codes are extracted from a 64-bit bit buffer, which is refilled 32 bits
+ * at a time. compress writes codes in groups of 8, and pads the current
+ * group whenever the code size changes or the table is cleared, so we
+ * count the codes read since the last change, to skip that padding.
  */
+typedef struct lzw_state_t {
+	transformer_state_t *xstate;
+	unsigned char *inbuf;
+	int inpos;
+	int insize;
+	int eof;
+	uint64_t bitbuf;
+	int bitcnt;
+} lzw_state_t;
+
+/* Fill the bit buffer with as much data as it can hold. Returns -1 on read error */
+static int lzw_fill(lzw_state_t *s)
+{
+	int rsize;
+
+	while (s->bitcnt <= 56) {
+		if (s->inpos >= s->insize) {
+			if (s->eof)
+				break;
+			rsize = safe_read(s->xstate->src_fd, s->inbuf, IBUFSIZ);
+			if (rsize < 0)
+				return -1;
+			if (rsize == 0) {
+				s->eof = 1;
+				break;
+			}
+			s->inpos = 0;
+			s->insize = rsize;
+		}
+		if ((s->bitcnt <= 32) && (s->insize - s->inpos >= 4)) {
+			s->bitbuf |= (uint64_t)get_le32(&s->inbuf[s->inpos]) << s->bitcnt;
+			s->inpos += 4;
+			s->bitcnt += 32;
+		} else {
+			s->bitbuf |= (uint64_t)s->inbuf[s->inpos++] << s->bitcnt;
+			s->bitcnt += 8;
+		}
+	}
+	return 0;
+}
+
+/* Skip the padding that follows a group of codes. Returns -1 on read error */
+static int lzw_skip(lzw_state_t *s, int nbits)
+{
+	int n;
+
+	while (nbits > 0) {
+		if ((s->bitcnt == 0) && ((lzw_fill(s) < 0) || (s->bitcnt == 0)))
+			return (s->bitcnt == 0 && s->eof) ? 0 : -1;
+		n = MIN(nbits, s->bitcnt);
+		/* n may be 64, which we can't shift by */
+		s->bitbuf = (n >= 64) ? 0 : (s->bitbuf >> n);
+		s->bitcnt -= n;
+		nbits -= n;
+	}
+	return 0;
+}
 
 IF_DESKTOP(long long) int FAST_FUNC
 unpack_Z_stream(transformer_state_t *xstate)
 {
 	IF_DESKTOP(long long total_written = 0;)
 	IF_DESKTOP(long long) int retval = -1;
-	unsigned char *stackp;
+	lzw_state_t s;
+	unsigned char *outbuf;
+	unsigned char *p, *q;
 	int finchar;
+	long code;
 	long oldcode;
 	long incode;
-	int inbits;
-	int posbits;
-	int outpos;
-	int insize;
-	int bitmask;
 	long free_ent;
 	long maxcode;
 	long maxmaxcode;
+	long c;
 	int n_bits;
-	int rsize = 0;
-	unsigned char *inbuf; /* were eating insane amounts of stack - */
-	unsigned char *outbuf; /* bad for some embedded targets */
-	unsigned char *htab;
-	unsigned short *codetab;
+	int bitmask;
+	int ncodes;		/* codes read since the last code size change */
+	int outpos;
+	int len;
+	int i;
+	uint64_t w;
+	uint64_t out_base;	/* absolute output position of outbuf[0] */
+	unsigned short *tab_prefix;
+	unsigned char *tab_suffix;
+	unsigned short *tab_len;
+	uint64_t *tab_pos;
 
-	/* Hmm, these were statics - why?! */
 	/* user settable max # bits/code */
 	int maxbits; /* = BITS; */
 	/* block compress mode -C compatible with 2.0 */
@@ -105,22 +165,29 @@ unpack_Z_stream(transformer_state_t *xstate)
 	if (check_signature16(xstate, COMPRESS_MAGIC))
 		return -1;
 
-	inbuf = xzalloc(IBUFSIZ + 64);
-	outbuf = xzalloc(OBUFSIZ + 2048);
-	htab = xzalloc(HSIZE);  /* wasn't zeroed out before, maybe can xmalloc? */
-	codetab = xzalloc(HSIZE * sizeof(codetab[0]));
-
-	insize = 0;
+	memset(&s, 0, sizeof(s));
+	s.xstate = xstate;
+	s.inbuf = xmalloc(IBUFSIZ);
+	outbuf = xmalloc(OBUFSIZ + MAXCODE(BITS) + 8);
+	tab_prefix = xzalloc(MAXCODE(BITS) * sizeof(tab_prefix[0]));
+	tab_suffix = xzalloc(MAXCODE(BITS) * sizeof(tab_suffix[0]));
+	tab_len = xzalloc(MAXCODE(BITS) * sizeof(tab_len[0]));
+	tab_pos = xzalloc(MAXCODE(BITS) * sizeof(tab_pos[0]));
+	if ((s.inbuf == NULL) || (outbuf == NULL) || (tab_prefix == NULL) || (tab_suffix == NULL)
+	 || (tab_len == NULL) || (tab_pos == NULL)) {
+		bb_error_msg("out of memory");
+		goto err;
+	}
 
 	/* xread isn't good here, we have to return - caller may want
 	 * to do some cleanup (e.g. delete incomplete unpacked file etc) */
-	if (full_read(xstate->src_fd, inbuf, 1) != 1) {
+	if (full_read(xstate->src_fd, s.inbuf, 1) != 1) {
 		bb_error_msg("short read");
 		goto err;
 	}
 
-	maxbits = inbuf[0] & BIT_MASK;
-	block_mode = inbuf[0] & BLOCK_MODE;
+	maxbits = s.inbuf[0] & BIT_MASK;
+	block_mode = s.inbuf[0] & BLOCK_MODE;
 	maxmaxcode = MAXCODE(maxbits);
 
 	if (maxbits > BITS) {
@@ -132,184 +199,142 @@ unpack_Z_stream(transformer_state_t *xstate)
 	n_bits = INIT_BITS;
 	maxcode = MAXCODE(INIT_BITS) - 1;
 	bitmask = (1 << INIT_BITS) - 1;
+	ncodes = 0;
 	oldcode = -1;
 	finchar = 0;
 	outpos = 0;
-	posbits = 0 << 3;
+	out_base = 0;
 
 	free_ent = ((block_mode) ? FIRST : 256);
 
-	/* As above, initialize the first 256 entries in the table. */
-	/*clear_tab_prefixof(); - done by xzalloc */
-
-	{
-		int i;
-		for (i = 255; i >= 0; --i)
-			tab_suffixof(i) = (unsigned char) i;
+	/* Initialize the first 256 entries in the table (as strings we never produced) */
+	for (c = 0; c < 256; c++) {
+		tab_suffix[c] = (unsigned char) c;
+		tab_len[c] = 1;
 	}
 
-	do {
- resetbuf:
-		{
-			int i;
-			int e;
-			int o;
-
-			o = posbits >> 3;
-			e = insize - o;
-
-			for (i = 0; i < e; ++i)
-				inbuf[i] = inbuf[i + o];
-
-			insize = e;
-			posbits = 0;
+	while (1) {
+		if (free_ent > maxcode) {
+			if (lzw_skip(&s, ((8 - (ncodes & 7)) & 7) * n_bits) < 0)
+				bb_error_msg_and_err(bb_msg_read_error);
+			ncodes = 0;
+			++n_bits;
+			if (n_bits == maxbits) {
+				maxcode = maxmaxcode;
+			} else {
+				maxcode = MAXCODE(n_bits) - 1;
+			}
+			bitmask = (1 << n_bits) - 1;
 		}
 
-		if (insize < (int) (IBUFSIZ + 64) - IBUFSIZ) {
-			rsize = safe_read(xstate->src_fd, inbuf + insize, IBUFSIZ);
-			if (rsize < 0)
+		if (s.bitcnt < n_bits) {
+			if (lzw_fill(&s) < 0)
 				bb_error_msg_and_err(bb_msg_read_error);
-			insize += rsize;
+			/* A trailing partial code is ignored */
+			if (s.bitcnt < n_bits)
+				break;
+		}
+		code = (long)(s.bitbuf & bitmask);
+		s.bitbuf >>= n_bits;
+		s.bitcnt -= n_bits;
+		ncodes++;
+
+		if (oldcode == -1) {
+			if (code >= 256)
+				bb_error_msg_and_err("corrupted data"); /* %ld", code); */
+			oldcode = code;
+			finchar = (int) oldcode;
+			tab_pos[code] = out_base + outpos;
+			outbuf[outpos++] = (unsigned char) finchar;
+			continue;
 		}
 
-		inbits = ((rsize > 0) ? (insize - insize % n_bits) << 3 :
-				  (insize << 3) - (n_bits - 1));
-
-		while (inbits > posbits) {
-			long code;
-
-			if (free_ent > maxcode) {
-				posbits =
-					((posbits - 1) +
-					 ((n_bits << 3) -
-					  (posbits - 1 + (n_bits << 3)) % (n_bits << 3)));
-				++n_bits;
-				if (n_bits == maxbits) {
-					maxcode = maxmaxcode;
-				} else {
-					maxcode = MAXCODE(n_bits) - 1;
-				}
-				bitmask = (1 << n_bits) - 1;
-				goto resetbuf;
-			}
-			{
-				unsigned char *p = &inbuf[posbits >> 3];
-				code = ((p[0]
-					| ((long) (p[1]) << 8)
-					| ((long) (p[2]) << 16)) >> (posbits & 0x7)) & bitmask;
-			}
-			posbits += n_bits;
-
-			if (oldcode == -1) {
-				if (code >= 256)
-					bb_error_msg_and_err("corrupted data"); /* %ld", code); */
-				oldcode = code;
-				finchar = (int) oldcode;
-				outbuf[outpos++] = (unsigned char) finchar;
-				continue;
-			}
-
-			if (code == CLEAR && block_mode) {
-				clear_tab_prefixof();
-				free_ent = FIRST - 1;
-				posbits =
-					((posbits - 1) +
-					 ((n_bits << 3) -
-					  (posbits - 1 + (n_bits << 3)) % (n_bits << 3)));
-				n_bits = INIT_BITS;
-				maxcode = MAXCODE(INIT_BITS) - 1;
-				bitmask = (1 << INIT_BITS) - 1;
-				goto resetbuf;
-			}
-
-			incode = code;
-			stackp = de_stack;
+		if (code == CLEAR && block_mode) {
+			free_ent = FIRST - 1;
+			if (lzw_skip(&s, ((8 - (ncodes & 7)) & 7) * n_bits) < 0)
+				bb_error_msg_and_err(bb_msg_read_error);
+			ncodes = 0;
+			n_bits = INIT_BITS;
+			maxcode = MAXCODE(INIT_BITS) - 1;
+			bitmask = (1 << INIT_BITS) - 1;
+			continue;
+		}
 
-			/* Special case for KwKwK string. */
-			if (code >= free_ent) {
-				if (code > free_ent) {
-/*
-					unsigned char *p;
-
-					posbits -= n_bits;
-					p = &inbuf[posbits >> 3];
-					bb_error_msg
-						("insize:%d posbits:%d inbuf:%02X %02X %02X %02X %02X (%d)",
-						insize, posbits, p[-1], p[0], p[1], p[2], p[3],
-						(posbits & 07));
-*/
-					bb_error_msg("corrupted data");
-					goto err;
-				}
-
-				*--stackp = (unsigned char) finchar;
-				code = oldcode;
-			}
+		incode = code;
+		q = &outbuf[outpos];
 
-			/* Generate output characters in reverse order */
-			while (code >= 256) {
-				if (stackp <= &htabof(0))
-					bb_error_msg_and_err("corrupted data");
-				*--stackp = tab_suffixof(code);
-				code = tab_prefixof(code);
+		/* Special case for KwKwK string: the previous string, followed by its first character */
+		if (code >= free_ent) {
+			if (code > free_ent) {
+				bb_error_msg("corrupted data");
+				goto err;
 			}
+			c = oldcode;
+			len = tab_len[c] + 1;
+		} else {
+			c = code;
+			len = tab_len[c];
+		}
 
-			finchar = tab_suffixof(code);
-			*--stackp = (unsigned char) finchar;
-
-			/* And put them out in forward order */
-			{
-				int i;
-
-				i = de_stack - stackp;
-				if (outpos + i >= OBUFSIZ) {
-					do {
-						if (i > OBUFSIZ - outpos) {
-							i = OBUFSIZ - outpos;
-						}
-
-						if (i > 0) {
-							memcpy(outbuf + outpos, stackp, i);
-							outpos += i;
-						}
-
-						if (outpos >= OBUFSIZ) {
-							xtransformer_write(xstate, outbuf, outpos);
-							IF_DESKTOP(total_written += outpos;)
-							outpos = 0;
-						}
-						stackp += i;
-						i = de_stack - stackp;
-					} while (i > 0);
-				} else {
-					memcpy(outbuf + outpos, stackp, i);
-					outpos += i;
-				}
+		/* Produce the string for c, either from its last occurrence or from the prefix chain */
+		if (c < 256) {
+			q[0] = (unsigned char) c;
+		} else if (tab_pos[c] >= out_base) {
+			/* Strings are short, so copy them 8 bytes at a time, rather than call memcpy.
+			 * The source always ends before q, and we have room to overshoot at the end. */
+			p = &outbuf[tab_pos[c] - out_base];
+			for (i = 0; i < tab_len[c]; i += 8) {
+				memcpy(&w, &p[i], sizeof(w));
+				memcpy(&q[i], &w, sizeof(w));
 			}
-
-			/* Generate the new entry. */
-			if (free_ent < maxmaxcode) {
-				tab_prefixof(free_ent) = (unsigned short) oldcode;
-				tab_suffixof(free_ent) = (unsigned char) finchar;
-				free_ent++;
+		} else {
+			p = q + tab_len[c];
+			while (c >= 256) {
+				*--p = tab_suffix[c];
+				c = tab_prefix[c];
 			}
-
-			/* Remember previous code.  */
-			oldcode = incode;
+			*--p = tab_suffix[c];
+		}
+		finchar = q[0];
+		if (code >= free_ent)
+			q[len - 1] = (unsigned char) finchar;
+
+		/* Generate the new entry, which starts where the previous string was produced */
+		if (free_ent < maxmaxcode) {
+			tab_prefix[free_ent] = (unsigned short) oldcode;
+			tab_suffix[free_ent] = (unsigned char) finchar;
+			tab_len[free_ent] = tab_len[oldcode] + 1;
+			tab_pos[free_ent] = tab_pos[oldcode];
+			free_ent++;
+		}
+		tab_pos[incode] = out_base + outpos;
+		outpos += len;
+
+		if (outpos >= OBUFSIZ) {
+			if (transformer_write(xstate, outbuf, outpos) != outpos)
+				goto err;
+			IF_DESKTOP(total_written += outpos;)
+			out_base += outpos;
+			outpos = 0;
 		}
 
-	} while (rsize > 0);
+		/* Remember previous code.  */
+		oldcode = incode;
+	}
 
 	if (outpos > 0) {
-		xtransformer_write(xstate, outbuf, outpos);
+		if (transformer_write(xstate, outbuf, outpos) != outpos)
+			goto err;
 		IF_DESKTOP(total_written += outpos;)
 	}
 
 	retval = IF_DESKTOP(total_written) + 0;
  err:
-	free(inbuf);
+	free(s.inbuf);
 	free(outbuf);
-	free(htab);
-	free(codetab);
+	free(tab_prefix);
+	free(tab_suffix);
+	free(tab_len);
+	free(tab_pos);
 	return retval;
 }
@@ -72,6 +72,8 @@ IF_DESKTOP(long long) int FAST_FUNC unpack_xz_stream(transformer_state_t *xstate
 			nwrote = transformer_write(xstate, b.out, b.out_pos);
 			if (nwrote == (ssize_t)-1) {
 				ret = XZ_DATA_ERROR;
+				if (xstate->mem_output_size_max != 0)
+					goto err;	/* memory buffer is full */
 				bb_error_msg_and_err("write error (errno: %d)", errno);
 			}
 			IF_DESKTOP(n += nwrote;)
@@ -91,6 +93,8 @@ IF_DESKTOP(long long) int FAST_FUNC unpack_xz_stream(transformer_state_t *xstate
 		nwrote = transformer_write(xstate, b.out, b.out_pos);
 		if (nwrote == (ssize_t)-1) {
 			ret = XZ_DATA_ERROR;
+			if (xstate->mem_output_size_max != 0)
+				goto err;
 			bb_error_msg_and_err("write error (errno: %d)", errno);
 		}
 		IF_DESKTOP(n += nwrote;)
@@ -110,7 +110,7 @@ typedef unsigned int uid_t;
 
 extern smallint bb_got_signal;
 extern uint32_t *global_crc32_table;
-extern jmp_buf bb_error_jmp;
+extern THREAD_LOCAL jmp_buf bb_error_jmp;
 
 uint32_t* crc32_filltable(uint32_t *crc_table, int endian);
 uint32_t crc32_le(uint32_t crc, unsigned char const *p, size_t len, uint32_t *crc32table_le);
@@ -134,6 +134,7 @@ typedef struct _llist_t {
 } llist_t;
 
 extern void (*bled_printf) (const char* format, ...);
+extern int (*bled_write) (int fd, const void* buf, unsigned int count);
 extern void (*bled_progress) (const uint64_t processed_bytes);
 extern unsigned long* bled_cancel_request;
 
@@ -169,8 +170,18 @@ static inline int fnmatch(const char *pattern, const char *string, int flags) {r
 static inline pid_t wait(int* status) { *status = 4; return -1; }
 #define wait_any_nohang wait
 
+/* Compressed data that the current thread reads from memory, instead of from a descriptor */
+typedef struct {
+	const char* buf;
+	size_t size;
+	size_t pos;
+} mem_input_t;
+extern THREAD_LOCAL mem_input_t bb_mem_input;
+/* Some decompressors only set up their input buffers for a valid fd, so use this one for memory input */
+#define BB_MEM_INPUT_FD 0
+
 /* This override enables the display of a progress based on the number of bytes read */
-extern uint64_t bb_total_rb;
+extern THREAD_LOCAL uint64_t bb_total_rb;
 static inline ssize_t full_read(int fd, void *buf, size_t count) {
 	ssize_t rb;
 	if ((bled_cancel_request != NULL) && (*bled_cancel_request != 0)) {
@@ -178,6 +189,13 @@ static inline ssize_t full_read(int fd, void *buf, size_t count) {
 		return -1;
 	}
 
+	if (bb_mem_input.buf != NULL) {
+		rb = (ssize_t)MIN(count, bb_mem_input.size - bb_mem_input.pos);
+		memcpy(buf, &bb_mem_input.buf[bb_mem_input.pos], rb);
+		bb_mem_input.pos += rb;
+		return rb;
+	}
+
 	rb = _read(fd, buf, count);
 	if (rb > 0) {
 		bb_total_rb += rb;
@@ -187,7 +205,11 @@ static inline ssize_t full_read(int fd, void *buf, size_t count) {
 	return rb;
 }
 
-#define full_write _write
+/* This override enables the use of a custom write function, to process the uncompressed data */
+static inline ssize_t full_write(int fd, const void *buf, size_t count) {
+	return (bled_write != NULL) ? bled_write(fd, buf, (unsigned int)count) : _write(fd, buf, (unsigned int)count);
+}
+
 #define safe_read full_read
 #define lstat stat
 #define xmalloc malloc
@@ -37,15 +37,26 @@ ssize_t FAST_FUNC transformer_write(transformer_state_t *xstate, const void *buf
 
 		size = (xstate->mem_output_size += bufsize);
 		if (size > xstate->mem_output_size_max) {
-			free(xstate->mem_output_buf);
-			xstate->mem_output_buf = NULL;
-			bb_perror_msg("buffer %u too small", (unsigned)xstate->mem_output_size_max);
+			if (xstate->mem_output_fixed) {
+				/* The caller provided buffer is full: copy what we can and report a short
+				 * write, so that the unpacker stops without processing the rest of the stream */
+				memcpy(xstate->mem_output_buf + pos, buf, xstate->mem_output_size_max - pos);
+				xstate->mem_output_size = xstate->mem_output_size_max;
+			} else {
+				free(xstate->mem_output_buf);
+				xstate->mem_output_buf = NULL;
+				bb_perror_msg("buffer %u too small", (unsigned)xstate->mem_output_size_max);
+			}
 			nwrote = -1;
 			goto ret;
 		}
-		xstate->mem_output_buf = xrealloc(xstate->mem_output_buf, size + 1);
-		memcpy(xstate->mem_output_buf + pos, buf, bufsize);
-		xstate->mem_output_buf[size] = '\0';
+		if (xstate->mem_output_fixed) {
+			memcpy(xstate->mem_output_buf + pos, buf, bufsize);
+		} else {
+			xstate->mem_output_buf = xrealloc(xstate->mem_output_buf, size + 1);
+			memcpy(xstate->mem_output_buf + pos, buf, bufsize);
+			xstate->mem_output_buf[size] = '\0';
+		}
 		nwrote = bufsize;
 	} else {
 		nwrote = full_write(xstate->dst_fd, buf, bufsize);
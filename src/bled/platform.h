@@ -63,12 +63,14 @@
 #define PACKED __attribute__ ((__packed__))
 #endif
 #define ALIGNED(m) __attribute__ ((__aligned__(m)))
+#define THREAD_LOCAL __thread
 #define PRAGMA_BEGIN_PACKED
 #define PRAGMA_END_PACKED
 #elif defined(_MSC_VER)
 #define RETURNS_MALLOC
 #define PACKED
 #define ALIGNED(m) __declspec(align(m))
+#define THREAD_LOCAL __declspec(thread)
 #define PRAGMA_BEGIN_PACKED __pragma(pack(push, 1))
 #define PRAGMA_END_PACKED   __pragma(pack(pop))
 #endif
@@ -12,11 +12,13 @@
 
 /* Uncomment as needed to enable BCJ filter decoders. */
 #define XZ_DEC_X86
-/* #define XZ_DEC_POWERPC */
-/* #define XZ_DEC_IA64 */
-/* #define XZ_DEC_ARM */
-/* #define XZ_DEC_ARMTHUMB */
-/* #define XZ_DEC_SPARC */
+#define XZ_DEC_POWERPC
+#define XZ_DEC_IA64
+#define XZ_DEC_ARM
+#define XZ_DEC_ARMTHUMB
+#define XZ_DEC_SPARC
+#define XZ_DEC_ARM64
+#define XZ_DEC_RISCV
 
 #include <stdbool.h>
 #include <stdlib.h>
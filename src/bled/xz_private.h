@@ -99,8 +99,8 @@
 #ifndef XZ_DEC_BCJ
 #	if defined(XZ_DEC_X86) || defined(XZ_DEC_POWERPC) \
 			|| defined(XZ_DEC_IA64) || defined(XZ_DEC_ARM) \
-			|| defined(XZ_DEC_ARM) || defined(XZ_DEC_ARMTHUMB) \
-			|| defined(XZ_DEC_SPARC)
+			|| defined(XZ_DEC_ARMTHUMB) || defined(XZ_DEC_SPARC) \
+			|| defined(XZ_DEC_ARM64) || defined(XZ_DEC_RISCV)
 #		define XZ_DEC_BCJ
 #	endif
 #endif
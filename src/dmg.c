@@ -0,0 +1,787 @@
+/*
+ * Rufus: The Reliable USB Formatting Utility
+ * Apple Disk Image (UDIF) support
+ * Copyright © 2015 Pete Batard <pete@akeo.ie>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * A UDIF image (.dmg) ends with a 512 byte 'koly' trailer, that points to an XML property
+ * list. The 'blkx' array of this plist holds a 'mish' table for each part of the disk, that
+ * splits it into chunks, each of which is either stored, compressed on its own, or not
+ * stored at all (zero fill and free space). Since the chunks are independent, and the
+ * tables tell us exactly where each of them goes, we decompress them in batches, using as
+ * many threads as we have CPUs, and write each batch in order once it is complete.
+ * All the fields from the trailer and the tables are Big Endian.
+ */
+
+#include <windows.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "rufus.h"
+#include "drive.h"
+#include "resource.h"
+#include "localization.h"
+#include "bled/bled.h"
+
+#define DMG_MAX_THREADS             8
+#define DMG_BATCH_SIZE              (32 * 1024 * 1024)	// Uncompressed data we process at once
+#define DMG_MAX_CHUNK_SIZE          (16 * 1024 * 1024)	// Largest compressed chunk we accept
+#define DMG_RAW_SPLIT_SIZE          (1024 * 1024)		// Stored chunks are processed in pieces of this size
+#define DMG_MAX_XML_SIZE            (64 * 1024 * 1024)
+#define DMG_PROBE_SIZE              (1024 * 1024)		// What we decompress to analyze the partition table
+#define DMG_SECTOR_SIZE             512
+#define DMG_TRAILER_SIZE            512
+#define DMG_MISH_HEADER_SIZE        204
+#define DMG_MISH_CHUNK_SIZE         40
+
+// Chunk types
+#define DMG_CHUNK_ZERO              0x00000000
+#define DMG_CHUNK_RAW               0x00000001
+#define DMG_CHUNK_IGNORE            0x00000002
+#define DMG_CHUNK_ADC               0x80000004
+#define DMG_CHUNK_ZLIB              0x80000005
+#define DMG_CHUNK_BZIP2             0x80000006
+#define DMG_CHUNK_LZFSE             0x80000007
+#define DMG_CHUNK_LZMA              0x80000008
+#define DMG_CHUNK_COMMENT           0x7FFFFFFE
+#define DMG_CHUNK_LAST              0xFFFFFFFF
+
+#define IS_DMG_DATA_CHUNK(c)        (((c)->type != DMG_CHUNK_ZERO) && ((c)->type != DMG_CHUNK_IGNORE))
+
+typedef struct {
+	uint32_t type;
+	uint64_t out_offset;
+	uint64_t out_size;
+	uint64_t in_offset;
+	uint64_t in_size;
+} dmg_chunk;
+
+typedef struct {
+	dmg_chunk* chunk;
+	uint32_t nb_chunks;
+	uint32_t max_chunks;
+	uint64_t size;				// size of the image once decompressed
+	uint64_t max_in_size;		// largest compressed and uncompressed sizes of a data chunk
+	uint64_t max_out_size;
+} dmg_table;
+
+// What the workers need to decompress a batch
+typedef struct dmg_batch {
+	const dmg_table* table;
+	uint32_t first;
+	volatile LONG nb_items;
+	volatile LONG next_item;
+	volatile LONG error;
+	volatile BOOL quit;
+	uint8_t* in_buf;
+	uint8_t* out_buf;
+	uint64_t* in_pos;			// position of each chunk in the buffers, indexed from 'first'
+	uint64_t* out_pos;
+	int nb_threads;
+	HANDLE thread[DMG_MAX_THREADS], start[DMG_MAX_THREADS], done[DMG_MAX_THREADS];
+} dmg_batch;
+
+typedef struct {
+	dmg_batch* b;
+	int id;
+} dmg_worker_param;
+
+static __inline uint32_t read_be32(const uint8_t* p)
+{
+	return ((uint32_t)p[0] << 24) | ((uint32_t)p[1] << 16) | ((uint32_t)p[2] << 8) | p[3];
+}
+
+static __inline uint64_t read_be64(const uint8_t* p)
+{
+	return ((uint64_t)read_be32(p) << 32) | read_be32(&p[4]);
+}
+
+static BOOL ReadAt(HANDLE h, uint64_t offset, void* buf, DWORD size)
+{
+	LARGE_INTEGER li;
+	DWORD rd;
+
+	li.QuadPart = offset;
+	return SetFilePointerEx(h, li, NULL, FILE_BEGIN) && ReadFile(h, buf, size, &rd, NULL) && (rd == size);
+}
+
+static const char* ChunkTypeName(uint32_t type)
+{
+	switch (type) {
+	case DMG_CHUNK_ZERO: return "zero";
+	case DMG_CHUNK_RAW: return "raw";
+	case DMG_CHUNK_IGNORE: return "free";
+	case DMG_CHUNK_ADC: return "ADC";
+	case DMG_CHUNK_ZLIB: return "zlib";
+	case DMG_CHUNK_BZIP2: return "bzip2";
+	case DMG_CHUNK_LZFSE: return "LZFSE";
+	case DMG_CHUNK_LZMA: return "LZMA";
+	default: return "unknown";
+	}
+}
+
+// Decode base64 data, ignoring the whitespaces the plist uses for formatting.
+// Returns the number of bytes decoded, or -1 on error.
+static int64_t Base64Decode(const char* src, size_t len, uint8_t* dst)
+{
+	uint32_t acc = 0;
+	int64_t size = 0;
+	size_t i;
+	int v, nb_bits = 0;
+	char c;
+
+	for (i = 0; i < len; i++) {
+		c = src[i];
+		if ((c >= 'A') && (c <= 'Z'))
+			v = c - 'A';
+		else if ((c >= 'a') && (c <= 'z'))
+			v = c - 'a' + 26;
+		else if ((c >= '0') && (c <= '9'))
+			v = c - '0' + 52;
+		else if (c == '+')
+			v = 62;
+		else if (c == '/')
+			v = 63;
+		else if ((c == '=') || (c == ' ') || (c == '\t') || (c == '\r') || (c == '\n'))
+			continue;
+		else
+			return -1;
+		acc = (acc << 6) | v;
+		nb_bits += 6;
+		if (nb_bits >= 8) {
+			nb_bits -= 8;
+			dst[size++] = (uint8_t)(acc >> nb_bits);
+		}
+	}
+	return size;
+}
+
+static BOOL AddChunk(dmg_table* t, uint32_t type, uint64_t out_offset, uint64_t out_size, uint64_t in_offset, uint64_t in_size)
+{
+	dmg_chunk* c;
+
+	if (t->nb_chunks >= t->max_chunks) {
+		t->max_chunks = (t->max_chunks == 0) ? 256 : 2 * t->max_chunks;
+		c = (dmg_chunk*)realloc(t->chunk, t->max_chunks * sizeof(dmg_chunk));
+		if (c == NULL)
+			return FALSE;
+		t->chunk = c;
+	}
+	c = &t->chunk[t->nb_chunks++];
+	c->type = type;
+	c->out_offset = out_offset;
+	c->out_size = out_size;
+	c->in_offset = in_offset;
+	c->in_size = in_size;
+	if (IS_DMG_DATA_CHUNK(c)) {
+		t->max_in_size = MAX(t->max_in_size, in_size);
+		t->max_out_size = MAX(t->max_out_size, out_size);
+	}
+	return TRUE;
+}
+
+// Add the chunks from a 'mish' table
+static BOOL ParseMish(dmg_table* t, const uint8_t* mish, size_t size, uint64_t data_fork_offset, uint64_t file_size)
+{
+	const uint8_t* p;
+	uint64_t base_sector, data_offset, out_offset, out_size, in_offset, in_size, s;
+	uint32_t i, nb_chunks, type;
+
+	if ((size < DMG_MISH_HEADER_SIZE) || (memcmp(mish, "mish", 4) != 0)) {
+		uprintf("DMG: Invalid block table");
+		return FALSE;
+	}
+	base_sector = read_be64(&mish[8]);
+	data_offset = read_be64(&mish[24]);
+	nb_chunks = read_be32(&mish[200]);
+	if (size < DMG_MISH_HEADER_SIZE + (uint64_t)nb_chunks * DMG_MISH_CHUNK_SIZE) {
+		uprintf("DMG: Truncated block table");
+		return FALSE;
+	}
+
+	for (i = 0; i < nb_chunks; i++) {
+		p = &mish[DMG_MISH_HEADER_SIZE + i * DMG_MISH_CHUNK_SIZE];
+		type = read_be32(p);
+		if (type == DMG_CHUNK_COMMENT)
+			continue;
+		if (type == DMG_CHUNK_LAST)
+			break;
+		out_offset = (base_sector + read_be64(&p[8])) * DMG_SECTOR_SIZE;
+		out_size = read_be64(&p[16]) * DMG_SECTOR_SIZE;
+		in_offset = data_fork_offset + data_offset + read_be64(&p[24]);
+		in_size = read_be64(&p[32]);
+		if (out_size == 0)
+			continue;
+		switch (type) {
+		case DMG_CHUNK_ZERO:
+		case DMG_CHUNK_IGNORE:
+			if (!AddChunk(t, type, out_offset, out_size, 0, 0))
+				return FALSE;
+			continue;
+		case DMG_CHUNK_RAW:
+		case DMG_CHUNK_ADC:
+		case DMG_CHUNK_ZLIB:
+		case DMG_CHUNK_BZIP2:
+		case DMG_CHUNK_LZMA:
+			break;
+		case DMG_CHUNK_LZFSE:
+			uprintf("DMG: LZFSE compressed images are not supported");
+			return FALSE;
+		default:
+			uprintf("DMG: Unsupported chunk type 0x%08X", type);
+			return FALSE;
+		}
+		if ((in_offset > file_size) || (in_size > file_size - in_offset)) {
+			uprintf("DMG: Chunk data lies beyond the end of the image");
+			return FALSE;
+		}
+		if (type == DMG_CHUNK_RAW) {
+			if (in_size != out_size) {
+				uprintf("DMG: Invalid stored chunk size");
+				return FALSE;
+			}
+			// Don't let a single stored chunk take all of our buffers
+			for (s = 0; s < out_size; s += DMG_RAW_SPLIT_SIZE) {
+				if (!AddChunk(t, type, out_offset + s, MIN(DMG_RAW_SPLIT_SIZE, out_size - s),
+					in_offset + s, MIN(DMG_RAW_SPLIT_SIZE, out_size - s)))
+					return FALSE;
+			}
+			continue;
+		}
+		if ((in_size == 0) || (in_size > DMG_MAX_CHUNK_SIZE) || (out_size > DMG_MAX_CHUNK_SIZE)) {
+			uprintf("DMG: Unsupported chunk size (%lld bytes)", MAX(in_size, out_size));
+			return FALSE;
+		}
+		if (!AddChunk(t, type, out_offset, out_size, in_offset, in_size))
+			return FALSE;
+	}
+	return TRUE;
+}
+
+static int ChunkCompare(const void* a, const void* b)
+{
+	const dmg_chunk* ca = (const dmg_chunk*)a;
+	const dmg_chunk* cb = (const dmg_chunk*)b;
+
+	return (ca->out_offset < cb->out_offset) ? -1 : ((ca->out_offset > cb->out_offset) ? 1 : 0);
+}
+
+// Read the trailer and the plist of an image, and build the table of all its chunks, in disk order
+static BOOL ReadDmgTable(HANDLE h, dmg_table* t)
+{
+	uint8_t trailer[DMG_TRAILER_SIZE];
+	uint8_t* mish = NULL;
+	char *xml = NULL, *p, *end, *data_end;
+	LARGE_INTEGER li;
+	uint64_t data_fork_offset, xml_offset, xml_size, sector_count;
+	int64_t mish_size;
+	uint32_t i, nb_tables = 0;
+	BOOL r = FALSE;
+
+	memset(t, 0, sizeof(dmg_table));
+	if ( (!GetFileSizeEx(h, &li)) || (li.QuadPart < DMG_TRAILER_SIZE)
+	  || (!ReadAt(h, li.QuadPart - DMG_TRAILER_SIZE, trailer, DMG_TRAILER_SIZE)) ) {
+		uprintf("DMG: Could not read image trailer: %s", WindowsErrorString());
+		return FALSE;
+	}
+	if ((memcmp(trailer, "koly", 4) != 0) || (read_be32(&trailer[8]) != DMG_TRAILER_SIZE)) {
+		uprintf("DMG: Invalid image trailer");
+		return FALSE;
+	}
+	if (read_be32(&trailer[60]) > 1) {
+		uprintf("DMG: Segmented images are not supported");
+		return FALSE;
+	}
+	data_fork_offset = read_be64(&trailer[24]);
+	xml_offset = read_be64(&trailer[216]);
+	xml_size = read_be64(&trailer[224]);
+	sector_count = read_be64(&trailer[492]);
+	if (xml_size == 0) {
+		uprintf("DMG: Images without an XML property list are not supported");
+		return FALSE;
+	}
+	if ((xml_size > DMG_MAX_XML_SIZE) || (xml_offset > (uint64_t)li.QuadPart) || (xml_size > li.QuadPart - xml_offset)) {
+		uprintf("DMG: Invalid property list location");
+		return FALSE;
+	}
+
+	xml = (char*)malloc((size_t)xml_size + 1);
+	mish = (uint8_t*)malloc((size_t)xml_size);
+	if ((xml == NULL) || (mish == NULL)) {
+		uprintf("DMG: Could not allocate property list buffer");
+		goto out;
+	}
+	if (!ReadAt(h, xml_offset, xml, (DWORD)xml_size)) {
+		uprintf("DMG: Could not read property list: %s", WindowsErrorString());
+		goto out;
+	}
+	xml[xml_size] = 0;
+
+	// We don't need a full plist parser: the tables are the <data> entries of the 'blkx' array
+	p = strstr(xml, "<key>blkx</key>");
+	if (p != NULL)
+		p = strstr(p, "<array>");
+	end = (p == NULL) ? NULL : strstr(p, "</array>");
+	if (end == NULL) {
+		uprintf("DMG: Property list has no block tables");
+		goto out;
+	}
+	while (((p = strstr(p, "<data>")) != NULL) && (p < end)) {
+		p += 6;
+		data_end = strstr(p, "</data>");
+		if ((data_end == NULL) || (data_end > end)) {
+			uprintf("DMG: Invalid property list");
+			goto out;
+		}
+		mish_size = Base64Decode(p, data_end - p, mish);
+		if (mish_size < 0) {
+			uprintf("DMG: Invalid block table encoding");
+			goto out;
+		}
+		if (!ParseMish(t, mish, (size_t)mish_size, data_fork_offset, li.QuadPart))
+			goto out;
+		nb_tables++;
+		p = data_end;
+	}
+
+	qsort(t->chunk, t->nb_chunks, sizeof(dmg_chunk), ChunkCompare);
+	for (i = 1; i < t->nb_chunks; i++) {
+		if (t->chunk[i].out_offset < t->chunk[i-1].out_offset + t->chunk[i-1].out_size) {
+			uprintf("DMG: Overlapping chunks at offset 0x%llx", t->chunk[i].out_offset);
+			goto out;
+		}
+	}
+	if (t->nb_chunks == 0) {
+		uprintf("DMG: Image has no data");
+		goto out;
+	}
+	t->size = MAX(sector_count * DMG_SECTOR_SIZE,
+		t->chunk[t->nb_chunks - 1].out_offset + t->chunk[t->nb_chunks - 1].out_size);
+	uprintf("DMG: %d block table(s), %d chunks", nb_tables, t->nb_chunks);
+	r = TRUE;
+
+out:
+	if (!r) {
+		safe_free(t->chunk);
+		t->nb_chunks = 0;
+	}
+	safe_free(xml);
+	safe_free(mish);
+	return r;
+}
+
+// Apple Data Compression, a simple LZ77 variant used by older images
+static BOOL AdcDecompress(const uint8_t* in, uint64_t in_size, uint8_t* out, uint64_t out_size)
+{
+	uint64_t i = 0, o = 0, len, dist;
+	uint8_t b;
+
+	while ((i < in_size) && (o < out_size)) {
+		b = in[i++];
+		if (b & 0x80) {
+			len = (b & 0x7F) + 1;
+			if ((len > in_size - i) || (len > out_size - o))
+				return FALSE;
+			memcpy(&out[o], &in[i], (size_t)len);
+			i += len;
+			o += len;
+			continue;
+		}
+		if (b & 0x40) {
+			if (i + 2 > in_size)
+				return FALSE;
+			len = (b & 0x3F) + 4;
+			dist = ((uint64_t)in[i] << 8) | in[i + 1];
+			i += 2;
+		} else {
+			if (i + 1 > in_size)
+				return FALSE;
+			len = ((b >> 2) & 0x0F) + 3;
+			dist = ((uint64_t)(b & 0x03) << 8) | in[i++];
+		}
+		// Distances are relative to the last byte written, and matches may overlap
+		dist++;
+		if ((dist > o) || (len > out_size - o))
+			return FALSE;
+		for (; len > 0; len--, o++)
+			out[o] = out[o - dist];
+	}
+	return (o == out_size);
+}
+
+static uint32_t Adler32(const uint8_t* buf, uint64_t len)
+{
+	uint32_t a = 1, b = 0;
+	uint64_t i, n;
+
+	// 5552 is the largest n for which 255n(n+1)/2 + (n+1)(BASE-1) fits in 32 bits
+	for (i = 0; i < len; ) {
+		for (n = MIN(len - i, 5552); n > 0; n--, i++) {
+			a += buf[i];
+			b += a;
+		}
+		a %= 65521;
+		b %= 65521;
+	}
+	return (b << 16) | a;
+}
+
+static BOOL DecompressChunk(const dmg_chunk* c, const uint8_t* in, uint8_t* out)
+{
+	int64_t size = -1;
+
+	switch (c->type) {
+	case DMG_CHUNK_RAW:
+		memcpy(out, in, (size_t)c->out_size);
+		return TRUE;
+	case DMG_CHUNK_ADC:
+		return AdcDecompress(in, c->in_size, out, c->out_size);
+	case DMG_CHUNK_ZLIB:
+		// A zlib stream is raw deflate data, between a 2 byte header and an Adler-32
+		if ( (c->in_size < 6) || ((in[0] & 0x0F) != 8) || ((((uint32_t)in[0] << 8) | in[1]) % 31 != 0)
+		  || (in[1] & 0x20) )
+			return FALSE;
+		size = bled_uncompress_from_buffer_to_buffer((const char*)&in[2], (size_t)c->in_size - 2,
+			(char*)out, (size_t)c->out_size, BLED_COMPRESSION_ZIP);
+		if ((size == (int64_t)c->out_size) && (Adler32(out, c->out_size) != read_be32(&in[c->in_size - 4])))
+			return FALSE;
+		break;
+	case DMG_CHUNK_BZIP2:
+		size = bled_uncompress_from_buffer_to_buffer((const char*)in, (size_t)c->in_size,
+			(char*)out, (size_t)c->out_size, BLED_COMPRESSION_BZIP2);
+		break;
+	case DMG_CHUNK_LZMA:
+		// Apple's LZMA chunks are xz streams
+		size = bled_uncompress_from_buffer_to_buffer((const char*)in, (size_t)c->in_size,
+			(char*)out, (size_t)c->out_size, BLED_COMPRESSION_XZ);
+		break;
+	}
+	return (size == (int64_t)c->out_size);
+}
+
+// Check if an image is a DMG we can write, and analyze its partition table
+BOOL IsDmgImage(const char* path)
+{
+	HANDLE h;
+	dmg_table t;
+	uint8_t *buf = NULL, *in = NULL, *out = NULL;
+	uint32_t i, j, nb_types = 0, types[16];
+	uint64_t size;
+	char str[128];
+	BOOL r = FALSE;
+
+	h = CreateFileU(path, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+	if (h == INVALID_HANDLE_VALUE) {
+		uprintf("Could not open image '%s'", path);
+		return FALSE;
+	}
+	if (!ReadDmgTable(h, &t))
+		goto out;
+
+	str[0] = 0;
+	for (i = 0; i < t.nb_chunks; i++) {
+		for (j = 0; (j < nb_types) && (types[j] != t.chunk[i].type); j++);
+		if ((j < nb_types) || (nb_types >= ARRAYSIZE(types)))
+			continue;
+		types[nb_types++] = t.chunk[i].type;
+		safe_strcat(str, sizeof(str), (str[0] == 0) ? "" : ", ");
+		safe_strcat(str, sizeof(str), ChunkTypeName(t.chunk[i].type));
+	}
+	uprintf("Image is an Apple Disk Image (UDIF), with %s chunks, and requires %s once uncompressed",
+		str, SizeToHumanReadable(t.size, TRUE, FALSE));
+	iso_report.is_dmg = TRUE;
+	iso_report.projected_size = t.size;
+
+	// Decompress the start of the disk, to find out if it's something we can boot
+	size = MIN(t.size, DMG_PROBE_SIZE);
+	buf = (uint8_t*)calloc(1, (size_t)size);
+	in = (uint8_t*)malloc((size_t)MAX(t.max_in_size, 1));
+	out = (uint8_t*)malloc((size_t)MAX(t.max_out_size, 1));
+	if ((buf == NULL) || (in == NULL) || (out == NULL)) {
+		uprintf("DMG: Could not allocate buffers for image analysis");
+		goto out;
+	}
+	bled_init(_uprintf, NULL, NULL, NULL);
+	for (i = 0; (i < t.nb_chunks) && (t.chunk[i].out_offset < size); i++) {
+		if (!IS_DMG_DATA_CHUNK(&t.chunk[i]))
+			continue;
+		if ( (!ReadAt(h, t.chunk[i].in_offset, in, (DWORD)t.chunk[i].in_size))
+		  || (!DecompressChunk(&t.chunk[i], in, out)) ) {
+			uprintf("DMG: Could not decompress %s chunk at offset 0x%llx", ChunkTypeName(t.chunk[i].type),
+				t.chunk[i].out_offset);
+			break;
+		}
+		memcpy(&buf[t.chunk[i].out_offset], out, (size_t)MIN(t.chunk[i].out_size, size - t.chunk[i].out_offset));
+	}
+	bled_exit();
+	if ((i >= t.nb_chunks) || (t.chunk[i].out_offset >= size))
+		r = AnalyzeMBRBuffer(buf, (size_t)size, "DMG image");
+
+out:
+	safe_free(t.chunk);
+	safe_free(buf);
+	safe_free(in);
+	safe_free(out);
+	safe_closehandle(h);
+	return r;
+}
+
+// Worker task: decompress the chunks from the current batch
+static DWORD WINAPI DmgWorkerThread(LPVOID param)
+{
+	dmg_batch* b = ((dmg_worker_param*)param)->b;
+	int id = ((dmg_worker_param*)param)->id;
+	const dmg_chunk* c;
+	LONG i;
+
+	while (TRUE) {
+		WaitForSingleObject(b->start[id], INFINITE);
+		if (b->quit)
+			break;
+		while ((i = InterlockedIncrement(&b->next_item) - 1) < b->nb_items) {
+			c = &b->table->chunk[b->first + i];
+			if ((!IS_DMG_DATA_CHUNK(c)) || (b->error) || (IS_ERROR(FormatStatus)))
+				continue;
+			if (!DecompressChunk(c, &b->in_buf[b->in_pos[i]], &b->out_buf[b->out_pos[i]])) {
+				uprintf("DMG: Could not decompress %s chunk at offset 0x%llx", ChunkTypeName(c->type), c->out_offset);
+				InterlockedExchange(&b->error, 1);
+			}
+		}
+		SetEvent(b->done[id]);
+	}
+	return 0;
+}
+
+static BOOL StartWorkers(dmg_batch* b, dmg_worker_param* param)
+{
+	SYSTEM_INFO sysinfo;
+	int i;
+
+	GetSystemInfo(&sysinfo);
+	b->nb_threads = MIN(MAX((int)sysinfo.dwNumberOfProcessors, 1), DMG_MAX_THREADS);
+	for (i = 0; i < b->nb_threads; i++) {
+		param[i].b = b;
+		param[i].id = i;
+		b->start[i] = CreateEvent(NULL, FALSE, FALSE, NULL);
+		b->done[i] = CreateEvent(NULL, FALSE, FALSE, NULL);
+		if ((b->start[i] == NULL) || (b->done[i] == NULL))
+			return FALSE;
+		b->thread[i] = CreateThread(NULL, 0, DmgWorkerThread, &param[i], 0, NULL);
+		if (b->thread[i] == NULL) {
+			uprintf("DMG: Could not start worker thread: %s", WindowsErrorString());
+			return FALSE;
+		}
+	}
+	return TRUE;
+}
+
+static void StopWorkers(dmg_batch* b)
+{
+	int i;
+
+	b->quit = TRUE;
+	for (i = 0; i < b->nb_threads; i++) {
+		if (b->thread[i] != NULL) {
+			SetEvent(b->start[i]);
+			WaitForSingleObject(b->thread[i], INFINITE);
+		}
+		safe_closehandle(b->thread[i]);
+		safe_closehandle(b->start[i]);
+		safe_closehandle(b->done[i]);
+	}
+}
+
+// Write zeroes, for zero fill chunks, or for free space that we can't skip
+static BOOL WriteZeroes(int (*write_function)(int, const void*, unsigned int), uint64_t size)
+{
+	static const uint8_t zero[64 * 1024] = { 0 };
+	unsigned int len;
+
+	for (; size > 0; size -= len) {
+		len = (unsigned int)MIN(size, sizeof(zero));
+		if (write_function(-1, zero, len) != (int)len)
+			return FALSE;
+	}
+	return TRUE;
+}
+
+// Move the output to 'offset', past free space. We can only skip whole sectors, so anything
+// that isn't sector aligned gets filled with zeroes.
+static BOOL SkipTo(uint64_t* pos, uint64_t offset, DWORD sector_size,
+	int (*write_function)(int, const void*, unsigned int), BOOL (*seek_function)(uint64_t))
+{
+	uint64_t start = ((*pos + sector_size - 1) / sector_size) * sector_size;
+	uint64_t end = (offset / sector_size) * sector_size;
+
+	if (offset <= *pos)
+		return TRUE;
+	if (start < end) {
+		if ((!WriteZeroes(write_function, start - *pos)) || (!seek_function(end))
+		  || (!WriteZeroes(write_function, offset - end)))
+			return FALSE;
+	} else if (!WriteZeroes(write_function, offset - *pos)) {
+		return FALSE;
+	}
+	*pos = offset;
+	return TRUE;
+}
+
+/*
+ * Write a DMG image, through the same buffered output as the one we use for compressed images:
+ * 'write_function' appends data to the output and 'seek_function' moves it, which we only ever
+ * do to sector aligned positions, to skip free space.
+ * Writing resumes from the last chunk that starts at a sector aligned offset before 'resume'.
+ */
+BOOL WriteDmgImage(HANDLE hSourceImage, DWORD sector_size, uint64_t resume,
+	int (*write_function)(int, const void*, unsigned int), BOOL (*seek_function)(uint64_t))
+{
+	dmg_table t;
+	dmg_batch b;
+	dmg_worker_param param[DMG_MAX_THREADS];
+	const dmg_chunk* c;
+	uint64_t pos, in_size, out_size, read_offset, read_size;
+	uint32_t i, j, k, end, first = 0;
+	DWORD LastRefresh = 0;
+	float format_percent;
+	int n;
+	BOOL r = FALSE;
+
+	memset(&b, 0, sizeof(b));
+	bled_init(_uprintf, NULL, NULL, &FormatStatus);
+	if (!ReadDmgTable(hSourceImage, &t)) {
+		FormatStatus = ERROR_SEVERITY_ERROR|FAC(FACILITY_STORAGE)|ERROR_INVALID_DATA;
+		goto out;
+	}
+
+	b.table = &t;
+	b.in_buf = (uint8_t*)malloc((size_t)MAX(t.max_in_size, DMG_BATCH_SIZE));
+	b.out_buf = (uint8_t*)malloc((size_t)MAX(t.max_out_size, DMG_BATCH_SIZE));
+	b.in_pos = (uint64_t*)malloc(t.nb_chunks * sizeof(uint64_t));
+	b.out_pos = (uint64_t*)malloc(t.nb_chunks * sizeof(uint64_t));
+	if ((b.in_buf == NULL) || (b.out_buf == NULL) || (b.in_pos == NULL) || (b.out_pos == NULL)) {
+		uprintf("DMG: Could not allocate buffers");
+		FormatStatus = ERROR_SEVERITY_ERROR|FAC(FACILITY_STORAGE)|ERROR_NOT_ENOUGH_MEMORY;
+		goto out;
+	}
+	if (!StartWorkers(&b, param)) {
+		FormatStatus = ERROR_SEVERITY_ERROR|FAC(FACILITY_STORAGE)|ERROR_NOT_ENOUGH_MEMORY;
+		goto out;
+	}
+	uprintf("DMG: Decompressing with %d thread(s)", b.nb_threads);
+
+	// Skip whatever an interrupted write already took care of
+	for (i = 0; (resume != 0) && (i < t.nb_chunks) && (t.chunk[i].out_offset <= resume); i++) {
+		if (t.chunk[i].out_offset % sector_size == 0)
+			first = i;
+	}
+	pos = (first == 0) ? 0 : t.chunk[first].out_offset;
+	if ((pos != 0) && (!seek_function(pos)))
+		goto out;
+
+	for (i = first; i < t.nb_chunks; i = end) {
+		if (IS_ERROR(FormatStatus))
+			goto out;
+
+		// Lay out a batch, with as many chunks as our buffers can take
+		for (end = i, in_size = 0, out_size = 0; end < t.nb_chunks; end++) {
+			c = &t.chunk[end];
+			if (!IS_DMG_DATA_CHUNK(c))
+				continue;
+			if ((end > i) && ((in_size + c->in_size > DMG_BATCH_SIZE) || (out_size + c->out_size > DMG_BATCH_SIZE)))
+				break;
+			b.in_pos[end - i] = in_size;
+			b.out_pos[end - i] = out_size;
+			in_size += c->in_size;
+			out_size += c->out_size;
+		}
+
+		// Read the compressed data. As chunks are usually stored back to back, this only takes
+		// a handful of reads per batch.
+		for (j = i; j < end; j = k) {
+			if (!IS_DMG_DATA_CHUNK(&t.chunk[j])) {
+				k = j + 1;
+				continue;
+			}
+			read_offset = t.chunk[j].in_offset;
+			read_size = t.chunk[j].in_size;
+			for (k = j + 1; k < end; k++) {
+				if (!IS_DMG_DATA_CHUNK(&t.chunk[k]))
+					continue;
+				if (t.chunk[k].in_offset != read_offset + read_size)
+					break;
+				read_size += t.chunk[k].in_size;
+			}
+			if (!ReadAt(hSourceImage, read_offset, &b.in_buf[b.in_pos[j - i]], (DWORD)read_size)) {
+				uprintf("DMG: Could not read chunk data: %s", WindowsErrorString());
+				FormatStatus = ERROR_SEVERITY_ERROR|FAC(FACILITY_STORAGE)|ERROR_READ_FAULT;
+				goto out;
+			}
+		}
+
+		// Decompress the whole batch
+		b.first = i;
+		b.nb_items = end - i;
+		b.next_item = 0;
+		for (n = 0; n < b.nb_threads; n++)
+			SetEvent(b.start[n]);
+		WaitForMultipleObjects(b.nb_threads, b.done, TRUE, INFINITE);
+		if (IS_ERROR(FormatStatus))
+			goto out;
+		if (b.error) {
+			FormatStatus = ERROR_SEVERITY_ERROR|FAC(FACILITY_STORAGE)|ERROR_INVALID_DATA;
+			goto out;
+		}
+
+		// Write it in disk order
+		for (j = i; j < end; j++) {
+			c = &t.chunk[j];
+			// Gaps between chunks are free space as well
+			if (!SkipTo(&pos, c->out_offset, sector_size, write_function, seek_function))
+				goto out;
+			if (c->type == DMG_CHUNK_IGNORE) {
+				if (!SkipTo(&pos, c->out_offset + c->out_size, sector_size, write_function, seek_function))
+					goto out;
+				continue;
+			}
+			if (c->type == DMG_CHUNK_ZERO) {
+				if (!WriteZeroes(write_function, c->out_size))
+					goto out;
+			} else if (write_function(-1, &b.out_buf[b.out_pos[j - i]], (unsigned int)c->out_size) != (int)c->out_size) {
+				goto out;
+			}
+			pos += c->out_size;
+			if (GetTickCount() > LastRefresh + 25) {
+				LastRefresh = GetTickCount();
+				format_percent = (100.0f*pos)/(1.0f*t.size);
+				PrintInfo(0, MSG_261, format_percent);
+				UpdateProgress(OP_FORMAT, format_percent);
+			}
+		}
+	}
+	r = TRUE;
+
+out:
+	StopWorkers(&b);
+	bled_exit();
+	safe_free(t.chunk);
+	safe_free(b.in_buf);
+	safe_free(b.out_buf);
+	safe_free(b.in_pos);
+	safe_free(b.out_pos);
+	return r;
+}
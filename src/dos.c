@@ -29,6 +29,7 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <ctype.h>
 
 #include "rufus.h"
 #include "dos.h"
@@ -36,6 +37,12 @@
 
 static BYTE* DiskImage = NULL;
 static DWORD DiskImageSize;
+/* Geometry of the El Torito floppy image, from its BPB */
+static size_t FatOffset, FatSize, FatDataOffset;
+static DWORD FatClusterSize, FatNbClusters;
+static BOOL FatIs16;
+
+#define FAT_MAX_DIR_DEPTH   16
 
 /*
  * FAT time conversion, from ReactOS' time.c
@@ -201,6 +208,29 @@ static BOOL Patch_IO_SYS(size_t filestart, size_t filesize)
 	return TRUE;
 }
 
+/* Restore the timestamps of a file from its FAT directory entry */
+static void SetFATFileTime(HANDLE hFile, PDIR_ENTRY dir_entry)
+{
+	FAT_DATETIME LastAccessTime;
+	LARGE_INTEGER liCreationTime, liLastAccessTime, liLastWriteTime;
+	FILETIME ftCreationTime, ftLastAccessTime, ftLastWriteTime;
+
+	FatDateTimeToSystemTime(&liCreationTime, &dir_entry->CreationDateTime, dir_entry->CreationTimeTenMs);
+	ftCreationTime.dwHighDateTime = liCreationTime.HighPart;
+	ftCreationTime.dwLowDateTime = liCreationTime.LowPart;
+	LastAccessTime.Value = 0;
+	LastAccessTime.Date = dir_entry->LastAccessDate;
+	FatDateTimeToSystemTime(&liLastAccessTime, &LastAccessTime, 0);
+	ftLastAccessTime.dwHighDateTime = liLastAccessTime.HighPart;
+	ftLastAccessTime.dwLowDateTime = liLastAccessTime.LowPart;
+	FatDateTimeToSystemTime(&liLastWriteTime, &dir_entry->LastWriteDateTime, 0);
+	ftLastWriteTime.dwHighDateTime = liLastWriteTime.HighPart;
+	ftLastWriteTime.dwLowDateTime = liLastWriteTime.LowPart;
+	if (!SetFileTime(hFile, &ftCreationTime, &ftLastAccessTime, &ftLastWriteTime)) {
+		uprintf("Could not set timestamps: %s\n", WindowsErrorString());
+	}
+}
+
 /* Extract the file identified by FAT RootDir index 'entry' to 'path' */
 static BOOL ExtractFAT(int entry, const char* path)
 {
@@ -209,9 +239,6 @@ static BOOL ExtractFAT(int entry, const char* path)
 	char filename[MAX_PATH];
 	size_t i, pos, fnamepos;
 	size_t filestart, filesize;
-	FAT_DATETIME LastAccessTime;
-	LARGE_INTEGER liCreationTime, liLastAccessTime, liLastWriteTime;
-	FILETIME ftCreationTime, ftLastAccessTime, ftLastWriteTime;
 	PDIR_ENTRY dir_entry = (PDIR_ENTRY)&DiskImage[FAT12_ROOTDIR_OFFSET + entry*FAT_BYTES_PER_DIRENT];
 
 	if ((path == NULL) || ((safe_strlen(path) + 14) > sizeof(filename))) {
@@ -263,22 +290,7 @@ static BOOL ExtractFAT(int entry, const char* path)
 		return FALSE;
 	}
 
-	/* Restore timestamps from FAT */
-	FatDateTimeToSystemTime(&liCreationTime, &dir_entry->CreationDateTime, dir_entry->CreationTimeTenMs);
-	ftCreationTime.dwHighDateTime = liCreationTime.HighPart;
-	ftCreationTime.dwLowDateTime = liCreationTime.LowPart;
-	LastAccessTime.Value = 0;
-	LastAccessTime.Date = dir_entry->LastAccessDate;
-	FatDateTimeToSystemTime(&liLastAccessTime, &LastAccessTime, 0);
-	ftLastAccessTime.dwHighDateTime = liLastAccessTime.HighPart;
-	ftLastAccessTime.dwLowDateTime = liLastAccessTime.LowPart;
-	FatDateTimeToSystemTime(&liLastWriteTime, &dir_entry->LastWriteDateTime, 0);
-	ftLastWriteTime.dwHighDateTime = liLastWriteTime.HighPart;
-	ftLastWriteTime.dwLowDateTime = liLastWriteTime.LowPart;
-	if (!SetFileTime(hFile, &ftCreationTime, &ftLastAccessTime, &ftLastWriteTime)) {
-		uprintf("Could not set timestamps: %s\n", WindowsErrorString());
-	}
-
+	SetFATFileTime(hFile, dir_entry);
 	safe_closehandle(hFile);
 	uprintf("Successfully wrote '%s' (%d bytes)\n", filename, filesize);
 
@@ -405,6 +417,208 @@ BOOL ExtractFreeDOS(const char* path)
 	return SetDOSLocale(path, TRUE);
 }
 
+/* Return the cluster that follows 'cluster' in a FAT12 or FAT16 chain, or 0 at the end of it */
+static DWORD NextFATCluster(DWORD cluster)
+{
+	size_t pos = FatOffset + (FatIs16 ? 2 * cluster : cluster + cluster / 2);
+	DWORD next;
+
+	if (pos + 1 >= FatOffset + FatSize)
+		return 0;
+	next = DiskImage[pos] | (DiskImage[pos + 1] << 8);
+	if (!FatIs16)
+		next = (cluster & 1) ? (next >> 4) : (next & 0xfff);
+	return ((next >= 2) && (next < FatNbClusters + 2)) ? next : 0;
+}
+
+/* Copy the data of a cluster chain to a new buffer, for subdirectories */
+static BYTE* ReadFATChain(DWORD cluster, size_t* size)
+{
+	BYTE *buf = NULL, *new_buf;
+	DWORD n;
+
+	*size = 0;
+	for (n = 0; (cluster >= 2) && (cluster < FatNbClusters + 2) && (n < FatNbClusters); n++) {
+		new_buf = (BYTE*)realloc(buf, *size + FatClusterSize);
+		if (new_buf == NULL) {
+			safe_free(buf);
+			return NULL;
+		}
+		buf = new_buf;
+		memcpy(&buf[*size], &DiskImage[FatDataOffset + (size_t)(cluster - 2) * FatClusterSize], FatClusterSize);
+		*size += FatClusterSize;
+		cluster = NextFATCluster(cluster);
+	}
+	return buf;
+}
+
+/*
+ * Get the 8.3 name of a FAT directory entry. We don't bother with long file names, since
+ * the DOS programs and batch files from the image only ever refer to files by these.
+ */
+static BOOL GetFATShortName(PDIR_ENTRY dir_entry, char* name)
+{
+	size_t i, pos = 0;
+
+	for (i = 0; (i < 8) && (dir_entry->FileName[i] != ' '); i++)
+		name[pos++] = (dir_entry->Case & FAT_CASE_LOWER_BASE) ? (char)tolower(dir_entry->FileName[i]) : dir_entry->FileName[i];
+	if (dir_entry->FileName[8] != ' ')
+		name[pos++] = '.';
+	for (i = 8; (i < 11) && (dir_entry->FileName[i] != ' '); i++)
+		name[pos++] = (dir_entry->Case & FAT_CASE_LOWER_EXT) ? (char)tolower(dir_entry->FileName[i]) : dir_entry->FileName[i];
+	name[pos] = 0;
+	if (name[0] == FAT_DIRENT_REALLY_0E5)
+		name[0] = (char)FAT_DIRENT_DELETED;
+	// Don't let a corrupted image write outside of the directory we extract to
+	return (pos != 0) && (strpbrk(name, "\\/:*?\"<>|") == NULL);
+}
+
+static BOOL ExtractFATFile(PDIR_ENTRY dir_entry, const char* filename)
+{
+	HANDLE hFile;
+	DWORD cluster = dir_entry->FirstCluster, remaining = dir_entry->FileSize, chunk, Size, n;
+	BOOL r = FALSE;
+
+	hFile = CreateFileA(filename, GENERIC_READ|GENERIC_WRITE, FILE_SHARE_READ|FILE_SHARE_WRITE, NULL, CREATE_ALWAYS,
+		dir_entry->Attributes & (FAT_DIRENT_ATTR_READ_ONLY|FAT_DIRENT_ATTR_HIDDEN|FAT_DIRENT_ATTR_SYSTEM|FAT_DIRENT_ATTR_ARCHIVE), NULL);
+	if (hFile == INVALID_HANDLE_VALUE) {
+		uprintf("Unable to create file '%s': %s.\n", filename, WindowsErrorString());
+		return FALSE;
+	}
+	for (n = 0; remaining > 0; n++) {
+		if ((cluster < 2) || (cluster >= FatNbClusters + 2) || (n >= FatNbClusters)) {
+			uprintf("FAT file '%s' has an invalid cluster chain\n", filename);
+			goto out;
+		}
+		chunk = MIN(remaining, FatClusterSize);
+		if ((!WriteFile(hFile, &DiskImage[FatDataOffset + (size_t)(cluster - 2) * FatClusterSize], chunk, &Size, NULL))
+			|| (Size != chunk)) {
+			uprintf("Couldn't write file '%s': %s.\n", filename, WindowsErrorString());
+			goto out;
+		}
+		remaining -= chunk;
+		cluster = NextFATCluster(cluster);
+	}
+	SetFATFileTime(hFile, dir_entry);
+	uprintf("Successfully wrote '%s' (%d bytes)\n", filename, dir_entry->FileSize);
+	r = TRUE;
+
+out:
+	safe_closehandle(hFile);
+	return r;
+}
+
+static BOOL ExtractFATDir(BYTE* dir, size_t nb_entries, const char* path, int depth)
+{
+	// The DOS from the floppy can't be relied on to boot from a hard disk partition, so FreeDOS is used instead
+	const char* system_files[] = { "IO      SYS", "MSDOS   SYS", "IBMBIO  COM", "IBMDOS  COM", "KERNEL  SYS", "COMMAND COM" };
+	char name[13], filename[MAX_PATH];
+	PDIR_ENTRY dir_entry;
+	BYTE* subdir;
+	size_t i, j, size;
+	BOOL r = TRUE;
+
+	if ((depth > FAT_MAX_DIR_DEPTH) || (safe_strlen(path) + 14 > sizeof(filename))) {
+		uprintf("FAT directory '%s' is nested too deep\n", path);
+		return FALSE;
+	}
+	for (i = 0; r && (i < nb_entries); i++) {
+		if (IS_ERROR(FormatStatus))
+			return FALSE;
+		dir_entry = (PDIR_ENTRY)&dir[i * FAT_BYTES_PER_DIRENT];
+		if (dir_entry->FileName[0] == FAT_DIRENT_NEVER_USED)
+			break;
+		if ((dir_entry->FileName[0] == FAT_DIRENT_DELETED) || (dir_entry->FileName[0] == FAT_DIRENT_DIRECTORY_ALIAS)
+			|| (dir_entry->Attributes & FAT_DIRENT_ATTR_VOLUME_ID))
+			continue;
+		for (j = 0; (depth == 0) && (j < ARRAYSIZE(system_files)); j++) {
+			if (memcmp(dir_entry->FileName, system_files[j], 11) == 0)
+				break;
+		}
+		if ((depth == 0) && (j < ARRAYSIZE(system_files)))
+			continue;
+		if (!GetFATShortName(dir_entry, name)) {
+			uprintf("Skipping FAT entry with an invalid name in '%s'\n", path);
+			continue;
+		}
+		static_sprintf(filename, "%s%s", path, name);
+		if (dir_entry->Attributes & FAT_DIRENT_ATTR_DIRECTORY) {
+			if ((!CreateDirectoryA(filename, NULL)) && (GetLastError() != ERROR_ALREADY_EXISTS)) {
+				uprintf("Unable to create directory '%s': %s.\n", filename, WindowsErrorString());
+				return FALSE;
+			}
+			subdir = ReadFATChain(dir_entry->FirstCluster, &size);
+			if (subdir == NULL)
+				continue;
+			safe_strcat(filename, sizeof(filename), "\\");
+			r = ExtractFATDir(subdir, size / FAT_BYTES_PER_DIRENT, filename, depth + 1);
+			free(subdir);
+		} else {
+			r = ExtractFATFile(dir_entry, filename);
+			UpdateProgress(OP_DOS, -1.0f);
+		}
+	}
+	return r;
+}
+
+/*
+ * Unpack the content of an El Torito floppy emulation image to 'path', reading it straight
+ * from the ISO, so that it runs on top of the FreeDOS files we install on the drive.
+ */
+BOOL ExtractElToritoFloppy(const char* iso, const char* path)
+{
+	HANDLE hISO = INVALID_HANDLE_VALUE;
+	LARGE_INTEGER li;
+	DWORD Size, nb_sectors, nb_fats, nb_root_entries;
+	size_t root_offset;
+	BOOL r = FALSE;
+
+	if ((path == NULL) || ((safe_strlen(path) + 14) > MAX_PATH) || (!HAS_EL_TORITO_FLOPPY(iso_report))) {
+		uprintf("invalid path supplied for El Torito floppy extraction\n");
+		return FALSE;
+	}
+
+	DiskImageSize = (DWORD)iso_report.el_torito_size;
+	DiskImage = (BYTE*)malloc(DiskImageSize);
+	if (DiskImage == NULL)
+		goto out;
+	hISO = CreateFileU(iso, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+	li.QuadPart = iso_report.el_torito_offset;
+	if ( (hISO == INVALID_HANDLE_VALUE) || (!SetFilePointerEx(hISO, li, NULL, FILE_BEGIN))
+	  || (!ReadFile(hISO, DiskImage, DiskImageSize, &Size, NULL)) || (Size != DiskImageSize) ) {
+		uprintf("Could not read El Torito floppy image: %s\n", WindowsErrorString());
+		goto out;
+	}
+
+	// Floppies are FAT12, but there's no reason not to also handle FAT16
+	nb_sectors = DiskImage[0x13] | (DiskImage[0x14] << 8);
+	if (nb_sectors == 0)
+		nb_sectors = DiskImage[0x20] | (DiskImage[0x21] << 8) | (DiskImage[0x22] << 16) | ((DWORD)DiskImage[0x23] << 24);
+	nb_sectors = MIN(nb_sectors, DiskImageSize / 512);
+	nb_fats = DiskImage[0x10];
+	nb_root_entries = DiskImage[0x11] | (DiskImage[0x12] << 8);
+	FatClusterSize = DiskImage[0x0d] * 512;
+	FatOffset = (DiskImage[0x0e] | (DiskImage[0x0f] << 8)) * 512;
+	FatSize = (DiskImage[0x16] | (DiskImage[0x17] << 8)) * 512;
+	root_offset = FatOffset + nb_fats * FatSize;
+	FatDataOffset = root_offset + ((nb_root_entries * FAT_BYTES_PER_DIRENT + 511) / 512) * 512;
+	if ((FatClusterSize == 0) || (nb_fats == 0) || (FatSize == 0) || (FatDataOffset >= (size_t)nb_sectors * 512)) {
+		uprintf("El Torito floppy image has an invalid FAT file system\n");
+		goto out;
+	}
+	FatNbClusters = (DWORD)(((size_t)nb_sectors * 512 - FatDataOffset) / FatClusterSize);
+	FatIs16 = (FatNbClusters >= 4085);
+
+	uprintf("Extracting El Torito floppy image (FAT%d, %d clusters of %d bytes)...\n",
+		FatIs16 ? 16 : 12, FatNbClusters, FatClusterSize);
+	r = ExtractFATDir(&DiskImage[root_offset], nb_root_entries, path, 0);
+
+out:
+	safe_closehandle(hISO);
+	safe_free(DiskImage);
+	return r;
+}
+
 BOOL ExtractDOS(const char* path)
 {
 	switch(ComboBox_GetItemData(hBootType, ComboBox_GetCurSel(hBootType))) {
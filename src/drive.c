@@ -24,6 +24,7 @@
 #include <windows.h>
 #include <stdio.h>
 #include <string.h>
+#include <stddef.h>
 #include <ctype.h>
 
 #include "msapi_utf8.h"
@@ -37,10 +38,16 @@
 #include "ntfs.h"
 #include "localization.h"
 
+#define TRIM_CHUNK_SIZE             (1024*1024*1024ULL)
+
 #if !defined(PARTITION_BASIC_DATA_GUID)
 const GUID PARTITION_BASIC_DATA_GUID = 
 	{ 0xebd0a0a2, 0xb9e5, 0x4433, {0x87, 0xc0, 0x68, 0xb6, 0xb7, 0x26, 0x99, 0xc7} };
 #endif
+#if !defined(PARTITION_LINUX_DATA_GUID)
+const GUID PARTITION_LINUX_DATA_GUID =
+	{ 0x0fc63daf, 0x8483, 0x4772, {0x8e, 0x79, 0x3d, 0x69, 0xd8, 0x47, 0x7d, 0xe4} };
+#endif
 
 /*
  * Globals
@@ -573,23 +580,17 @@ const struct {int (*fn)(FILE *fp); char* str;} known_mbr[] = {
 	{ is_zero_mbr, "Zeroed" },
 };
 
-// Returns TRUE if the drive seems bootable, FALSE otherwise
-BOOL AnalyzeMBR(HANDLE hPhysicalDrive, const char* TargetName)
+static BOOL _AnalyzeMBR(FILE* fp, const char* TargetName)
 {
 	const char* mbr_name = "Master Boot Record";
-	FILE fake_fd = { 0 };
 	int i;
 
-	fake_fd._ptr = (char*)hPhysicalDrive;
-	// Must be set to 512, as we also use this method for images and we may not have a target UFD yet
-	fake_fd._bufsiz = 512;
-
-	if (!is_br(&fake_fd)) {
+	if (!is_br(fp)) {
 		uprintf("%s does not have an x86 %s\n", TargetName, mbr_name);
 		return FALSE;
 	}
 	for (i=0; i<ARRAYSIZE(known_mbr); i++) {
-		if (known_mbr[i].fn(&fake_fd)) {
+		if (known_mbr[i].fn(fp)) {
 			uprintf("%s has a %s %s\n", TargetName, known_mbr[i].str, mbr_name);
 			return TRUE;
 		}
@@ -599,6 +600,32 @@ BOOL AnalyzeMBR(HANDLE hPhysicalDrive, const char* TargetName)
 	return TRUE;
 }
 
+// Returns TRUE if the drive seems bootable, FALSE otherwise
+BOOL AnalyzeMBR(HANDLE hPhysicalDrive, const char* TargetName)
+{
+	FILE fake_fd = { 0 };
+
+	fake_fd._ptr = (char*)hPhysicalDrive;
+	// Must be set to 512, as we also use this method for images and we may not have a target UFD yet
+	fake_fd._bufsiz = 512;
+
+	return _AnalyzeMBR(&fake_fd, TargetName);
+}
+
+// Same as above, for an MBR that has already been read into memory (e.g. from a compressed image)
+BOOL AnalyzeMBRBuffer(const uint8_t* buf, size_t size, const char* TargetName)
+{
+	FILE fake_fd = { 0 };
+
+	if ((buf == NULL) || (size < 512))
+		return FALSE;
+	fake_fd._base = (char*)buf;
+	fake_fd._charbuf = (int)MIN(size, 0x7FFFFFFF);
+	fake_fd._bufsiz = 512;
+
+	return _AnalyzeMBR(&fake_fd, TargetName);
+}
+
 const struct {int (*fn)(FILE *fp); char* str;} known_pbr[] = {
 	{ entire_fat_16_br_matches, "FAT16 DOS" },
 	{ entire_fat_16_fd_br_matches, "FAT16 FreeDOS" },
@@ -905,15 +932,23 @@ typedef struct _DRIVE_LAYOUT_INFORMATION_EX4 {
  * copy it got from the last IOCTL, and ignores your changes until you replug the drive
  * or issue an IOCTL_DISK_UPDATE_PROPERTIES.
  */
-BOOL CreatePartition(HANDLE hDrive, int partition_style, int file_system, BOOL mbr_uefi_marker, BOOL add_uefi_togo)
+/*
+ * Create the partition(s) for our target. If persistence_size is not zero, a Linux
+ * partition of that size, for the persistence data of live media, is added after the
+ * other ones. It is never written to, so creating it costs nothing beyond formatting.
+ */
+BOOL CreatePartition(HANDLE hDrive, int partition_style, int file_system, BOOL mbr_uefi_marker, BOOL add_uefi_togo,
+	uint64_t persistence_size)
 {
 	const char* PartitionTypeName[2] = { "MBR", "GPT" };
 	unsigned char* buffer;
 	CREATE_DISK CreateDisk = {PARTITION_STYLE_RAW, {{0}}};
 	DRIVE_LAYOUT_INFORMATION_EX4 DriveLayoutEx = {0};
 	BOOL r;
-	DWORD size, bufsize;
-	LONGLONG size_in_sectors, extra_size_in_tracks = 1;
+	DWORD size, bufsize, i;
+	LONGLONG size_in_sectors, extra_size_in_tracks = 1, persistence_sectors = 0;
+	const LONGLONG sectors_per_mb = 1024 * 1024 / SelectedDrive.Geometry.BytesPerSector;
+	int pn = 1;
 
 	PrintInfoDebug(0, MSG_238, PartitionTypeName[partition_style]);
 	if (uefi_togo_size == 0)
@@ -947,7 +982,8 @@ BOOL CreatePartition(HANDLE hDrive, int partition_style, int file_system, BOOL m
 		// This helps us reselect the partition scheme option that was used when creating the
 		// drive in Rufus. As far as I can tell, Windows doesn't care much if this signature
 		// isn't unique for USB drives.
-		CreateDisk.Mbr.Signature = mbr_uefi_marker?MBR_UEFI_MARKER:GetTickCount();
+		CreateDisk.Mbr.Signature = mbr_uefi_marker?MBR_UEFI_MARKER:
+			(enable_reproducible?GetReproducibleDword("disk signature"):GetTickCount());
 
 		DriveLayoutEx.PartitionStyle = PARTITION_STYLE_MBR;
 		DriveLayoutEx.PartitionCount = 4;	// Must be multiple of 4 for MBR
@@ -963,11 +999,10 @@ BOOL CreatePartition(HANDLE hDrive, int partition_style, int file_system, BOOL m
 		// control code. For more information about device notification, see RegisterDeviceNotification."
 
 		CreateDisk.PartitionStyle = PARTITION_STYLE_GPT;
-		IGNORE_RETVAL(CoCreateGuid(&CreateDisk.Gpt.DiskId));
+		NewGuid(&CreateDisk.Gpt.DiskId, "disk guid", 0);
 		CreateDisk.Gpt.MaxPartitionCount = MAX_GPT_PARTITIONS;
 
 		DriveLayoutEx.PartitionStyle = PARTITION_STYLE_GPT;
-		DriveLayoutEx.PartitionCount = (add_uefi_togo)?2:1;
 		// At the very least, a GPT disk has 34 reserved sectors at the beginning and 33 at the end.
 		DriveLayoutEx.Type.Gpt.StartingUsableOffset.QuadPart = 34 * SelectedDrive.Geometry.BytesPerSector;
 		DriveLayoutEx.Type.Gpt.UsableLength.QuadPart = SelectedDrive.DiskSize - (34+33) * SelectedDrive.Geometry.BytesPerSector;
@@ -981,6 +1016,17 @@ BOOL CreatePartition(HANDLE hDrive, int partition_style, int file_system, BOOL m
 		break;
 	}
 
+	if (persistence_size != 0) {
+		persistence_sectors = persistence_size / SelectedDrive.Geometry.BytesPerSector;
+		uprintf("Reserving %s for persistence partition", SizeToHumanReadable(persistence_size, TRUE, FALSE));
+		size_in_sectors -= persistence_sectors;
+		// Keep the persistence partition 1 MB aligned, unless the partitions are track aligned
+		if ((partition_style == PARTITION_STYLE_GPT) || (!IsChecked(IDC_EXTRA_PARTITION)))
+			size_in_sectors -= size_in_sectors % sectors_per_mb;
+		if (size_in_sectors <= 0)
+			return FALSE;
+	}
+
 	DriveLayoutEx.PartitionEntry[0].PartitionLength.QuadPart = size_in_sectors * SelectedDrive.Geometry.BytesPerSector;
 	DriveLayoutEx.PartitionEntry[0].PartitionNumber = 1;
 	DriveLayoutEx.PartitionEntry[0].RewritePartition = TRUE;
@@ -1002,6 +1048,10 @@ BOOL CreatePartition(HANDLE hDrive, int partition_style, int file_system, BOOL m
 		case FS_FAT32:
 			DriveLayoutEx.PartitionEntry[0].Mbr.PartitionType = 0x0c;	// FAT32 LBA
 			break;
+		case FS_EXT2:
+		case FS_EXT4:
+			DriveLayoutEx.PartitionEntry[0].Mbr.PartitionType = 0x83;	// Linux
+			break;
 		default:
 			uprintf("Unsupported file system\n");
 			return FALSE;
@@ -1023,29 +1073,69 @@ BOOL CreatePartition(HANDLE hDrive, int partition_style, int file_system, BOOL m
 			DriveLayoutEx.PartitionEntry[1].Mbr.BootIndicator = FALSE;
 			DriveLayoutEx.PartitionEntry[1].Mbr.HiddenSectors = SelectedDrive.Geometry.SectorsPerTrack*SelectedDrive.Geometry.BytesPerSector;
 			DriveLayoutEx.PartitionEntry[1].Mbr.PartitionType = (add_uefi_togo)?0x01:RUFUS_EXTRA_PARTITION_TYPE;
+			pn++;
+		}
+		if (persistence_sectors != 0) {
+			DriveLayoutEx.PartitionEntry[pn].PartitionStyle = PARTITION_STYLE_MBR;
+			DriveLayoutEx.PartitionEntry[pn].StartingOffset.QuadPart = DriveLayoutEx.PartitionEntry[pn-1].StartingOffset.QuadPart +
+				DriveLayoutEx.PartitionEntry[pn-1].PartitionLength.QuadPart;
+			DriveLayoutEx.PartitionEntry[pn].PartitionLength.QuadPart = persistence_sectors * SelectedDrive.Geometry.BytesPerSector;
+			DriveLayoutEx.PartitionEntry[pn].PartitionNumber = pn + 1;
+			DriveLayoutEx.PartitionEntry[pn].RewritePartition = TRUE;
+			DriveLayoutEx.PartitionEntry[pn].Mbr.BootIndicator = FALSE;
+			DriveLayoutEx.PartitionEntry[pn].Mbr.HiddenSectors = (DWORD)(DriveLayoutEx.PartitionEntry[pn].StartingOffset.QuadPart /
+				SelectedDrive.Geometry.BytesPerSector);
+			DriveLayoutEx.PartitionEntry[pn].Mbr.PartitionType = 0x83;	// Linux
+			pn++;
 		}
 		// For the remaining partitions, PartitionStyle & PartitionType have already
 		// been zeroed => already set to MBR/unused
 		break;
 	case PARTITION_STYLE_GPT:
-		DriveLayoutEx.PartitionEntry[0].Gpt.PartitionType = PARTITION_BASIC_DATA_GUID;
-		IGNORE_RETVAL(CoCreateGuid(&DriveLayoutEx.PartitionEntry[0].Gpt.PartitionId));
-		wcscpy(DriveLayoutEx.PartitionEntry[0].Gpt.Name, L"Microsoft Basic Data");
+		if (IS_EXT(file_system)) {
+			DriveLayoutEx.PartitionEntry[0].Gpt.PartitionType = PARTITION_LINUX_DATA_GUID;
+			wcscpy(DriveLayoutEx.PartitionEntry[0].Gpt.Name, L"Linux filesystem");
+		} else {
+			DriveLayoutEx.PartitionEntry[0].Gpt.PartitionType = PARTITION_BASIC_DATA_GUID;
+			wcscpy(DriveLayoutEx.PartitionEntry[0].Gpt.Name, L"Microsoft Basic Data");
+		}
+		NewGuid(&DriveLayoutEx.PartitionEntry[0].Gpt.PartitionId, "partition guid", 0);
 		if (add_uefi_togo) {
 			DriveLayoutEx.PartitionEntry[1].Gpt.PartitionType = PARTITION_BASIC_DATA_GUID;
-			IGNORE_RETVAL(CoCreateGuid(&DriveLayoutEx.PartitionEntry[1].Gpt.PartitionId));
+			NewGuid(&DriveLayoutEx.PartitionEntry[1].Gpt.PartitionId, "partition guid", 1);
 			wcscpy(DriveLayoutEx.PartitionEntry[1].Gpt.Name, L"UEFI:TOGO");
 			DriveLayoutEx.PartitionEntry[1].PartitionNumber = 2;
 			DriveLayoutEx.PartitionEntry[1].RewritePartition = TRUE;
 			DriveLayoutEx.PartitionEntry[1].StartingOffset.QuadPart = DriveLayoutEx.PartitionEntry[0].StartingOffset.QuadPart +
 				DriveLayoutEx.PartitionEntry[0].PartitionLength.QuadPart;
 			DriveLayoutEx.PartitionEntry[1].PartitionLength.QuadPart = uefi_togo_size;
+			pn++;
+		}
+		if (persistence_sectors != 0) {
+			DriveLayoutEx.PartitionEntry[pn].PartitionStyle = PARTITION_STYLE_GPT;
+			DriveLayoutEx.PartitionEntry[pn].Gpt.PartitionType = PARTITION_LINUX_DATA_GUID;
+			NewGuid(&DriveLayoutEx.PartitionEntry[pn].Gpt.PartitionId, "partition guid", pn);
+			wcscpy(DriveLayoutEx.PartitionEntry[pn].Gpt.Name, L"Linux filesystem");
+			DriveLayoutEx.PartitionEntry[pn].PartitionNumber = pn + 1;
+			DriveLayoutEx.PartitionEntry[pn].RewritePartition = TRUE;
+			DriveLayoutEx.PartitionEntry[pn].StartingOffset.QuadPart = DriveLayoutEx.PartitionEntry[pn-1].StartingOffset.QuadPart +
+				DriveLayoutEx.PartitionEntry[pn-1].PartitionLength.QuadPart;
+			DriveLayoutEx.PartitionEntry[pn].PartitionLength.QuadPart = persistence_sectors * SelectedDrive.Geometry.BytesPerSector;
+			pn++;
 		}
+		DriveLayoutEx.PartitionCount = pn;
 		break;
 	default:
 		break;
 	}
 
+	// Keep track of where our partitions are, for the formatters that need to access them directly
+	SelectedDrive.nPartitions = pn;
+	for (i = 0; i < ARRAYSIZE(SelectedDrive.PartitionOffset); i++) {
+		SelectedDrive.PartitionOffset[i] = DriveLayoutEx.PartitionEntry[i].StartingOffset.QuadPart;
+		SelectedDrive.PartitionSize[i] = DriveLayoutEx.PartitionEntry[i].PartitionLength.QuadPart;
+	}
+
 	// We need to write the extra partition before we refresh the disk
 	if (add_uefi_togo) {
 		uprintf("Writing UEFI:TOGO partition...");
@@ -1081,7 +1171,7 @@ BOOL CreatePartition(HANDLE hDrive, int partition_style, int file_system, BOOL m
 		return FALSE;
 	}
 
-	size = sizeof(DriveLayoutEx) - ((partition_style == PARTITION_STYLE_GPT)?((add_uefi_togo?2:3)*sizeof(PARTITION_INFORMATION_EX)):0);
+	size = sizeof(DriveLayoutEx) - ((partition_style == PARTITION_STYLE_GPT)?((4-pn)*sizeof(PARTITION_INFORMATION_EX)):0);
 	r = DeviceIoControl(hDrive, IOCTL_DISK_SET_DRIVE_LAYOUT_EX,
 			(BYTE*)&DriveLayoutEx, size, NULL, 0, &size, NULL );
 	if (!r) {
@@ -1110,6 +1200,53 @@ BOOL RefreshDriveLayout(HANDLE hDrive)
 	return r;
 }
 
+/*
+ * Tell the drive that it doesn't need to preserve the content of a range. This is
+ * done in chunks, so that we can check for cancellation on large drives.
+ */
+BOOL DiscardDriveRange(HANDLE hDrive, uint64_t offset, uint64_t size)
+{
+	uint64_t done;
+	DWORD ret_size;
+	DEVICE_TRIM_REDEF trim;
+
+	for (done = 0; done < size; done += TRIM_CHUNK_SIZE) {
+		memset(&trim, 0, sizeof(trim));
+		trim.Attributes.Size = sizeof(trim.Attributes);
+		trim.Attributes.Action = DeviceDsmAction_Trim_REDEF;
+		trim.Attributes.DataSetRangesOffset = offsetof(DEVICE_TRIM_REDEF, Range);
+		trim.Attributes.DataSetRangesLength = sizeof(trim.Range);
+		trim.Range.StartingOffset = offset + done;
+		trim.Range.LengthInBytes = min(TRIM_CHUNK_SIZE, size - done);
+		if (!DeviceIoControl(hDrive, IOCTL_STORAGE_MANAGE_DATA_SET_ATTRIBUTES, &trim, sizeof(trim),
+			NULL, 0, &ret_size, NULL))
+			return FALSE;
+		if (IS_ERROR(FormatStatus))
+			return FALSE;
+	}
+	return TRUE;
+}
+
+/*
+ * Find out if discarded blocks are guaranteed to read back as zeroes, in which case
+ * areas of the drive that must be zeroed can be discarded rather than written.
+ */
+BOOL DiscardReadsZeroes(HANDLE hDrive)
+{
+	STORAGE_PROPERTY_QUERY query;
+	DEVICE_LB_PROVISIONING_DESCRIPTOR_REDEF lbp;
+	DWORD size;
+
+	memset(&query, 0, sizeof(query));
+	memset(&lbp, 0, sizeof(lbp));
+	query.PropertyId = (STORAGE_PROPERTY_ID)StorageDeviceLBProvisioningProperty_REDEF;
+	query.QueryType = PropertyStandardQuery;
+	if ( (!DeviceIoControl(hDrive, IOCTL_STORAGE_QUERY_PROPERTY, &query, sizeof(query), &lbp, sizeof(lbp), &size, NULL))
+	  || (size < offsetof(DEVICE_LB_PROVISIONING_DESCRIPTOR_REDEF, Reserved1)) )
+		return FALSE;
+	return (lbp.ThinProvisioningEnabled && lbp.ThinProvisioningReadZeros);
+}
+
 /* Delete the disk partition table */
 BOOL DeletePartitions(HANDLE hDrive)
 {
@@ -43,6 +43,88 @@ typedef struct {
 	DISK_EXTENT Extents[8];
 } VOLUME_DISK_EXTENTS_REDEF;
 
+#if !defined(IOCTL_STORAGE_MANAGE_DATA_SET_ATTRIBUTES)
+#define IOCTL_STORAGE_MANAGE_DATA_SET_ATTRIBUTES \
+	CTL_CODE(IOCTL_STORAGE_BASE, 0x0501, METHOD_BUFFERED, FILE_WRITE_ACCESS)
+#endif
+#define DeviceDsmAction_Trim_REDEF          1
+#define StorageDeviceLBProvisioningProperty_REDEF 11
+
+typedef struct {
+	DWORD Size;
+	DWORD Action;
+	DWORD Flags;
+	DWORD ParameterBlockOffset;
+	DWORD ParameterBlockLength;
+	DWORD DataSetRangesOffset;
+	DWORD DataSetRangesLength;
+} DEVICE_MANAGE_DATA_SET_ATTRIBUTES_REDEF;
+
+typedef struct {
+	LONGLONG StartingOffset;
+	DWORDLONG LengthInBytes;
+} DEVICE_DATA_SET_RANGE_REDEF;
+
+typedef struct {
+	DEVICE_MANAGE_DATA_SET_ATTRIBUTES_REDEF Attributes;
+	DEVICE_DATA_SET_RANGE_REDEF Range;
+} DEVICE_TRIM_REDEF;
+
+typedef struct {
+	DWORD Version;
+	DWORD Size;
+	BYTE ThinProvisioningEnabled:1;
+	BYTE ThinProvisioningReadZeros:1;
+	BYTE AnchorSupported:1;
+	BYTE UnmapGranularityAlignmentValid:1;
+	BYTE Reserved0:4;
+	BYTE Reserved1[7];
+	DWORDLONG OptimalUnmapGranularity;
+	DWORDLONG UnmapGranularityAlignment;
+} DEVICE_LB_PROVISIONING_DESCRIPTOR_REDEF;
+
+/*
+ * MBR partition entry and GPT header/entry, as found on disk (Little Endian)
+ */
+#define GPT_HEADER_SIGNATURE                "EFI PART"
+
+#pragma pack(push, 1)
+typedef struct mbr_partition {
+	uint8_t		boot_indicator;
+	uint8_t		chs_start[3];
+	uint8_t		type;
+	uint8_t		chs_end[3];
+	uint32_t	lba_start;
+	uint32_t	nb_sectors;
+} mbr_partition;
+
+typedef struct gpt_header {
+	char		signature[8];
+	uint32_t	revision;
+	uint32_t	header_size;
+	uint32_t	header_crc;
+	uint32_t	reserved;
+	uint64_t	my_lba;
+	uint64_t	alternate_lba;
+	uint64_t	first_usable_lba;
+	uint64_t	last_usable_lba;
+	uint8_t		disk_guid[16];
+	uint64_t	partition_entry_lba;
+	uint32_t	nb_partition_entries;
+	uint32_t	partition_entry_size;
+	uint32_t	partition_entry_crc;
+} gpt_header;
+
+typedef struct gpt_entry {
+	uint8_t		type_guid[16];
+	uint8_t		unique_guid[16];
+	uint64_t	first_lba;
+	uint64_t	last_lba;
+	uint64_t	attributes;
+	uint16_t	name[36];
+} gpt_entry;
+#pragma pack(pop)
+
 BOOL SetAutoMount(BOOL enable);
 BOOL GetAutoMount(BOOL* enabled);
 char* GetPhysicalName(DWORD DriveIndex);
@@ -58,12 +140,18 @@ BOOL GetDriveLabel(DWORD DriveIndex, char* letter, char** label);
 uint64_t GetDriveSize(DWORD DriveIndex);
 BOOL IsMediaPresent(DWORD DriveIndex);
 BOOL AnalyzeMBR(HANDLE hPhysicalDrive, const char* TargetName);
+BOOL AnalyzeMBRBuffer(const uint8_t* buf, size_t size, const char* TargetName);
 BOOL AnalyzePBR(HANDLE hLogicalVolume);
 BOOL GetDrivePartitionData(DWORD DriveIndex, char* FileSystemName, DWORD FileSystemNameSize, BOOL bSilent);
 BOOL UnmountVolume(HANDLE hDrive);
 BOOL MountVolume(char* drive_name, char *drive_guid);
 BOOL RemountVolume(char* drive_name);
-BOOL CreatePartition(HANDLE hDrive, int partition_style, int file_system, BOOL mbr_uefi_marker, BOOL add_uefi_togo);
+BOOL CreatePartition(HANDLE hDrive, int partition_style, int file_system, BOOL mbr_uefi_marker, BOOL add_uefi_togo,
+	uint64_t persistence_size);
 BOOL DeletePartitions(HANDLE hDrive);
 BOOL RefreshDriveLayout(HANDLE hDrive);
+BOOL DiscardDriveRange(HANDLE hDrive, uint64_t offset, uint64_t size);
+BOOL DiscardReadsZeroes(HANDLE hDrive);
 const char* GetPartitionType(BYTE Type);
+uint32_t gpt_crc32(const uint8_t* buf, size_t len);
+BOOL ValidateDrive(HANDLE hPhysicalDrive, const char* drive_name, int pt, int bt, int fs, int dt);
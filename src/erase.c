@@ -0,0 +1,410 @@
+/*
+ * Rufus: The Reliable USB Formatting Utility
+ * Whole drive erasure
+ * Copyright © 2015 Pete Batard <pete@akeo.ie>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Writing every single byte of a large drive takes ages, when the drive itself may be
+ * able to do the job in a fraction of the time. So we try, in order:
+ * - ATA Security Erase, for SATA drives behind an USB bridge that supports SAT passthrough,
+ *   or the vendor specific one of a bridge we can identify from its Vendor ID
+ * - SCSI UNMAP of the whole drive, for drives that report unmapped blocks as zeroed
+ * - Zeroing the drive ourselves, with as many writes in flight as we can get away with
+ * Since we can't exactly take a drive's word for it, the result is checked by reading
+ * back sectors from all over the drive, and we move on to the next method if any of
+ * them still contains data.
+ */
+
+#include <windows.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stddef.h>
+
+#include "rufus.h"
+#include "smart.h"
+
+#define ERASE_BUFFER_SIZE           (1024 * 1024)
+#define ERASE_QUEUE_DEPTH           8
+#define ERASE_NB_SAMPLES            64
+#define ERASE_PASSWORD              APPLICATION_NAME
+#define ATA_ERASE_DEFAULT_TIME      (12 * 60)	// in minutes, for drives that don't report it
+#define SCSI_UNMAP_TIMEOUT          60			// in seconds, for each UNMAP command
+
+PF_TYPE_DECL(WINAPI, HANDLE, ReOpenFile, (HANDLE, DWORD, DWORD, DWORD));
+
+BOOL enable_secure_erase = FALSE;
+static DWORD LastEraseRefresh;
+
+static __inline uint32_t read_be32(const uint8_t* p)
+{
+	return ((uint32_t)p[0] << 24) | ((uint32_t)p[1] << 16) | ((uint32_t)p[2] << 8) | p[3];
+}
+
+static __inline uint64_t read_be64(const uint8_t* p)
+{
+	return ((uint64_t)read_be32(p) << 32) | read_be32(&p[4]);
+}
+
+static __inline void write_be32(uint8_t* p, uint32_t v)
+{
+	p[0] = (uint8_t)(v >> 24);
+	p[1] = (uint8_t)(v >> 16);
+	p[2] = (uint8_t)(v >> 8);
+	p[3] = (uint8_t)v;
+}
+
+static void erase_progress(uint64_t done, uint64_t size)
+{
+	if (GetTickCount() > LastEraseRefresh + 25) {
+		LastEraseRefresh = GetTickCount();
+		UpdateProgress(OP_ERASE, (100.0f * done) / (1.0f * size));
+	}
+}
+
+/*
+ * Read sectors from all over the drive, including the first and last ones, and check
+ * that they are filled with zeros (or, if allow_ones is set, with 0xFF).
+ */
+static BOOL VerifyErase(HANDLE hDrive, uint64_t size, DWORD sector_size, BOOL allow_ones)
+{
+	LARGE_INTEGER li;
+	DWORD rSize, j;
+	uint64_t nb_sectors = size / sector_size, stride = nb_sectors / (ERASE_NB_SAMPLES - 1);
+	uint8_t* buf;
+	BOOL r = FALSE;
+	int i;
+
+	buf = (uint8_t*)_aligned_malloc(sector_size, 0x1000);
+	if (buf == NULL)
+		return FALSE;
+	srand((unsigned int)GetTickCount());
+	for (i = 0; i < ERASE_NB_SAMPLES; i++) {
+		li.QuadPart = (i == ERASE_NB_SAMPLES - 1) ? nb_sectors - 1 : i * stride;
+		if ((i != 0) && (i != ERASE_NB_SAMPLES - 1) && (stride > 1))
+			li.QuadPart += ((((uint64_t)rand()) << 16) | rand()) % stride;
+		li.QuadPart *= sector_size;
+		if ( (!SetFilePointerEx(hDrive, li, NULL, FILE_BEGIN))
+		  || (!ReadFile(hDrive, buf, sector_size, &rSize, NULL)) || (rSize != sector_size) ) {
+			uprintf("Could not read sector at offset 0x%llx: %s", li.QuadPart, WindowsErrorString());
+			goto out;
+		}
+		for (j = 1; (j < sector_size) && (buf[j] == buf[0]); j++);
+		if ((j < sector_size) || ((buf[0] != 0x00) && ((!allow_ones) || (buf[0] != 0xFF)))) {
+			uprintf("Sector at offset 0x%llx was not erased", li.QuadPart);
+			goto out;
+		}
+	}
+	r = TRUE;
+
+out:
+	_aligned_free(buf);
+	return r;
+}
+
+/*
+ * Have the drive erase itself, using the ATA Security feature set. This requires setting
+ * a user password, which the erase then clears. If anything goes wrong along the way, we
+ * make sure that the drive isn't left locked with our password.
+ */
+static BOOL AtaSecurityErase(HANDLE hDrive, uint16_t vid, uint64_t size, DWORD sector_size)
+{
+	ATA_PASSTHROUGH_CMD Command = { 0 };
+	IDENTIFY_DEVICE_DATA* idd = NULL;
+	uint8_t* buf = NULL;
+	uint64_t nb_sectors;
+	uint32_t erase_time;
+	int bridge = -1, r;
+	BOOL ret = FALSE;
+
+	// The passthrough functions assume 512 bytes sectors
+	if (sector_size != 512)
+		return FALSE;
+	idd = (IDENTIFY_DEVICE_DATA*)_aligned_malloc(sizeof(IDENTIFY_DEVICE_DATA), 0x10);
+	buf = (uint8_t*)_aligned_malloc(512, 0x10);
+	if ((idd == NULL) || (buf == NULL))
+		goto out;
+
+	Command.AtaCmd = ATA_IDENTIFY_DEVICE;
+	r = AtaPassthrough(hDrive, vid, &bridge, &Command, idd, sizeof(IDENTIFY_DEVICE_DATA), SPT_TIMEOUT_VALUE);
+	if (r != SPT_SUCCESS) {
+		uprintf("ATA passthrough is not available (%s)", SptStrerr(r));
+		goto out;
+	}
+	if (!idd->SecurityStatus.SecuritySupported) {
+		uprintf("Drive does not support ATA Security Erase");
+		goto out;
+	}
+	if ( idd->SecurityStatus.SecurityEnabled || idd->SecurityStatus.SecurityLocked
+	  || idd->SecurityStatus.SecurityFrozen || idd->SecurityStatus.SecurityCountExpired ) {
+		uprintf("Drive security is %s - ATA Security Erase is not possible",
+			idd->SecurityStatus.SecurityFrozen ? "frozen" : "in use");
+		goto out;
+	}
+	// Only erase what we know to be the whole of the drive we were given
+	nb_sectors = idd->CommandSetActive.BigLba ?
+		(((uint64_t)idd->Max48BitLBA[1] << 32) | idd->Max48BitLBA[0]) : idd->UserAddressableSectors;
+	if (nb_sectors * 512 != size) {
+		uprintf("ATA drive size (%lld sectors) does not match the one of the device", nb_sectors);
+		goto out;
+	}
+	// Word 89 is the time required for the erase, in units of 2 minutes
+	erase_time = idd->ReservedWord89[0] & ((idd->ReservedWord89[0] & 0x8000) ? 0x7fff : 0x00ff);
+	erase_time = ((erase_time == 0) || (erase_time == 0xff)) ? ATA_ERASE_DEFAULT_TIME : 2 * erase_time;
+	uprintf("Erasing drive using ATA Security Erase (expected to take %d minutes)...", erase_time);
+
+	memset(buf, 0, 512);
+	memcpy(&buf[2], ERASE_PASSWORD, sizeof(ERASE_PASSWORD) - 1);
+	memset(&Command, 0, sizeof(Command));
+	Command.AtaCmd = ATA_SECURITY_SET_PASSWORD;
+	r = AtaPassthrough(hDrive, vid, &bridge, &Command, buf, 512, SPT_TIMEOUT_VALUE);
+	if (r != SPT_SUCCESS) {
+		uprintf("Could not set drive password: %s", SptStrerr(r));
+		goto out;
+	}
+	Command.AtaCmd = ATA_SECURITY_ERASE_PREPARE;
+	r = AtaPassthrough(hDrive, vid, &bridge, &Command, NULL, 0, SPT_TIMEOUT_VALUE);
+	if (r == SPT_SUCCESS) {
+		Command.AtaCmd = ATA_SECURITY_ERASE_UNIT;
+		r = AtaPassthrough(hDrive, vid, &bridge, &Command, buf, 512, (erase_time + erase_time / 2) * 60);
+	}
+	if (r != SPT_SUCCESS) {
+		uprintf("ATA Security Erase failed: %s", SptStrerr(r));
+		Command.AtaCmd = ATA_SECURITY_DISABLE_PASSWORD;
+		r = AtaPassthrough(hDrive, vid, &bridge, &Command, buf, 512, SPT_TIMEOUT_VALUE);
+		if (r != SPT_SUCCESS)
+			uprintf("WARNING: Could not clear the drive password. If the drive is locked, use '%s' to unlock it.",
+				ERASE_PASSWORD);
+		goto out;
+	}
+	ret = TRUE;
+
+out:
+	_aligned_free(idd);
+	_aligned_free(buf);
+	return ret;
+}
+
+/*
+ * Unmap all the blocks of the drive. This is only of use if the drive guarantees that
+ * unmapped blocks read back as zeros, which it tells us through READ CAPACITY (16).
+ */
+static BOOL ScsiUnmap(HANDLE hDrive, uint64_t size, DWORD sector_size)
+{
+	uint8_t Cdb[16], *buf = NULL;
+	uint64_t lba, nb_blocks;
+	uint32_t count, max_count;
+	int r;
+	BOOL ret = FALSE;
+
+	buf = (uint8_t*)_aligned_malloc(64, 0x10);
+	if (buf == NULL)
+		return FALSE;
+
+	memset(Cdb, 0, sizeof(Cdb));
+	memset(buf, 0, 64);
+	Cdb[0] = SCSI_SERVICE_ACTION_IN_16;
+	Cdb[1] = SCSI_READ_CAPACITY_16;
+	Cdb[13] = 32;
+	r = ScsiPassthroughDirect(hDrive, Cdb, 16, SCSI_IOCTL_DATA_IN, buf, 32, SPT_TIMEOUT_VALUE);
+	if (r != SPT_SUCCESS) {
+		uprintf("Could not read drive capacity: %s", SptStrerr(r));
+		goto out;
+	}
+	nb_blocks = read_be64(buf) + 1;
+	if ((read_be32(&buf[8]) != sector_size) || (nb_blocks * sector_size != size)) {
+		uprintf("SCSI drive size does not match the one of the device");
+		goto out;
+	}
+	// LBPME: Logical Block Provisioning Management Enabled, LBPRZ: Read Zeros
+	if ((buf[14] & 0xc0) != 0xc0) {
+		uprintf("Drive does not support zeroing through SCSI UNMAP");
+		goto out;
+	}
+
+	// The Block Limits VPD page tells us how much we can unmap at once
+	memset(Cdb, 0, sizeof(Cdb));
+	memset(buf, 0, 64);
+	Cdb[0] = SCSI_INQUIRY;
+	Cdb[1] = 0x01;
+	Cdb[2] = 0xb0;
+	Cdb[4] = 64;
+	r = ScsiPassthroughDirect(hDrive, Cdb, 6, SCSI_IOCTL_DATA_IN, buf, 64, SPT_TIMEOUT_VALUE);
+	max_count = read_be32(&buf[20]);
+	if ((r != SPT_SUCCESS) || (buf[1] != 0xb0) || (buf[3] < 0x3c) || (max_count == 0) || (read_be32(&buf[24]) == 0)) {
+		uprintf("Drive does not report SCSI UNMAP limits");
+		goto out;
+	}
+
+	uprintf("Erasing drive using SCSI UNMAP...");
+	LastEraseRefresh = 0;
+	for (lba = 0; lba < nb_blocks; lba += count) {
+		if (IS_ERROR(FormatStatus))
+			goto out;
+		count = (uint32_t)MIN(max_count, nb_blocks - lba);
+		// A parameter list header, followed by a single block descriptor
+		memset(buf, 0, 24);
+		buf[1] = 22;
+		buf[3] = 16;
+		write_be32(&buf[8], (uint32_t)(lba >> 32));
+		write_be32(&buf[12], (uint32_t)lba);
+		write_be32(&buf[16], count);
+		memset(Cdb, 0, sizeof(Cdb));
+		Cdb[0] = SCSI_UNMAP;
+		Cdb[8] = 24;
+		r = ScsiPassthroughDirect(hDrive, Cdb, 10, SCSI_IOCTL_DATA_OUT, buf, 24, SCSI_UNMAP_TIMEOUT);
+		if (r != SPT_SUCCESS) {
+			uprintf("Could not unmap blocks 0x%llx-0x%llx: %s", lba, lba + count - 1, SptStrerr(r));
+			goto out;
+		}
+		erase_progress(lba + count, nb_blocks);
+	}
+	ret = TRUE;
+
+out:
+	_aligned_free(buf);
+	return ret;
+}
+
+/*
+ * Zero the drive. Rather than wait for each write to complete before we issue the next,
+ * we keep the drive's queue filled, through a handle opened for overlapped I/O. If we
+ * can't get one, we fall back to a regular sequential write.
+ */
+static BOOL OverwriteDrive(HANDLE hDrive, uint64_t size, DWORD sector_size)
+{
+	OVERLAPPED ov[ERASE_QUEUE_DEPTH];
+	DWORD len[ERASE_QUEUE_DEPTH] = { 0 }, wSize;
+	HANDLE hAsync = INVALID_HANDLE_VALUE, h = hDrive;
+	uint64_t offset, written = 0;
+	uint8_t* buf = NULL;
+	int i, depth = 1, pending = 0;
+	BOOL r = FALSE;
+
+	memset(ov, 0, sizeof(ov));
+	PF_INIT(ReOpenFile, Kernel32);
+	if (pfReOpenFile != NULL)
+		hAsync = pfReOpenFile(hDrive, GENERIC_READ|GENERIC_WRITE, FILE_SHARE_READ|FILE_SHARE_WRITE,
+			FILE_FLAG_OVERLAPPED|FILE_FLAG_NO_BUFFERING|FILE_FLAG_WRITE_THROUGH);
+	if (hAsync != INVALID_HANDLE_VALUE) {
+		h = hAsync;
+		depth = ERASE_QUEUE_DEPTH;
+	}
+	buf = (uint8_t*)_aligned_malloc(ERASE_BUFFER_SIZE, 0x1000);
+	if (buf == NULL)
+		goto out;
+	memset(buf, 0, ERASE_BUFFER_SIZE);
+	for (i = 0; i < depth; i++) {
+		ov[i].hEvent = CreateEvent(NULL, TRUE, FALSE, NULL);
+		if (ov[i].hEvent == NULL)
+			goto out;
+	}
+
+	uprintf("Erasing drive by zeroing it (%d write%s in flight)...", depth, (depth == 1) ? "" : "s");
+	LastEraseRefresh = 0;
+	for (offset = 0, i = 0; (offset < size) || (pending > 0); i = (i + 1) % depth) {
+		if (len[i] != 0) {
+			if ((!GetOverlappedResult(h, &ov[i], &wSize, TRUE)) || (wSize != len[i])) {
+				uprintf("Write error at offset 0x%llx: %s", ((uint64_t)ov[i].OffsetHigh << 32) | ov[i].Offset,
+					WindowsErrorString());
+				FormatStatus = ERROR_SEVERITY_ERROR|FAC(FACILITY_STORAGE)|ERROR_WRITE_FAULT;
+				len[i] = 0;
+				pending--;
+				goto out;
+			}
+			written += len[i];
+			len[i] = 0;
+			pending--;
+			erase_progress(written, size);
+		}
+		// On cancel, we just wait for the writes that are in flight
+		if ((offset < size) && (!IS_ERROR(FormatStatus))) {
+			len[i] = (DWORD)MIN(ERASE_BUFFER_SIZE, size - offset);
+			ov[i].Offset = (DWORD)offset;
+			ov[i].OffsetHigh = (DWORD)(offset >> 32);
+			if ((!WriteFile(h, buf, len[i], NULL, &ov[i])) && (GetLastError() != ERROR_IO_PENDING)) {
+				uprintf("Write error at offset 0x%llx: %s", offset, WindowsErrorString());
+				FormatStatus = ERROR_SEVERITY_ERROR|FAC(FACILITY_STORAGE)|ERROR_WRITE_FAULT;
+				len[i] = 0;
+				goto out;
+			}
+			pending++;
+			offset += len[i];
+		} else if (offset < size) {
+			offset = size;
+		}
+	}
+	r = !IS_ERROR(FormatStatus);
+
+out:
+	// Don't release anything that writes in flight may still be using
+	if (pending > 0) {
+		CancelIo(h);
+		for (i = 0; i < depth; i++) {
+			if (len[i] != 0)
+				GetOverlappedResult(h, &ov[i], &wSize, TRUE);
+		}
+	}
+	for (i = 0; i < depth; i++) {
+		if (ov[i].hEvent != NULL)
+			CloseHandle(ov[i].hEvent);
+	}
+	safe_closehandle(hAsync);
+	_aligned_free(buf);
+	return r;
+}
+
+/*
+ * Erase the whole drive, using the fastest method that the drive supports, and that we
+ * can verify actually erased it. ATA Security Erase may leave the drive filled with 0xFF
+ * rather than zeros, which is only accepted if zeroed isn't set. vid is the USB Vendor ID
+ * of the drive, if known, which selects the ATA passthrough method of the bridge.
+ */
+BOOL EraseDrive(HANDLE hDrive, uint16_t vid, uint64_t size, DWORD sector_size, BOOL zeroed)
+{
+	const char* method = NULL;
+
+	if ((size == 0) || (sector_size == 0) || (size % sector_size != 0))
+		return FALSE;
+
+	if (AtaSecurityErase(hDrive, vid, size, sector_size)) {
+		if (VerifyErase(hDrive, size, sector_size, !zeroed))
+			method = "ATA Security Erase";
+		else
+			uprintf("ATA Security Erase could not be verified");
+	}
+	if ((method == NULL) && (!IS_ERROR(FormatStatus)) && (ScsiUnmap(hDrive, size, sector_size))) {
+		if (VerifyErase(hDrive, size, sector_size, FALSE))
+			method = "SCSI UNMAP";
+		else
+			uprintf("SCSI UNMAP could not be verified");
+	}
+	if ((method == NULL) && (!IS_ERROR(FormatStatus)) && (OverwriteDrive(hDrive, size, sector_size))) {
+		if (VerifyErase(hDrive, size, sector_size, FALSE))
+			method = "zeroing";
+		else
+			uprintf("Zeroing could not be verified");
+	}
+	if (method == NULL) {
+		if (!IS_ERROR(FormatStatus))
+			FormatStatus = ERROR_SEVERITY_ERROR|FAC(FACILITY_STORAGE)|ERROR_WRITE_FAULT;
+		return FALSE;
+	}
+	uprintf("Drive erased using %s (checked on %d sectors)", method, ERASE_NB_SAMPLES);
+	UpdateProgress(OP_ERASE, 100.0f);
+	return TRUE;
+}
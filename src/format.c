@@ -43,10 +43,21 @@
 #include "file.h"
 #include "drive.h"
 #include "format.h"
+#include "multiboot.h"
+#include "wim.h"
 #include "badblocks.h"
+#include "journal.h"
 #include "localization.h"
+#include "registry.h"
 #include "bled/bled.h"
 
+/*
+ * Defaults for the write cost model, until we have measured the actual values
+ */
+#define DEFAULT_WRITE_THROUGHPUT    (8*1024)    // in KB/s
+#define DEFAULT_FILE_OVERHEAD       15          // in ms per file
+#define MIN_MEASURED_DURATION       5000        // in ms
+
 /*
  * Globals
  */
@@ -56,8 +67,10 @@ static float format_percent = 0.0f;
 static int task_number = 0;
 extern const int nb_steps[FS_MAX];
 extern uint32_t dur_mins, dur_secs;
+extern uint64_t persistence_size;
+extern StrArray DriveHwID;
 static int fs_index = 0;
-BOOL force_large_fat32 = FALSE, enable_ntfs_compression = FALSE;
+BOOL force_large_fat32 = FALSE, enable_ntfs_compression = FALSE, use_persistence = FALSE;
 uint8_t *grub2_buf = NULL;
 long grub2_len;
 static BOOL WritePBR(HANDLE hLogicalDrive);
@@ -327,6 +340,9 @@ static DWORD GetVolumeID(void)
 	DWORD d;
 	WORD lo,hi,tmp;
 
+	if (enable_reproducible)
+		return GetReproducibleDword("volume id");
+
 	GetLocalTime(&s);
 
 	lo = s.wDay + (s.wMonth << 8);
@@ -910,6 +926,9 @@ static BOOL WriteMBR(HANDLE hPhysicalDrive)
 	fs = (int)ComboBox_GetItemData(hFileSystem, ComboBox_GetCurSel(hFileSystem));
 	dt = (int)ComboBox_GetItemData(hBootType, ComboBox_GetCurSel(hBootType));
 	bt = GETBIOSTYPE((int)ComboBox_GetItemData(hPartitionScheme, ComboBox_GetCurSel(hPartitionScheme)));
+	// ISOs that boot from an El Torito floppy image are installed as FreeDOS
+	if ((dt == DT_ISO) && (HAS_EL_TORITO_FLOPPY(iso_report)))
+		dt = DT_FREEDOS;
 	if ((bt == BT_UEFI) && (!allow_dual_uefi_bios)) {
 		uprintf(using_msg, "zeroed");
 		r = write_zero_mbr(&fake_fd);	// Force UEFI boot only by zeroing the MBR
@@ -1026,6 +1045,8 @@ static BOOL WritePBR(HANDLE hLogicalVolume)
 	int dt = (int)ComboBox_GetItemData(hBootType, ComboBox_GetCurSel(hBootType));
 	const char* using_msg = "Using %s %s partition boot record\n";
 
+	if ((dt == DT_ISO) && (HAS_EL_TORITO_FLOPPY(iso_report)))
+		dt = DT_FREEDOS;
 	fake_fd._ptr = (char*)hLogicalVolume;
 	fake_fd._bufsiz = SelectedDrive.Geometry.BytesPerSector;
 
@@ -1269,16 +1290,147 @@ DWORD WINAPI CloseFormatPromptThread(LPVOID param) {
 	ExitThread(0);
 }
 
+/*
+ * Estimate how long it takes, in ms, to write the current image raw (DD) or by extracting its files.
+ * Both are bound by the sequential throughput of the target, but extraction also pays a cost for
+ * each file (directory entries and FAT updates, cluster slack, small writes) which, with many small
+ * files or on a slow FAT32 flash drive, can easily outweigh the extra data a raw write has to copy.
+ */
+static void GetWriteCostParams(DWORD* throughput, DWORD* overhead)
+{
+	if ((!GetRegistryKey32(REGKEY_HKCU, REGKEY_WRITE_THROUGHPUT, throughput)) || (*throughput == 0))
+		*throughput = DEFAULT_WRITE_THROUGHPUT;
+	if (!GetRegistryKey32(REGKEY_HKCU, REGKEY_FILE_OVERHEAD, overhead))
+		*overhead = DEFAULT_FILE_OVERHEAD;
+}
+
+uint64_t EstimateWriteTime(BOOL raw)
+{
+	DWORD throughput, overhead;
+
+	GetWriteCostParams(&throughput, &overhead);
+	if (raw)
+		return (iso_report.src_size * 1000) / (throughput * 1024ULL);
+	return (iso_report.projected_size * 1000) / (throughput * 1024ULL) + (uint64_t)iso_report.nb_files * overhead;
+}
+
+// Refine the cost model parameters from an actual write of 'size' bytes, and report how good our prediction was
+static void UpdateWriteCostModel(BOOL raw, uint64_t size, uint64_t predicted, DWORD duration)
+{
+	DWORD throughput, overhead, measured;
+	uint64_t data_time;
+
+	uprintf("%s took %d.%d s (predicted %d.%d s)", raw?"Image write":"File extraction",
+		duration/1000, (duration%1000)/100, (DWORD)(predicted/1000), (DWORD)((predicted%1000)/100));
+	// Short writes are dominated by caching and setup, and don't tell us much
+	if (duration < MIN_MEASURED_DURATION)
+		return;
+	GetWriteCostParams(&throughput, &overhead);
+	// Average with the previous values, to smooth out differences between drives
+	if (raw) {
+		measured = (DWORD)((size * 1000) / (duration * 1024ULL));
+		if (measured != 0)
+			WriteRegistryKey32(REGKEY_HKCU, REGKEY_WRITE_THROUGHPUT, (throughput + measured) / 2);
+	} else if (iso_report.nb_files != 0) {
+		data_time = (size * 1000) / (throughput * 1024ULL);
+		measured = (duration > data_time) ? (DWORD)((duration - data_time) / iso_report.nb_files) : 0;
+		WriteRegistryKey32(REGKEY_HKCU, REGKEY_FILE_OVERHEAD, (overhead + measured) / 2);
+	}
+}
+
 void update_progress(const uint64_t processed_bytes)
 {
 	if (GetTickCount() > LastRefresh + 25) {
 		LastRefresh = GetTickCount();
-		format_percent = (100.0f*processed_bytes)/(1.0f*iso_report.projected_size);
+		format_percent = (100.0f*processed_bytes)/(1.0f*iso_report.src_size);
 		PrintInfo(0, MSG_261, format_percent);
 		UpdateProgress(OP_FORMAT, format_percent);
 	}
 }
 
+/*
+ * Output of the decompressor, which we buffer so that we write whole sectors to the drive,
+ * and can skip what an interrupted write already took care of and journal the rest.
+ * As bled cannot restart decompression from an arbitrary point, resuming the write of a
+ * compressed image means decompressing it from the start, but only writing the new data.
+ */
+static struct {
+	HANDLE hDrive;
+	uint8_t* buf;
+	DWORD sector_size;
+	DWORD pos;
+	uint64_t offset;	// drive offset of the data in buf
+	uint64_t resume;	// drive offset from which data needs to be written
+	BOOL discard_zeroes;	// whether the drive reads discarded sectors as zeroes
+} dd_out;
+
+static BOOL flush_decompressed(void)
+{
+	LARGE_INTEGER li;
+	DWORD size = dd_out.pos, wSize;
+
+	if (size == 0)
+		return TRUE;
+	if (dd_out.offset + size > dd_out.resume) {
+		// WriteFile fails unless the size is a multiple of sector size
+		if (size % dd_out.sector_size != 0) {
+			size = ((size + dd_out.sector_size - 1) / dd_out.sector_size) * dd_out.sector_size;
+			memset(&dd_out.buf[dd_out.pos], 0, size - dd_out.pos);
+		}
+		li.QuadPart = dd_out.offset;
+		if ( (!SetFilePointerEx(dd_out.hDrive, li, NULL, FILE_BEGIN))
+		  || (!WriteFile(dd_out.hDrive, dd_out.buf, size, &wSize, NULL)) || (wSize != size) ) {
+			uprintf("write error: %s", WindowsErrorString());
+			FormatStatus = ERROR_SEVERITY_ERROR|FAC(FACILITY_STORAGE)|ERROR_WRITE_FAULT;
+			return FALSE;
+		}
+		JournalRecord(dd_out.offset, dd_out.buf, size);
+	}
+	dd_out.offset += dd_out.pos;
+	dd_out.pos = 0;
+	return TRUE;
+}
+
+// Sources that know where their data goes, such as DMG images, can skip over what they don't need to write
+static BOOL seek_decompressed(uint64_t offset)
+{
+	if (!flush_decompressed())
+		return FALSE;
+	dd_out.offset = offset;
+	return TRUE;
+}
+
+// Sources that know which areas must read as zeroes, such as QCOW2 images, can have them discarded
+// rather than written, on drives that guarantee it
+static BOOL discard_decompressed(uint64_t offset, uint64_t size)
+{
+	if ((!dd_out.discard_zeroes) || (!flush_decompressed()))
+		return FALSE;
+	if (!DiscardDriveRange(dd_out.hDrive, offset, size)) {
+		if (!IS_ERROR(FormatStatus)) {
+			uprintf("Could not discard drive sectors, writing zeroes instead: %s", WindowsErrorString());
+			dd_out.discard_zeroes = FALSE;
+		}
+		return FALSE;
+	}
+	dd_out.offset = offset + size;
+	return TRUE;
+}
+
+static int write_decompressed(int fd, const void* buf, unsigned int count)
+{
+	unsigned int size, written;
+
+	for (written = 0; written < count; written += size) {
+		size = MIN(count - written, JOURNAL_RECORD_SIZE - dd_out.pos);
+		memcpy(&dd_out.buf[dd_out.pos], (const uint8_t*)buf + written, size);
+		dd_out.pos += size;
+		if ((dd_out.pos == JOURNAL_RECORD_SIZE) && (!flush_decompressed()))
+			return -1;
+	}
+	return (int)count;
+}
+
 /*
  * Standalone thread for the formatting operation
  * According to http://msdn.microsoft.com/en-us/library/windows/desktop/aa364562.aspx
@@ -1303,7 +1455,10 @@ DWORD WINAPI FormatThread(void* param)
 	SYSTEMTIME lt;
 	FILE* log_fd;
 	LARGE_INTEGER li;
-	uint64_t wb;
+	uint64_t wb, rb, total_size, skipped_size, predicted_time, resume_offset = 0;
+	uint32_t j, nb_ranges;
+	image_range *ranges = NULL, *range, full_range;
+	DWORD start_time;
 	uint8_t *buffer = NULL, *aligned_buffer;
 	char *bb_msg, *guid_volume = NULL;
 	char drive_name[] = "?:\\";
@@ -1313,6 +1468,7 @@ DWORD WINAPI FormatThread(void* param)
 	char efi_dst[] = "?:\\efi\\boot\\bootx64.efi";
 	char kolibri_dst[] = "?:\\MTLD_F32";
 	char grub4dos_dst[] = "?:\\grldr";
+	char ext_label[64];
 	
 	PF_TYPE_DECL(WINAPI, LANGID, GetThreadUILanguage, (void));
 	PF_TYPE_DECL(WINAPI, LANGID, SetThreadUILanguage, (LANGID));
@@ -1325,6 +1481,12 @@ DWORD WINAPI FormatThread(void* param)
 	bt = GETBIOSTYPE((int)ComboBox_GetItemData(hPartitionScheme, ComboBox_GetCurSel(hPartitionScheme)));
 	use_large_fat32 = (fs == FS_FAT32) && ((SelectedDrive.DiskSize > LARGE_FAT32_SIZE) || (force_large_fat32));
 	add_uefi_togo = (fs == FS_NTFS) && (dt == DT_ISO) && (IS_EFI(iso_report)) && (bt == BT_UEFI);
+	// Live Linux media can get a persistence partition, which we format ourselves, and which
+	// the boot configuration files we extract are then patched to use (see fix_config())
+	use_persistence = (persistence_size != 0) && IsChecked(IDC_BOOT) && (dt == DT_ISO) &&
+		HAS_PERSISTENCE(iso_report) && (!add_uefi_togo);
+	if (enable_reproducible)
+		InitReproducible((IsChecked(IDC_BOOT) && ((dt == DT_ISO) || (dt == DT_IMG))) ? image_path : NULL, fs, pt, bt, dt);
 
 	PrintInfoDebug(0, MSG_225);
 	hPhysicalDrive = GetPhysicalHandle(DriveIndex, TRUE, TRUE);
@@ -1389,16 +1551,24 @@ DWORD WINAPI FormatThread(void* param)
 	}
 	UpdateProgress(OP_ANALYZE_MBR, -1.0f);
 
+	// If we are writing the same image as an interrupted session, to the same drive, we
+	// can resume from where it left off, in which case we must leave the drive as it is
+	if (IsChecked(IDC_BOOT) && (dt == DT_IMG)) {
+		i = ComboBox_GetCurSel(hDeviceList);
+		resume_offset = JournalOpen(image_path, iso_report.compression_type, (i >= 0) ? DriveHwID.String[i] : NULL,
+			SelectedDrive.DiskSize, SectorSize, hPhysicalDrive);
+	}
+
 	// Zap any existing partitions. This helps prevent access errors.
 	// As this creates issues with FAT16 formatted MS drives, only do this for other filesystems
-	if ( (fs != FS_FAT16) && (!DeletePartitions(hPhysicalDrive)) ) {
+	if ( (resume_offset == 0) && (fs != FS_FAT16) && (!DeletePartitions(hPhysicalDrive)) ) {
 		uprintf("Could not reset partitions\n");
 		FormatStatus = ERROR_SEVERITY_ERROR|FAC(FACILITY_STORAGE)|ERROR_PARTITION_FAILURE;
 		goto out;
 	}
 
 	CreateThread(NULL, 0, CloseFormatPromptThread, NULL, 0, NULL);
-	if (IsChecked(IDC_BADBLOCKS)) {
+	if (IsChecked(IDC_BADBLOCKS) && (resume_offset == 0)) {
 		do {
 			// create a log file for bad blocks report. Since %USERPROFILE% may
 			// have localized characters, we use the UTF-8 API.
@@ -1454,9 +1624,17 @@ DWORD WINAPI FormatThread(void* param)
 		}
 	}
 
+	// Reproducible output requires that nothing is left from the previous content of the drive, and
+	// that the areas we don't write read back as zeros, whatever the drive or erase method used
+	if ( (enable_secure_erase || enable_reproducible) && (resume_offset == 0)
+	  && (!EraseDrive(hPhysicalDrive, GetUSBVendorID(DriveIndex), SelectedDrive.DiskSize, SectorSize, enable_reproducible)) ) {
+		uprintf("Could not erase drive");
+		goto out;
+	}
+
 	// Especially after destructive badblocks test, you must zero the MBR/GPT completely
 	// before repartitioning. Else, all kind of bad things happen.
-	if (!ClearMBRGPT(hPhysicalDrive, SelectedDrive.DiskSize, SectorSize, use_large_fat32)) {
+	if ((resume_offset == 0) && (!ClearMBRGPT(hPhysicalDrive, SelectedDrive.DiskSize, SectorSize, use_large_fat32))) {
 		uprintf("unable to zero MBR/GPT\n");
 		if (!IS_ERROR(FormatStatus))
 			FormatStatus = ERROR_SEVERITY_ERROR|FAC(FACILITY_STORAGE)|ERROR_WRITE_FAULT;
@@ -1479,13 +1657,38 @@ DWORD WINAPI FormatThread(void* param)
 		}
 		LastRefresh = 0;
 
-		if (iso_report.compression_type != BLED_COMPRESSION_NONE) {
-			uprintf("Writing Compressed Image...");
-			bled_init(_uprintf, update_progress, &FormatStatus);
-			bled_uncompress_with_handles(hSourceImage, hPhysicalDrive, iso_report.compression_type);
-			bled_exit();
+		if ((iso_report.compression_type != BLED_COMPRESSION_NONE) || (iso_report.is_dmg) || (iso_report.is_qcow2)) {
+			uprintf("Writing %s Image...", iso_report.is_dmg ? "DMG" : (iso_report.is_qcow2 ? "QCOW2" : "Compressed"));
+			buffer = (uint8_t*)malloc(JOURNAL_RECORD_SIZE + 2 * SectorSize);	// +1 sector for align, +1 for padding
+			if (buffer == NULL) {
+				FormatStatus = ERROR_SEVERITY_ERROR|FAC(FACILITY_STORAGE)|ERROR_NOT_ENOUGH_MEMORY;
+				uprintf("could not allocate decompression buffer");
+				goto out;
+			}
+			memset(&dd_out, 0, sizeof(dd_out));
+			dd_out.hDrive = hPhysicalDrive;
+			dd_out.buf = ((void *) ((((uintptr_t)(buffer)) + (SectorSize) - 1) & (~(((uintptr_t)(SectorSize)) - 1))));
+			dd_out.sector_size = SectorSize;
+			dd_out.resume = resume_offset;
+			if (iso_report.is_dmg) {
+				WriteDmgImage(hSourceImage, SectorSize, resume_offset, write_decompressed, seek_decompressed);
+			} else if (iso_report.is_qcow2) {
+				dd_out.discard_zeroes = DiscardReadsZeroes(hPhysicalDrive);
+				if (dd_out.discard_zeroes)
+					uprintf("Drive reads discarded sectors as zeroes - unallocated clusters will be discarded");
+				WriteQcow2Image(hSourceImage, image_path, SectorSize, resume_offset, write_decompressed,
+					seek_decompressed, discard_decompressed);
+			} else {
+				bled_init(_uprintf, write_decompressed, update_progress, &FormatStatus);
+				bled_uncompress_with_handles(hSourceImage, hPhysicalDrive, iso_report.compression_type);
+				bled_exit();
+			}
+			if (!IS_ERROR(FormatStatus))
+				flush_decompressed();
 		} else {
 			uprintf("Writing Image...");
+			predicted_time = EstimateWriteTime(TRUE);
+			start_time = GetTickCount();
 			// Our buffer size must be a multiple of the sector size
 			BufSize = ((DD_BUFFER_SIZE + SectorSize - 1) / SectorSize) * SectorSize;
 			buffer = (uint8_t*)malloc(BufSize + SectorSize);	// +1 sector for align
@@ -1497,55 +1700,92 @@ DWORD WINAPI FormatThread(void* param)
 			// http://msdn.microsoft.com/en-us/library/windows/desktop/aa365747.aspx does buffer sector alignment
 			aligned_buffer = ((void *) ((((uintptr_t)(buffer)) + (SectorSize) - 1) & (~(((uintptr_t)(SectorSize)) - 1))));
 
+			// Only write the parts of the image that hold data, if we can find them. An El Torito
+			// hard disk image is written as a whole, from where it lies in the ISO.
+			if (!HAS_EL_TORITO_HDD(iso_report))
+				ranges = GetImageRanges(hSourceImage, iso_report.projected_size, SectorSize, &nb_ranges);
+			if (ranges == NULL) {
+				full_range.offset = 0;
+				full_range.size = iso_report.projected_size;
+				nb_ranges = 1;
+			}
+			for (j = 0, total_size = 0; j < nb_ranges; j++)
+				total_size += (ranges == NULL) ? full_range.size : ranges[j].size;
+
 			// Don't bother trying for something clever, using double buffering overlapped and whatnot:
 			// With Windows' default optimizations, sync read + sync write for sequential operations
 			// will be as fast, if not faster, than whatever async scheme you can come up with.
-			for (wb = 0, wSize = 0; ; wb += wSize) {
-				s = ReadFile(hSourceImage, aligned_buffer, BufSize, &rSize, NULL);
-				if (!s) {
-					FormatStatus = ERROR_SEVERITY_ERROR|FAC(FACILITY_STORAGE)|ERROR_READ_FAULT;
-					uprintf("read error: %s", WindowsErrorString());
+			for (j = 0, wb = 0, skipped_size = 0; j < nb_ranges; j++) {
+				range = (ranges == NULL) ? &full_range : &ranges[j];
+				// Skip whatever an interrupted write already took care of
+				rb = (resume_offset > range->offset) ? MIN(resume_offset - range->offset, range->size) : 0;
+				wb += rb;
+				skipped_size += rb;
+				if (rb == range->size)
+					continue;
+				li.QuadPart = iso_report.el_torito_offset + range->offset + rb;
+				s = SetFilePointerEx(hSourceImage, li, NULL, FILE_BEGIN);
+				li.QuadPart = range->offset + rb;
+				if ((!s) || (!SetFilePointerEx(hPhysicalDrive, li, NULL, FILE_BEGIN))) {
+					FormatStatus = ERROR_SEVERITY_ERROR|FAC(FACILITY_STORAGE)|ERROR_SEEK;
+					uprintf("seek error: %s", WindowsErrorString());
 					goto out;
 				}
-				if (rSize == 0)
-					break;
-				if (GetTickCount() > LastRefresh + 25) {
-					LastRefresh = GetTickCount();
-					format_percent = (100.0f*wb)/(1.0f*iso_report.projected_size);
-					PrintInfo(0, MSG_261, format_percent);
-					UpdateProgress(OP_FORMAT, format_percent);
-				}
-				// Don't overflow our projected size (mostly for VHDs)
-				if (wb + rSize > iso_report.projected_size) {
-					rSize = (DWORD)(iso_report.projected_size - wb);
-				}
-				// WriteFile fails unless the size is a multiple of sector size
-				if (rSize % SectorSize != 0)
-					rSize = ((rSize + SectorSize -1) / SectorSize) * SectorSize;
-				for (i=0; i<WRITE_RETRIES; i++) {
-					CHECK_FOR_USER_CANCEL;
-					s = WriteFile(hPhysicalDrive, aligned_buffer, rSize, &wSize, NULL);
-					if ((s) && (wSize == rSize))
-						break;
-					if (s)
-						uprintf("write error: Wrote %d bytes, expected %d bytes\n", wSize, rSize);
-					else
-						uprintf("write error: %s", WindowsErrorString());
-					if (i < WRITE_RETRIES-1) {
-						li.QuadPart = wb;
-						SetFilePointerEx(hPhysicalDrive, li, NULL, FILE_BEGIN);
-						uprintf("  RETRYING...\n");
-					} else {
-						FormatStatus = ERROR_SEVERITY_ERROR|FAC(FACILITY_STORAGE)|ERROR_WRITE_FAULT;
+				for (wSize = 0; rb < range->size; rb += wSize, wb += wSize) {
+					s = ReadFile(hSourceImage, aligned_buffer, (DWORD)MIN(BufSize, range->size - rb), &rSize, NULL);
+					if (!s) {
+						FormatStatus = ERROR_SEVERITY_ERROR|FAC(FACILITY_STORAGE)|ERROR_READ_FAULT;
+						uprintf("read error: %s", WindowsErrorString());
 						goto out;
 					}
+					if (rSize == 0)
+						break;
+					if (GetTickCount() > LastRefresh + 25) {
+						LastRefresh = GetTickCount();
+						format_percent = (100.0f*wb)/(1.0f*total_size);
+						PrintInfo(0, MSG_261, format_percent);
+						UpdateProgress(OP_FORMAT, format_percent);
+					}
+					// WriteFile fails unless the size is a multiple of sector size
+					if (rSize % SectorSize != 0)
+						rSize = ((rSize + SectorSize -1) / SectorSize) * SectorSize;
+					for (i=0; i<WRITE_RETRIES; i++) {
+						CHECK_FOR_USER_CANCEL;
+						s = WriteFile(hPhysicalDrive, aligned_buffer, rSize, &wSize, NULL);
+						if ((s) && (wSize == rSize))
+							break;
+						if (s)
+							uprintf("write error: Wrote %d bytes, expected %d bytes\n", wSize, rSize);
+						else
+							uprintf("write error: %s", WindowsErrorString());
+						if (i < WRITE_RETRIES-1) {
+							li.QuadPart = range->offset + rb;
+							SetFilePointerEx(hPhysicalDrive, li, NULL, FILE_BEGIN);
+							uprintf("  RETRYING...\n");
+						} else {
+							FormatStatus = ERROR_SEVERITY_ERROR|FAC(FACILITY_STORAGE)|ERROR_WRITE_FAULT;
+							goto out;
+						}
+					}
+					if (i >= WRITE_RETRIES) goto out;
+					JournalRecord(range->offset + rb, aligned_buffer, wSize);
 				}
-				if (i >= WRITE_RETRIES) goto out;
 			}
+			// Only account for the data we actually sent to the drive
+			UpdateWriteCostModel(TRUE, wb - skipped_size, predicted_time, GetTickCount() - start_time);
 		}
+		CHECK_FOR_USER_CANCEL;
+
+		// Make the rest of the drive usable, if the image was written for a smaller one
+		if ((enable_partition_grow) && (!iso_report.is_hybrid_img) && (SectorSize == 512) && (SelectedDrive.DiskSize > iso_report.projected_size))
+			GrowLastPartition(hPhysicalDrive, SelectedDrive.DiskSize);
 
 		// If the image contains a partition we might be able to access, try to re-mount it
 		RefreshDriveLayout(hPhysicalDrive);
+		if (!ValidateDrive(hPhysicalDrive, NULL, pt, bt, fs, dt))
+			goto out;
+		if (enable_reproducible)
+			FinalizeReproducible(hPhysicalDrive, DriveIndex, NULL, fs);
 		safe_unlockclose(hPhysicalDrive);
 		safe_unlockclose(hLogicalVolume);
 		Sleep(200);
@@ -1556,6 +1796,7 @@ DWORD WINAPI FormatThread(void* param)
 				uprintf("Remounted %s on %s\n", guid_volume, drive_name);
 		}
 
+		JournalClose(TRUE);
 		uprintf("Done");
 		goto out;
 	}
@@ -1563,7 +1804,8 @@ DWORD WINAPI FormatThread(void* param)
 	UpdateProgress(OP_ZERO_MBR, -1.0f);
 	CHECK_FOR_USER_CANCEL;
 
-	if (!CreatePartition(hPhysicalDrive, pt, fs, (pt==PARTITION_STYLE_MBR) && (bt==BT_UEFI), add_uefi_togo)) {
+	if (!CreatePartition(hPhysicalDrive, pt, fs, (pt==PARTITION_STYLE_MBR) && (bt==BT_UEFI), add_uefi_togo,
+		use_persistence ? persistence_size : 0)) {
 		FormatStatus = ERROR_SEVERITY_ERROR|FAC(FACILITY_STORAGE)|ERROR_PARTITION_FAILURE;
 		goto out;
 	}
@@ -1580,6 +1822,35 @@ DWORD WINAPI FormatThread(void* param)
 	}
 	hLogicalVolume = INVALID_HANDLE_VALUE;
 
+	// Windows can't mount ext partitions, so we format them through the physical drive and stop there
+	if (IS_EXT(fs)) {
+		GetWindowTextU(hLabel, ext_label, sizeof(ext_label));
+		if (!FormatExtFs(hPhysicalDrive, SelectedDrive.PartitionOffset[0], SelectedDrive.PartitionSize[0], SectorSize, fs,
+			(DWORD)ComboBox_GetItemData(hClusterSize, ComboBox_GetCurSel(hClusterSize)), ext_label,
+			IsChecked(IDC_QUICKFORMAT) ? FP_QUICK : 0)) {
+			if (!IS_ERROR(FormatStatus))
+				FormatStatus = ERROR_SEVERITY_ERROR|FAC(FACILITY_STORAGE)|ERROR_WRITE_FAULT;
+			uprintf("Format error: %s\n", StrError(FormatStatus, TRUE));
+			goto out;
+		}
+		if (pt == PARTITION_STYLE_MBR) {
+			PrintInfoDebug(0, MSG_228);	// "Writing master boot record..."
+			if ((!WriteMBR(hPhysicalDrive)) || (!WriteSBR(hPhysicalDrive))) {
+				if (!IS_ERROR(FormatStatus))
+					FormatStatus = ERROR_SEVERITY_ERROR|FAC(FACILITY_STORAGE)|ERROR_WRITE_FAULT;
+				goto out;
+			}
+			UpdateProgress(OP_FIX_MBR, -1.0f);
+		}
+		RefreshDriveLayout(hPhysicalDrive);
+		if (ValidateDrive(hPhysicalDrive, NULL, pt, bt, fs, dt)) {
+			if (enable_reproducible)
+				FinalizeReproducible(hPhysicalDrive, DriveIndex, NULL, fs);
+			uprintf("Done");
+		}
+		goto out;
+	}
+
 	// Wait for the logical drive we just created to appear
 	uprintf("Waiting for logical drive to reappear...\n");
 	Sleep(200);
@@ -1606,6 +1877,20 @@ DWORD WINAPI FormatThread(void* param)
 		}
 		UpdateProgress(OP_FIX_MBR, -1.0f);
 	}
+
+	// Ubuntu looks for a "casper-rw" labelled volume, whereas Debian wants a "persistence"
+	// one, that also contains a persistence.conf. Only the metadata needs to be written.
+	if (use_persistence) {
+		i = SelectedDrive.nPartitions - 1;
+		uprintf("Formatting persistence partition...");
+		if (!FormatExtFs(hPhysicalDrive, SelectedDrive.PartitionOffset[i], SelectedDrive.PartitionSize[i], SectorSize,
+			FS_EXT4, 4096, iso_report.uses_casper ? "casper-rw" : "persistence",
+			FP_QUICK | (iso_report.uses_casper ? 0 : FP_CREATE_PERSISTENCE_CONF))) {
+			if (!IS_ERROR(FormatStatus))
+				FormatStatus = ERROR_SEVERITY_ERROR|FAC(FACILITY_STORAGE)|ERROR_WRITE_FAULT;
+			goto out;
+		}
+	}
 	Sleep(200);
 	WaitForLogical(DriveIndex);
 	// Try to continue
@@ -1635,7 +1920,8 @@ DWORD WINAPI FormatThread(void* param)
 				goto out;
 			}
 		} else if ((((dt == DT_WINME) || (dt == DT_FREEDOS) || (dt == DT_GRUB4DOS) || (dt == DT_GRUB2) || (dt == DT_REACTOS)) &&
-			(!use_large_fat32)) || ((dt == DT_ISO) && ((fs == FS_NTFS)||(iso_report.has_kolibrios||IS_GRUB(iso_report))))) {
+			(!use_large_fat32)) || ((dt == DT_ISO) && ((fs == FS_NTFS)||(iso_report.has_kolibrios||IS_GRUB(iso_report)||
+			HAS_EL_TORITO_FLOPPY(iso_report))))) {
 			// We still have a lock, which we need to modify the volume boot record 
 			// => no need to reacquire the lock...
 			hLogicalVolume = GetLogicalHandle(DriveIndex, TRUE, FALSE);
@@ -1688,16 +1974,41 @@ DWORD WINAPI FormatThread(void* param)
 			IGNORE_RETVAL(_chdirU(app_dir));
 			if (!CopyFileU(FILES_DIR "\\grub4dos\\grldr", grub4dos_dst, FALSE))
 				uprintf("Failed to copy file: %s", WindowsErrorString());
+			// In multiboot mode, also copy all the ISOs and create the menu
+			if (!WriteMultibootImages(drive_name))
+				goto out;
+		} else if ((dt == DT_ISO) && (enable_wintogo) && (fs == FS_NTFS) && (iso_report.has_install_wim) && (image_path != NULL)) {
+			// Windows To Go: the boot files come from the image, so none of the fixups below apply
+			UpdateProgress(OP_DOS, 0.0f);
+			PrintInfoDebug(0, MSG_231);
+			drive_name[2] = 0;
+			if (!ApplyWindowsToGo(image_path, drive_name)) {
+				if (!IS_ERROR(FormatStatus))
+					FormatStatus = ERROR_SEVERITY_ERROR|FAC(FACILITY_STORAGE)|ERROR_CANNOT_COPY;
+				goto out;
+			}
 		} else if (dt == DT_ISO) {
 			if (image_path != NULL) {
 				UpdateProgress(OP_DOS, 0.0f);
 				PrintInfoDebug(0, MSG_231);
 				drive_name[2] = 0;
+				predicted_time = EstimateWriteTime(FALSE);
+				start_time = GetTickCount();
 				if (!ExtractISO(image_path, drive_name, FALSE)) {
 					if (!IS_ERROR(FormatStatus))
 						FormatStatus = ERROR_SEVERITY_ERROR|FAC(FACILITY_STORAGE)|ERROR_CANNOT_COPY;
 					goto out;
 				}
+				UpdateWriteCostModel(FALSE, iso_report.projected_size, predicted_time, GetTickCount() - start_time);
+				if (HAS_EL_TORITO_FLOPPY(iso_report)) {
+					drive_name[2] = '\\';
+					if ((!ExtractFreeDOS(drive_name)) || (!ExtractElToritoFloppy(image_path, drive_name))) {
+						if (!IS_ERROR(FormatStatus))
+							FormatStatus = ERROR_SEVERITY_ERROR|FAC(FACILITY_STORAGE)|ERROR_CANNOT_COPY;
+						goto out;
+					}
+					drive_name[2] = 0;
+				}
 				if (iso_report.has_kolibrios) {
 					kolibri_dst[0] = drive_name[0];
 					uprintf("Installing: %s (KolibriOS loader)\n", kolibri_dst);
@@ -1748,9 +2059,17 @@ DWORD WINAPI FormatThread(void* param)
 		}
 	}
 
+	// Make sure that what we wrote is what we meant to write
+	if (!IS_ERROR(FormatStatus))
+		ValidateDrive(hPhysicalDrive, drive_name, pt, bt, fs, dt);
+	if ((enable_reproducible) && (!IS_ERROR(FormatStatus)))
+		FinalizeReproducible(hPhysicalDrive, DriveIndex, drive_name, fs);
+
 out:
+	JournalClose(FALSE);
 	safe_free(guid_volume);
 	safe_free(buffer);
+	safe_free(ranges);
 	safe_closehandle(hSourceImage);
 	safe_unlockclose(hLogicalVolume);
 	safe_unlockclose(hPhysicalDrive);	// This can take a while
@@ -1775,6 +2094,7 @@ DWORD WINAPI SaveImageThread(void* param)
 	LARGE_INTEGER li;
 	uint8_t *buffer = NULL;
 	uint64_t wb;
+	char map_path[MAX_PATH];
 	int i;
 
 	PrintInfoDebug(0, MSG_225);
@@ -1790,14 +2110,28 @@ DWORD WINAPI SaveImageThread(void* param)
 	li.QuadPart = 0;
 	if (!SetFilePointerEx(hPhysicalDrive, li, NULL, FILE_BEGIN))
 		uprintf("Warning: Unable to rewind device position - wrong data might be copied!");
+	// In rescue mode, we may be resuming the capture of an existing image
 	hDestImage = CreateFileU(image_path, GENERIC_WRITE, FILE_SHARE_WRITE, NULL,
-		CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL);
+		enable_rescue ? OPEN_ALWAYS : CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL);
 	if (hDestImage == INVALID_HANDLE_VALUE) {
 		uprintf("Could not open image '%s': %s", image_path, WindowsErrorString());
 		FormatStatus = ERROR_SEVERITY_ERROR|FAC(FACILITY_STORAGE)|ERROR_OPEN_FAILED;
 		goto out;
 	}
 
+	if (enable_rescue) {
+		uprintf("Rescuing to image '%s'...", image_path);
+		static_sprintf(map_path, "%s.map", image_path);
+		i = ComboBox_GetCurSel(hDeviceList);
+		if (!RescueCapture(hPhysicalDrive, (i >= 0) ? DriveHwID.String[i] : NULL, SelectedDrive.DiskSize,
+			SelectedDrive.Geometry.BytesPerSector, hDestImage, map_path)) {
+			if (!IS_ERROR(FormatStatus))
+				FormatStatus = ERROR_SEVERITY_ERROR|FAC(FACILITY_STORAGE)|ERROR_READ_FAULT;
+			goto out;
+		}
+		goto append_footer;
+	}
+
 	uprintf("Saving to image '%s'...", image_path);
 	buffer = (uint8_t*)malloc(DD_BUFFER_SIZE);
 	if (buffer == NULL) {
@@ -1851,6 +2185,8 @@ DWORD WINAPI SaveImageThread(void* param)
 		goto out;
 	}
 	uprintf("%llu bytes written", wb);
+
+append_footer:
 	uprintf("Appending VHD footer...");
 	if (!AppendVHDFooter(image_path)) {
 		FormatStatus = ERROR_SEVERITY_ERROR|FAC(FACILITY_STORAGE)|ERROR_WRITE_FAULT;
@@ -19,6 +19,7 @@
  */
 #include <Windows.h>
 #include <winioctl.h>				// for MEDIA_TYPE
+#include <stdint.h>
 
 #pragma once
 
@@ -149,8 +150,134 @@ typedef struct {
 	BYTE sReserved2[12];    // zeros
 	DWORD dTrailSig;        // 0xAA550000
 } FAT_FSINFO;
+
+/* ext2/ext4 (only the fields we need to set are named) */
+typedef struct {
+	uint32_t s_inodes_count;
+	uint32_t s_blocks_count;
+	uint32_t s_r_blocks_count;
+	uint32_t s_free_blocks_count;
+	uint32_t s_free_inodes_count;
+	uint32_t s_first_data_block;
+	uint32_t s_log_block_size;
+	uint32_t s_log_cluster_size;
+	uint32_t s_blocks_per_group;
+	uint32_t s_clusters_per_group;
+	uint32_t s_inodes_per_group;
+	uint32_t s_mtime;
+	uint32_t s_wtime;
+	uint16_t s_mnt_count;
+	int16_t  s_max_mnt_count;
+	uint16_t s_magic;               // 0xEF53
+	uint16_t s_state;
+	uint16_t s_errors;
+	uint16_t s_minor_rev_level;
+	uint32_t s_lastcheck;
+	uint32_t s_checkinterval;
+	uint32_t s_creator_os;
+	uint32_t s_rev_level;
+	uint16_t s_def_resuid;
+	uint16_t s_def_resgid;
+	uint32_t s_first_ino;
+	uint16_t s_inode_size;
+	uint16_t s_block_group_nr;
+	uint32_t s_feature_compat;
+	uint32_t s_feature_incompat;
+	uint32_t s_feature_ro_compat;
+	uint8_t  s_uuid[16];
+	char     s_volume_name[16];
+	char     s_last_mounted[64];
+	uint32_t s_algorithm_usage_bitmap;
+	uint8_t  s_prealloc_blocks;
+	uint8_t  s_prealloc_dir_blocks;
+	uint16_t s_reserved_gdt_blocks;
+	uint8_t  s_journal_uuid[16];
+	uint32_t s_journal_inum;
+	uint32_t s_journal_dev;
+	uint32_t s_last_orphan;
+	uint32_t s_hash_seed[4];
+	uint8_t  s_def_hash_version;
+	uint8_t  s_jnl_backup_type;
+	uint16_t s_desc_size;
+	uint32_t s_default_mount_opts;
+	uint32_t s_first_meta_bg;
+	uint32_t s_mkfs_time;
+	uint32_t s_jnl_blocks[17];
+	uint32_t s_blocks_count_hi;
+	uint32_t s_r_blocks_count_hi;
+	uint32_t s_free_blocks_count_hi;
+	uint16_t s_min_extra_isize;
+	uint16_t s_want_extra_isize;
+	uint32_t s_flags;
+	uint8_t  s_reserved[1024-356];
+} EXT_SUPERBLOCK;
+
+typedef struct {
+	uint32_t bg_block_bitmap;
+	uint32_t bg_inode_bitmap;
+	uint32_t bg_inode_table;
+	uint16_t bg_free_blocks_count;
+	uint16_t bg_free_inodes_count;
+	uint16_t bg_used_dirs_count;
+	uint16_t bg_flags;
+	uint32_t bg_exclude_bitmap;
+	uint16_t bg_block_bitmap_csum;
+	uint16_t bg_inode_bitmap_csum;
+	uint16_t bg_itable_unused;
+	uint16_t bg_checksum;           // crc16(uuid+group+desc)
+} EXT_GROUP_DESC;
+
+typedef struct {
+	uint16_t i_mode;
+	uint16_t i_uid;
+	uint32_t i_size;
+	uint32_t i_atime;
+	uint32_t i_ctime;
+	uint32_t i_mtime;
+	uint32_t i_dtime;
+	uint16_t i_gid;
+	uint16_t i_links_count;
+	uint32_t i_blocks;              // in 512 bytes units
+	uint32_t i_flags;
+	uint32_t i_version;
+	uint32_t i_block[15];           // block map or extent tree
+	uint32_t i_generation;
+	uint32_t i_file_acl;
+	uint32_t i_size_high;
+	uint32_t i_faddr;
+	uint8_t  i_osd2[12];
+	uint16_t i_extra_isize;
+	uint8_t  i_extra[126];
+} EXT_INODE;
+
+typedef struct {
+	uint16_t eh_magic;              // 0xF30A
+	uint16_t eh_entries;
+	uint16_t eh_max;
+	uint16_t eh_depth;
+	uint32_t eh_generation;
+	uint32_t ee_block;
+	uint16_t ee_len;
+	uint16_t ee_start_hi;
+	uint32_t ee_start_lo;
+} EXT_EXTENT_HEADER;
+
+typedef struct {
+	uint32_t inode;
+	uint16_t rec_len;
+	uint8_t  name_len;
+	uint8_t  file_type;
+	char     name[4];               // actually name_len, padded to 4 bytes
+} EXT_DIR_ENTRY;
 #pragma pack(pop)
 
 #define die(msg, err) do { uprintf(msg); \
 	FormatStatus = ERROR_SEVERITY_ERROR|FAC(FACILITY_STORAGE)|err; \
 	goto out; } while(0)
+
+/* Flags for FormatExtFs() */
+#define FP_QUICK                    0x00000001
+#define FP_CREATE_PERSISTENCE_CONF  0x00000002
+
+BOOL FormatExtFs(HANDLE hDrive, uint64_t PartitionOffset, uint64_t PartitionSize, DWORD SectorSize,
+	int FSType, DWORD BlockSize, const char* Label, DWORD Flags);
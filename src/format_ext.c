@@ -0,0 +1,551 @@
+/*
+ * Rufus: The Reliable USB Formatting Utility
+ * Native ext2/ext4 formatting
+ * Copyright © 2015 Pete Batard <pete@akeo.ie>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+#ifdef _CRTDBG_MAP_ALLOC
+#include <stdlib.h>
+#include <crtdbg.h>
+#endif
+
+#include <windows.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stddef.h>
+#include <time.h>
+
+#include "rufus.h"
+#include "resource.h"
+#include "file.h"
+#include "drive.h"
+#include "format.h"
+#include "localization.h"
+
+/*
+ * Since Windows cannot mount ext file systems, there is no API we can call
+ * for these, so we create the file system ourselves, in the same fashion as
+ * FormatFAT32() does. Only the metadata is written: superblocks, group
+ * descriptors, bitmaps and the root and lost+found directories.
+ *
+ * For ext4 quick format, we follow what mke2fs does with lazy_itable_init:
+ * groups are flagged as uninitialised (uninit_bg), which lets us skip writing
+ * the inode tables and most bitmaps altogether, and leaves it to the Linux
+ * kernel to zero the inode tables in the background on first mount. Since
+ * this is the bulk of the data mke2fs writes, it makes formatting large
+ * drives near instantaneous.
+ *
+ * We don't create a journal or a resize inode, and don't use 64bit or
+ * flex_bg, which keeps the layout simple enough to compute for each group.
+ * Both can be added post format with tune2fs/resize2fs if required.
+ */
+#define EXT_MAGIC                   0xEF53
+#define EXT_EXTENT_MAGIC            0xF30A
+#define EXT_ROOT_INO                2
+#define EXT_LPF_INO                 11
+#define EXT_FIRST_INO               11
+#define EXT_INODE_SIZE              256
+#define EXT_EXTRA_ISIZE             32
+#define EXT_LPF_SIZE                (16*1024)
+#define EXT_NDIR_BLOCKS             12
+#define EXT_MIN_DATA_BLOCKS         50
+#define EXT_MAX_BLOCKS              0xFFFFFFFFULL
+
+// Feature flags
+#define EXT_COMPAT_DIR_INDEX        0x0020
+#define EXT_INCOMPAT_FILETYPE       0x0002
+#define EXT_INCOMPAT_EXTENTS        0x0040
+#define EXT_RO_COMPAT_SPARSE_SUPER  0x0001
+#define EXT_RO_COMPAT_LARGE_FILE    0x0002
+#define EXT_RO_COMPAT_GDT_CSUM      0x0010
+#define EXT_RO_COMPAT_DIR_NLINK     0x0020
+#define EXT_RO_COMPAT_EXTRA_ISIZE   0x0040
+
+// Group descriptor flags
+#define EXT_BG_INODE_UNINIT         0x0001
+#define EXT_BG_BLOCK_UNINIT         0x0002
+#define EXT_BG_INODE_ZEROED         0x0004
+
+// Misc.
+#define EXT_DEFM_XATTR_USER         0x0004
+#define EXT_DEFM_ACL                0x0008
+#define EXT_FLAGS_SIGNED_HASH       0x0001
+#define EXT_HASH_HALF_MD4           1
+#define EXT_EXTENTS_FL              0x00080000
+#define EXT_FT_REG_FILE             1
+#define EXT_FT_DIR                  2
+#define EXT_S_IFREG                 0x8000
+#define EXT_S_IFDIR                 0x4000
+
+// Debian live needs a persistence.conf at the root of the persistence volume
+#define EXT_CONF_INO                12
+#define PERSISTENCE_CONF_NAME       "persistence.conf"
+#define PERSISTENCE_CONF_DATA       "/ union\n"
+
+#define WIPE_SIZE                   (1024*1024)
+
+/* Everything we need to know about the layout of the file system we create */
+typedef struct {
+	HANDLE hDrive;
+	uint64_t PartitionOffset;
+	DWORD SectorSize;
+	DWORD BlockSize;
+	uint32_t BlocksCount;
+	uint32_t FirstDataBlock;
+	uint32_t BlocksPerGroup;
+	uint32_t InodesPerGroup;
+	uint32_t InodeTableBlocks;
+	uint32_t GdtBlocks;
+	uint32_t GroupsCount;
+} EXT_LAYOUT;
+
+/*
+ * The sparse_super feature only keeps superblock backups in groups 0, 1
+ * and the groups that are a power of 3, 5 or 7
+ */
+static BOOL HasSuperblock(uint32_t group)
+{
+	uint32_t i, p;
+	const uint32_t base[] = { 3, 5, 7 };
+
+	if (group <= 1)
+		return TRUE;
+	for (i = 0; i < ARRAYSIZE(base); i++) {
+		for (p = base[i]; p < group; p *= base[i]);
+		if (p == group)
+			return TRUE;
+	}
+	return FALSE;
+}
+
+static __inline uint32_t GroupFirstBlock(EXT_LAYOUT* l, uint32_t group)
+{
+	return l->FirstDataBlock + group * l->BlocksPerGroup;
+}
+
+static __inline uint32_t GroupBlocks(EXT_LAYOUT* l, uint32_t group)
+{
+	return (group == l->GroupsCount - 1) ?
+		(l->BlocksCount - GroupFirstBlock(l, group)) : l->BlocksPerGroup;
+}
+
+/* Number of blocks used by the metadata at the start of a group */
+static __inline uint32_t GroupOverhead(EXT_LAYOUT* l, uint32_t group)
+{
+	return (HasSuperblock(group) ? (1 + l->GdtBlocks) : 0) + 2 + l->InodeTableBlocks;
+}
+
+/*
+ * Descriptor checksum for the uninit_bg feature: CRC16 (poly 0x8005, reflected)
+ * of the volume UUID, the group number and the descriptor up to bg_checksum
+ */
+static uint16_t crc16(uint16_t crc, const uint8_t* buf, size_t len)
+{
+	int i;
+
+	while (len--) {
+		crc ^= *buf++;
+		for (i = 0; i < 8; i++)
+			crc = (crc >> 1) ^ ((crc & 1) ? 0xA001 : 0);
+	}
+	return crc;
+}
+
+static uint16_t GroupDescChecksum(const uint8_t* uuid, uint32_t group, EXT_GROUP_DESC* gd)
+{
+	uint16_t crc = crc16(0xFFFF, uuid, 16);
+	crc = crc16(crc, (uint8_t*)&group, sizeof(group));
+	return crc16(crc, (uint8_t*)gd, offsetof(EXT_GROUP_DESC, bg_checksum));
+}
+
+/* Set bits [start, end[ of a bitmap */
+static void SetBits(uint8_t* bitmap, uint32_t start, uint32_t end)
+{
+	for (; (start < end) && (start & 7); start++)
+		bitmap[start >> 3] |= 1 << (start & 7);
+	if (end - start >= 8) {
+		memset(&bitmap[start >> 3], 0xFF, (end - start) >> 3);
+		start += (end - start) & ~7;
+	}
+	for (; start < end; start++)
+		bitmap[start >> 3] |= 1 << (start & 7);
+}
+
+static BOOL WriteBlocks(EXT_LAYOUT* l, uint64_t block, uint32_t nb_blocks, void* buf)
+{
+	uint64_t sector = (l->PartitionOffset + block * l->BlockSize) / l->SectorSize;
+	uint64_t nb_sectors = ((uint64_t)nb_blocks * l->BlockSize) / l->SectorSize;
+
+	if (write_sectors(l->hDrive, l->SectorSize, sector, nb_sectors, buf) !=
+		(int64_t)(nb_sectors * l->SectorSize)) {
+		uprintf("Could not write block %lld: %s", block, WindowsErrorString());
+		return FALSE;
+	}
+	return TRUE;
+}
+
+static void AddDirEntry(uint8_t* buf, uint32_t* pos, uint32_t inode, uint8_t file_type, uint16_t rec_len, const char* name)
+{
+	EXT_DIR_ENTRY* de = (EXT_DIR_ENTRY*)&buf[*pos];
+
+	de->inode = inode;
+	de->rec_len = rec_len;
+	de->name_len = (uint8_t)strlen(name);
+	de->file_type = file_type;
+	memcpy(&buf[*pos + offsetof(EXT_DIR_ENTRY, name)], name, de->name_len);
+	*pos += rec_len;
+}
+
+static void SetInode(EXT_INODE* inode, BOOL bExtents, uint16_t mode, uint16_t links, uint32_t size,
+	uint32_t block, uint32_t nb_blocks, DWORD BlockSize, uint32_t now)
+{
+	uint32_t i;
+	EXT_EXTENT_HEADER* eh = (EXT_EXTENT_HEADER*)inode->i_block;
+
+	inode->i_mode = mode;
+	inode->i_size = size;
+	inode->i_atime = now;
+	inode->i_ctime = now;
+	inode->i_mtime = now;
+	inode->i_links_count = links;
+	inode->i_blocks = nb_blocks * (BlockSize / 512);
+	inode->i_extra_isize = EXT_EXTRA_ISIZE;
+	if (bExtents) {
+		inode->i_flags = EXT_EXTENTS_FL;
+		eh->eh_magic = EXT_EXTENT_MAGIC;
+		eh->eh_entries = 1;
+		eh->eh_max = (sizeof(inode->i_block) - 12) / 12;
+		eh->eh_depth = 0;
+		eh->ee_block = 0;
+		eh->ee_len = (uint16_t)nb_blocks;
+		eh->ee_start_hi = 0;
+		eh->ee_start_lo = block;
+	} else {
+		for (i = 0; i < nb_blocks; i++)
+			inode->i_block[i] = block + i;
+	}
+}
+
+/*
+ * Discard the whole partition, so that the flash media doesn't have to
+ * preserve data we don't care about. Not all devices support it, so failure
+ * is not an error.
+ */
+static void DiscardPartition(HANDLE hDrive, uint64_t PartitionOffset, uint64_t PartitionSize)
+{
+	if (!DiscardDriveRange(hDrive, PartitionOffset, PartitionSize)) {
+		if (!IS_ERROR(FormatStatus))
+			uprintf("Discard is not supported by this device: %s", WindowsErrorString());
+		return;
+	}
+	uprintf("Discarded %s", SizeToHumanReadable(PartitionSize, FALSE, FALSE));
+}
+
+/*
+ * Create an ext2 or ext4 file system on the partition located at PartitionOffset.
+ * Quick format (FP_QUICK) on ext4 leaves the inode tables uninitialised, while
+ * regular format discards the partition and zeroes all the inode tables.
+ * FP_CREATE_PERSISTENCE_CONF adds the persistence.conf Debian live expects.
+ */
+BOOL FormatExtFs(HANDLE hDrive, uint64_t PartitionOffset, uint64_t PartitionSize, DWORD SectorSize,
+	int FSType, DWORD BlockSize, const char* Label, DWORD Flags)
+{
+	BOOL r = FALSE, bExt4 = (FSType == FS_EXT4), bQuick = (Flags & FP_QUICK), bLazy;
+	BOOL bConf = (Flags & FP_CREATE_PERSISTENCE_CONF);
+	DWORD LastRefresh = 0;
+	EXT_LAYOUT l;
+	EXT_SUPERBLOCK* sb = NULL;
+	EXT_GROUP_DESC* gdt = NULL;
+	EXT_INODE* inode;
+	GUID guid;
+	uint8_t *buf = NULL, *zero = NULL;
+	uint32_t g, i, pos, start, used, now, InodeRatio, ZeroBlocks;
+	uint32_t RootBlock, LpfBlock, LpfBlocks, ConfBlock, UsedInodes, InodeBlocks;
+	uint64_t FreeBlocks = 0, FreeInodes = 0, TotalWork, Work = 0;
+	float format_percent = 0.0f;
+
+	PrintInfoDebug(0, MSG_222, (FSType == FS_EXT4) ? "ext4" : "ext2");
+	uprintf("Formatting partition as %s (%s mode)...", bExt4 ? "ext4" : "ext2", bQuick ? "quick" : "full");
+
+	memset(&l, 0, sizeof(l));
+	l.hDrive = hDrive;
+	l.PartitionOffset = PartitionOffset;
+	l.SectorSize = SectorSize;
+	if ((BlockSize != 1024) && (BlockSize != 2048) && (BlockSize != 4096))
+		BlockSize = 4096;
+	// A block cannot be smaller than a sector
+	if (BlockSize < SectorSize)
+		BlockSize = SectorSize;
+	if ((BlockSize > 4096) || (BlockSize % SectorSize != 0))
+		die("Unsupported sector size\n", ERROR_INVALID_PARAMETER);
+	l.BlockSize = BlockSize;
+	bLazy = bExt4 && bQuick;
+
+	// Without the 64bit feature we are limited to 2^32 blocks
+	if (PartitionSize / BlockSize > EXT_MAX_BLOCKS) {
+		uprintf("Partition is too large for %s - only using the first %s", bExt4 ? "ext4" : "ext2",
+			SizeToHumanReadable(EXT_MAX_BLOCKS * BlockSize, FALSE, FALSE));
+		PartitionSize = EXT_MAX_BLOCKS * BlockSize;
+	}
+	l.BlocksCount = (uint32_t)(PartitionSize / BlockSize);
+	l.FirstDataBlock = (BlockSize == 1024) ? 1 : 0;
+	l.BlocksPerGroup = 8 * BlockSize;
+	if (l.BlocksCount <= l.FirstDataBlock)
+		die("Partition is too small\n", ERROR_INVALID_BLOCK_LENGTH);
+	l.GroupsCount = (l.BlocksCount - l.FirstDataBlock + l.BlocksPerGroup - 1) / l.BlocksPerGroup;
+
+	// Same inode ratio as mke2fs' "small" and "default" usage types
+	InodeRatio = (PartitionSize < 512 * 1024 * 1024ULL) ? 4096 : 16384;
+	l.InodesPerGroup = (uint32_t)(((uint64_t)l.BlocksCount * BlockSize / InodeRatio + l.GroupsCount - 1) / l.GroupsCount);
+	// Fill whole inode table blocks and whole bitmap bytes
+	i = max(8, BlockSize / EXT_INODE_SIZE);
+	l.InodesPerGroup = max(16, (l.InodesPerGroup + i - 1) / i * i);
+	l.InodesPerGroup = min(l.InodesPerGroup, 8 * BlockSize);
+	l.InodeTableBlocks = l.InodesPerGroup * EXT_INODE_SIZE / BlockSize;
+	l.GdtBlocks = (l.GroupsCount * sizeof(EXT_GROUP_DESC) + BlockSize - 1) / BlockSize;
+
+	// Drop the last group if it is too small to be useful
+	g = l.GroupsCount - 1;
+	if (GroupBlocks(&l, g) < GroupOverhead(&l, g) + EXT_MIN_DATA_BLOCKS) {
+		if (l.GroupsCount == 1)
+			die("Partition is too small\n", ERROR_INVALID_BLOCK_LENGTH);
+		l.GroupsCount--;
+		l.BlocksCount = GroupFirstBlock(&l, l.GroupsCount);
+		l.GdtBlocks = (l.GroupsCount * sizeof(EXT_GROUP_DESC) + BlockSize - 1) / BlockSize;
+	}
+
+	// The root directory and lost+found come right after the inode table of group 0
+	RootBlock = GroupFirstBlock(&l, 0) + GroupOverhead(&l, 0);
+	LpfBlock = RootBlock + 1;
+	LpfBlocks = EXT_LPF_SIZE / BlockSize;
+	if (!bExt4)
+		LpfBlocks = min(LpfBlocks, EXT_NDIR_BLOCKS);
+	ConfBlock = LpfBlock + LpfBlocks;
+	UsedInodes = bConf ? EXT_CONF_INO : EXT_FIRST_INO;
+	InodeBlocks = (UsedInodes * EXT_INODE_SIZE + BlockSize - 1) / BlockSize;
+
+	uprintf("%d blocks of %d bytes, %d groups, %d inodes per group", l.BlocksCount, BlockSize,
+		l.GroupsCount, l.InodesPerGroup);
+
+	buf = (uint8_t*)calloc(1, BlockSize);
+	zero = (uint8_t*)calloc(1, WIPE_SIZE);
+	sb = (EXT_SUPERBLOCK*)calloc(1, sizeof(EXT_SUPERBLOCK));
+	gdt = (EXT_GROUP_DESC*)calloc(l.GdtBlocks, BlockSize);
+	if ((buf == NULL) || (zero == NULL) || (sb == NULL) || (gdt == NULL))
+		die("Could not allocate memory\n", ERROR_NOT_ENOUGH_MEMORY);
+
+	if (!bQuick)
+		DiscardPartition(hDrive, PartitionOffset, PartitionSize);
+
+	// Remove any stale signature (e.g. ISO9660 at 32 KB) that could confuse blkid
+	if (!WriteBlocks(&l, 0, (uint32_t)min(WIPE_SIZE, PartitionSize) / BlockSize, zero))
+		die("Could not wipe partition start\n", ERROR_WRITE_FAULT);
+
+	// Populate the superblock
+	now = enable_reproducible ? GetReproducibleTime() : (uint32_t)time(NULL);
+	NewGuid(&guid, "ext uuid", PartitionOffset);
+	memcpy(sb->s_uuid, &guid, sizeof(sb->s_uuid));
+	NewGuid(&guid, "ext hash seed", PartitionOffset);
+	memcpy(sb->s_hash_seed, &guid, sizeof(sb->s_hash_seed));
+	sb->s_inodes_count = l.InodesPerGroup * l.GroupsCount;
+	sb->s_blocks_count = l.BlocksCount;
+	sb->s_r_blocks_count = l.BlocksCount / 20;
+	sb->s_first_data_block = l.FirstDataBlock;
+	for (i = 1024; i < BlockSize; i <<= 1)
+		sb->s_log_block_size++;
+	sb->s_log_cluster_size = sb->s_log_block_size;
+	sb->s_blocks_per_group = l.BlocksPerGroup;
+	sb->s_clusters_per_group = l.BlocksPerGroup;
+	sb->s_inodes_per_group = l.InodesPerGroup;
+	sb->s_wtime = now;
+	sb->s_max_mnt_count = -1;
+	sb->s_magic = EXT_MAGIC;
+	sb->s_state = 1;    // Cleanly unmounted
+	sb->s_errors = 1;   // Continue
+	sb->s_lastcheck = now;
+	sb->s_rev_level = 1;
+	sb->s_first_ino = EXT_FIRST_INO;
+	sb->s_inode_size = EXT_INODE_SIZE;
+	sb->s_feature_compat = EXT_COMPAT_DIR_INDEX;
+	sb->s_feature_incompat = EXT_INCOMPAT_FILETYPE;
+	sb->s_feature_ro_compat = EXT_RO_COMPAT_SPARSE_SUPER | EXT_RO_COMPAT_LARGE_FILE;
+	if (bExt4) {
+		sb->s_feature_incompat |= EXT_INCOMPAT_EXTENTS;
+		sb->s_feature_ro_compat |= EXT_RO_COMPAT_GDT_CSUM | EXT_RO_COMPAT_DIR_NLINK | EXT_RO_COMPAT_EXTRA_ISIZE;
+		sb->s_default_mount_opts = EXT_DEFM_XATTR_USER | EXT_DEFM_ACL;
+		sb->s_min_extra_isize = EXT_EXTRA_ISIZE;
+		sb->s_want_extra_isize = EXT_EXTRA_ISIZE;
+	}
+	if (Label != NULL)
+		strncpy(sb->s_volume_name, Label, sizeof(sb->s_volume_name));
+	sb->s_def_hash_version = EXT_HASH_HALF_MD4;
+	sb->s_mkfs_time = now;
+	sb->s_flags = EXT_FLAGS_SIGNED_HASH;
+
+	// Populate the group descriptors
+	for (g = 0; g < l.GroupsCount; g++) {
+		start = GroupFirstBlock(&l, g) + (HasSuperblock(g) ? (1 + l.GdtBlocks) : 0);
+		used = GroupOverhead(&l, g) + ((g == 0) ? (1 + LpfBlocks + (bConf ? 1 : 0)) : 0);
+		gdt[g].bg_block_bitmap = start;
+		gdt[g].bg_inode_bitmap = start + 1;
+		gdt[g].bg_inode_table = start + 2;
+		gdt[g].bg_free_blocks_count = (uint16_t)(GroupBlocks(&l, g) - used);
+		gdt[g].bg_free_inodes_count = (uint16_t)(l.InodesPerGroup - ((g == 0) ? UsedInodes : 0));
+		gdt[g].bg_used_dirs_count = (g == 0) ? 2 : 0;
+		if (bExt4) {
+			if (bLazy) {
+				if (g != 0) {
+					gdt[g].bg_flags |= EXT_BG_INODE_UNINIT;
+					// The kernel expects the last group's block bitmap to be initialised
+					if (g != l.GroupsCount - 1)
+						gdt[g].bg_flags |= EXT_BG_BLOCK_UNINIT;
+				}
+			} else {
+				gdt[g].bg_flags |= EXT_BG_INODE_ZEROED;
+			}
+			gdt[g].bg_itable_unused = gdt[g].bg_free_inodes_count;
+			gdt[g].bg_checksum = GroupDescChecksum(sb->s_uuid, g, &gdt[g]);
+		}
+		FreeBlocks += gdt[g].bg_free_blocks_count;
+		FreeInodes += gdt[g].bg_free_inodes_count;
+	}
+	sb->s_free_blocks_count = (uint32_t)FreeBlocks;
+	sb->s_free_inodes_count = (uint32_t)FreeInodes;
+
+	// Only the inode tables are sizeable enough to warrant progress reporting
+	TotalWork = l.GroupsCount + (bLazy ? 0 : (uint64_t)l.GroupsCount * l.InodeTableBlocks);
+	ZeroBlocks = WIPE_SIZE / BlockSize;
+
+	for (g = 0; g < l.GroupsCount; g++) {
+		// Superblock and descriptors backups
+		if (HasSuperblock(g)) {
+			sb->s_block_group_nr = (uint16_t)g;
+			memset(buf, 0, BlockSize);
+			// The superblock always starts at byte 1024, and group 0 starts at block 0 unless the block size is 1K
+			memcpy(&buf[(g == 0 && BlockSize > 1024) ? 1024 : 0], sb, min(BlockSize, sizeof(EXT_SUPERBLOCK)));
+			if ( !WriteBlocks(&l, GroupFirstBlock(&l, g), 1, buf)
+			  || !WriteBlocks(&l, GroupFirstBlock(&l, g) + 1, l.GdtBlocks, gdt) )
+				die("Could not write superblock\n", ERROR_WRITE_FAULT);
+		}
+
+		// Block bitmap: the metadata (and root directories in group 0) is at the start
+		// of the group, and the padding past the end of the last group is marked in use
+		if (!(gdt[g].bg_flags & EXT_BG_BLOCK_UNINIT)) {
+			memset(buf, 0, BlockSize);
+			SetBits(buf, 0, GroupBlocks(&l, g) - gdt[g].bg_free_blocks_count);
+			SetBits(buf, GroupBlocks(&l, g), 8 * BlockSize);
+			if (!WriteBlocks(&l, gdt[g].bg_block_bitmap, 1, buf))
+				die("Could not write block bitmap\n", ERROR_WRITE_FAULT);
+		}
+
+		// Inode bitmap
+		if (!(gdt[g].bg_flags & EXT_BG_INODE_UNINIT)) {
+			memset(buf, 0, BlockSize);
+			if (g == 0)
+				SetBits(buf, 0, UsedInodes);
+			SetBits(buf, l.InodesPerGroup, 8 * BlockSize);
+			if (!WriteBlocks(&l, gdt[g].bg_inode_bitmap, 1, buf))
+				die("Could not write inode bitmap\n", ERROR_WRITE_FAULT);
+		}
+
+		// Inode table
+		if (!bLazy) {
+			for (i = 0; i < l.InodeTableBlocks; i += pos) {
+				pos = min(ZeroBlocks, l.InodeTableBlocks - i);
+				if (!WriteBlocks(&l, (uint64_t)gdt[g].bg_inode_table + i, pos, zero))
+					die("Could not zero inode table\n", ERROR_WRITE_FAULT);
+				Work += pos;
+				if (GetTickCount() > LastRefresh + 25) {
+					LastRefresh = GetTickCount();
+					format_percent = (100.0f * Work) / (1.0f * TotalWork);
+					PrintInfo(0, MSG_217, format_percent);
+					UpdateProgress(OP_FORMAT, format_percent);
+				}
+				if (IS_ERROR(FormatStatus))
+					goto out;
+			}
+		}
+		Work++;
+		if (GetTickCount() > LastRefresh + 25) {
+			LastRefresh = GetTickCount();
+			format_percent = (100.0f * Work) / (1.0f * TotalWork);
+			PrintInfo(0, MSG_217, format_percent);
+			UpdateProgress(OP_FORMAT, format_percent);
+		}
+		if (IS_ERROR(FormatStatus))
+			goto out;
+	}
+
+	// Reserved inodes, root directory and lost+found
+	safe_free(buf);
+	buf = (uint8_t*)calloc(InodeBlocks, BlockSize);
+	if (buf == NULL)
+		die("Could not allocate memory\n", ERROR_NOT_ENOUGH_MEMORY);
+	inode = (EXT_INODE*)&buf[(EXT_ROOT_INO - 1) * EXT_INODE_SIZE];
+	SetInode(inode, bExt4, EXT_S_IFDIR | 0755, 3, BlockSize, RootBlock, 1, BlockSize, now);
+	inode = (EXT_INODE*)&buf[(EXT_LPF_INO - 1) * EXT_INODE_SIZE];
+	SetInode(inode, bExt4, EXT_S_IFDIR | 0700, 2, LpfBlocks * BlockSize, LpfBlock, LpfBlocks, BlockSize, now);
+	if (bConf) {
+		inode = (EXT_INODE*)&buf[(EXT_CONF_INO - 1) * EXT_INODE_SIZE];
+		SetInode(inode, bExt4, EXT_S_IFREG | 0644, 1, sizeof(PERSISTENCE_CONF_DATA) - 1, ConfBlock, 1, BlockSize, now);
+	}
+	if (!WriteBlocks(&l, gdt[0].bg_inode_table, InodeBlocks, buf))
+		die("Could not write root inodes\n", ERROR_WRITE_FAULT);
+
+	memset(buf, 0, BlockSize);
+	pos = 0;
+	AddDirEntry(buf, &pos, EXT_ROOT_INO, EXT_FT_DIR, 12, ".");
+	AddDirEntry(buf, &pos, EXT_ROOT_INO, EXT_FT_DIR, 12, "..");
+	if (bConf) {
+		AddDirEntry(buf, &pos, EXT_LPF_INO, EXT_FT_DIR, 20, "lost+found");
+		AddDirEntry(buf, &pos, EXT_CONF_INO, EXT_FT_REG_FILE, (uint16_t)(BlockSize - pos), PERSISTENCE_CONF_NAME);
+	} else {
+		AddDirEntry(buf, &pos, EXT_LPF_INO, EXT_FT_DIR, (uint16_t)(BlockSize - pos), "lost+found");
+	}
+	if (!WriteBlocks(&l, RootBlock, 1, buf))
+		die("Could not write root directory\n", ERROR_WRITE_FAULT);
+
+	for (i = 0; i < LpfBlocks; i++) {
+		memset(buf, 0, BlockSize);
+		pos = 0;
+		if (i == 0) {
+			AddDirEntry(buf, &pos, EXT_LPF_INO, EXT_FT_DIR, 12, ".");
+			AddDirEntry(buf, &pos, EXT_ROOT_INO, EXT_FT_DIR, (uint16_t)(BlockSize - pos), "..");
+		} else {
+			AddDirEntry(buf, &pos, 0, 0, (uint16_t)BlockSize, "");
+		}
+		if (!WriteBlocks(&l, LpfBlock + i, 1, buf))
+			die("Could not write lost+found directory\n", ERROR_WRITE_FAULT);
+	}
+
+	if (bConf) {
+		memset(buf, 0, BlockSize);
+		memcpy(buf, PERSISTENCE_CONF_DATA, sizeof(PERSISTENCE_CONF_DATA) - 1);
+		if (!WriteBlocks(&l, ConfBlock, 1, buf))
+			die("Could not write " PERSISTENCE_CONF_NAME "\n", ERROR_WRITE_FAULT);
+	}
+
+	UpdateProgress(OP_FORMAT, 100.0f);
+	uprintf("Format completed.");
+	r = TRUE;
+
+out:
+	safe_free(buf);
+	safe_free(zero);
+	safe_free(sb);
+	safe_free(gdt);
+	return r;
+}
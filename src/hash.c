@@ -0,0 +1,95 @@
+/*
+ * Rufus: The Reliable USB Formatting Utility
+ * Hash functions
+ * Copyright © 2015 Pete Batard <pete@akeo.ie>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <windows.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "rufus.h"
+
+/*
+ * SHA-1 (FIPS 180-1), used to check zsync targets and to identify reproducible drives
+ */
+#define ROL32(x, n) (((x) << (n)) | ((x) >> (32 - (n))))
+
+static void sha1_transform(uint32_t* h, const uint8_t* p)
+{
+	uint32_t w[80], a = h[0], b = h[1], c = h[2], d = h[3], e = h[4], t;
+	int i;
+
+	for (i = 0; i < 16; i++)
+		w[i] = ((uint32_t)p[4*i] << 24) | (p[4*i + 1] << 16) | (p[4*i + 2] << 8) | p[4*i + 3];
+	for (; i < 80; i++)
+		w[i] = ROL32(w[i - 3] ^ w[i - 8] ^ w[i - 14] ^ w[i - 16], 1);
+	for (i = 0; i < 80; i++) {
+		if (i < 20)
+			t = ((b & c) | (~b & d)) + 0x5a827999;
+		else if (i < 40)
+			t = (b ^ c ^ d) + 0x6ed9eba1;
+		else if (i < 60)
+			t = ((b & c) | (b & d) | (c & d)) + 0x8f1bbcdc;
+		else
+			t = (b ^ c ^ d) + 0xca62c1d6;
+		t += ROL32(a, 5) + e + w[i];
+		e = d; d = c; c = ROL32(b, 30); b = a; a = t;
+	}
+	h[0] += a; h[1] += b; h[2] += c; h[3] += d; h[4] += e;
+}
+
+void sha1_init(sha1_ctx* ctx)
+{
+	static const uint32_t h[5] = { 0x67452301, 0xefcdab89, 0x98badcfe, 0x10325476, 0xc3d2e1f0 };
+
+	memcpy(ctx->h, h, sizeof(h));
+	ctx->len = 0;
+}
+
+void sha1_update(sha1_ctx* ctx, const uint8_t* data, size_t len)
+{
+	size_t n = (size_t)(ctx->len % 64);
+
+	ctx->len += len;
+	if (n != 0) {
+		if (n + len < 64) {
+			memcpy(&ctx->buf[n], data, len);
+			return;
+		}
+		memcpy(&ctx->buf[n], data, 64 - n);
+		sha1_transform(ctx->h, ctx->buf);
+		data += 64 - n;
+		len -= 64 - n;
+	}
+	for (; len >= 64; data += 64, len -= 64)
+		sha1_transform(ctx->h, data);
+	memcpy(ctx->buf, data, len);
+}
+
+void sha1_final(sha1_ctx* ctx, uint8_t* digest)
+{
+	uint64_t bits = ctx->len * 8;
+	uint8_t pad[72] = { 0x80 };
+	size_t i, n = (size_t)(ctx->len % 64);
+
+	n = (n < 56) ? 56 - n : 120 - n;
+	for (i = 0; i < 8; i++)
+		pad[n + i] = (uint8_t)(bits >> (56 - 8 * i));
+	sha1_update(ctx, pad, n + 8);
+	for (i = 0; i < 20; i++)
+		digest[i] = (uint8_t)(ctx->h[i / 4] >> (24 - 8 * (i % 4)));
+}
@@ -42,10 +42,15 @@
 #include "msapi_utf8.h"
 #include "resource.h"
 #include "localization.h"
+#include "wim.h"
+#include "drive.h"
 
 // How often should we update the progress bar (in 2K blocks) as updating
 // the progress bar for every block will bring extraction to a crawl
 #define PROGRESS_THRESHOLD        128
+// How many 2K blocks we read at once from an UDF or ISO9660 file during extraction
+#define UDF_READ_BLOCKS           32
+#define ISO_READ_BLOCKS           32
 #define FOUR_GIGABYTES            4294967296LL
 
 // Needed for UDF ISO access
@@ -53,8 +58,10 @@ CdIo_t* cdio_open (const char* psz_source, driver_id_t driver_id) {return NULL;}
 void cdio_destroy (CdIo_t* p_cdio) {}
 
 typedef struct {
+	BOOL is_cfg;
 	BOOL is_syslinux_cfg;
 	BOOL is_grub_cfg;
+	BOOL is_split_wim;
 	BOOL is_old_c32[NB_OLD_C32];
 } EXTRACT_PROPS;
 
@@ -63,6 +70,7 @@ int64_t iso_blocking_status = -1;
 BOOL enable_iso = TRUE, enable_joliet = TRUE, enable_rockridge = TRUE, has_ldlinux_c32;
 #define ISO_BLOCKING(x) do {x; iso_blocking_status++; } while(0)
 static const char* psz_extract_dir;
+static const char* psz_src_iso;
 static const char* bootmgr_efi_name = "bootmgr.efi";
 static const char* grldr_name = "grldr";
 static const char* ldlinux_name = "ldlinux.sys";
@@ -70,6 +78,11 @@ static const char* ldlinux_c32 = "ldlinux.c32";
 static const char* efi_dirname = "/efi/boot";
 static const char* grub_dirname = "/boot/grub";   // NB: We don't support nonstandard config dir such as AROS' "/boot/pc/grub/"
 static const char* grub_cfg = "grub.cfg";
+static const char* casper_dirname = "/casper";
+static const char* live_dirname = "/live";
+static const char* sources_dirname = "/sources";
+static const char* install_wim_name = "install.wim";
+static const char* kernel_token[] = { "append", "linux" };
 static const char* syslinux_cfg[] = { "isolinux.cfg", "syslinux.cfg", "extlinux.conf"};
 static const char dot_isolinux_bin[] = ".\\isolinux.bin";
 static const char* isolinux_bin = &dot_isolinux_bin[2];
@@ -86,7 +99,9 @@ static const int64_t old_c32_threshold[NB_OLD_C32] = OLD_C32_THRESHOLD;
 static uint8_t i_joliet_level = 0;
 static uint64_t total_blocks, nb_blocks;
 static BOOL scan_only = FALSE;
+static BOOL split_wim = FALSE;
 static StrArray config_path, isolinux_path;
+extern BOOL use_persistence;
 
 // Ensure filenames do not contain invalid FAT32 or NTFS characters
 static __inline char* sanitize_filename(char* filename, BOOL* is_identical)
@@ -132,9 +147,15 @@ static void log_handler (cdio_log_level_t level, const char *message)
 static BOOL check_iso_props(const char* psz_dirname, int64_t i_file_length, const char* psz_basename,
 	const char* psz_fullpath, EXTRACT_PROPS *props)
 {
-	size_t i, j;
+	size_t i, j, len;
+	BOOL is_install_wim = (safe_stricmp(psz_dirname, sources_dirname) == 0) && (safe_stricmp(psz_basename, install_wim_name) == 0);
 	// Check for an isolinux/syslinux config file anywhere
 	memset(props, 0, sizeof(EXTRACT_PROPS));
+	// Any config file may hold kernel command lines that need patching
+	len = safe_strlen(psz_basename);
+	if ( ((len > 4) && (safe_stricmp(&psz_basename[len-4], ".cfg") == 0))
+	  || ((len > 5) && (safe_stricmp(&psz_basename[len-5], ".conf") == 0)) )
+		props->is_cfg = TRUE;
 	for (i=0; i<ARRAYSIZE(syslinux_cfg); i++) {
 		if (safe_stricmp(psz_basename, syslinux_cfg[i]) == 0) {
 			props->is_syslinux_cfg = TRUE;
@@ -157,6 +178,9 @@ static BOOL check_iso_props(const char* psz_dirname, int64_t i_file_length, cons
 			props->is_grub_cfg = TRUE;
 	}
 
+	// An install.wim that is too large for the target gets written as .swm parts instead
+	if ((!scan_only) && (split_wim) && (is_install_wim) && (i_file_length >= FOUR_GIGABYTES))
+		props->is_split_wim = TRUE;
 
 	if (scan_only) {
 		// Check for a syslinux v5.0+ file anywhere
@@ -188,6 +212,22 @@ static BOOL check_iso_props(const char* psz_dirname, int64_t i_file_length, cons
 		if (safe_stricmp(psz_dirname, efi_dirname) == 0)
 			iso_report.has_efi = TRUE;
 
+		// Check for Ubuntu (casper) or Debian live media, which can use a persistence partition
+		if (safe_stricmp(psz_dirname, casper_dirname) == 0)
+			iso_report.uses_casper = TRUE;
+		if (safe_stricmp(psz_dirname, live_dirname) == 0)
+			iso_report.uses_debian_live = TRUE;
+		// Check for a Windows installation image, which we can apply for Windows To Go
+		if (is_install_wim)
+			iso_report.has_install_wim = TRUE;
+		// Keep track of the live kernel and initrd, so that the ISO can also be booted off a file
+		if ((safe_stricmp(psz_dirname, casper_dirname) == 0) || (safe_stricmp(psz_dirname, live_dirname) == 0)) {
+			if ((iso_report.kernel_path[0] == 0) && (safe_strnicmp(psz_basename, "vmlinuz", 7) == 0))
+				safe_sprintf(iso_report.kernel_path, sizeof(iso_report.kernel_path), "%s/%s", psz_dirname, psz_basename);
+			if ((iso_report.initrd_path[0] == 0) && (safe_strnicmp(psz_basename, "initrd", 6) == 0))
+				safe_sprintf(iso_report.initrd_path, sizeof(iso_report.initrd_path), "%s/%s", psz_dirname, psz_basename);
+		}
+
 		// Check for PE (XP) specific files in "/i386" or "/minint"
 		for (i=0; i<ARRAYSIZE(pe_dirname); i++)
 			if (safe_stricmp(psz_dirname, pe_dirname[i]) == 0)
@@ -208,8 +248,12 @@ static BOOL check_iso_props(const char* psz_dirname, int64_t i_file_length, cons
 			if (props->is_old_c32[i])
 				iso_report.has_old_c32[i] = TRUE;
 		}
-		if (i_file_length >= FOUR_GIGABYTES)
+		// A large install.wim doesn't rule out FAT32, since we can split it
+		if ((i_file_length >= FOUR_GIGABYTES) && (is_install_wim))
+			iso_report.has_4GB_wim = TRUE;
+		else if (i_file_length >= FOUR_GIGABYTES)
 			iso_report.has_4GB_file = TRUE;
+		iso_report.nb_files++;
 		// Compute projected size needed
 		total_blocks += i_file_length/UDF_BLOCKSIZE;
 		// NB: ISO_BLOCKSIZE = UDF_BLOCKSIZE
@@ -266,6 +310,18 @@ static void fix_config(const char* psz_fullpath, const char* psz_path, const cha
 				uprintf("  Patched %s: '%s' ⇨ '%s'\n", src, iso_label, usb_label);
 		}
 	}
+	// Enable persistence on the kernel command line, if we create a persistence partition
+	if ((props->is_cfg) && (use_persistence)) {
+		for (i=0; i<ARRAYSIZE(kernel_token); i++) {
+			if (iso_report.uses_casper) {
+				if (replace_in_token_data(src, kernel_token[i], "boot=casper", "boot=casper persistent", TRUE) != NULL)
+					uprintf("  Added persistence to %s\n", src);
+			} else {
+				if (replace_in_token_data(src, kernel_token[i], "boot=live", "boot=live persistence", TRUE) != NULL)
+					uprintf("  Added persistence to %s\n", src);
+			}
+		}
+	}
 	safe_free(iso_label);
 	safe_free(usb_label);
 	free(src);
@@ -291,6 +347,16 @@ static void print_extracted_file(char* psz_fullpath, int64_t i_file_length)
 	psz_fullpath[nul_pos] = 0;
 }
 
+// Splitting install.wim doesn't go through our read loops, so it reports its progress here
+static void split_wim_progress(const uint64_t nb_bytes)
+{
+	uint64_t prev_blocks = nb_blocks;
+
+	nb_blocks += nb_bytes / ISO_BLOCKSIZE;
+	if (nb_blocks / PROGRESS_THRESHOLD != prev_blocks / PROGRESS_THRESHOLD)
+		UpdateProgress(OP_DOS, 100.0f*nb_blocks/total_blocks);
+}
+
 // Returns 0 on success, nonzero on error
 static int udf_extract_files(udf_t *p_udf, udf_dirent_t *p_udf_dirent, const char *psz_path)
 {
@@ -303,7 +369,9 @@ static int udf_extract_files(udf_t *p_udf, udf_dirent_t *p_udf_dirent, const cha
 	char tmp[128], *psz_fullpath = NULL, *psz_sanpath = NULL;
 	const char* psz_basename;
 	udf_dirent_t *p_udf_dirent2;
-	uint8_t buf[UDF_BLOCKSIZE];
+	// This function is recursive, so keep the read buffer off the stack
+	static uint8_t buf[UDF_READ_BLOCKS * UDF_BLOCKSIZE];
+	uint64_t prev_blocks;
 	int64_t i_read, i_file_length;
 
 	if ((p_udf_dirent == NULL) || (psz_path == NULL))
@@ -357,6 +425,14 @@ static int udf_extract_files(udf_t *p_udf, udf_dirent_t *p_udf_dirent, const cha
 			psz_sanpath = sanitize_filename(psz_fullpath, &is_identical);
 			if (!is_identical)
 				uprintf("  File name sanitized to '%s'\n", psz_sanpath);
+			if (props.is_split_wim) {
+				r = SplitWindowsImage(psz_src_iso, psz_sanpath, split_wim_progress);
+				safe_free(psz_sanpath);
+				if (!r)
+					goto out;
+				safe_free(psz_fullpath);
+				continue;
+			}
 			file_handle = CreateFileU(psz_sanpath, GENERIC_READ | GENERIC_WRITE,
 				FILE_SHARE_READ|FILE_SHARE_WRITE, NULL, CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL);
 			if (file_handle == INVALID_HANDLE_VALUE) {
@@ -368,9 +444,8 @@ static int udf_extract_files(udf_t *p_udf, udf_dirent_t *p_udf_dirent, const cha
 					goto out;
 			} else while (i_file_length > 0) {
 				if (FormatStatus) goto out;
-				memset(buf, 0, UDF_BLOCKSIZE);
-				i_read = udf_read_block(p_udf_dirent, buf, 1);
-				if (i_read < 0) {
+				i_read = udf_read_block(p_udf_dirent, buf, UDF_READ_BLOCKS);
+				if (i_read <= 0) {
 					uprintf("  Error reading UDF file %s\n", &psz_fullpath[strlen(psz_extract_dir)]);
 					goto out;
 				}
@@ -387,7 +462,9 @@ static int udf_extract_files(udf_t *p_udf, udf_dirent_t *p_udf_dirent, const cha
 				}
 				if (i >= WRITE_RETRIES) goto out;
 				i_file_length -= i_read;
-				if (nb_blocks++ % PROGRESS_THRESHOLD == 0)
+				prev_blocks = nb_blocks;
+				nb_blocks += (i_read + UDF_BLOCKSIZE - 1) / UDF_BLOCKSIZE;
+				if (nb_blocks / PROGRESS_THRESHOLD != prev_blocks / PROGRESS_THRESHOLD)
 					UpdateProgress(OP_DOS, 100.0f*nb_blocks/total_blocks);
 			}
 			// If you have a fast USB 3.0 device, the default Windows buffering does an
@@ -396,7 +473,7 @@ static int udf_extract_files(udf_t *p_udf, udf_dirent_t *p_udf_dirent, const cha
 			// The drawback however is with cancellation. With a large file, CloseHandle()
 			// may take forever to complete and is not interruptible. We try to detect this.
 			ISO_BLOCKING(safe_closehandle(file_handle));
-			if (props.is_syslinux_cfg || props.is_grub_cfg)
+			if (props.is_cfg || props.is_syslinux_cfg || props.is_grub_cfg)
 				fix_config(psz_sanpath, psz_path, psz_basename, &props);
 			safe_free(psz_sanpath);
 		}
@@ -422,13 +499,16 @@ static int iso_extract_files(iso9660_t* p_iso, const char *psz_path)
 	int i_length, r = 1;
 	char tmp[128], psz_fullpath[MAX_PATH], *psz_basename, *psz_sanpath;
 	const char *psz_iso_name = &psz_fullpath[strlen(psz_extract_dir)];
-	unsigned char buf[ISO_BLOCKSIZE];
+	// This function is recursive, so keep the read buffer off the stack
+	static unsigned char buf[ISO_READ_BLOCKS * ISO_BLOCKSIZE];
 	CdioListNode_t* p_entnode;
 	iso9660_stat_t *p_statbuf;
 	CdioList_t* p_entlist;
 	size_t i, j;
 	lsn_t lsn;
-	int64_t i_file_length;
+	long nb_read;
+	uint64_t prev_blocks;
+	int64_t i_file_length, i_extent_length;
 
 	if ((p_iso == NULL) || (psz_path == NULL))
 		return 1;
@@ -476,7 +556,7 @@ static int iso_extract_files(iso9660_t* p_iso, const char *psz_path)
 			if (iso_extract_files(p_iso, psz_iso_name))
 				goto out;
 		} else {
-			i_file_length = p_statbuf->size;
+			i_file_length = p_statbuf->total_size;
 			if (check_iso_props(psz_path, i_file_length, psz_basename, psz_fullpath, &props)) {
 				continue;
 			}
@@ -501,6 +581,13 @@ static int iso_extract_files(iso9660_t* p_iso, const char *psz_path)
 					uprintf("  Ignoring Rock Ridge symbolic link to '%s'\n", p_statbuf->rr.psz_symlink);
 				safe_free(p_statbuf->rr.psz_symlink);
 			}
+			if (props.is_split_wim) {
+				s = SplitWindowsImage(psz_src_iso, psz_sanpath, split_wim_progress);
+				safe_free(psz_sanpath);
+				if (!s)
+					goto out;
+				continue;
+			}
 			file_handle = CreateFileU(psz_sanpath, GENERIC_READ | GENERIC_WRITE,
 				FILE_SHARE_READ|FILE_SHARE_WRITE, NULL, CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL);
 			if (file_handle == INVALID_HANDLE_VALUE) {
@@ -510,33 +597,46 @@ static int iso_extract_files(iso9660_t* p_iso, const char *psz_path)
 					uprintf(stupid_antivirus);
 				else
 					goto out;
-			} else for (i=0; i_file_length>0; i++) {
-				if (FormatStatus) goto out;
-				memset(buf, 0, ISO_BLOCKSIZE);
-				lsn = p_statbuf->lsn + (lsn_t)i;
-				if (iso9660_iso_seek_read(p_iso, buf, lsn, 1) != ISO_BLOCKSIZE) {
-					uprintf("  Error reading ISO9660 file %s at LSN %lu\n",
-						psz_iso_name, (long unsigned int)lsn);
-					goto out;
-				}
-				buf_size = (DWORD)MIN(i_file_length, ISO_BLOCKSIZE);
-				for (j=0; j<WRITE_RETRIES; j++) {
-					ISO_BLOCKING(s = WriteFile(file_handle, buf, buf_size, &wr_size, NULL));
-					if ((!s) || (buf_size != wr_size)) {
-						uprintf("  Error writing file: %s", WindowsErrorString());
-						if (j < WRITE_RETRIES-1)
-							uprintf("  RETRYING...\n");
-					} else {
-						break;
+			} else for (i=0; (i<p_statbuf->extents) && (i_file_length>0); ) {
+				// Files larger than 4 GB are split into several extents, which we
+				// merge when they follow each other on the media
+				lsn = p_statbuf->extent_lsn[i];
+				i_extent_length = p_statbuf->extent_size[i];
+				for (i++; (i<p_statbuf->extents) && (i_extent_length%ISO_BLOCKSIZE == 0)
+					&& (p_statbuf->extent_lsn[i] == lsn + (lsn_t)(i_extent_length/ISO_BLOCKSIZE)); i++)
+					i_extent_length += p_statbuf->extent_size[i];
+				i_extent_length = MIN(i_extent_length, i_file_length);
+				while (i_extent_length > 0) {
+					if (FormatStatus) goto out;
+					nb_read = (long)MIN(ISO_READ_BLOCKS, (i_extent_length + ISO_BLOCKSIZE - 1) / ISO_BLOCKSIZE);
+					if (iso9660_iso_seek_read(p_iso, buf, lsn, nb_read) != nb_read * ISO_BLOCKSIZE) {
+						uprintf("  Error reading ISO9660 file %s at LSN %lu\n",
+							psz_iso_name, (long unsigned int)lsn);
+						goto out;
+					}
+					buf_size = (DWORD)MIN(i_extent_length, nb_read * ISO_BLOCKSIZE);
+					for (j=0; j<WRITE_RETRIES; j++) {
+						ISO_BLOCKING(s = WriteFile(file_handle, buf, buf_size, &wr_size, NULL));
+						if ((!s) || (buf_size != wr_size)) {
+							uprintf("  Error writing file: %s", WindowsErrorString());
+							if (j < WRITE_RETRIES-1)
+								uprintf("  RETRYING...\n");
+						} else {
+							break;
+						}
 					}
+					if (j >= WRITE_RETRIES) goto out;
+					lsn += nb_read;
+					i_extent_length -= buf_size;
+					i_file_length -= buf_size;
+					prev_blocks = nb_blocks;
+					nb_blocks += nb_read;
+					if (nb_blocks / PROGRESS_THRESHOLD != prev_blocks / PROGRESS_THRESHOLD)
+						UpdateProgress(OP_DOS, 100.0f*nb_blocks/total_blocks);
 				}
-				if (j >= WRITE_RETRIES) goto out;
-				i_file_length -= ISO_BLOCKSIZE;
-				if (nb_blocks++ % PROGRESS_THRESHOLD == 0)
-					UpdateProgress(OP_DOS, 100.0f*nb_blocks/total_blocks);
 			}
 			ISO_BLOCKING(safe_closehandle(file_handle));
-			if (props.is_syslinux_cfg || props.is_grub_cfg)
+			if (props.is_cfg || props.is_syslinux_cfg || props.is_grub_cfg)
 				fix_config(psz_sanpath, psz_path, psz_basename, &props);
 			safe_free(psz_sanpath);
 		}
@@ -581,7 +681,7 @@ BOOL ExtractISO(const char* src_iso, const char* dest_dir, BOOL scan)
 	udf_t* p_udf = NULL; 
 	udf_dirent_t* p_udf_root;
 	char *tmp, *buf, *ext;
-	char path[MAX_PATH];
+	char path[MAX_PATH], fs_name[32];
 	const char* basedir[] = { "i386", "minint" };
 	const char* tmp_sif = ".\\txtsetup.sif~";
 	iso_extension_mask_t iso_extension_mask = ISO_EXTENSION_ALL;
@@ -592,6 +692,7 @@ BOOL ExtractISO(const char* src_iso, const char* dest_dir, BOOL scan)
 	scan_only = scan;
 	cdio_log_set_handler(log_handler);
 	psz_extract_dir = dest_dir;
+	psz_src_iso = src_iso;
 	// Change progress style to marquee for scanning
 	if (scan_only) {
 		SendMessage(hMainDialog, UM_PROGRESS_INIT, PBS_MARQUEE, 0);
@@ -613,6 +714,16 @@ BOOL ExtractISO(const char* src_iso, const char* dest_dir, BOOL scan)
 		}
 		nb_blocks = 0;
 		iso_blocking_status = 0;
+		// FAT32 can't hold files of 4 GB or more, so a large install.wim must be split.
+		// Windows Setup can use .swm parts from any file system, so split if unsure.
+		split_wim = FALSE;
+		if (iso_report.has_4GB_wim) {
+			static_sprintf(path, "%c:\\", dest_dir[0]);
+			split_wim = (!GetVolumeInformationA(path, NULL, 0, NULL, NULL, NULL, fs_name, sizeof(fs_name))) ||
+				(safe_strnicmp(fs_name, "FAT", 3) == 0);
+			if (split_wim)
+				uprintf("install.wim is larger than 4 GB and will be split\n");
+		}
 	}
 
 	/* First try to open as UDF - fallback to ISO if it failed */
@@ -807,11 +918,188 @@ out:
 	return (r == 0);
 }
 
+/*
+ * Return the offset, in bytes, of the data of a file that is recorded contiguously
+ * in an ISO image, so that it can be read directly from the image, or -1 on error.
+ */
+int64_t GetISOFileOffset(const char* iso, const char* iso_file, uint64_t* file_size)
+{
+	int64_t r = -1;
+	uint32_t i;
+	lsn_t lsn;
+	iso9660_t* p_iso = NULL;
+	udf_t* p_udf = NULL;
+	udf_dirent_t *p_udf_root = NULL, *p_udf_file = NULL;
+	iso9660_stat_t *p_statbuf = NULL;
+
+	// First try to open as UDF - fallback to ISO if it failed
+	p_udf = udf_open(iso);
+	if (p_udf == NULL)
+		goto try_iso;
+	p_udf_root = udf_get_root(p_udf, true, 0);
+	if (p_udf_root == NULL) {
+		uprintf("Could not locate UDF root directory\n");
+		goto out;
+	}
+	p_udf_file = udf_fopen(p_udf_root, iso_file);
+	if (p_udf_file == NULL) {
+		uprintf("Could not locate file %s in ISO image\n", iso_file);
+		goto out;
+	}
+	lsn = udf_get_file_lsn(p_udf_file);
+	if (lsn == CDIO_INVALID_LSN) {
+		uprintf("File %s is not contiguous in the ISO image\n", iso_file);
+		goto out;
+	}
+	if (file_size != NULL)
+		*file_size = udf_get_file_length(p_udf_file);
+	r = (int64_t)lsn * UDF_BLOCKSIZE;
+	goto out;
+
+try_iso:
+	p_iso = iso9660_open(iso);
+	if (p_iso == NULL) {
+		uprintf("Unable to open image '%s'.\n", iso);
+		goto out;
+	}
+	p_statbuf = iso9660_ifs_stat_translate(p_iso, iso_file);
+	if (p_statbuf == NULL) {
+		uprintf("Could not get ISO-9660 file information for file %s\n", iso_file);
+		goto out;
+	}
+	// The extents of a multi-extent file must follow each other
+	for (i = 1; i < p_statbuf->extents; i++) {
+		if ((p_statbuf->extent_size[i-1] % ISO_BLOCKSIZE != 0) || (p_statbuf->extent_lsn[i] !=
+			p_statbuf->extent_lsn[i-1] + (lsn_t)(p_statbuf->extent_size[i-1] / ISO_BLOCKSIZE))) {
+			uprintf("File %s is not contiguous in the ISO image\n", iso_file);
+			goto out;
+		}
+	}
+	if (file_size != NULL)
+		*file_size = p_statbuf->total_size;
+	r = (int64_t)p_statbuf->lsn * ISO_BLOCKSIZE;
+
+out:
+	if (p_statbuf != NULL)
+		safe_free(p_statbuf->rr.psz_symlink);
+	safe_free(p_statbuf);
+	if (p_udf_root != NULL)
+		udf_dirent_free(p_udf_root);
+	if (p_udf_file != NULL)
+		udf_dirent_free(p_udf_file);
+	if (p_iso != NULL)
+		iso9660_close(p_iso);
+	if (p_udf != NULL)
+		udf_close(p_udf);
+	return r;
+}
+
+/*
+ * Look for an El Torito floppy or hard disk emulation boot image, as used by many firmware
+ * update and diagnostic discs that have nothing else we could boot, and record where it is,
+ * so that it can be deployed straight from the ISO.
+ */
+BOOL GetElToritoImage(const char* iso)
+{
+	const char el_torito_id[] = "EL TORITO SPECIFICATION";
+	const uint64_t floppy_size[] = { 1200 * 1024, 1440 * 1024, 2880 * 1024 };
+	const char* type_name[] = { "1.2 MB floppy", "1.44 MB floppy", "2.88 MB floppy", "hard disk" };
+	uint8_t buf[ISO_BLOCKSIZE], *entry, platform, type = EL_TORITO_NO_EMULATION;
+	uint16_t sum = 0;
+	uint32_t lsn = 0;
+	uint64_t size = 0;
+	mbr_partition* part;
+	iso9660_t* p_iso;
+	int i;
+
+	iso_report.el_torito_type = EL_TORITO_NO_EMULATION;
+	p_iso = iso9660_open(iso);
+	if (p_iso == NULL)
+		return FALSE;
+
+	// The Boot Record Volume Descriptor, at sector 17, points to the boot catalog
+	if ( (iso9660_iso_seek_read(p_iso, buf, 17, 1) != ISO_BLOCKSIZE) || (buf[0] != ISO_VD_BOOT_RECORD)
+	  || (memcmp(&buf[1], "CD001", 5) != 0) || (memcmp(&buf[7], el_torito_id, sizeof(el_torito_id) - 1) != 0) )
+		goto out;
+	lsn = buf[0x47] | (buf[0x48] << 8) | (buf[0x49] << 16) | ((uint32_t)buf[0x4a] << 24);
+	if (iso9660_iso_seek_read(p_iso, buf, lsn, 1) != ISO_BLOCKSIZE) {
+		uprintf("Could not read the El Torito boot catalog");
+		goto out;
+	}
+	// The catalog starts with a validation entry, whose 16-bit words must add up to zero
+	for (i = 0; i < 32; i += 2)
+		sum += buf[i] | (buf[i + 1] << 8);
+	if ((buf[0] != 0x01) || (buf[0x1e] != 0x55) || (buf[0x1f] != 0xaa) || (sum != 0)) {
+		uprintf("Invalid El Torito boot catalog");
+		goto out;
+	}
+	// Then come the default entry, for the platform of the validation entry, and the sections.
+	// A single catalog sector is enough for 63 entries, which is more than any disc we know of.
+	platform = buf[1];
+	for (i = 32; i < ISO_BLOCKSIZE; i += 32) {
+		entry = &buf[i];
+		if ((entry[0] == 0x90) || (entry[0] == 0x91)) {
+			// Section header
+			platform = entry[1];
+			continue;
+		}
+		// Only bootable x86 emulation images are of use to us (0x44 are section entry extensions)
+		if ((entry[0] != 0x88) || (platform != 0x00))
+			continue;
+		type = entry[1] & 0x0f;
+		if ((type >= EL_TORITO_FLOPPY_1_2) && (type <= EL_TORITO_HDD))
+			break;
+		type = EL_TORITO_NO_EMULATION;
+	}
+	if (type == EL_TORITO_NO_EMULATION)
+		goto out;
+
+	// The image starts with a boot sector: a FAT one for floppies and an MBR for hard disks
+	lsn = entry[8] | (entry[9] << 8) | (entry[10] << 16) | ((uint32_t)entry[11] << 24);
+	if (iso9660_iso_seek_read(p_iso, buf, lsn, 1) != ISO_BLOCKSIZE) {
+		uprintf("Could not read the El Torito boot image");
+		goto out;
+	}
+	if (type == EL_TORITO_HDD) {
+		// The size of an emulated hard disk is set by its partition table
+		for (i = 0; i < 4; i++) {
+			part = (mbr_partition*)&buf[0x1be + i * sizeof(mbr_partition)];
+			if (part->type != 0)
+				size = MAX(size, ((uint64_t)part->lba_start + part->nb_sectors) * 512);
+		}
+		if ((buf[0x1fe] != 0x55) || (buf[0x1ff] != 0xaa) || (size == 0)) {
+			uprintf("El Torito hard disk image has no valid partition table");
+			goto out;
+		}
+	} else {
+		size = floppy_size[type - EL_TORITO_FLOPPY_1_2];
+		if ((buf[0x0b] != 0x00) || (buf[0x0c] != 0x02) || (buf[0x0d] == 0)) {
+			uprintf("El Torito floppy image does not have a FAT file system");
+			goto out;
+		}
+	}
+	// Make sure that the whole image is in the ISO
+	if (iso9660_iso_seek_read(p_iso, buf, lsn + (lsn_t)((size - 1) / ISO_BLOCKSIZE), 1) != ISO_BLOCKSIZE) {
+		uprintf("El Torito boot image is truncated");
+		goto out;
+	}
+	iso_report.el_torito_type = type;
+	iso_report.el_torito_offset = (uint64_t)lsn * ISO_BLOCKSIZE;
+	iso_report.el_torito_size = size;
+	uprintf("Found El Torito %s emulation boot image (%s at offset 0x%llx)", type_name[type - EL_TORITO_FLOPPY_1_2],
+		SizeToHumanReadable(size, FALSE, FALSE), iso_report.el_torito_offset);
+
+out:
+	iso9660_close(p_iso);
+	return (iso_report.el_torito_type != EL_TORITO_NO_EMULATION);
+}
+
 int64_t ExtractISOFile(const char* iso, const char* iso_file, const char* dest_file, DWORD attributes)
 {
 	size_t i;
+	uint32_t j;
 	ssize_t read_size;
-	int64_t file_length, r = 0;
+	int64_t file_length, extent_length, r = 0;
 	char buf[UDF_BLOCKSIZE];
 	DWORD buf_size, wr_size;
 	BOOL s;
@@ -848,7 +1136,7 @@ int64_t ExtractISOFile(const char* iso, const char* iso_file, const char* dest_f
 	while (file_length > 0) {
 		memset(buf, 0, UDF_BLOCKSIZE);
 		read_size = udf_read_block(p_udf_file, buf, 1);
-		if (read_size < 0) {
+		if (read_size <= 0) {
 			uprintf("Error reading UDF file %s\n", iso_file);
 			goto out;
 		}
@@ -876,22 +1164,26 @@ try_iso:
 		goto out;
 	}
 
-	file_length = p_statbuf->size;
-	for (i = 0; file_length > 0; i++) {
-		memset(buf, 0, ISO_BLOCKSIZE);
-		lsn = p_statbuf->lsn + (lsn_t)i;
-		if (iso9660_iso_seek_read(p_iso, buf, lsn, 1) != ISO_BLOCKSIZE) {
-			uprintf("  Error reading ISO9660 file %s at LSN %lu\n", iso_file, (long unsigned int)lsn);
-			goto out;
-		}
-		buf_size = (DWORD)MIN(file_length, ISO_BLOCKSIZE);
-		s = WriteFile(file_handle, buf, buf_size, &wr_size, NULL);
-		if ((!s) || (buf_size != wr_size)) {
-			uprintf("  Error writing file %s: %s\n", dest_file, WindowsErrorString());
-			goto out;
+	file_length = p_statbuf->total_size;
+	for (j = 0; (j < p_statbuf->extents) && (file_length > 0); j++) {
+		extent_length = MIN(file_length, p_statbuf->extent_size[j]);
+		for (i = 0; extent_length > 0; i++) {
+			memset(buf, 0, ISO_BLOCKSIZE);
+			lsn = p_statbuf->extent_lsn[j] + (lsn_t)i;
+			if (iso9660_iso_seek_read(p_iso, buf, lsn, 1) != ISO_BLOCKSIZE) {
+				uprintf("  Error reading ISO9660 file %s at LSN %lu\n", iso_file, (long unsigned int)lsn);
+				goto out;
+			}
+			buf_size = (DWORD)MIN(extent_length, ISO_BLOCKSIZE);
+			s = WriteFile(file_handle, buf, buf_size, &wr_size, NULL);
+			if ((!s) || (buf_size != wr_size)) {
+				uprintf("  Error writing file %s: %s\n", dest_file, WindowsErrorString());
+				goto out;
+			}
+			extent_length -= buf_size;
+			file_length -= buf_size;
+			r += ISO_BLOCKSIZE;
 		}
-		file_length -= ISO_BLOCKSIZE;
-		r += ISO_BLOCKSIZE;
 	}
 
 out:
@@ -0,0 +1,277 @@
+/*
+ * Rufus: The Reliable USB Formatting Utility
+ * Write journal, for resuming interrupted image writes
+ * Copyright © 2015 Pete Batard <pete@akeo.ie>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Writing a large image can take a long time, during which the drive may get unplugged,
+ * the host may go to sleep or we may crash. Rather than have users restart from scratch
+ * we keep a journal of what was written, so that we can pick up where we left off.
+ *
+ * The journal identifies the source (path, size, timestamp and a hash of its start and
+ * end) and the target (VID:PID, serial number and size, so that a drive we can't tell
+ * apart from others is never resumed), followed by records holding the CRC-32 of each
+ * chunk of data that was written. Because the last chunks we were told were written may
+ * still have been sitting in a cache when the drive went away, the tail of the data is
+ * read back and checked against the journal before resuming. As resuming skips the
+ * partitioning and erasure of the drive, the start of the data, which holds the
+ * partition table, as well as a sample of the rest, are also checked, to detect a drive
+ * that was modified since. Finally, the user is asked to confirm before we resume.
+ */
+
+#include <windows.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "rufus.h"
+#include "msapi_utf8.h"
+#include "resource.h"
+#include "journal.h"
+#include "localization.h"
+
+static HANDLE hJournal = INVALID_HANDLE_VALUE;
+static char journal_path[MAX_PATH];
+static JOURNAL_RECORD cur_record;
+static uint32_t crc32_table[256];
+
+static uint32_t crc32_update(uint32_t crc, const uint8_t* buf, size_t len)
+{
+	uint32_t c;
+	size_t i;
+	int j;
+
+	if (crc32_table[1] == 0) {
+		for (i = 0; i < 256; i++) {
+			for (c = (uint32_t)i, j = 0; j < 8; j++)
+				c = (c >> 1) ^ (0xEDB88320 & (0 - (c & 1)));
+			crc32_table[i] = c;
+		}
+	}
+	crc = ~crc;
+	for (i = 0; i < len; i++)
+		crc = crc32_table[(crc ^ buf[i]) & 0xFF] ^ (crc >> 8);
+	return ~crc;
+}
+
+// Identify the source and target of the current write
+static BOOL GetJournalHeader(JOURNAL_HEADER* hdr, const char* image, int compression_type,
+	const char* device_id, uint64_t device_size, DWORD sector_size)
+{
+	HANDLE hImage;
+	LARGE_INTEGER li;
+	FILETIME ft;
+	DWORD size, rSize;
+	uint8_t* buf = NULL;
+	BOOL r = FALSE;
+
+	memset(hdr, 0, sizeof(JOURNAL_HEADER));
+	hImage = CreateFileU(image, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, 0, NULL);
+	if (hImage == INVALID_HANDLE_VALUE)
+		return FALSE;
+	buf = (uint8_t*)malloc(JOURNAL_ID_SAMPLE_SIZE);
+	if ((buf == NULL) || (!GetFileSizeEx(hImage, &li)) || (!GetFileTime(hImage, NULL, NULL, &ft)))
+		goto out;
+	memcpy(hdr->magic, JOURNAL_MAGIC, sizeof(hdr->magic));
+	hdr->version = JOURNAL_VERSION;
+	hdr->compression_type = compression_type;
+	hdr->image_size = li.QuadPart;
+	hdr->image_time = ((uint64_t)ft.dwHighDateTime << 32) | ft.dwLowDateTime;
+	hdr->sector_size = sector_size;
+	hdr->device_size = device_size;
+	safe_strcpy(hdr->image_path, sizeof(hdr->image_path), image);
+	safe_strcpy(hdr->device_id, sizeof(hdr->device_id), device_id);
+
+	// Hashing the start and end of the source is enough to tell different images apart
+	size = (DWORD)MIN(JOURNAL_ID_SAMPLE_SIZE, hdr->image_size);
+	if ((!ReadFile(hImage, buf, size, &rSize, NULL)) || (rSize != size))
+		goto out;
+	hdr->image_crc = crc32_update(0, buf, size);
+	li.QuadPart = hdr->image_size - size;
+	if ( (!SetFilePointerEx(hImage, li, NULL, FILE_BEGIN))
+	  || (!ReadFile(hImage, buf, size, &rSize, NULL)) || (rSize != size) )
+		goto out;
+	hdr->image_crc = crc32_update(hdr->image_crc, buf, size);
+	r = TRUE;
+
+out:
+	free(buf);
+	safe_closehandle(hImage);
+	return r;
+}
+
+static BOOL WriteJournalRecord(void)
+{
+	DWORD size;
+
+	if ( (!WriteFile(hJournal, &cur_record, sizeof(cur_record), &size, NULL)) || (size != sizeof(cur_record))
+	  || (!FlushFileBuffers(hJournal)) ) {
+		uprintf("Could not update write journal: %s - Resuming will not be possible", WindowsErrorString());
+		safe_closehandle(hJournal);
+		return FALSE;
+	}
+	cur_record.size = 0;
+	return TRUE;
+}
+
+// Read back the data covered by a record, and check that it matches
+static BOOL VerifyJournalRecord(HANDLE hDrive, const JOURNAL_RECORD* rec, uint8_t* buf)
+{
+	LARGE_INTEGER li;
+	DWORD size;
+
+	li.QuadPart = rec->offset;
+	if ( (!SetFilePointerEx(hDrive, li, NULL, FILE_BEGIN))
+	  || (!ReadFile(hDrive, buf, rec->size, &size, NULL)) || (size != rec->size)
+	  || (crc32_update(0, buf, size) != rec->crc) ) {
+		uprintf("Data at offset 0x%llx does not match the write journal", rec->offset);
+		return FALSE;
+	}
+	return TRUE;
+}
+
+/*
+ * Open the write journal for the current image and drive. If the journal is from an
+ * interrupted write of the same image to the same drive, check the data that was
+ * written and, if the user agrees, return the offset the write can resume from.
+ * Otherwise, or if resuming is not possible, start a new journal and return 0.
+ */
+uint64_t JournalOpen(const char* image, int compression_type, const char* device_id,
+	uint64_t device_size, DWORD sector_size, HANDLE hDrive)
+{
+	JOURNAL_HEADER hdr, old_hdr;
+	JOURNAL_RECORD* rec = NULL;
+	LARGE_INTEGER li;
+	DWORD size;
+	uint64_t resume = 0, verified = 0;
+	uint32_t i, j, k, nb_records = 0;
+	uint8_t* buf = NULL;
+
+	JournalClose(FALSE);
+	memset(&cur_record, 0, sizeof(cur_record));
+	if ( (device_id == NULL) || (device_id[0] == 0) || (GetTempPathU(sizeof(journal_path), journal_path) == 0)
+	  || (!GetJournalHeader(&hdr, image, compression_type, device_id, device_size, sector_size)) )
+		return 0;
+	safe_strcat(journal_path, sizeof(journal_path), JOURNAL_FILENAME);
+	hJournal = CreateFileU(journal_path, GENERIC_READ|GENERIC_WRITE, FILE_SHARE_READ, NULL,
+		OPEN_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL);
+	if (hJournal == INVALID_HANDLE_VALUE) {
+		uprintf("Could not open write journal '%s': %s", journal_path, WindowsErrorString());
+		return 0;
+	}
+
+	if ( (ReadFile(hJournal, &old_hdr, sizeof(old_hdr), &size, NULL)) && (size == sizeof(old_hdr))
+	  && (GetFileSizeEx(hJournal, &li)) ) {
+		if (memcmp(&old_hdr, &hdr, sizeof(hdr)) != 0) {
+			uprintf("Discarding the journal of a previous write of '%s'", old_hdr.image_path);
+			goto out;
+		}
+		nb_records = (uint32_t)((li.QuadPart - sizeof(hdr)) / sizeof(JOURNAL_RECORD));
+		rec = (JOURNAL_RECORD*)malloc(nb_records * sizeof(JOURNAL_RECORD));
+		buf = (uint8_t*)malloc(JOURNAL_RECORD_SIZE + DD_BUFFER_SIZE);
+		if ( (rec == NULL) || (buf == NULL)
+		  || (!ReadFile(hJournal, rec, nb_records * sizeof(JOURNAL_RECORD), &size, NULL))
+		  || (size != nb_records * sizeof(JOURNAL_RECORD)) ) {
+			nb_records = 0;
+			goto out;
+		}
+		// Ignore anything that doesn't look like the record of a sequential write, such
+		// as what may be left by a crash while the journal was being updated
+		for (i = 0; i < nb_records; i++) {
+			if ( (rec[i].size == 0) || (rec[i].size > JOURNAL_RECORD_SIZE + DD_BUFFER_SIZE)
+			  || (rec[i].size % sector_size != 0) || (rec[i].offset + rec[i].size > device_size)
+			  || ((i > 0) && (rec[i].offset < rec[i - 1].offset + rec[i - 1].size)) )
+				break;
+		}
+		nb_records = i;
+		// Read back the tail of what was written, and resume from the first chunk that doesn't match
+		for (i = nb_records; (i > 0) && (verified < JOURNAL_VERIFY_SIZE); i--) {
+			if (!VerifyJournalRecord(hDrive, &rec[i - 1], buf))
+				nb_records = i - 1;
+			verified += rec[i - 1].size;
+		}
+		// Data that wasn't in a cache can only differ if something else wrote to the drive, in
+		// which case we must start over. The first record must cover the partition table, and
+		// we check it, along with a sample spread over the records that precede the tail.
+		if ((nb_records > 0) && (rec[0].offset != 0)) {
+			uprintf("The write journal does not cover the start of the drive");
+			nb_records = 0;
+		}
+		for (j = 0, k = (uint32_t)-1; (i > 0) && (j < JOURNAL_VERIFY_SAMPLES) && (nb_records > 0); j++) {
+			if ((uint32_t)(((uint64_t)j * i) / JOURNAL_VERIFY_SAMPLES) == k)
+				continue;
+			k = (uint32_t)(((uint64_t)j * i) / JOURNAL_VERIFY_SAMPLES);
+			if (!VerifyJournalRecord(hDrive, &rec[k], buf))
+				nb_records = 0;
+		}
+		if (nb_records > 0)
+			resume = rec[nb_records - 1].offset + rec[nb_records - 1].size;
+		// Resuming leaves the drive as it is, so this must be the user's decision
+		if ( (resume != 0) && (MessageBoxU(hMainDialog, lmprintf(MSG_267, SizeToHumanReadable(resume, FALSE, FALSE)),
+			lmprintf(MSG_266), MB_YESNO|MB_ICONQUESTION|MB_IS_RTL) != IDYES) ) {
+			uprintf("Not resuming the interrupted write of this image, as requested by the user");
+			resume = 0;
+		}
+	}
+
+out:
+	// Drop the records we won't use, or start a new journal
+	li.QuadPart = (resume == 0) ? 0 : sizeof(hdr) + (uint64_t)nb_records * sizeof(JOURNAL_RECORD);
+	if ( (!SetFilePointerEx(hJournal, li, NULL, FILE_BEGIN)) || (!SetEndOfFile(hJournal))
+	  || ((resume == 0) && ((!WriteFile(hJournal, &hdr, sizeof(hdr), &size, NULL)) || (size != sizeof(hdr))))
+	  || (!FlushFileBuffers(hJournal)) ) {
+		uprintf("Could not initialize write journal: %s", WindowsErrorString());
+		safe_closehandle(hJournal);
+		resume = 0;
+	}
+	if (resume != 0)
+		uprintf("Resuming the interrupted write of this image, from offset 0x%llx (%s already written)",
+			resume, SizeToHumanReadable(resume, TRUE, FALSE));
+	free(rec);
+	free(buf);
+	return resume;
+}
+
+// Add data that was just written to the journal
+void JournalRecord(uint64_t offset, const void* buf, DWORD size)
+{
+	if (hJournal == INVALID_HANDLE_VALUE)
+		return;
+	if ( (cur_record.size != 0) && ((offset != cur_record.offset + cur_record.size)
+	  || (cur_record.size + size > JOURNAL_RECORD_SIZE + DD_BUFFER_SIZE)) && (!WriteJournalRecord()) )
+		return;
+	if (cur_record.size == 0) {
+		cur_record.offset = offset;
+		cur_record.crc = 0;
+	}
+	cur_record.crc = crc32_update(cur_record.crc, (const uint8_t*)buf, size);
+	cur_record.size += size;
+	if (cur_record.size >= JOURNAL_RECORD_SIZE)
+		WriteJournalRecord();
+}
+
+// Once the write has completed, we no longer need the journal
+void JournalClose(BOOL completed)
+{
+	if (hJournal == INVALID_HANDLE_VALUE)
+		return;
+	if ((!completed) && (cur_record.size != 0))
+		WriteJournalRecord();
+	safe_closehandle(hJournal);
+	if (completed)
+		DeleteFileU(journal_path);
+}
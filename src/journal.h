@@ -0,0 +1,63 @@
+/*
+ * Rufus: The Reliable USB Formatting Utility
+ * Write journal, for resuming interrupted image writes
+ * Copyright © 2015 Pete Batard <pete@akeo.ie>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <windows.h>
+#include <stdint.h>
+
+#pragma once
+
+#define JOURNAL_MAGIC                   "RUFUSJNL"
+#define JOURNAL_VERSION                 1
+#define JOURNAL_FILENAME                APPLICATION_NAME ".journal"
+#define JOURNAL_RECORD_SIZE             (1024 * 1024)		/* data covered by a single record */
+#define JOURNAL_VERIFY_SIZE             (64 * 1024 * 1024)	/* data at the end we read back before resuming */
+#define JOURNAL_VERIFY_SAMPLES          16					/* records before that we also read back, including the first */
+#define JOURNAL_ID_SAMPLE_SIZE          (64 * 1024)			/* data we hash to identify the source */
+#define JOURNAL_MAX_ID_LENGTH           256
+
+/*
+ * On-disk structures (Little Endian)
+ * The header is followed by the records, that are appended in the order the data
+ * was written to the target, which is always from lower to higher offsets.
+ */
+#pragma pack(push, 1)
+typedef struct {
+	char		magic[8];
+	uint32_t	version;
+	uint32_t	compression_type;
+	uint64_t	image_size;
+	uint64_t	image_time;			/* last write time of the source */
+	uint32_t	image_crc;			/* CRC-32 of the start and end of the source */
+	uint32_t	sector_size;
+	uint64_t	device_size;
+	char		image_path[MAX_PATH];
+	char		device_id[JOURNAL_MAX_ID_LENGTH];
+} JOURNAL_HEADER;
+
+typedef struct {
+	uint64_t	offset;
+	uint32_t	size;
+	uint32_t	crc;				/* CRC-32 of the data written at offset */
+} JOURNAL_RECORD;
+#pragma pack(pop)
+
+uint64_t JournalOpen(const char* image, int compression_type, const char* device_id,
+	uint64_t device_size, DWORD sector_size, HANDLE hDrive);
+void JournalRecord(uint64_t offset, const void* buf, DWORD size);
+void JournalClose(BOOL completed);
@@ -432,7 +432,6 @@ struct logical_vol_desc_s
     udf_long_ad_t fsd_loc;
     udf_Uint8_t   logvol_content_use[16];
   } lvd_use;
-  udf_Uint8_t     logvol_contents_use[16];
   udf_Uint32_t    maptable_len;
   udf_Uint32_t    i_partition_maps;
   udf_regid_t     imp_id;
@@ -473,6 +472,41 @@ struct generic_partition_map2
   udf_Uint8_t   partition_id[62];
 } GNUC_PACKED;
 
+/** Virtual Partition Map (UDF 2.60 2.2.8) */
+struct udf_virtual_partition_map
+{
+  udf_Uint8_t   partition_map_type;
+  udf_Uint8_t   partition_map_length;
+  udf_Uint8_t   reserved1[2];
+  udf_regid_t   partition_type_id;
+  udf_Uint16_t  vol_seq_num;
+  udf_Uint16_t  i_partition;
+  udf_Uint8_t   reserved2[24];
+} GNUC_PACKED;
+
+/** Metadata Partition Map (UDF 2.60 2.2.10) */
+struct udf_metadata_partition_map
+{
+  udf_Uint8_t   partition_map_type;
+  udf_Uint8_t   partition_map_length;
+  udf_Uint8_t   reserved1[2];
+  udf_regid_t   partition_type_id;
+  udf_Uint16_t  vol_seq_num;
+  udf_Uint16_t  i_partition;
+  udf_Uint32_t  metadata_file_loc;
+  udf_Uint32_t  metadata_mirror_file_loc;
+  udf_Uint32_t  metadata_bitmap_file_loc;
+  udf_Uint32_t  alloc_unit_size;
+  udf_Uint16_t  align_unit_size;
+  udf_Uint8_t   flags;
+  udf_Uint8_t   reserved2[5];
+} GNUC_PACKED;
+
+/** Partition Type Identifiers of Type 2 Partition Maps (UDF 2.60 2.2.8-2.2.10) */
+#define UDF_ID_VIRTUAL                  "*UDF Virtual Partition"
+#define UDF_ID_SPARABLE                 "*UDF Sparable Partition"
+#define UDF_ID_METADATA                 "*UDF Metadata Partition"
+
 /** Unallocated Space Descriptor (ECMA 167r3 3/10.8) */
 struct unalloc_space_desc_s
 {
@@ -526,6 +560,7 @@ struct udf_ext_ad_s
   udf_Uint32_t  recorded_len;
   udf_Uint32_t  information_len;
   udf_lb_addr_t ext_loc;
+  udf_Uint8_t   imp_use[2];
 } GNUC_PACKED;
 
 typedef struct udf_ext_ad_s udf_ext_ad_t;
@@ -655,6 +690,10 @@ typedef struct udf_icbtag_s udf_icbtag_t;
                                            single ICB with one direct entry.
                                            This is what's most often used.
                                           */
+#define ICBTAG_STRATEGY_TYPE_4096  0x1000 /**< UDF 2.3.5.1: Direct entry,
+                                           possibly followed by an Indirect
+                                           Entry to a newer ICB (WORM media)
+                                          */
 
 /** File Type (ECMA 167r3 4/14.6.6) 
 
@@ -675,7 +714,11 @@ typedef enum {
   ICBTAG_FILE_TYPE_SOCKET =     0x0A,
   ICBTAG_FILE_TYPE_TE =         0x0B,
   ICBTAG_FILE_TYPE_SYMLINK =    0x0C,
-  ICBTAG_FILE_TYPE_STREAMDIR =  0x0D
+  ICBTAG_FILE_TYPE_STREAMDIR =  0x0D,
+  ICBTAG_FILE_TYPE_VAT20 =      0xF8, /**< UDF 2.00+ Virtual Allocation Table */
+  ICBTAG_FILE_TYPE_METADATA =   0xFA, /**< UDF 2.50+ Metadata File */
+  ICBTAG_FILE_TYPE_MIRROR =     0xFB, /**< UDF 2.50+ Metadata Mirror File */
+  ICBTAG_FILE_TYPE_BITMAP =     0xFC  /**< UDF 2.50+ Metadata Bitmap File */
 } icbtag_file_type_enum_t;
 
 /** Flags (ECMA 167r3 4/14.6.8) */
@@ -506,6 +506,11 @@ typedef struct iso9660_svd_s  iso9660_svd_t;
 
 PRAGMA_END_PACKED
 
+/*! Maximum number of File Sections (extents) we keep track of for a file
+    recorded with ISO_MULTIEXTENT directory records. Each section is at
+    most 4 GB, so this is enough for files of up to 32 GB. */
+#define ISO_MAX_MULTIEXTENT 8
+
 /*! \brief Unix stat-like version of iso9660_dir
 
    The iso9660_stat structure is not part of the ISO-9660
@@ -522,8 +527,12 @@ struct iso9660_stat_s { /* big endian!! */
   struct tm          tm;              /**< time on entry - FIXME merge with
                                          one of entries above, like ctime? */
   lsn_t              lsn;             /**< start logical sector number */
-  uint32_t           size;            /**< total size in bytes */
+  uint32_t           size;            /**< size in bytes of the first extent */
   uint32_t           secsize;         /**< number of sectors allocated */
+  uint64_t           total_size;      /**< total size in bytes */
+  uint32_t           extents;         /**< number of extents (File Sections) */
+  lsn_t              extent_lsn[ISO_MAX_MULTIEXTENT];  /**< per extent start */
+  uint32_t           extent_size[ISO_MAX_MULTIEXTENT]; /**< per extent size */
   iso9660_xa_t       xa;              /**< XA attributes */
   enum { _STAT_FILE = 1, _STAT_DIR = 2 } type;
   bool               b_xa;
@@ -35,6 +35,7 @@ typedef uint16_t partition_num_t;
 /** Opaque structures. */
 typedef struct udf_s udf_t; 
 typedef struct udf_file_s udf_file_t;
+typedef struct udf_extent_s udf_extent_t;
 
 typedef struct udf_dirent_s {
     char              *psz_name;
@@ -45,9 +46,13 @@ typedef struct udf_dirent_s {
     udf_t             *p_udf;
     uint32_t           i_part_start;
     uint32_t           i_loc, i_loc_end;
+    uint16_t           i_loc_part; /* partition map of the directory data */
+    uint16_t           i_fe_part;  /* partition map of the File Entry (fe) */
     uint64_t           dir_left;
     uint8_t           *sector;
     udf_fileid_desc_t *fid;
+    udf_extent_t      *extents;  /* extent map of fe, sorted by file offset */
+    uint32_t           i_extents;
     
     /* This field has to come last because it is variable in length. */
     udf_file_entry_t   fe;
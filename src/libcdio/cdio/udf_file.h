@@ -56,6 +56,13 @@ extern "C" {
   */
   uint64_t udf_get_file_length(const udf_dirent_t *p_udf_dirent);
 
+  /**
+    Return the absolute sector (LSN) where the data of the file starts,
+    provided that it is recorded contiguously on a physical partition.
+    Return CDIO_INVALID_LSN otherwise.
+  */
+  lsn_t udf_get_file_lsn(const udf_dirent_t *p_udf_dirent);
+
   /**  
     Returns a POSIX mode for a given p_udf_dirent.
   */
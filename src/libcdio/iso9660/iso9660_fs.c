@@ -706,9 +706,46 @@ iso9660_iso_seek_read (const iso9660_t *p_iso, void *ptr, lsn_t start,
 
 
 
+/*!
+  Add the File Section described by p_iso9660_dir to the extents of p_stat.
+  Return false if the file has too many extents for us to track, in which
+  case the file cannot be accessed in full and must be treated as an error.
+*/
+static bool
+_iso9660_stat_add_extent (iso9660_stat_t *p_stat,
+			  const iso9660_dir_t *p_iso9660_dir)
+{
+  const lsn_t lsn = from_733 (p_iso9660_dir->extent);
+  const uint32_t size = from_733 (p_iso9660_dir->size);
+
+  if (p_stat->extents >= ISO_MAX_MULTIEXTENT) {
+    cdio_error("File '%s' has more than %d extents", p_stat->filename,
+	       ISO_MAX_MULTIEXTENT);
+    return false;
+  }
+  p_stat->extent_lsn[p_stat->extents]  = lsn;
+  p_stat->extent_size[p_stat->extents] = size;
+  p_stat->total_size += size;
+  p_stat->extents++;
+  return true;
+}
+
+/*!
+  Convert a directory record into a newly allocated iso9660_stat_t.
+
+  Files larger than 4 GB are recorded as several consecutive directory
+  records, all but the last of which have the ISO_MULTIEXTENT flag set.
+  To merge them, pass the iso9660_stat_t that was returned for the
+  previous record as p_stat_last, as long as that record had the flag
+  set: the extent is then appended to p_stat_last, which is returned.
+  If the extent cannot be added, p_stat_last is freed, NULL is returned
+  and, if pb_too_many_extents is not NULL, *pb_too_many_extents is set,
+  so that callers can tell this apart from a record that can be skipped.
+*/
 static iso9660_stat_t *
-_iso9660_dir_to_statbuf (iso9660_dir_t *p_iso9660_dir, bool_3way_t b_xa,
-			 uint8_t u_joliet_level)
+_iso9660_dir_to_statbuf (iso9660_dir_t *p_iso9660_dir,
+			 iso9660_stat_t *p_stat_last, bool_3way_t b_xa,
+			 uint8_t u_joliet_level, bool *pb_too_many_extents)
 {
   uint8_t dir_len= iso9660_get_dir_len(p_iso9660_dir);
   iso711_t i_fname;
@@ -717,6 +754,18 @@ _iso9660_dir_to_statbuf (iso9660_dir_t *p_iso9660_dir, bool_3way_t b_xa,
 
   if (!dir_len) return NULL;
 
+  if (p_stat_last) {
+    /* Subsequent File Sections only add an extent to the file */
+    if (!_iso9660_stat_add_extent(p_stat_last, p_iso9660_dir)) {
+      free(p_stat_last->rr.psz_symlink);
+      free(p_stat_last);
+      if (pb_too_many_extents)
+	*pb_too_many_extents = true;
+      return NULL;
+    }
+    return p_stat_last;
+  }
+
   i_fname  = from_711(p_iso9660_dir->filename.len);
 
   /* .. string in statbuf is one longer than in p_iso9660_dir's listing '\1' */
@@ -733,6 +782,12 @@ _iso9660_dir_to_statbuf (iso9660_dir_t *p_iso9660_dir, bool_3way_t b_xa,
   p_stat->lsn     = from_733 (p_iso9660_dir->extent);
   p_stat->size    = from_733 (p_iso9660_dir->size);
   p_stat->secsize = _cdio_len2blocks (p_stat->size, ISO_BLOCKSIZE);
+  if (!_iso9660_stat_add_extent(p_stat, p_iso9660_dir)) {
+    free(p_stat);
+    if (pb_too_many_extents)
+      *pb_too_many_extents = true;
+    return NULL;
+  }
   p_stat->rr.b3_rock = dunno; /*FIXME should do based on mask */
   p_stat->b_xa    = false;
 
@@ -910,8 +965,8 @@ _fs_stat_root (CdIo_t *p_cdio)
     p_iso9660_dir = &(p_env->pvd.root_directory_record) ;
 #endif
 
-    p_stat = _iso9660_dir_to_statbuf (p_iso9660_dir, b_xa,
-				      p_env->u_joliet_level);
+    p_stat = _iso9660_dir_to_statbuf (p_iso9660_dir, NULL, b_xa,
+				      p_env->u_joliet_level, NULL);
     return p_stat;
   }
 
@@ -931,8 +986,8 @@ _ifs_stat_root (iso9660_t *p_iso)
   p_iso9660_dir = &(p_iso->pvd.root_directory_record) ;
 #endif
 
-  p_stat = _iso9660_dir_to_statbuf (p_iso9660_dir, p_iso->b_xa,
-				    p_iso->u_joliet_level);
+  p_stat = _iso9660_dir_to_statbuf (p_iso9660_dir, NULL, p_iso->b_xa,
+				    p_iso->u_joliet_level, NULL);
   return p_stat;
 }
 
@@ -942,7 +997,7 @@ _fs_stat_traverse (const CdIo_t *p_cdio, const iso9660_stat_t *_root,
 {
   unsigned offset = 0;
   uint8_t *_dirbuf = NULL;
-  iso9660_stat_t *p_stat;
+  iso9660_stat_t *p_stat, *p_iso9660_stat = NULL;
   generic_img_private_t *p_env = (generic_img_private_t *) p_cdio->env;
 
   if (!splitpath[0])
@@ -975,7 +1030,6 @@ _fs_stat_traverse (const CdIo_t *p_cdio, const iso9660_stat_t *_root,
   while (offset < (_root->secsize * ISO_BLOCKSIZE))
     {
       iso9660_dir_t *p_iso9660_dir = (void *) &_dirbuf[offset];
-      iso9660_stat_t *p_iso9660_stat;
       int cmp;
 
       if (!iso9660_get_dir_len(p_iso9660_dir))
@@ -984,8 +1038,17 @@ _fs_stat_traverse (const CdIo_t *p_cdio, const iso9660_stat_t *_root,
 	  continue;
 	}
 
-      p_iso9660_stat = _iso9660_dir_to_statbuf (p_iso9660_dir, dunno,
-					p_env->u_joliet_level);
+      p_iso9660_stat = _iso9660_dir_to_statbuf (p_iso9660_dir, p_iso9660_stat,
+					dunno, p_env->u_joliet_level, NULL);
+      if (!p_iso9660_stat) {
+	free (_dirbuf);
+	return NULL;
+      }
+      if (p_iso9660_dir->file_flags & ISO_MULTIEXTENT) {
+	/* Wait for the last File Section before looking at the name */
+	offset += iso9660_get_dir_len(p_iso9660_dir);
+	continue;
+      }
 
       cmp = strcmp(splitpath[0], p_iso9660_stat->filename);
 
@@ -1020,12 +1083,19 @@ _fs_stat_traverse (const CdIo_t *p_cdio, const iso9660_stat_t *_root,
 
       free(p_iso9660_stat->rr.psz_symlink);
       free(p_iso9660_stat);
+      p_iso9660_stat = NULL;
 
       offset += iso9660_get_dir_len(p_iso9660_dir);
     }
 
   cdio_assert (offset == (_root->secsize * ISO_BLOCKSIZE));
 
+  /* A dangling multi-extent record */
+  if (p_iso9660_stat) {
+    free(p_iso9660_stat->rr.psz_symlink);
+    free(p_iso9660_stat);
+  }
+
   /* not found */
   free (_dirbuf);
   return NULL;
@@ -1037,6 +1107,7 @@ _fs_iso_stat_traverse (iso9660_t *p_iso, const iso9660_stat_t *_root,
 {
   unsigned offset = 0;
   uint8_t *_dirbuf = NULL;
+  iso9660_stat_t *p_stat = NULL;
   int ret;
 
   if (!splitpath[0])
@@ -1074,7 +1145,6 @@ _fs_iso_stat_traverse (iso9660_t *p_iso, const iso9660_stat_t *_root,
   while (offset < (_root->secsize * ISO_BLOCKSIZE))
     {
       iso9660_dir_t *p_iso9660_dir = (void *) &_dirbuf[offset];
-      iso9660_stat_t *p_stat;
       int cmp;
 
       if (!iso9660_get_dir_len(p_iso9660_dir))
@@ -1083,8 +1153,17 @@ _fs_iso_stat_traverse (iso9660_t *p_iso, const iso9660_stat_t *_root,
 	  continue;
 	}
 
-      p_stat = _iso9660_dir_to_statbuf (p_iso9660_dir, p_iso->b_xa,
-					p_iso->u_joliet_level);
+      p_stat = _iso9660_dir_to_statbuf (p_iso9660_dir, p_stat, p_iso->b_xa,
+					p_iso->u_joliet_level, NULL);
+      if (!p_stat) {
+	free (_dirbuf);
+	return NULL;
+      }
+      if (p_iso9660_dir->file_flags & ISO_MULTIEXTENT) {
+	/* Wait for the last File Section before looking at the name */
+	offset += iso9660_get_dir_len(p_iso9660_dir);
+	continue;
+      }
 
       cmp = strcmp(splitpath[0], p_stat->filename);
 
@@ -1119,12 +1198,19 @@ _fs_iso_stat_traverse (iso9660_t *p_iso, const iso9660_stat_t *_root,
 
       free(p_stat->rr.psz_symlink);
       free(p_stat);
+      p_stat = NULL;
 
       offset += iso9660_get_dir_len(p_iso9660_dir);
     }
 
   cdio_assert (offset == (_root->secsize * ISO_BLOCKSIZE));
 
+  /* A dangling multi-extent record */
+  if (p_stat) {
+    free(p_stat->rr.psz_symlink);
+    free(p_stat);
+  }
+
   /* not found */
   free (_dirbuf);
   return NULL;
@@ -1265,6 +1351,8 @@ iso9660_fs_readdir (CdIo_t *p_cdio, const char psz_path[], bool b_mode2)
   {
     unsigned offset = 0;
     uint8_t *_dirbuf = NULL;
+    iso9660_stat_t *p_iso9660_stat = NULL;
+    bool b_too_many_extents = false;
     CdioList_t *retval = _cdio_list_new ();
 
     _dirbuf = calloc(1, p_stat->secsize * ISO_BLOCKSIZE);
@@ -1284,7 +1372,6 @@ iso9660_fs_readdir (CdIo_t *p_cdio, const char psz_path[], bool b_mode2)
     while (offset < (p_stat->secsize * ISO_BLOCKSIZE))
       {
 	iso9660_dir_t *p_iso9660_dir = (void *) &_dirbuf[offset];
-	iso9660_stat_t *p_iso9660_stat;
 
 	if (!iso9660_get_dir_len(p_iso9660_dir))
 	  {
@@ -1292,13 +1379,29 @@ iso9660_fs_readdir (CdIo_t *p_cdio, const char psz_path[], bool b_mode2)
 	    continue;
 	  }
 
-	p_iso9660_stat = _iso9660_dir_to_statbuf(p_iso9660_dir, dunno,
-						 p_env->u_joliet_level);
-	_cdio_list_append (retval, p_iso9660_stat);
+	p_iso9660_stat = _iso9660_dir_to_statbuf(p_iso9660_dir, p_iso9660_stat,
+						 dunno, p_env->u_joliet_level,
+						 &b_too_many_extents);
+	/* Don't return a listing with a truncated file, but keep skipping
+	   the other records we can't use */
+	if (b_too_many_extents) {
+	  free (_dirbuf);
+	  free (p_stat);
+	  _cdio_list_free (retval, true);
+	  return NULL;
+	}
+	/* Merge the File Sections of multi-extent files into one entry */
+	if (p_iso9660_stat && !(p_iso9660_dir->file_flags & ISO_MULTIEXTENT)) {
+	  _cdio_list_append (retval, p_iso9660_stat);
+	  p_iso9660_stat = NULL;
+	}
 
 	offset += iso9660_get_dir_len(p_iso9660_dir);
       }
 
+    if (p_iso9660_stat)
+      _cdio_list_append (retval, p_iso9660_stat);
+
     cdio_assert (offset == (p_stat->secsize * ISO_BLOCKSIZE));
 
     free (_dirbuf);
@@ -1332,6 +1435,8 @@ iso9660_ifs_readdir (iso9660_t *p_iso, const char psz_path[])
     long int ret;
     unsigned offset = 0;
     uint8_t *_dirbuf = NULL;
+    iso9660_stat_t *p_iso9660_stat = NULL;
+    bool b_too_many_extents = false;
     CdioList_t *retval = _cdio_list_new ();
 
     _dirbuf = calloc(1, p_stat->secsize * ISO_BLOCKSIZE);
@@ -1353,7 +1458,6 @@ iso9660_ifs_readdir (iso9660_t *p_iso, const char psz_path[])
     while (offset < (p_stat->secsize * ISO_BLOCKSIZE))
       {
 	iso9660_dir_t *p_iso9660_dir = (void *) &_dirbuf[offset];
-	iso9660_stat_t *p_iso9660_stat;
 
 	if (!iso9660_get_dir_len(p_iso9660_dir))
 	  {
@@ -1361,15 +1465,31 @@ iso9660_ifs_readdir (iso9660_t *p_iso, const char psz_path[])
 	    continue;
 	  }
 
-	p_iso9660_stat = _iso9660_dir_to_statbuf(p_iso9660_dir, p_iso->b_xa,
-						 p_iso->u_joliet_level);
+	p_iso9660_stat = _iso9660_dir_to_statbuf(p_iso9660_dir, p_iso9660_stat,
+						 p_iso->b_xa,
+						 p_iso->u_joliet_level,
+						 &b_too_many_extents);
+	/* Don't return a listing with a truncated file, but keep skipping
+	   the other records we can't use */
+	if (b_too_many_extents) {
+	  free (_dirbuf);
+	  free (p_stat->rr.psz_symlink);
+	  free (p_stat);
+	  _cdio_list_free (retval, true);
+	  return NULL;
+	}
 
-	if (p_iso9660_stat)
+	/* Merge the File Sections of multi-extent files into one entry */
+	if (p_iso9660_stat && !(p_iso9660_dir->file_flags & ISO_MULTIEXTENT)) {
 	  _cdio_list_append (retval, p_iso9660_stat);
+	  p_iso9660_stat = NULL;
+	}
 
 	offset += iso9660_get_dir_len(p_iso9660_dir);
       }
 
+    if (p_iso9660_stat)
+      _cdio_list_append (retval, p_iso9660_stat);
     free (_dirbuf);
 
     if (offset != (p_stat->secsize * ISO_BLOCKSIZE)) {
@@ -1574,8 +1694,8 @@ iso_have_rr_traverse (iso9660_t *p_iso, const iso9660_stat_t *_root,
 	  continue;
 	}
 
-      p_stat = _iso9660_dir_to_statbuf (p_iso9660_dir, p_iso->b_xa,
-					p_iso->u_joliet_level);
+      p_stat = _iso9660_dir_to_statbuf (p_iso9660_dir, NULL, p_iso->b_xa,
+					p_iso->u_joliet_level, NULL);
       have_rr = p_stat->rr.b3_rock;
       if ( have_rr != yep) {
 	have_rr = iso_have_rr_traverse (p_iso, p_stat, &splitpath[1], pu_file_limit);
@@ -26,6 +26,10 @@
 # include <string.h>
 #endif
 
+#ifdef HAVE_STDLIB_H
+# include <stdlib.h>
+#endif
+
 #ifdef HAVE_STDIO_H
 #include <stdio.h>  /* Remove when adding cdio/logging.h */
 #endif
@@ -35,9 +39,6 @@
 #define MIN(a, b) (a<b) ? (a) : (b)
 #define CEILING(x, y) ((x+(y-1))/y)
 
-#define	GETICB(offset)	\
-	&p_udf_fe->u.alloc_descs[offset]
-
 const char *
 udf_get_filename(const udf_dirent_t *p_udf_dirent)
 {
@@ -104,120 +105,200 @@ udf_is_dir(const udf_dirent_t *p_udf_dirent)
   return p_udf_dirent->b_dir;
 }
 
-/*
- * Translate a file offset into a logical block and then into a physical
- * block.
- */
-static lba_t
-offset_to_lba(const udf_dirent_t *p_udf_dirent, off_t i_offset, 
-	      /*out*/ lba_t *pi_lba, /*out*/ uint32_t *pi_max_size)
+/* Upper bound on the number of Allocation Extent Descriptors we follow for
+   a single file, so that a looping chain can't keep us busy forever. */
+#define UDF_MAX_AED_CHAIN 65536
+
+static bool
+udf_add_extent(udf_extent_t **pp_extents, uint32_t *pi_extents,
+	       uint32_t *pi_alloc, uint64_t i_offset, uint32_t i_len,
+	       uint32_t i_lba, uint16_t i_part_ref, uint8_t i_type)
 {
-  udf_t *p_udf = p_udf_dirent->p_udf;
-  const udf_file_entry_t *p_udf_fe = (udf_file_entry_t *) 
-    &p_udf_dirent->fe;
-  const udf_icbtag_t *p_icb_tag = &p_udf_fe->icb_tag;
-  const uint16_t strat_type= uint16_from_le(p_icb_tag->strat_type);
+  udf_extent_t *p_ext;
 
-  if (i_offset < 0) {
-    cdio_warn("Negative offset value");
-    return CDIO_INVALID_LBA;
+  if (*pi_extents >= *pi_alloc) {
+    uint32_t i_alloc = (*pi_alloc == 0) ? 8 : 2 * *pi_alloc;
+    p_ext = (udf_extent_t *) realloc(*pp_extents,
+				     i_alloc * sizeof(udf_extent_t));
+    if (!p_ext) return false;
+    *pp_extents = p_ext;
+    *pi_alloc = i_alloc;
   }
+  p_ext = &(*pp_extents)[(*pi_extents)++];
+  p_ext->i_offset   = i_offset;
+  p_ext->i_len      = i_len;
+  p_ext->i_lba      = i_lba;
+  p_ext->i_part_ref = i_part_ref;
+  p_ext->i_type     = i_type;
+  return true;
+}
 
-  switch (strat_type) {
-  case 4096:
-    cdio_warn("Cannot deal with strategy4096 yet!");
-    return CDIO_INVALID_LBA;
+/*!
+  Build the extent map of the data described by File Entry p_udf_fe,
+  recorded in partition map i_fe_part. Short, long and extended
+  allocation descriptors are supported, as well as data embedded in
+  the File Entry and chains of Allocation Extent Descriptors. Since
+  allocation descriptors are recorded in file order, the resulting
+  extents are sorted by offset.
+
+  The map is returned in *pp_extents, and must be freed by the caller.
+  Returns false on error, in which case *pp_extents is NULL.
+*/
+bool
+udf_get_extents(const udf_t *p_udf, const udf_file_entry_t *p_udf_fe,
+		uint16_t i_fe_part, /*out*/ udf_extent_t **pp_extents,
+		/*out*/ uint32_t *pi_extents)
+{
+  const uint16_t strat_type = uint16_from_le(p_udf_fe->icb_tag.strat_type);
+  const uint16_t addr_ilk =
+    uint16_from_le(p_udf_fe->icb_tag.flags) & ICBTAG_FLAG_AD_MASK;
+  const uint32_t i_ea = uint32_from_le(p_udf_fe->i_extended_attr);
+  uint32_t i_ad = uint32_from_le(p_udf_fe->i_alloc_descs);
+  const uint8_t *p_ad;
+  uint8_t aed[UDF_BLOCKSIZE];
+  uint32_t i_ad_size, i_off = 0, i_alloc = 0, i_chain = 0;
+  uint64_t i_offset = 0;
+
+  *pp_extents = NULL;
+  *pi_extents = 0;
+
+  if (strat_type != ICBTAG_STRATEGY_TYPE_4
+      && strat_type != ICBTAG_STRATEGY_TYPE_4096) {
+    cdio_warn("Unknown strategy type %d", strat_type);
+    return false;
+  }
+  if (i_ea > sizeof(p_udf_fe->u) || i_ad > sizeof(p_udf_fe->u) - i_ea) {
+    cdio_warn("Invalid allocation descriptors length");
+    return false;
+  }
+  p_ad = p_udf_fe->u.ext_attr + i_ea;
+
+  switch (addr_ilk) {
+  case ICBTAG_FLAG_AD_IN_ICB:
+    /* The file data is stored in the allocation descriptor field */
+    if (i_ad == 0)
+      return true;
+    return udf_add_extent(pp_extents, pi_extents, &i_alloc, 0, i_ad, i_ea,
+			  i_fe_part, UDF_EXTENT_EMBEDDED);
+  case ICBTAG_FLAG_AD_SHORT:
+    i_ad_size = sizeof(udf_short_ad_t);
     break;
-  case ICBTAG_STRATEGY_TYPE_4:
-    {
-      off_t icblen = 0;
-      uint64_t lsector;
-      int ad_offset, ad_num = 0;
-      uint16_t addr_ilk = uint16_from_le(p_icb_tag->flags&ICBTAG_FLAG_AD_MASK);
-      
-      switch (addr_ilk) {
-      case ICBTAG_FLAG_AD_SHORT: 
-	{
-	  udf_short_ad_t *p_icb;
-	  /*
-	   * The allocation descriptor field is filled with short_ad's.
-	   * If the offset is beyond the current extent, look for the
-	   * next extent.
-	   */
-	  do {
-	    i_offset -= icblen;
-	    ad_offset = sizeof(udf_short_ad_t) * ad_num;
-	    if (ad_offset > uint32_from_le(p_udf_fe->i_alloc_descs)) {
-	      cdio_warn("File offset out of bounds");
-	      return CDIO_INVALID_LBA;
-	    }
-	    p_icb = (udf_short_ad_t *) 
-	      GETICB( uint32_from_le(p_udf_fe->i_extended_attr) 
-		      + ad_offset );
-	    icblen = p_icb->len;
-	    ad_num++;
-	  } while(i_offset >= icblen);
-	  
-	  lsector = (i_offset / UDF_BLOCKSIZE) + p_icb->pos;
-	  
-	  *pi_max_size = p_icb->len;
-	}
-	break;
-      case ICBTAG_FLAG_AD_LONG: 
-	{
-	  /*
-	   * The allocation descriptor field is filled with long_ad's
-	   * If the i_offset is beyond the current extent, look for the
-	   * next extent.
-	   */
-	  udf_long_ad_t *p_icb;
-	  do {
-	    i_offset -= icblen;
-	    ad_offset = sizeof(udf_long_ad_t) * ad_num;
-	    if (ad_offset > uint32_from_le(p_udf_fe->i_alloc_descs)) {
-	      cdio_warn("File offset out of bounds");
-	      return CDIO_INVALID_LBA;
-	    }
-	    p_icb = (udf_long_ad_t *) 
-	      GETICB( uint32_from_le(p_udf_fe->i_extended_attr)
-		      + ad_offset );
-	    icblen = p_icb->len;
-	    ad_num++;
-	  } while(i_offset >= icblen);
-	
-	  lsector = (i_offset / UDF_BLOCKSIZE) +
-	    uint32_from_le(((udf_long_ad_t *)(p_icb))->loc.lba);
-	  
-	  *pi_max_size = p_icb->len;
-	}
-	break;
-      case ICBTAG_FLAG_AD_IN_ICB:
-	/*
-	 * This type means that the file *data* is stored in the
-	 * allocation descriptor field of the file entry.
-	 */
-	*pi_max_size = 0;
-	cdio_warn("Don't know how to data in ICB handle yet");
-	return CDIO_INVALID_LBA;
-      case ICBTAG_FLAG_AD_EXTENDED:
-	cdio_warn("Don't know how to handle extended addresses yet");
-	return CDIO_INVALID_LBA;
-      default:
-	cdio_warn("Unsupported allocation descriptor %d", addr_ilk);
-	return CDIO_INVALID_LBA;
+  case ICBTAG_FLAG_AD_LONG:
+    i_ad_size = sizeof(udf_long_ad_t);
+    break;
+  case ICBTAG_FLAG_AD_EXTENDED:
+    i_ad_size = sizeof(udf_ext_ad_t);
+    break;
+  default:
+    cdio_warn("Unsupported allocation descriptor %d", addr_ilk);
+    return false;
+  }
+
+  while (i_off + i_ad_size <= i_ad) {
+    uint32_t i_len, i_lba;
+    uint16_t i_part_ref;
+
+    switch (addr_ilk) {
+    case ICBTAG_FLAG_AD_SHORT:
+      {
+	const udf_short_ad_t *p_sad = (const udf_short_ad_t *) (p_ad + i_off);
+	i_len = uint32_from_le(p_sad->len);
+	i_lba = uint32_from_le(p_sad->pos);
+	/* short_ad's refer to the partition of the File Entry */
+	i_part_ref = i_fe_part;
       }
+      break;
+    case ICBTAG_FLAG_AD_LONG:
+      {
+	const udf_long_ad_t *p_lad = (const udf_long_ad_t *) (p_ad + i_off);
+	i_len = uint32_from_le(p_lad->len);
+	i_lba = uint32_from_le(p_lad->loc.lba);
+	i_part_ref = uint16_from_le(p_lad->loc.partitionReferenceNum);
+      }
+      break;
+    default:
+      {
+	const udf_ext_ad_t *p_ead = (const udf_ext_ad_t *) (p_ad + i_off);
+	i_len = uint32_from_le(p_ead->len);
+	i_lba = uint32_from_le(p_ead->ext_loc.lba);
+	i_part_ref = uint16_from_le(p_ead->ext_loc.partitionReferenceNum);
+      }
+      break;
+    }
+    i_off += i_ad_size;
+
+    /* A zero length descriptor terminates the list */
+    if ((i_len & UDF_LENGTH_MASK) == 0)
+      break;
 
-      *pi_lba = (lba_t)lsector + p_udf->i_part_start;
-      if (*pi_lba < 0) {
-	cdio_warn("Negative LBA value");
-	return CDIO_INVALID_LBA;
+    switch (i_len & ~UDF_LENGTH_MASK) {
+    case EXT_NEXT_EXTENT_ALLOCDECS:
+      {
+	/* The list continues in an Allocation Extent Descriptor */
+	const struct allocExtDesc *p_aed = (const struct allocExtDesc *) aed;
+
+	if (++i_chain > UDF_MAX_AED_CHAIN
+	    || DRIVER_OP_SUCCESS != udf_read_logical(p_udf, aed, i_part_ref,
+						     i_lba, 1)
+	    || udf_checktag(&p_aed->tag, TAGID_AED)) {
+	  cdio_warn("Invalid Allocation Extent Descriptor at block %u",
+		    (unsigned int) i_lba);
+	  goto error;
+	}
+	i_ad = uint32_from_le(p_aed->i_alloc_descs);
+	if (i_ad > UDF_BLOCKSIZE - sizeof(struct allocExtDesc))
+	  i_ad = UDF_BLOCKSIZE - sizeof(struct allocExtDesc);
+	p_ad = aed + sizeof(struct allocExtDesc);
+	i_off = 0;
       }
-      return *pi_lba;
+      break;
+    case EXT_RECORDED_ALLOCATED:
+      if (!udf_add_extent(pp_extents, pi_extents, &i_alloc, i_offset,
+			  i_len & UDF_LENGTH_MASK, i_lba, i_part_ref,
+			  UDF_EXTENT_RECORDED))
+	goto error;
+      i_offset += i_len & UDF_LENGTH_MASK;
+      break;
+    default:
+      /* Extents that are not recorded read back as zeroes */
+      if (!udf_add_extent(pp_extents, pi_extents, &i_alloc, i_offset,
+			  i_len & UDF_LENGTH_MASK, 0, i_part_ref,
+			  UDF_EXTENT_UNRECORDED))
+	goto error;
+      i_offset += i_len & UDF_LENGTH_MASK;
+      break;
     }
-  default:
-    cdio_warn("Unknown strategy type %d", strat_type);
-    return DRIVER_OP_ERROR;
   }
+  return true;
+
+ error:
+  free(*pp_extents);
+  *pp_extents = NULL;
+  *pi_extents = 0;
+  return false;
+}
+
+/*
+ * Return the extent that holds offset i_offset of the file, or NULL if the
+ * offset lies beyond the recorded extents.
+ */
+static const udf_extent_t *
+udf_find_extent(const udf_dirent_t *p_udf_dirent, uint64_t i_offset)
+{
+  uint32_t i_lo = 0, i_hi = p_udf_dirent->i_extents;
+
+  while (i_lo < i_hi) {
+    const uint32_t i_mid = i_lo + (i_hi - i_lo) / 2;
+    const udf_extent_t *p_ext = &p_udf_dirent->extents[i_mid];
+
+    if (i_offset < p_ext->i_offset)
+      i_hi = i_mid;
+    else if (i_offset >= p_ext->i_offset + p_ext->i_len)
+      i_lo = i_mid + 1;
+    else
+      return p_ext;
+  }
+  return NULL;
 }
 
 /**
@@ -229,8 +310,10 @@ offset_to_lba(const udf_dirent_t *p_udf_dirent, off_t i_offset,
   If count is zero, read() returns zero and has no other results. If
   count is greater than SSIZE_MAX, the result is unspecified.
 
-  It is the caller's responsibility to ensure that count is less
-  than the number of blocks recorded via p_udf_dirent.
+  A single call may span several extents. Reading stops early at the
+  end of the last extent, or at the end of an extent whose length is
+  not a multiple of UDF_BLOCKSIZE, so the number of bytes returned may
+  be smaller than count blocks.
 
   If there is an error, cast the result to driver_return_code_t for 
   the specific error code.
@@ -238,30 +321,103 @@ offset_to_lba(const udf_dirent_t *p_udf_dirent, off_t i_offset,
 ssize_t
 udf_read_block(const udf_dirent_t *p_udf_dirent, void * buf, size_t count)
 {
+  udf_t *p_udf;
+  const udf_extent_t *p_ext, *p_end;
+  uint8_t *p_buf = (uint8_t *) buf;
+  uint64_t i_size, i_done = 0;
+
   if (count == 0) return 0;
-  else {
-    driver_return_code_t ret;
-    uint32_t i_max_size=0;
-    udf_t *p_udf = p_udf_dirent->p_udf;
-    lba_t i_lba = offset_to_lba(p_udf_dirent, p_udf->i_position, &i_lba, 
-				&i_max_size);
-    if (i_lba != CDIO_INVALID_LBA) {
-      uint32_t i_max_blocks = CEILING(i_max_size, UDF_BLOCKSIZE);
-      if ( i_max_blocks < count ) {
-	  cdio_warn("read count %u is larger than %u extent size.",
-		  (unsigned int)count, i_max_blocks);
-	  cdio_warn("read count truncated to %u", (unsigned int)count);
-	  count = i_max_blocks;
-      }
-      ret = udf_read_sectors(p_udf, buf, i_lba, count);
-      if (DRIVER_OP_SUCCESS == ret) {
-	ssize_t i_read_len = MIN(i_max_size, count * UDF_BLOCKSIZE);
-	p_udf->i_position += i_read_len;
-	return i_read_len;
+  p_udf = p_udf_dirent->p_udf;
+  if (p_udf->i_position < 0) {
+    cdio_warn("Negative offset value");
+    return DRIVER_OP_ERROR;
+  }
+  p_ext = udf_find_extent(p_udf_dirent, (uint64_t) p_udf->i_position);
+  if (!p_ext) {
+    cdio_warn("File offset out of bounds");
+    return DRIVER_OP_ERROR;
+  }
+  p_end = &p_udf_dirent->extents[p_udf_dirent->i_extents];
+  i_size = (uint64_t) count * UDF_BLOCKSIZE;
+
+  for (; p_ext < p_end && i_done < i_size; p_ext++) {
+    const uint64_t i_skip = (uint64_t) p_udf->i_position + i_done
+      - p_ext->i_offset;
+    uint32_t i_len = p_ext->i_len - (uint32_t) i_skip;
+
+    if (i_len > i_size - i_done)
+      i_len = (uint32_t) (i_size - i_done);
+    switch (p_ext->i_type) {
+    case UDF_EXTENT_RECORDED:
+      {
+	driver_return_code_t ret;
+	if (i_skip % UDF_BLOCKSIZE) {
+	  cdio_warn("Unaligned read in extent at block %u",
+		    (unsigned int) p_ext->i_lba);
+	  return DRIVER_OP_ERROR;
+	}
+	ret = udf_read_logical(p_udf, p_buf + i_done, p_ext->i_part_ref,
+			       p_ext->i_lba + (uint32_t) (i_skip / UDF_BLOCKSIZE),
+			       CEILING(i_len, UDF_BLOCKSIZE));
+	if (DRIVER_OP_SUCCESS != ret) return ret;
       }
-      return ret;
-    } else {
-      return DRIVER_OP_ERROR;
+      break;
+    case UDF_EXTENT_EMBEDDED:
+      memcpy(p_buf + i_done,
+	     p_udf_dirent->fe.u.ext_attr + p_ext->i_lba + i_skip, i_len);
+      break;
+    default:
+      memset(p_buf + i_done, 0, i_len);
+      break;
     }
+    i_done += i_len;
+    /* Only carry on with the next extent if we stayed block aligned */
+    if (i_done % UDF_BLOCKSIZE)
+      break;
   }
+
+  p_udf->i_position += (off_t) i_done;
+  return (ssize_t) i_done;
+}
+
+/*!
+  Return the absolute sector where the data of the file starts, provided
+  that its extents are contiguous and on a physical partition, or
+  CDIO_INVALID_LSN otherwise.
+*/
+lsn_t
+udf_get_file_lsn(const udf_dirent_t *p_udf_dirent)
+{
+  const udf_extent_t *p_ext;
+  uint64_t i_length;
+  uint32_t i;
+  udf_t *p_udf;
+
+  if (!p_udf_dirent || p_udf_dirent->i_extents == 0) return CDIO_INVALID_LSN;
+  p_udf = p_udf_dirent->p_udf;
+  i_length = udf_get_file_length(p_udf_dirent);
+  if (i_length == 0) return CDIO_INVALID_LSN;
+
+  /* Check that each extent follows the previous one on the media */
+  p_ext = p_udf_dirent->extents;
+  for (i = 0; i < p_udf_dirent->i_extents
+	 && p_udf_dirent->extents[i].i_offset < i_length; i++) {
+    const udf_extent_t *p_cur = &p_udf_dirent->extents[i];
+    if (p_cur->i_type != UDF_EXTENT_RECORDED
+	|| p_cur->i_part_ref != p_ext->i_part_ref
+	|| p_cur->i_offset % UDF_BLOCKSIZE
+	|| (uint64_t) p_cur->i_lba
+	   != p_ext->i_lba + p_cur->i_offset / UDF_BLOCKSIZE)
+      return CDIO_INVALID_LSN;
+  }
+  /* The extents must cover the whole file */
+  p_ext = &p_udf_dirent->extents[i - 1];
+  if (p_ext->i_offset + p_ext->i_len < i_length)
+    return CDIO_INVALID_LSN;
+  p_ext = p_udf_dirent->extents;
+  if ((p_ext->i_part_ref < p_udf->i_part_maps)
+      && (p_udf->part_type[p_ext->i_part_ref] != UDF_PART_PHYSICAL))
+    return CDIO_INVALID_LSN;
+
+  return (lsn_t)(p_udf->i_part_start + p_ext->i_lba);
 }
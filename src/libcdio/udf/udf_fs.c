@@ -123,7 +123,8 @@ const char VSD_STD_ID_TEA01[] = {'T', 'E', 'A', '0', '1'};
 
 static udf_dirent_t *
 udf_new_dirent(udf_file_entry_t *p_udf_fe, udf_t *p_udf,
-	       const char *psz_name, bool b_dir, bool b_parent);
+	       const char *psz_name, bool b_dir, bool b_parent,
+	       uint16_t i_fe_part);
 
 /**
  * Check the descriptor tag for both the correct id and correct checksum.
@@ -261,13 +262,13 @@ udf_fopen(udf_dirent_t *p_udf_root, const char *psz_name)
       udf_dirent_t *p_udf_dirent =
 	udf_new_dirent(&p_udf_root->fe, p_udf_root->p_udf,
 		       p_udf_root->psz_name, p_udf_root->b_dir,
-		       p_udf_root->b_parent);
+		       p_udf_root->b_parent, p_udf_root->i_fe_part);
       p_udf_file = udf_ff_traverse(p_udf_dirent, psz_token);
     }
     else if ( 0 == strncmp("/", psz_name, sizeof("/")) ) {
       return udf_new_dirent(&p_udf_root->fe, p_udf_root->p_udf,
 			    p_udf_root->psz_name, p_udf_root->b_dir,
-			    p_udf_root->b_parent);
+			    p_udf_root->b_parent, p_udf_root->i_fe_part);
     }
   }
   return p_udf_file;
@@ -304,7 +305,8 @@ unicode16_decode(const uint8_t *data, int i_len)
 
 static udf_dirent_t *
 udf_new_dirent(udf_file_entry_t *p_udf_fe, udf_t *p_udf,
-	       const char *psz_name, bool b_dir, bool b_parent)
+	       const char *psz_name, bool b_dir, bool b_parent,
+	       uint16_t i_fe_part)
 {
   udf_dirent_t *p_udf_dirent = (udf_dirent_t *)
     calloc(1, sizeof(udf_dirent_t));
@@ -321,6 +323,18 @@ udf_new_dirent(udf_file_entry_t *p_udf_fe, udf_t *p_udf,
 	 sizeof(udf_file_entry_t));
   udf_get_lba( p_udf_fe, &(p_udf_dirent->i_loc),
 	       &(p_udf_dirent->i_loc_end) );
+
+  /* short_ad's refer to the partition the File Entry is recorded in */
+  p_udf_dirent->i_fe_part  = i_fe_part;
+  p_udf_dirent->i_loc_part = i_fe_part;
+  if ((p_udf_fe->icb_tag.flags & ICBTAG_FLAG_AD_MASK) == ICBTAG_FLAG_AD_LONG
+      && p_udf_fe->i_alloc_descs) {
+    udf_long_ad_t *p_ad = (udf_long_ad_t *)
+      (p_udf_fe->u.ext_attr + p_udf_fe->i_extended_attr);
+    p_udf_dirent->i_loc_part = uint16_from_le(p_ad->loc.partitionReferenceNum);
+  }
+  udf_get_extents(p_udf, p_udf_fe, i_fe_part, &p_udf_dirent->extents,
+		  &p_udf_dirent->i_extents);
   return p_udf_dirent;
 }
 
@@ -358,6 +372,149 @@ udf_read_sectors (const udf_t *p_udf, void *ptr, lsn_t i_start,
   }
 }
 
+/*!
+  Read i_blocks logical blocks, starting at i_lba, from the partition
+  referenced by partition map i_part_ref. Metadata partition blocks are
+  served from the in-memory copy of the Metadata File, and virtual
+  partition blocks are translated one by one through the VAT.
+*/
+driver_return_code_t
+udf_read_logical(const udf_t *p_udf, void *ptr, uint16_t i_part_ref,
+		 uint32_t i_lba, long i_blocks)
+{
+  long i;
+
+  if (!p_udf) return 0;
+  if (i_blocks <= 0) return DRIVER_OP_SUCCESS;
+  switch ((i_part_ref < p_udf->i_part_maps) ?
+	  p_udf->part_type[i_part_ref] : UDF_PART_PHYSICAL) {
+  case UDF_PART_METADATA:
+    if (!p_udf->metadata
+	|| (uint64_t)i_lba + i_blocks > p_udf->i_meta_blocks) {
+      cdio_warn("Metadata block %u is out of range", (unsigned int)i_lba);
+      return DRIVER_OP_ERROR;
+    }
+    memcpy(ptr, p_udf->metadata + (size_t)i_lba * UDF_BLOCKSIZE,
+	   (size_t)i_blocks * UDF_BLOCKSIZE);
+    return DRIVER_OP_SUCCESS;
+  case UDF_PART_VIRTUAL:
+    for (i = 0; i < i_blocks; i++) {
+      driver_return_code_t ret;
+      if ((uint64_t)i_lba + i >= p_udf->i_vat_entries
+	  || p_udf->vat[i_lba + i] == 0xFFFFFFFF) {
+	cdio_warn("Virtual block %u is not mapped", (unsigned int)(i_lba + i));
+	return DRIVER_OP_ERROR;
+      }
+      ret = udf_read_sectors(p_udf, (uint8_t *)ptr + i * UDF_BLOCKSIZE,
+			     p_udf->i_part_start + p_udf->vat[i_lba + i], 1);
+      if (DRIVER_OP_SUCCESS != ret) return ret;
+    }
+    return DRIVER_OP_SUCCESS;
+  default:
+    return udf_read_sectors(p_udf, ptr, p_udf->i_part_start + i_lba,
+			    i_blocks);
+  }
+}
+
+/**
+ * Check that p_udf_fe holds a valid File Entry or Extended File Entry.
+ * Extended File Entries are converted in place to regular ones, so that
+ * the rest of the code only has to deal with a single layout.
+ * Return zero if all is good, -1 if not.
+ */
+static int
+udf_check_fe(udf_file_entry_t *p_udf_fe)
+{
+  struct extended_file_entry efe;
+  uint32_t i_ea, i_ad;
+  uint8_t *itag = (uint8_t *) &p_udf_fe->tag;
+  uint8_t i, cksum = 0;
+
+  if (!udf_checktag(&p_udf_fe->tag, TAGID_FILE_ENTRY))
+    return 0;
+  if (udf_checktag(&p_udf_fe->tag, TAGID_EFE))
+    return -1;
+
+  memcpy(&efe, p_udf_fe, sizeof(efe));
+  i_ea = uint32_from_le(efe.length_extended_attr);
+  i_ad = uint32_from_le(efe.length_alloc_descs);
+  if (i_ea > sizeof(efe.u) || i_ad > sizeof(efe.u) - i_ea)
+    return -1;
+
+  /* Everything up to logblks_recorded is common to both */
+  p_udf_fe->logblks_recorded  = efe.logblks_recorded;
+  p_udf_fe->access_time       = efe.access_time;
+  p_udf_fe->modification_time = efe.modification_time;
+  p_udf_fe->attribute_time    = efe.attribute_time;
+  p_udf_fe->checkpoint        = efe.checkpoint;
+  p_udf_fe->ext_attr_ICB      = efe.ext_attr_ICB;
+  p_udf_fe->imp_id            = efe.imp_id;
+  p_udf_fe->unique_ID         = efe.unique_ID;
+  p_udf_fe->i_extended_attr   = efe.length_extended_attr;
+  p_udf_fe->i_alloc_descs     = efe.length_alloc_descs;
+  memset(p_udf_fe->u.pad_to_one_block, 0, sizeof(p_udf_fe->u.pad_to_one_block));
+  memcpy(p_udf_fe->u.ext_attr, efe.u.ext_attr, i_ea + i_ad);
+
+  /* Retag as a File Entry */
+  p_udf_fe->tag.id = uint16_to_le(TAGID_FILE_ENTRY);
+  for (i = 0; i < 15; i++)
+    if (i != 4)
+      cksum += itag[i];
+  p_udf_fe->tag.cksum = cksum;
+  return 0;
+}
+
+/* Upper bound on the number of Indirect Entries we follow for an ICB */
+#define UDF_MAX_INDIRECT 256
+
+/*!
+  Read the File Entry of the ICB recorded at block i_lba of partition
+  map *pi_part_ref into p_udf_fe. With strategy 4096, the direct entry
+  of an ICB may be followed by an Indirect Entry pointing to a newer
+  ICB, which is where the current File Entry is to be found. Indirect
+  Entries are followed, and *pi_part_ref is updated accordingly.
+*/
+static driver_return_code_t
+udf_read_fe(const udf_t *p_udf, /*out*/ udf_file_entry_t *p_udf_fe,
+	    uint16_t *pi_part_ref, uint32_t i_lba)
+{
+  uint8_t data[UDF_BLOCKSIZE];
+  const struct indirect_entry_s *p_ie = (struct indirect_entry_s *) &data;
+  driver_return_code_t ret;
+  int i;
+
+  for (i = 0; i < UDF_MAX_INDIRECT; i++) {
+    ret = udf_read_logical(p_udf, p_udf_fe, *pi_part_ref, i_lba, 1);
+    if (DRIVER_OP_SUCCESS != ret)
+      return ret;
+    if (!udf_checktag(&p_udf_fe->tag, TAGID_IE)) {
+      p_ie = (struct indirect_entry_s *) p_udf_fe;
+    } else {
+      if (udf_check_fe(p_udf_fe))
+	return DRIVER_OP_ERROR;
+      if (uint16_from_le(p_udf_fe->icb_tag.strat_type)
+	  != ICBTAG_STRATEGY_TYPE_4096)
+	return DRIVER_OP_SUCCESS;
+      /* Look for an Indirect Entry in the block following the direct one */
+      p_ie = (struct indirect_entry_s *) &data;
+      if (DRIVER_OP_SUCCESS != udf_read_logical(p_udf, data, *pi_part_ref,
+						i_lba + 1, 1)
+	  || udf_checktag(&p_ie->tag, TAGID_IE))
+	return DRIVER_OP_SUCCESS;
+    }
+    if ((uint32_from_le(p_ie->indirect_ICB.len) & UDF_LENGTH_MASK) == 0) {
+      /* An empty Indirect Entry terminates the chain */
+      return (p_ie == (struct indirect_entry_s *) &data) ?
+	DRIVER_OP_SUCCESS : DRIVER_OP_ERROR;
+    }
+    i_lba = uint32_from_le(p_ie->indirect_ICB.loc.lba);
+    *pi_part_ref = uint16_from_le(p_ie->indirect_ICB.loc.partitionReferenceNum);
+  }
+  cdio_warn("Too many Indirect Entries for ICB at block %u",
+	    (unsigned int) i_lba);
+  return DRIVER_OP_ERROR;
+}
+
 /*!
   Open an UDF for reading. Maybe in the future we will have
   a mode. NULL is returned on error.
@@ -547,6 +704,195 @@ udf_get_logical_volume_id(udf_t *p_udf, /*out*/ char *psz_logvolid, unsigned int
   return logvolid_len;
 }
 
+/*!
+  Read the partition maps of a Logical Volume Descriptor, to find out
+  how blocks are to be translated for each partition reference.
+*/
+static void
+udf_parse_partition_maps(udf_t *p_udf, const logical_vol_desc_t *p_logvol)
+{
+  const uint8_t *p_map = p_logvol->partition_maps;
+  const uint8_t *p_end = (const uint8_t *) p_logvol + UDF_BLOCKSIZE;
+  const uint32_t i_maps = uint32_from_le(p_logvol->i_partition_maps);
+  uint32_t i;
+
+  for (i = 0; i < i_maps && i < UDF_MAX_PARTITION_MAPS; i++) {
+    const struct generic_partition_map *p_gpm =
+      (const struct generic_partition_map *) p_map;
+    uint8_t i_len;
+
+    if (p_map + 2 > p_end)
+      break;
+    i_len = p_gpm->partition_map_length;
+    if (i_len < 2 || p_map + i_len > p_end)
+      break;
+    p_udf->part_type[i] = UDF_PART_PHYSICAL;
+    if (p_gpm->partition_map_type == GP_PARTITION_MAP_TYPE_2
+	&& i_len >= sizeof(struct udf_metadata_partition_map)) {
+      const struct udf_metadata_partition_map *p_mpm =
+	(const struct udf_metadata_partition_map *) p_map;
+      const char *psz_id = (const char *) p_mpm->partition_type_id.id;
+
+      if (!strncmp(psz_id, UDF_ID_VIRTUAL, sizeof(UDF_ID_VIRTUAL)-1)) {
+	p_udf->part_type[i] = UDF_PART_VIRTUAL;
+      } else if (!strncmp(psz_id, UDF_ID_METADATA, sizeof(UDF_ID_METADATA)-1)) {
+	p_udf->part_type[i] = UDF_PART_METADATA;
+	p_udf->meta_loc[0] = uint32_from_le(p_mpm->metadata_file_loc);
+	p_udf->meta_loc[1] = uint32_from_le(p_mpm->metadata_mirror_file_loc);
+      }
+      /* Sparable partitions are read as physical ones, without
+	 going through the sparing table. */
+    }
+    p_map += i_len;
+  }
+  p_udf->i_part_maps = (uint16_t) i;
+}
+
+/*!
+  Read the whole content of the file described by p_udf_fe, whose
+  allocation descriptors refer to the physical partition. Extents that
+  are not recorded are left zeroed. Returns a buffer of *pi_blocks
+  blocks, to be freed by the caller, or NULL on error.
+*/
+static uint8_t *
+udf_read_fe_data(const udf_t *p_udf, const udf_file_entry_t *p_udf_fe,
+		 /*out*/ uint32_t *pi_blocks)
+{
+  const uint64_t i_size = uint64_from_le(p_udf_fe->info_len);
+  udf_extent_t *p_extents;
+  uint32_t i, i_extents, i_blocks;
+  uint8_t *p_data;
+
+  /* The files we read this way (Metadata File, VAT) are never that large */
+  if (i_size == 0 || i_size > 0x40000000)
+    return NULL;
+  if (!udf_get_extents(p_udf, p_udf_fe, UDF_PART_REF_PHYSICAL,
+		       &p_extents, &i_extents))
+    return NULL;
+  i_blocks = (uint32_t) ((i_size + UDF_BLOCKSIZE - 1) / UDF_BLOCKSIZE);
+  p_data = (uint8_t *) calloc(i_blocks, UDF_BLOCKSIZE);
+  if (!p_data)
+    goto out;
+
+  for (i = 0; i < i_extents && p_extents[i].i_offset < i_size; i++) {
+    const udf_extent_t *p_ext = &p_extents[i];
+    const uint32_t i_len = (uint32_t) MIN(p_ext->i_len,
+					  i_size - p_ext->i_offset);
+
+    switch (p_ext->i_type) {
+    case UDF_EXTENT_EMBEDDED:
+      memcpy(p_data + p_ext->i_offset, p_udf_fe->u.ext_attr + p_ext->i_lba,
+	     i_len);
+      break;
+    case UDF_EXTENT_RECORDED:
+      if ((p_ext->i_offset % UDF_BLOCKSIZE)
+	  || DRIVER_OP_SUCCESS !=
+	  udf_read_logical(p_udf, p_data + p_ext->i_offset,
+			   UDF_PART_REF_PHYSICAL, p_ext->i_lba,
+			   (i_len + UDF_BLOCKSIZE - 1) / UDF_BLOCKSIZE)) {
+	free(p_data);
+	p_data = NULL;
+	goto out;
+      }
+      break;
+    default:
+      break;
+    }
+  }
+  *pi_blocks = i_blocks;
+
+ out:
+  free(p_extents);
+  return p_data;
+}
+
+/*!
+  Load the Metadata File (or its mirror, if the former can't be read)
+  in memory. All File Entries and directories of a UDF 2.50+ volume
+  live in the metadata partition, so this turns a tree walk into memory
+  reads rather than scattered media accesses.
+*/
+static bool
+udf_load_metadata(udf_t *p_udf)
+{
+  udf_file_entry_t udf_fe;
+  int i;
+
+  for (i = 0; i < 2; i++) {
+    if (DRIVER_OP_SUCCESS != udf_read_sectors(p_udf, &udf_fe,
+			       p_udf->i_part_start + p_udf->meta_loc[i], 1)
+	|| udf_check_fe(&udf_fe)
+	|| udf_fe.icb_tag.file_type !=
+	   (i ? ICBTAG_FILE_TYPE_MIRROR : ICBTAG_FILE_TYPE_METADATA))
+      continue;
+    p_udf->metadata = udf_read_fe_data(p_udf, &udf_fe, &p_udf->i_meta_blocks);
+    if (p_udf->metadata)
+      return true;
+  }
+  cdio_warn("Could not read the Metadata File");
+  return false;
+}
+
+/*!
+  Locate and load the Virtual Allocation Table, whose File Entry is
+  recorded in the last sector of the media.
+*/
+static bool
+udf_load_vat(udf_t *p_udf)
+{
+  udf_file_entry_t udf_fe;
+  uint8_t *p_data;
+  uint32_t i, i_blocks, i_size, i_hdr;
+  lsn_t i_last;
+
+  if (p_udf->b_stream)
+    i_last = (lsn_t) (cdio_stream_stat(p_udf->stream) / UDF_BLOCKSIZE) - 1;
+  else
+    i_last = cdio_get_disc_last_lsn(p_udf->cdio) - 1;
+
+  /* Allow for some padding after the last recorded sector */
+  for (i = 0; i < 32 && i_last - (lsn_t) i > (lsn_t) p_udf->i_part_start; i++) {
+    if (DRIVER_OP_SUCCESS != udf_read_sectors(p_udf, &udf_fe, i_last - i, 1)
+	|| udf_check_fe(&udf_fe))
+      continue;
+    if (udf_fe.icb_tag.file_type != ICBTAG_FILE_TYPE_VAT20
+	&& udf_fe.icb_tag.file_type != ICBTAG_FILE_TYPE_UNDEF)
+      continue;
+    p_data = udf_read_fe_data(p_udf, &udf_fe, &i_blocks);
+    if (!p_data)
+      continue;
+    i_size = (uint32_t) uint64_from_le(udf_fe.info_len);
+    if (udf_fe.icb_tag.file_type == ICBTAG_FILE_TYPE_VAT20) {
+      /* UDF 2.00+: the entries follow a header of variable length */
+      i_hdr = (i_size >= 2) ? (p_data[0] | (p_data[1] << 8)) : i_size + 1;
+    } else {
+      /* UDF 1.50: the entries are followed by an Entity Identifier and
+	 the location of the previous VAT */
+      i_hdr = 0;
+      if (i_size < 36 || strncmp((char *) &p_data[i_size - 35],
+				 "*UDF Virtual Alloc Tbl", 22) != 0)
+	i_hdr = i_size + 1;
+      else
+	i_size -= 36;
+    }
+    if (i_hdr + 4 > i_size) {
+      free(p_data);
+      continue;
+    }
+    p_udf->i_vat_entries = (i_size - i_hdr) / 4;
+    p_udf->vat = (uint32_t *) malloc(p_udf->i_vat_entries * sizeof(uint32_t));
+    if (p_udf->vat) {
+      uint32_t j;
+      for (j = 0; j < p_udf->i_vat_entries; j++)
+	p_udf->vat[j] = uint32_from_le(*(uint32_t *) &p_data[i_hdr + 4 * j]);
+    }
+    free(p_data);
+    return (p_udf->vat != NULL);
+  }
+  cdio_warn("Could not locate the Virtual Allocation Table");
+  return false;
+}
+
 /*!
   Get the root in p_udf. If b_any_partition is false then
   the root must be in the given partition.
@@ -600,32 +946,42 @@ udf_get_root (udf_t *p_udf, bool b_any_partition, partition_num_t i_partition)
 	p_udf->lvd_lba = i_lba;
 	p_udf->fsd_offset =
 	  uint32_from_le(p_logvol->lvd_use.fsd_loc.loc.lba);
+	p_udf->fsd_part_ref =
+	  uint16_from_le(p_logvol->lvd_use.fsd_loc.loc.partitionReferenceNum);
+	udf_parse_partition_maps(p_udf, p_logvol);
 	if (p_udf->i_part_start) break;
       }
     }
   }
   if (p_udf->lvd_lba && p_udf->i_part_start) {
     udf_fsd_t *p_fsd = (udf_fsd_t *) &data;
+    driver_return_code_t ret;
+    uint16_t i;
+
+    /* Set up the block translation of the metadata and virtual partitions */
+    for (i = 0; i < p_udf->i_part_maps; i++) {
+      if (p_udf->part_type[i] == UDF_PART_METADATA && !p_udf->metadata
+	  && !udf_load_metadata(p_udf))
+	return NULL;
+      if (p_udf->part_type[i] == UDF_PART_VIRTUAL && !p_udf->vat
+	  && !udf_load_vat(p_udf))
+	return NULL;
+    }
 
-    driver_return_code_t ret =
-      udf_read_sectors(p_udf, p_fsd, p_udf->i_part_start + p_udf->fsd_offset,
-		       1);
+    ret = udf_read_logical(p_udf, p_fsd, p_udf->fsd_part_ref,
+			   p_udf->fsd_offset, 1);
 
     if (DRIVER_OP_SUCCESS == ret && !udf_checktag(&p_fsd->tag, TAGID_FSD)) {
       udf_file_entry_t *p_udf_fe = (udf_file_entry_t *) &data;
       const uint32_t parent_icb = uint32_from_le(p_fsd->root_icb.loc.lba);
+      uint16_t parent_part =
+	uint16_from_le(p_fsd->root_icb.loc.partitionReferenceNum);
 
-      /* Check partition numbers match of last-read block?  */
-
-      ret = udf_read_sectors(p_udf, p_udf_fe,
-			     p_udf->i_part_start + parent_icb, 1);
-      if (ret == DRIVER_OP_SUCCESS &&
-	  !udf_checktag(&p_udf_fe->tag, TAGID_FILE_ENTRY)) {
-
-	/* Check partition numbers match of last-read block? */
+      ret = udf_read_fe(p_udf, p_udf_fe, &parent_part, parent_icb);
+      if (ret == DRIVER_OP_SUCCESS) {
 
 	/* We win! - Save root directory information. */
-	return udf_new_dirent(p_udf_fe, p_udf, "/", true, false );
+	return udf_new_dirent(p_udf_fe, p_udf, "/", true, false, parent_part);
       }
     }
   }
@@ -650,6 +1006,9 @@ udf_close (udf_t *p_udf)
     cdio_destroy(p_udf->cdio);
   }
 
+  free(p_udf->metadata);
+  free(p_udf->vat);
+
   /* Get rid of root directory if allocated. */
 
   free_and_null(p_udf);
@@ -662,17 +1021,19 @@ udf_opendir(const udf_dirent_t *p_udf_dirent)
   if (p_udf_dirent->b_dir && !p_udf_dirent->b_parent && p_udf_dirent->fid) {
     udf_t *p_udf = p_udf_dirent->p_udf;
     udf_file_entry_t udf_fe;
+    uint16_t i_part =
+      uint16_from_le(p_udf_dirent->fid->icb.loc.partitionReferenceNum);
 
     driver_return_code_t i_ret =
-      udf_read_sectors(p_udf, &udf_fe, p_udf->i_part_start
-		       + p_udf_dirent->fid->icb.loc.lba, 1);
+      udf_read_fe(p_udf, &udf_fe, &i_part,
+		  uint32_from_le(p_udf_dirent->fid->icb.loc.lba));
 
-    if (DRIVER_OP_SUCCESS == i_ret
-	&& !udf_checktag(&udf_fe.tag, TAGID_FILE_ENTRY)) {
+    if (DRIVER_OP_SUCCESS == i_ret) {
 
       if (ICBTAG_FILE_TYPE_DIRECTORY == udf_fe.icb_tag.file_type) {
 	udf_dirent_t *p_udf_dirent_new =
-	  udf_new_dirent(&udf_fe, p_udf, p_udf_dirent->psz_name, true, true);
+	  udf_new_dirent(&udf_fe, p_udf, p_udf_dirent->psz_name, true, true,
+			 i_part);
 	return p_udf_dirent_new;
       }
     }
@@ -707,29 +1068,49 @@ udf_readdir(udf_dirent_t *p_udf_dirent)
   }
 
   if (!p_udf_dirent->fid) {
-    uint32_t i_sectors =
-      (p_udf_dirent->i_loc_end - p_udf_dirent->i_loc + 1);
-    uint32_t size = UDF_BLOCKSIZE * i_sectors;
-    driver_return_code_t i_ret;
-
+    /* Read the whole directory, through the extent map of its File Entry,
+       which may be split over several extents or embedded in the ICB. */
+    const uint64_t i_size = p_udf_dirent->dir_left;
+    uint32_t i_sectors;
+    uint64_t i_read = 0;
+    ssize_t i_ret = 0;
+
+    /* Directories of more than a few MB are most likely bogus */
+    if (i_size > 0x10000000) {
+      udf_dirent_free(p_udf_dirent);
+      return NULL;
+    }
+    i_sectors = (uint32_t) ((i_size + UDF_BLOCKSIZE - 1) / UDF_BLOCKSIZE);
     if (!p_udf_dirent->sector)
-      p_udf_dirent->sector = (uint8_t*) malloc(size);
-    i_ret = udf_read_sectors(p_udf, p_udf_dirent->sector,
-			     p_udf_dirent->i_part_start+p_udf_dirent->i_loc,
-			     i_sectors);
-    if (DRIVER_OP_SUCCESS == i_ret)
+      p_udf_dirent->sector = (uint8_t*) calloc(i_sectors, UDF_BLOCKSIZE);
+    while (p_udf_dirent->sector && i_read < i_size) {
+      i_ret = udf_read_block(p_udf_dirent, p_udf_dirent->sector + i_read,
+			     i_sectors - (uint32_t) (i_read / UDF_BLOCKSIZE));
+      if (i_ret <= 0)
+	break;
+      i_read += i_ret;
+    }
+    p_udf->i_position = 0;
+    if (p_udf_dirent->sector && i_read >= i_size)
       p_udf_dirent->fid = (udf_fileid_desc_t *) p_udf_dirent->sector;
     else
       p_udf_dirent->fid = NULL;
   }
 
+  /* Don't let a File Identifier Descriptor run past the directory data */
+  if (p_udf_dirent->fid
+      && (p_udf_dirent->dir_left < sizeof(*p_udf_dirent->fid)
+	  || p_udf_dirent->dir_left < sizeof(*p_udf_dirent->fid)
+	     + p_udf_dirent->fid->u.i_imp_use + p_udf_dirent->fid->i_file_id))
+    p_udf_dirent->fid = NULL;
+
   if (p_udf_dirent->fid && !udf_checktag(&(p_udf_dirent->fid->tag), TAGID_FID))
     {
       uint32_t ofs =
 	4 * ((sizeof(*p_udf_dirent->fid) + p_udf_dirent->fid->u.i_imp_use
 	      + p_udf_dirent->fid->i_file_id + 3) / 4);
 
-      p_udf_dirent->dir_left -= ofs;
+      p_udf_dirent->dir_left -= MIN(ofs, p_udf_dirent->dir_left);
       p_udf_dirent->b_dir =
 	(p_udf_dirent->fid->file_characteristics & UDF_FILE_DIRECTORY) != 0;
       p_udf_dirent->b_parent =
@@ -737,12 +1118,19 @@ udf_readdir(udf_dirent_t *p_udf_dirent)
 
       {
 	const unsigned int i_len = p_udf_dirent->fid->i_file_id;
+	uint16_t i_part =
+	  uint16_from_le(p_udf_dirent->fid->icb.loc.partitionReferenceNum);
 
-	if (DRIVER_OP_SUCCESS != udf_read_sectors(p_udf, &p_udf_dirent->fe, p_udf->i_part_start
-			 + p_udf_dirent->fid->icb.loc.lba, 1)) {
+	if (DRIVER_OP_SUCCESS != udf_read_fe(p_udf, &p_udf_dirent->fe, &i_part,
+			 uint32_from_le(p_udf_dirent->fid->icb.loc.lba))) {
 		udf_dirent_free(p_udf_dirent);
 		return NULL;
 	}
+	p_udf_dirent->i_fe_part = i_part;
+	free_and_null(p_udf_dirent->extents);
+	p_udf_dirent->i_extents = 0;
+	udf_get_extents(p_udf, &p_udf_dirent->fe, i_part,
+			&p_udf_dirent->extents, &p_udf_dirent->i_extents);
 
        free_and_null(p_udf_dirent->psz_name);
        p = (uint8_t*)p_udf_dirent->fid->u.imp_use.data + p_udf_dirent->fid->u.i_imp_use;
@@ -764,6 +1152,7 @@ udf_dirent_free(udf_dirent_t *p_udf_dirent)
     p_udf_dirent->fid = NULL;
     free_and_null(p_udf_dirent->psz_name);
     free_and_null(p_udf_dirent->sector);
+    free_and_null(p_udf_dirent->extents);
     free_and_null(p_udf_dirent);
   }
   return true;
@@ -19,12 +19,29 @@
 #define CDIO_UDF_UDF_FS_H_
 
 #include <cdio/ecma_167.h>
+#include <cdio/udf.h>
 /**
  * Check the descriptor tag for both the correct id and correct checksum.
  * Return zero if all is good, -1 if not.
  */
 int udf_checktag(const udf_tag_t *p_tag, udf_Uint16_t tag_id);
 
+/**
+ * Read i_blocks logical blocks, starting at i_lba, from the partition
+ * referenced by partition map i_part_ref.
+ */
+driver_return_code_t udf_read_logical(const udf_t *p_udf, void *ptr,
+                                      uint16_t i_part_ref, uint32_t i_lba,
+                                      long i_blocks);
+
+/**
+ * Build the extent map of the data described by File Entry p_udf_fe,
+ * recorded in partition map i_fe_part. The map must be freed by the caller.
+ */
+bool udf_get_extents(const udf_t *p_udf, const udf_file_entry_t *p_udf_fe,
+                     uint16_t i_fe_part, udf_extent_t **pp_extents,
+                     uint32_t *pi_extents);
+
 #endif /* CDIO_UDF_UDF_FS_H_ */
 
 
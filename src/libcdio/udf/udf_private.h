@@ -34,6 +34,34 @@
 
 /* Implementation of opaque types */
 
+#define UDF_MAX_PARTITION_MAPS 4
+/* Partition reference that bypasses the partition maps */
+#define UDF_PART_REF_PHYSICAL  0xFFFF
+
+/* How the logical blocks of a partition map are translated */
+typedef enum {
+  UDF_PART_PHYSICAL = 0,  /* directly mapped (type 1 or sparable) */
+  UDF_PART_VIRTUAL,       /* through the Virtual Allocation Table */
+  UDF_PART_METADATA       /* through the Metadata File */
+} udf_part_type_t;
+
+/* Kinds of extents in the extent map of a file */
+typedef enum {
+  UDF_EXTENT_RECORDED = 0,  /* data recorded at i_lba of i_part_ref */
+  UDF_EXTENT_UNRECORDED,    /* allocated or not, reads back as zeroes */
+  UDF_EXTENT_EMBEDDED       /* data recorded in the File Entry itself */
+} udf_extent_type_t;
+
+/* One extent of a file, as described by its allocation descriptors */
+struct udf_extent_s {
+  uint64_t              i_offset;     /* offset of the extent in the file */
+  uint32_t              i_len;        /* length of the extent, in bytes */
+  uint32_t              i_lba;        /* first block, or for embedded data,
+                                         offset of the data in fe.u */
+  uint16_t              i_part_ref;   /* partition map of i_lba */
+  uint8_t               i_type;       /* udf_extent_type_t */
+};
+
 struct udf_s {
   bool                  b_stream;     /* Use stream pointer, else use p_cdio */
   off_t                 i_position;   /* Position in file if positive */
@@ -45,6 +73,14 @@ struct udf_s {
   uint32_t              i_part_start; /* start of Partition Descriptor */
   uint32_t              lvd_lba;      /* sector of Logical Volume Descriptor */
   uint32_t              fsd_offset;   /* lba of fileset descriptor */
+  uint16_t              fsd_part_ref; /* partition map of fileset descriptor */
+  uint16_t              i_part_maps;  /* number of partition maps */
+  udf_part_type_t       part_type[UDF_MAX_PARTITION_MAPS];
+  uint32_t              meta_loc[2];  /* lba of metadata file and mirror */
+  uint8_t               *metadata;    /* cached content of the metadata file */
+  uint32_t              i_meta_blocks;/* size of the above, in blocks */
+  uint32_t              *vat;         /* Virtual Allocation Table */
+  uint32_t              i_vat_entries;
 };
 
 #endif /* CDIO_UDF_UDF_PRIVATE_H_ */
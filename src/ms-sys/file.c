@@ -93,6 +93,8 @@ int64_t read_sectors(HANDLE hDrive, uint64_t SectorSize,
  * fp->_ptr: a Windows handle
  * fp->_bufsiz: the sector size
  * fp->_cnt: a file offset
+ * fp->_base: (optional) a memory buffer, to use instead of the handle
+ * fp->_charbuf: the size of the memory buffer above
  */
 int contains_data(FILE *fp, uint64_t Position,
                   const void *pData, uint64_t Len)
@@ -103,6 +105,14 @@ int contains_data(FILE *fp, uint64_t Position,
    uint64_t StartSector, EndSector, NumSectors;
    Position += (uint64_t)fp->_cnt;
 
+   if(fp->_base != NULL)
+   {
+      /* Memory backed fp, such as the decompressed header of an image */
+      if((Position + Len) > (uint64_t)fp->_charbuf)
+         return 0;
+      return (memcmp(pData, &fp->_base[Position], (size_t)Len) == 0);
+   }
+
    StartSector = Position/SectorSize;
    EndSector   = (Position+Len+SectorSize-1)/SectorSize;
    NumSectors  = (size_t)(EndSector - StartSector);
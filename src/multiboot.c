@@ -0,0 +1,299 @@
+/*
+ * Rufus: The Reliable USB Formatting Utility
+ * Multiboot (multiple ISO images) support
+ * Copyright © 2014 Pete Batard <pete@akeo.ie>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * In multiboot mode, rather than extracting a single ISO, we copy each of the
+ * ISOs the user selected, as is, into an /images directory of the data partition
+ * and install Grub4DOS with a generated menu that boots each of them.
+ * Grub4DOS can either map an ISO file directly as a CD drive, which requires
+ * the file to be contiguous on disk, or load it in memory first, which works
+ * with any file but is slow and limited by the amount of RAM. We therefore
+ * preallocate each ISO before copying it, so that it has the best chance of
+ * ending up in a single extent, and only fall back to memory mapping for the
+ * ones that didn't.
+ */
+
+#include <windows.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+
+#include "rufus.h"
+#include "msapi_utf8.h"
+#include "resource.h"
+#include "localization.h"
+#include "multiboot.h"
+
+#define MULTIBOOT_BUFFER_SIZE       (1024 * 1024)
+
+MULTIBOOT_IMAGE multiboot_image[MAX_MULTIBOOT_IMAGES];
+int nb_multiboot_images = 0;
+BOOL enable_multiboot = FALSE;
+
+static uint64_t multiboot_total, multiboot_done;
+
+void ClearMultibootImages(void)
+{
+	int i;
+
+	for (i=0; i<nb_multiboot_images; i++)
+		safe_free(multiboot_image[i].path);
+	memset(multiboot_image, 0, sizeof(multiboot_image));
+	nb_multiboot_images = 0;
+}
+
+/*
+ * Add the ISO that was just scanned (i.e. whose properties are in iso_report)
+ * to the list of images to write.
+ */
+BOOL AddMultibootImage(const char* path)
+{
+	int i, j;
+	const char* base;
+	char name[64];
+	HANDLE hFile;
+	LARGE_INTEGER li;
+	MULTIBOOT_IMAGE* img;
+
+	if (nb_multiboot_images >= MAX_MULTIBOOT_IMAGES) {
+		uprintf("Multiboot: Too many images (max %d)", MAX_MULTIBOOT_IMAGES);
+		return FALSE;
+	}
+	for (i=0; i<nb_multiboot_images; i++) {
+		if (safe_stricmp(multiboot_image[i].path, path) == 0) {
+			uprintf("Multiboot: '%s' is already part of the list", path);
+			return FALSE;
+		}
+	}
+
+	hFile = CreateFileU(path, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, 0, NULL);
+	if ((hFile == INVALID_HANDLE_VALUE) || (!GetFileSizeEx(hFile, &li))) {
+		uprintf("Multiboot: Could not get the size of '%s': %s", path, WindowsErrorString());
+		safe_closehandle(hFile);
+		return FALSE;
+	}
+	safe_closehandle(hFile);
+
+	// Grub4DOS does not handle spaces or non ASCII characters in paths => sanitize the name
+	for (base = &path[safe_strlen(path)]; (base > path) && (base[-1] != '\\') && (base[-1] != '/'); base--);
+	for (j=0; (base[j] != 0) && (j < sizeof(name)-1); j++)
+		name[j] = (isalnum((unsigned char)base[j]) || (base[j] == '.') || (base[j] == '-')) ? base[j] : '_';
+	name[j] = 0;
+
+	img = &multiboot_image[nb_multiboot_images];
+	memset(img, 0, sizeof(MULTIBOOT_IMAGE));
+	// Prefix the name with the index in case of a duplicate
+	for (i=0; i<nb_multiboot_images; i++)
+		if (safe_stricmp(multiboot_image[i].name, name) == 0)
+			break;
+	if (i < nb_multiboot_images)
+		safe_sprintf(img->name, sizeof(img->name), "%d_%s", nb_multiboot_images, name);
+	else
+		safe_strcpy(img->name, sizeof(img->name), name);
+	safe_strcpy(img->label, sizeof(img->label), (iso_report.label[0] != 0) ? iso_report.label : img->name);
+	safe_strcpy(img->kernel_path, sizeof(img->kernel_path), iso_report.kernel_path);
+	safe_strcpy(img->initrd_path, sizeof(img->initrd_path), iso_report.initrd_path);
+	img->uses_casper = iso_report.uses_casper;
+	img->uses_debian_live = iso_report.uses_debian_live;
+	img->size = (uint64_t)li.QuadPart;
+	img->path = safe_strdup(path);
+	if (img->path == NULL)
+		return FALSE;
+	nb_multiboot_images++;
+	uprintf("Multiboot: Added '%s' as /%s/%s (%s)", path, MULTIBOOT_DIR, img->name,
+		SizeToHumanReadable(img->size, FALSE, FALSE));
+	return TRUE;
+}
+
+uint64_t GetMultibootSize(uint64_t* largest)
+{
+	int i;
+	uint64_t size = 0;
+
+	if (largest != NULL)
+		*largest = 0;
+	for (i=0; i<nb_multiboot_images; i++) {
+		size += multiboot_image[i].size;
+		if ((largest != NULL) && (multiboot_image[i].size > *largest))
+			*largest = multiboot_image[i].size;
+	}
+	return size;
+}
+
+/*
+ * Check whether a file occupies a single extent on disk
+ */
+static BOOL IsContiguous(HANDLE hFile)
+{
+	STARTING_VCN_INPUT_BUFFER vcn = { 0 };
+	RETRIEVAL_POINTERS_BUFFER rp;
+	DWORD size;
+
+	// There is only room for one extent in the output buffer => ERROR_MORE_DATA if fragmented
+	if (!DeviceIoControl(hFile, FSCTL_GET_RETRIEVAL_POINTERS, &vcn, sizeof(vcn), &rp, sizeof(rp), &size, NULL))
+		return FALSE;
+	return (rp.ExtentCount == 1);
+}
+
+/*
+ * Copy an ISO into a preallocated file. Returns FALSE on error or if cancelled.
+ */
+static BOOL CopyImage(MULTIBOOT_IMAGE* img, const char* dst, uint8_t* buf, BOOL* contiguous)
+{
+	BOOL r = FALSE;
+	HANDLE hSrc = INVALID_HANDLE_VALUE, hDst = INVALID_HANDLE_VALUE;
+	LARGE_INTEGER li;
+	DWORD rSize, wSize;
+	uint64_t left;
+	int i;
+
+	*contiguous = FALSE;
+	hSrc = CreateFileU(img->path, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING,
+		FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+	if (hSrc == INVALID_HANDLE_VALUE) {
+		uprintf("Could not open '%s': %s", img->path, WindowsErrorString());
+		goto out;
+	}
+	hDst = CreateFileU(dst, GENERIC_READ|GENERIC_WRITE, FILE_SHARE_READ, NULL, CREATE_ALWAYS,
+		FILE_ATTRIBUTE_NORMAL|FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+	if (hDst == INVALID_HANDLE_VALUE) {
+		uprintf("Could not create '%s': %s", dst, WindowsErrorString());
+		goto out;
+	}
+
+	// Reserve the whole size upfront, so that the file system can allocate it as a single run
+	li.QuadPart = img->size;
+	if ((!SetFilePointerEx(hDst, li, NULL, FILE_BEGIN)) || (!SetEndOfFile(hDst))) {
+		uprintf("Could not preallocate '%s': %s", dst, WindowsErrorString());
+		goto out;
+	}
+	*contiguous = IsContiguous(hDst);
+	li.QuadPart = 0;
+	if (!SetFilePointerEx(hDst, li, NULL, FILE_BEGIN))
+		goto out;
+
+	for (left = img->size; left > 0; left -= rSize) {
+		if (IS_ERROR(FormatStatus))
+			goto out;
+		if ((!ReadFile(hSrc, buf, (DWORD)MIN(left, MULTIBOOT_BUFFER_SIZE), &rSize, NULL)) || (rSize == 0)) {
+			uprintf("Could not read '%s': %s", img->path, WindowsErrorString());
+			goto out;
+		}
+		for (i=0; i<WRITE_RETRIES; i++) {
+			if ((WriteFile(hDst, buf, rSize, &wSize, NULL)) && (wSize == rSize))
+				break;
+			uprintf("  Error writing file: %s", WindowsErrorString());
+			if (i < WRITE_RETRIES-1)
+				uprintf("  RETRYING...\n");
+		}
+		if (i >= WRITE_RETRIES)
+			goto out;
+		multiboot_done += rSize;
+		UpdateProgress(OP_DOS, 100.0f*multiboot_done/multiboot_total);
+	}
+	r = TRUE;
+
+out:
+	safe_closehandle(hSrc);
+	safe_closehandle(hDst);
+	return r;
+}
+
+/*
+ * Write the Grub4DOS menu entry for an image
+ */
+static void WriteMenuEntry(FILE* fd, MULTIBOOT_IMAGE* img, BOOL contiguous)
+{
+	fprintf(fd, "title %s\n", img->label);
+	fprintf(fd, "find --set-root --ignore-floppies /%s/%s\n", MULTIBOOT_DIR, img->name);
+	fprintf(fd, "map %s/%s/%s (0xff)\n", contiguous ? "" : "--mem ", MULTIBOOT_DIR, img->name);
+	fprintf(fd, "map --hook\n");
+	fprintf(fd, "root (0xff)\n");
+	// Live Linux distros can't access an emulated CD once their kernel is running, so
+	// boot them directly, and tell them where to find the ISO file
+	if ((img->kernel_path[0] != 0) && (img->initrd_path[0] != 0) && (img->uses_casper || img->uses_debian_live)) {
+		fprintf(fd, "kernel %s boot=%s %s=/%s/%s quiet splash\n", img->kernel_path,
+			img->uses_casper ? "casper" : "live", img->uses_casper ? "iso-scan/filename" : "findiso",
+			MULTIBOOT_DIR, img->name);
+		fprintf(fd, "initrd %s\n", img->initrd_path);
+	} else {
+		fprintf(fd, "chainloader (0xff)\n");
+	}
+	fprintf(fd, "\n");
+}
+
+/*
+ * Copy all the images to the target, in one pass, and generate the boot menu
+ */
+BOOL WriteMultibootImages(const char* drive_name)
+{
+	BOOL r = FALSE, contiguous;
+	int i;
+	char path[MAX_PATH];
+	uint8_t* buf = NULL;
+	FILE* fd = NULL;
+
+	if (nb_multiboot_images == 0)
+		return TRUE;
+	multiboot_total = GetMultibootSize(NULL);
+	multiboot_done = 0;
+	buf = (uint8_t*)malloc(MULTIBOOT_BUFFER_SIZE);
+	if (buf == NULL) {
+		FormatStatus = ERROR_SEVERITY_ERROR|FAC(FACILITY_STORAGE)|ERROR_NOT_ENOUGH_MEMORY;
+		goto out;
+	}
+
+	static_sprintf(path, "%c:\\menu.lst", drive_name[0]);
+	fd = fopenU(path, "w");
+	if (fd == NULL) {
+		uprintf("Could not create '%s'", path);
+		goto out;
+	}
+	fprintf(fd, "# Generated by " APPLICATION_NAME "\n");
+	fprintf(fd, "timeout 30\ndefault 0\n\n");
+
+	static_sprintf(path, "%c:\\%s", drive_name[0], MULTIBOOT_DIR);
+	if ((!CreateDirectoryA(path, NULL)) && (GetLastError() != ERROR_ALREADY_EXISTS)) {
+		uprintf("Could not create directory '%s': %s", path, WindowsErrorString());
+		goto out;
+	}
+
+	UpdateProgress(OP_DOS, 0.0f);
+	PrintInfoDebug(0, MSG_231);
+	for (i=0; i<nb_multiboot_images; i++) {
+		static_sprintf(path, "%c:\\%s\\%s", drive_name[0], MULTIBOOT_DIR, multiboot_image[i].name);
+		uprintf("Copying: %s (%s)", path, SizeToHumanReadable(multiboot_image[i].size, FALSE, FALSE));
+		if (!CopyImage(&multiboot_image[i], path, buf, &contiguous))
+			goto out;
+		if (!contiguous)
+			uprintf("  File is fragmented - it will have to be loaded in memory to boot");
+		WriteMenuEntry(fd, &multiboot_image[i], contiguous);
+	}
+	fprintf(fd, "title Reboot\nreboot\n\ntitle Power off\nhalt\n");
+	r = TRUE;
+
+out:
+	if (fd != NULL)
+		fclose(fd);
+	safe_free(buf);
+	if ((!r) && (!IS_ERROR(FormatStatus)))
+		FormatStatus = ERROR_SEVERITY_ERROR|FAC(FACILITY_STORAGE)|ERROR_CANNOT_COPY;
+	return r;
+}
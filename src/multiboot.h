@@ -0,0 +1,46 @@
+/*
+ * Rufus: The Reliable USB Formatting Utility
+ * Multiboot (multiple ISO images) support
+ * Copyright © 2014 Pete Batard <pete@akeo.ie>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <windows.h>
+#include <stdint.h>
+
+#pragma once
+
+#define MAX_MULTIBOOT_IMAGES        16
+#define MULTIBOOT_DIR               "images"
+
+typedef struct {
+	char* path;					/* source ISO */
+	char name[64];				/* file name under /images on the target */
+	char label[192];			/* menu title (ISO label, UTF-8) */
+	char kernel_path[64];		/* casper/live kernel, if any */
+	char initrd_path[64];		/* casper/live initrd, if any */
+	uint64_t size;
+	BOOL uses_casper;
+	BOOL uses_debian_live;
+} MULTIBOOT_IMAGE;
+
+extern MULTIBOOT_IMAGE multiboot_image[MAX_MULTIBOOT_IMAGES];
+extern int nb_multiboot_images;
+extern BOOL enable_multiboot;
+
+BOOL AddMultibootImage(const char* path);
+void ClearMultibootImages(void);
+uint64_t GetMultibootSize(uint64_t* largest);
+BOOL WriteMultibootImages(const char* drive_name);
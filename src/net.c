@@ -242,21 +242,48 @@ const char* WinInetErrorString(void)
  * to the dialog in question, with WPARAM being set to nonzero for EXIT on success
  * and also attempt to indicate progress using an IDC_PROGRESS control
  */
+/*
+ * Open an Internet session, once the network is available
+ */
+static HINTERNET GetInternetSession(void)
+{
+	int i;
+	DWORD dwFlags;
+	char agent[64];
+	HINTERNET hSession;
+
+	for (i=5; (i>0) && (!InternetGetConnectedState(&dwFlags, 0)); i--) {
+		Sleep(1000);
+	}
+	if (i <= 0) {
+		// http://msdn.microsoft.com/en-us/library/windows/desktop/aa384702.aspx is wrong...
+		SetLastError(ERROR_INTERNET_NOT_INITIALIZED);
+		uprintf("Network is unavailable: %s\n", WinInetErrorString());
+		return NULL;
+	}
+	_snprintf(agent, ARRAYSIZE(agent), APPLICATION_NAME "/%d.%d.%d.%d (WinNT %d.%d%s)",
+		rufus_version[0], rufus_version[1], rufus_version[2], rufus_version[3],
+		nWindowsVersion>>4, nWindowsVersion&0x0F, is_x64()?"; WOW64":"");
+	hSession = InternetOpenA(agent, INTERNET_OPEN_TYPE_PRECONFIG, NULL, NULL, 0);
+	if (hSession == NULL)
+		uprintf("Could not open Internet session: %s\n", WinInetErrorString());
+	return hSession;
+}
+
 DWORD DownloadFile(const char* url, const char* file, HWND hProgressDialog)
 {
 	HWND hProgressBar = NULL;
 	BOOL r = FALSE;
-	DWORD dwFlags, dwSize, dwDownloaded, dwTotalSize;
+	DWORD dwSize, dwDownloaded, dwTotalSize;
 	FILE* fd = NULL; 
 	LONG progress_style;
 	const char* accept_types[] = {"*/*\0", NULL};
 	unsigned char buf[DOWNLOAD_BUFFER_SIZE];
-	char agent[64], hostname[64], urlpath[128];
+	char hostname[64], urlpath[128];
 	HINTERNET hSession = NULL, hConnection = NULL, hRequest = NULL;
 	URL_COMPONENTSA UrlParts = {sizeof(URL_COMPONENTSA), NULL, 1, (INTERNET_SCHEME)0,
 		hostname, sizeof(hostname), 0, NULL, 1, urlpath, sizeof(urlpath), NULL, 1};
 	size_t last_slash;
-	int i;
 
 	DownloadStatus = 0;
 	if (hProgressDialog != NULL) {
@@ -288,23 +315,9 @@ DWORD DownloadFile(const char* url, const char* file, HWND hProgressDialog)
 	hostname[sizeof(hostname)-1] = 0;
 
 	// Open an Internet session
-	for (i=5; (i>0) && (!InternetGetConnectedState(&dwFlags, 0)); i--) {
-		Sleep(1000);
-	}
-	if (i <= 0) {
-		// http://msdn.microsoft.com/en-us/library/windows/desktop/aa384702.aspx is wrong...
-		SetLastError(ERROR_INTERNET_NOT_INITIALIZED);
-		uprintf("Network is unavailable: %s\n", WinInetErrorString());
-		goto out;
-	}
-	_snprintf(agent, ARRAYSIZE(agent), APPLICATION_NAME "/%d.%d.%d.%d (WinNT %d.%d%s)",
-		rufus_version[0], rufus_version[1], rufus_version[2], rufus_version[3],
-		nWindowsVersion>>4, nWindowsVersion&0x0F, is_x64()?"; WOW64":"");
-	hSession = InternetOpenA(agent, INTERNET_OPEN_TYPE_PRECONFIG, NULL, NULL, 0);
-	if (hSession == NULL) {
-		uprintf("Could not open Internet session: %s\n", WinInetErrorString());
+	hSession = GetInternetSession();
+	if (hSession == NULL)
 		goto out;
-	}
 
 	hConnection = InternetConnectA(hSession, UrlParts.lpszHostName, UrlParts.nPort, NULL, NULL, INTERNET_SERVICE_HTTP, 0, (DWORD_PTR)NULL);
 	if (hConnection == NULL) {
@@ -393,6 +406,99 @@ out:
 	return r?dwSize:0;
 }
 
+/*
+ * Downloading parts of a remote file, using HTTP range requests. The session and the
+ * connection to the server are kept open between requests, as opening them for each
+ * part would cost more than the transfer of the part itself.
+ */
+static HINTERNET hRangeSession = NULL, hRangeConnection = NULL;
+static char range_hostname[64], range_urlpath[512];
+static const char* range_url;
+static BOOL range_secure;
+
+void CloseRangeDownload(void)
+{
+	if (hRangeConnection) InternetCloseHandle(hRangeConnection);
+	if (hRangeSession) InternetCloseHandle(hRangeSession);
+	hRangeConnection = NULL;
+	hRangeSession = NULL;
+	range_url = NULL;
+}
+
+BOOL OpenRangeDownload(const char* url)
+{
+	URL_COMPONENTSA UrlParts = {sizeof(URL_COMPONENTSA), NULL, 1, (INTERNET_SCHEME)0,
+		range_hostname, sizeof(range_hostname), 0, NULL, 1, range_urlpath, sizeof(range_urlpath), NULL, 1};
+
+	CloseRangeDownload();
+	if ( (!InternetCrackUrlA(url, (DWORD)safe_strlen(url), 0, &UrlParts))
+	  || (UrlParts.lpszHostName == NULL) || (UrlParts.lpszUrlPath == NULL)) {
+		uprintf("Unable to decode URL: %s\n", WinInetErrorString());
+		return FALSE;
+	}
+	range_hostname[sizeof(range_hostname)-1] = 0;
+	range_secure = (UrlParts.nScheme == INTERNET_SCHEME_HTTPS);
+
+	hRangeSession = GetInternetSession();
+	if (hRangeSession == NULL)
+		return FALSE;
+	hRangeConnection = InternetConnectA(hRangeSession, UrlParts.lpszHostName, UrlParts.nPort, NULL, NULL, INTERNET_SERVICE_HTTP, 0, (DWORD_PTR)NULL);
+	if (hRangeConnection == NULL) {
+		uprintf("Could not connect to server %s:%d: %s\n", UrlParts.lpszHostName, UrlParts.nPort, WinInetErrorString());
+		CloseRangeDownload();
+		return FALSE;
+	}
+	range_url = url;
+	return TRUE;
+}
+
+/*
+ * Download part of the file set by OpenRangeDownload().
+ * Returns the number of bytes that were read into buf, which is less than size on error.
+ */
+DWORD DownloadRange(uint64_t offset, DWORD size, uint8_t* buf)
+{
+	DWORD dwSize, dwDownloaded, dwStatus = 0, dwRead = 0;
+	const char* accept_types[] = {"*/*\0", NULL};
+	char range[64];
+	HINTERNET hRequest = NULL;
+
+	if ((size == 0) || (hRangeConnection == NULL))
+		return 0;
+	hRequest = HttpOpenRequestA(hRangeConnection, "GET", range_urlpath, NULL, NULL, accept_types,
+		INTERNET_FLAG_HYPERLINK|INTERNET_FLAG_IGNORE_REDIRECT_TO_HTTP|INTERNET_FLAG_IGNORE_REDIRECT_TO_HTTPS|INTERNET_FLAG_NO_COOKIES|
+		INTERNET_FLAG_NO_UI|INTERNET_FLAG_NO_CACHE_WRITE|INTERNET_FLAG_KEEP_CONNECTION|(range_secure?INTERNET_FLAG_SECURE:0),
+		(DWORD_PTR)NULL);
+	if (hRequest == NULL) {
+		uprintf("Could not open URL %s: %s\n", range_url, WinInetErrorString());
+		goto out;
+	}
+	safe_sprintf(range, sizeof(range), "Range: bytes=%" PRIu64 "-%" PRIu64 "\r\n", offset, offset + size - 1);
+	if (!HttpSendRequestA(hRequest, range, (DWORD)-1L, NULL, 0)) {
+		uprintf("Unable to send request: %s\n", WinInetErrorString());
+		goto out;
+	}
+	// Servers that don't support ranges return the whole file, which is not what we want
+	dwSize = sizeof(dwStatus);
+	HttpQueryInfoA(hRequest, HTTP_QUERY_STATUS_CODE|HTTP_QUERY_FLAG_NUMBER, (LPVOID)&dwStatus, &dwSize, NULL);
+	if (dwStatus != 206) {
+		uprintf("Unable to access range 0x%" PRIx64 "-0x%" PRIx64 " of %s: Server status %d\n",
+			offset, offset + size - 1, range_url, dwStatus);
+		goto out;
+	}
+	while (dwRead < size) {
+		if (IS_ERROR(FormatStatus))
+			goto out;
+		if (!InternetReadFile(hRequest, &buf[dwRead], size - dwRead, &dwDownloaded) || (dwDownloaded == 0))
+			break;
+		dwRead += dwDownloaded;
+	}
+
+out:
+	if (hRequest) InternetCloseHandle(hRequest);
+	return dwRead;
+}
+
 /* Threaded download */
 static const char *_url, *_file;
 static HWND _hProgressDialog;
@@ -0,0 +1,725 @@
+/*
+ * Rufus: The Reliable USB Formatting Utility
+ * QEMU Copy-On-Write (QCOW2) image support
+ * Copyright © 2015 Pete Batard <pete@akeo.ie>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * A QCOW2 image maps the clusters of a virtual disk through two levels of tables: the L1
+ * table, that the header points to, holds the offsets of the L2 tables, which hold the
+ * offset of each data cluster in the file. A cluster can also be compressed on its own,
+ * flagged as reading as zeroes, or not be allocated at all, in which case it comes from
+ * the backing file, if there is one, or reads as zeroes otherwise. As these tables are all
+ * we need to find the data, refcounts and snapshots are ignored.
+ * We write the virtual disk in order, reading data clusters in runs that take as few reads
+ * as their layout in the file allows, and areas that read as zeroes are discarded rather
+ * than written, on drives that guarantee that discarded sectors read back as zeroes.
+ * All the fields from the header and the tables are Big Endian.
+ */
+
+#include <windows.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "rufus.h"
+#include "drive.h"
+#include "resource.h"
+#include "localization.h"
+#include "bled/bled.h"
+
+#define QCOW2_MAGIC                 0x514649FB	// "QFI\xfb"
+#define QCOW2_HEADER_SIZE           4096		// What we read to parse the header and its extensions
+#define QCOW2_V2_HEADER_LENGTH      72
+#define QCOW2_MIN_CLUSTER_BITS      9
+#define QCOW2_MAX_CLUSTER_BITS      21
+#define QCOW2_MAX_L1_SIZE           (32 * 1024 * 1024 / sizeof(uint64_t))	// Same limit as QEMU
+#define QCOW2_MAX_BACKING_DEPTH     16
+#define QCOW2_MAX_BACKING_NAME      1023
+#define QCOW2_RUN_SIZE              (8 * 1024 * 1024)		// Most data we read and write at once
+#define QCOW2_ZERO_RUN_SIZE         (1024 * 1024 * 1024ULL)	// Most zeroes we write or discard at once
+#define QCOW2_MIN_DISCARD_SIZE      (1024 * 1024)			// Smaller areas are written rather than discarded
+#define QCOW2_PROBE_SIZE            (1024 * 1024)			// What we read to analyze the partition table
+
+// Incompatible features
+#define QCOW2_INCOMPAT_DIRTY        0x01
+#define QCOW2_INCOMPAT_CORRUPT      0x02
+#define QCOW2_INCOMPAT_DATA_FILE    0x04
+#define QCOW2_INCOMPAT_COMPRESSION  0x08
+#define QCOW2_INCOMPAT_EXTL2        0x10
+#define QCOW2_INCOMPAT_SUPPORTED    (QCOW2_INCOMPAT_DIRTY | QCOW2_INCOMPAT_COMPRESSION | QCOW2_INCOMPAT_EXTL2)
+
+#define QCOW2_COMPRESSION_ZLIB      0
+#define QCOW2_COMPRESSION_ZSTD      1
+
+// Header extensions
+#define QCOW2_EXT_END               0x00000000
+#define QCOW2_EXT_BACKING_FORMAT    0xE2792ACA
+
+// L1 and L2 entries
+#define QCOW2_OFFSET_MASK           0x00FFFFFFFFFFFE00ULL
+#define QCOW2_FLAG_COMPRESSED       (1ULL << 62)
+#define QCOW2_FLAG_ZERO             1ULL
+#define QCOW2_SUBCLUSTER_BITS       5			// 32 subclusters per cluster, with extended L2 entries
+
+// What an area of the virtual disk maps to
+#define QCOW2_EXTENT_ZERO           0
+#define QCOW2_EXTENT_DATA           1
+#define QCOW2_EXTENT_COMPRESSED     2
+
+typedef struct qcow2_layer {
+	HANDLE h;
+	BOOL own_handle;
+	BOOL is_raw;				// backing files can be raw images
+	uint64_t size;				// size of the virtual disk
+	uint32_t version;
+	uint32_t cluster_bits;
+	uint64_t cluster_size;
+	uint32_t l2_bits;			// log2 of the number of entries in an L2 table
+	BOOL extended_l2;
+	uint8_t compression_type;
+	uint64_t* l1;
+	uint32_t l1_size;
+	uint8_t* l2;				// the last L2 table we read, and its offset in the file
+	uint64_t l2_offset;
+	uint8_t* comp_buf;
+	uint8_t* cluster_buf;		// the last compressed cluster we decompressed, and its offset in the file
+	uint64_t cluster_offset;
+	struct qcow2_layer* backing;
+} qcow2_layer;
+
+typedef struct {
+	int type;
+	qcow2_layer* layer;			// the image that holds the data
+	uint64_t offset;			// data: offset in the file, compressed: offset in the cluster
+	uint64_t comp_offset;		// compressed: offset and size of the compressed cluster in the file
+	uint64_t comp_size;
+	uint64_t size;				// size of the area of the virtual disk that the extent covers
+} qcow2_extent;
+
+static __inline uint32_t read_be32(const uint8_t* p)
+{
+	return ((uint32_t)p[0] << 24) | ((uint32_t)p[1] << 16) | ((uint32_t)p[2] << 8) | p[3];
+}
+
+static __inline uint64_t read_be64(const uint8_t* p)
+{
+	return ((uint64_t)read_be32(p) << 32) | read_be32(&p[4]);
+}
+
+// Returns the number of bytes read, which can be less than requested at the end of the file
+static DWORD ReadUpTo(HANDLE h, uint64_t offset, void* buf, DWORD size)
+{
+	LARGE_INTEGER li;
+	DWORD rd;
+
+	li.QuadPart = offset;
+	if ((!SetFilePointerEx(h, li, NULL, FILE_BEGIN)) || (!ReadFile(h, buf, size, &rd, NULL)))
+		return 0;
+	return rd;
+}
+
+static BOOL ReadAt(HANDLE h, uint64_t offset, void* buf, DWORD size)
+{
+	return (ReadUpTo(h, offset, buf, size) == size);
+}
+
+static void CloseLayers(qcow2_layer* layer)
+{
+	qcow2_layer* backing;
+
+	for (; layer != NULL; layer = backing) {
+		backing = layer->backing;
+		if (layer->own_handle)
+			safe_closehandle(layer->h);
+		safe_free(layer->l1);
+		safe_free(layer->l2);
+		safe_free(layer->comp_buf);
+		safe_free(layer->cluster_buf);
+		free(layer);
+	}
+}
+
+// Backing file names that aren't absolute are relative to the image that references them
+static char* GetBackingPath(const char* image_path, const char* name)
+{
+	const char *sep, *sep2;
+	char* path;
+	size_t len;
+
+	if ((name[0] == '\\') || (name[0] == '/') || ((name[0] != 0) && (name[1] == ':')))
+		return safe_strdup(name);
+	sep = strrchr(image_path, '\\');
+	sep2 = strrchr(image_path, '/');
+	if ((sep == NULL) || ((sep2 != NULL) && (sep2 > sep)))
+		sep = sep2;
+	len = (sep == NULL) ? 0 : (size_t)(sep - image_path + 1);
+	path = (char*)malloc(len + strlen(name) + 1);
+	if (path == NULL)
+		return NULL;
+	memcpy(path, image_path, len);
+	strcpy(&path[len], name);
+	return path;
+}
+
+/*
+ * Open an image and its backing files. 'h' is the handle to use for the image, if it is
+ * already open, and 'format' the format it is expected to have, "qcow2" or "raw", or NULL
+ * if we should find out from its content.
+ */
+static qcow2_layer* OpenLayer(const char* path, HANDLE h, const char* format, int depth)
+{
+	qcow2_layer* layer;
+	uint8_t* hdr = NULL;
+	LARGE_INTEGER li;
+	uint64_t backing_offset, l1_offset, incompat = 0;
+	uint32_t i, backing_size, header_length, crypt_method, ext_type, ext_len;
+	char backing_name[QCOW2_MAX_BACKING_NAME + 1], backing_format[16] = "", *backing_path;
+	DWORD size;
+	BOOL r = FALSE;
+
+	layer = (qcow2_layer*)calloc(1, sizeof(qcow2_layer));
+	hdr = (uint8_t*)calloc(1, QCOW2_HEADER_SIZE);
+	if ((layer == NULL) || (hdr == NULL)) {
+		uprintf("QCOW2: Could not allocate image data");
+		goto out;
+	}
+	layer->h = h;
+	if (h == NULL) {
+		layer->h = CreateFileU(path, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+		if (layer->h == INVALID_HANDLE_VALUE) {
+			layer->h = NULL;
+			uprintf("QCOW2: Could not open '%s': %s", path, WindowsErrorString());
+			goto out;
+		}
+		layer->own_handle = TRUE;
+	}
+	if (!GetFileSizeEx(layer->h, &li)) {
+		uprintf("QCOW2: Could not get the size of '%s': %s", path, WindowsErrorString());
+		goto out;
+	}
+	size = ReadUpTo(layer->h, 0, hdr, QCOW2_HEADER_SIZE);
+	if ((format != NULL) && (strcmp(format, "raw") == 0)) {
+		layer->is_raw = TRUE;
+	} else if ((size < QCOW2_V2_HEADER_LENGTH) || (read_be32(hdr) != QCOW2_MAGIC)) {
+		if (format != NULL) {
+			uprintf("QCOW2: '%s' is not a QCOW2 image", path);
+			goto out;
+		}
+		layer->is_raw = TRUE;
+	}
+	if (layer->is_raw) {
+		layer->size = (uint64_t)li.QuadPart;
+		r = TRUE;
+		goto out;
+	}
+
+	layer->version = read_be32(&hdr[4]);
+	backing_offset = read_be64(&hdr[8]);
+	backing_size = read_be32(&hdr[16]);
+	layer->cluster_bits = read_be32(&hdr[20]);
+	layer->size = read_be64(&hdr[24]);
+	crypt_method = read_be32(&hdr[32]);
+	layer->l1_size = read_be32(&hdr[36]);
+	l1_offset = read_be64(&hdr[40]);
+	header_length = QCOW2_V2_HEADER_LENGTH;
+	if (layer->version >= 3) {
+		incompat = read_be64(&hdr[72]);
+		header_length = read_be32(&hdr[100]);
+		if (header_length > 104)
+			layer->compression_type = hdr[104];
+	}
+
+	if ((layer->version != 2) && (layer->version != 3)) {
+		uprintf("QCOW2: Unsupported version %d", layer->version);
+		goto out;
+	}
+	if (crypt_method != 0) {
+		uprintf("QCOW2: Encrypted images are not supported");
+		goto out;
+	}
+	if (incompat & QCOW2_INCOMPAT_CORRUPT) {
+		uprintf("QCOW2: '%s' is marked as corrupted", path);
+		goto out;
+	}
+	if (incompat & QCOW2_INCOMPAT_DATA_FILE) {
+		uprintf("QCOW2: Images with an external data file are not supported");
+		goto out;
+	}
+	if (incompat & ~QCOW2_INCOMPAT_SUPPORTED) {
+		uprintf("QCOW2: Unsupported image features (0x%llx)", incompat & ~QCOW2_INCOMPAT_SUPPORTED);
+		goto out;
+	}
+	if (layer->compression_type > QCOW2_COMPRESSION_ZSTD) {
+		uprintf("QCOW2: Unsupported compression type %d", layer->compression_type);
+		goto out;
+	}
+	// The refcounts of an image that wasn't closed properly may be off, but we don't use them
+	if (incompat & QCOW2_INCOMPAT_DIRTY)
+		uprintf("QCOW2: '%s' was not closed properly", path);
+
+	layer->extended_l2 = ((incompat & QCOW2_INCOMPAT_EXTL2) != 0);
+	layer->l2_bits = layer->cluster_bits - (layer->extended_l2 ? 4 : 3);
+	if ( (layer->cluster_bits < (layer->extended_l2 ? QCOW2_MIN_CLUSTER_BITS + QCOW2_SUBCLUSTER_BITS : QCOW2_MIN_CLUSTER_BITS))
+	  || (layer->cluster_bits > QCOW2_MAX_CLUSTER_BITS) || (header_length < QCOW2_V2_HEADER_LENGTH)
+	  || (header_length > size) || (layer->size == 0) || (layer->l1_size > QCOW2_MAX_L1_SIZE)
+	  || ((uint64_t)layer->l1_size << (layer->l2_bits + layer->cluster_bits) < layer->size) ) {
+		uprintf("QCOW2: Invalid header");
+		goto out;
+	}
+	layer->cluster_size = 1ULL << layer->cluster_bits;
+	if (l1_offset % layer->cluster_size != 0) {
+		uprintf("QCOW2: Invalid L1 table offset");
+		goto out;
+	}
+
+	// Header extensions follow the header, in the first cluster
+	size = (DWORD)MIN(size, layer->cluster_size);
+	for (i = (header_length + 7) & ~7; i + 8 <= size; i += 8 + ((ext_len + 7) & ~7)) {
+		ext_type = read_be32(&hdr[i]);
+		ext_len = read_be32(&hdr[i + 4]);
+		if ((ext_type == QCOW2_EXT_END) || (ext_len > size - i - 8))
+			break;
+		if ((ext_type == QCOW2_EXT_BACKING_FORMAT) && (ext_len < sizeof(backing_format))) {
+			memcpy(backing_format, &hdr[i + 8], ext_len);
+			backing_format[ext_len] = 0;
+		}
+	}
+
+	layer->l1 = (uint64_t*)malloc(MAX(layer->l1_size, 1) * sizeof(uint64_t));
+	layer->l2 = (uint8_t*)malloc((size_t)layer->cluster_size);
+	layer->comp_buf = (uint8_t*)malloc(2 * (size_t)layer->cluster_size);
+	layer->cluster_buf = (uint8_t*)malloc((size_t)layer->cluster_size);
+	if ((layer->l1 == NULL) || (layer->l2 == NULL) || (layer->comp_buf == NULL) || (layer->cluster_buf == NULL)) {
+		uprintf("QCOW2: Could not allocate image tables");
+		goto out;
+	}
+	if ((layer->l1_size != 0) && (!ReadAt(layer->h, l1_offset, layer->l1, layer->l1_size * sizeof(uint64_t)))) {
+		uprintf("QCOW2: Could not read L1 table: %s", WindowsErrorString());
+		goto out;
+	}
+	for (i = 0; i < layer->l1_size; i++)
+		layer->l1[i] = read_be64((uint8_t*)&layer->l1[i]);
+
+	if (backing_offset != 0) {
+		if ((backing_size == 0) || (backing_size > QCOW2_MAX_BACKING_NAME)
+		  || (!ReadAt(layer->h, backing_offset, backing_name, backing_size))) {
+			uprintf("QCOW2: Could not read the name of the backing file");
+			goto out;
+		}
+		backing_name[backing_size] = 0;
+		if (depth >= QCOW2_MAX_BACKING_DEPTH) {
+			uprintf("QCOW2: Too many levels of backing files");
+			goto out;
+		}
+		if ((backing_format[0] != 0) && (strcmp(backing_format, "raw") != 0) && (strcmp(backing_format, "qcow2") != 0)) {
+			uprintf("QCOW2: Backing files in %s format are not supported", backing_format);
+			goto out;
+		}
+		backing_path = GetBackingPath(path, backing_name);
+		if (backing_path == NULL)
+			goto out;
+		uprintf("QCOW2: Using backing file '%s'", backing_path);
+		layer->backing = OpenLayer(backing_path, NULL, (backing_format[0] == 0) ? NULL : backing_format, depth + 1);
+		free(backing_path);
+		if (layer->backing == NULL)
+			goto out;
+	}
+	r = TRUE;
+
+out:
+	free(hdr);
+	if (!r) {
+		CloseLayers(layer);
+		return NULL;
+	}
+	return layer;
+}
+
+static BOOL LoadL2(qcow2_layer* layer, uint64_t offset)
+{
+	if (offset == layer->l2_offset)
+		return TRUE;
+	layer->l2_offset = 0;
+	if ((offset % layer->cluster_size != 0) || (!ReadAt(layer->h, offset, layer->l2, (DWORD)layer->cluster_size))) {
+		uprintf("QCOW2: Could not read L2 table at offset 0x%llx", offset);
+		return FALSE;
+	}
+	layer->l2_offset = offset;
+	return TRUE;
+}
+
+static uint64_t GetL2Entry(const qcow2_layer* layer, uint32_t index, uint64_t* bitmap)
+{
+	if (layer->extended_l2) {
+		*bitmap = read_be64(&layer->l2[16 * index + 8]);
+		return read_be64(&layer->l2[16 * index]);
+	}
+	*bitmap = 0;
+	return read_be64(&layer->l2[8 * index]);
+}
+
+/*
+ * Find out what the virtual disk holds at 'offset', for at most 'max_size' bytes. The extent
+ * covers as much as a single table entry tells us about, which is never more than a cluster
+ * of data, but can be the whole area that an unallocated L2 table would map.
+ */
+static BOOL GetExtent(qcow2_layer* layer, uint64_t offset, uint64_t max_size, qcow2_extent* e)
+{
+	uint64_t cluster, in_cluster, l2_offset, entry, bitmap, host, nb_sectors;
+	uint32_t l1_index, l2_index, sc;
+	int x;
+
+	e->layer = layer;
+	// Anything past the end of a backing image reads as zeroes
+	if (offset >= layer->size) {
+		e->type = QCOW2_EXTENT_ZERO;
+		e->size = max_size;
+		return TRUE;
+	}
+	max_size = MIN(max_size, layer->size - offset);
+	if (layer->is_raw) {
+		e->type = QCOW2_EXTENT_DATA;
+		e->offset = offset;
+		e->size = max_size;
+		return TRUE;
+	}
+
+	cluster = offset >> layer->cluster_bits;
+	in_cluster = offset & (layer->cluster_size - 1);
+	l1_index = (uint32_t)(cluster >> layer->l2_bits);
+	l2_index = (uint32_t)(cluster & ((1ULL << layer->l2_bits) - 1));
+	l2_offset = (l1_index < layer->l1_size) ? (layer->l1[l1_index] & QCOW2_OFFSET_MASK) : 0;
+	if (l2_offset == 0) {
+		e->size = MIN(max_size, ((uint64_t)(l1_index + 1) << (layer->l2_bits + layer->cluster_bits)) - offset);
+		goto unallocated;
+	}
+	if (!LoadL2(layer, l2_offset))
+		return FALSE;
+	entry = GetL2Entry(layer, l2_index, &bitmap);
+	e->size = MIN(max_size, layer->cluster_size - in_cluster);
+
+	if (entry & QCOW2_FLAG_COMPRESSED) {
+		// The bits above the offset give the number of extra 512 byte sectors the data spans
+		x = 62 - (layer->cluster_bits - 8);
+		host = entry & ((1ULL << x) - 1);
+		nb_sectors = (entry >> x) & ((1ULL << (layer->cluster_bits - 8)) - 1);
+		e->type = QCOW2_EXTENT_COMPRESSED;
+		e->offset = in_cluster;
+		e->comp_offset = host;
+		e->comp_size = (nb_sectors + 1) * 512 - (host & 511);
+		return TRUE;
+	}
+	host = entry & QCOW2_OFFSET_MASK;
+	if (layer->extended_l2) {
+		// Each subcluster has an allocated bit, in the low 32 bits, and a zero bit, in the high ones
+		sc = (uint32_t)(in_cluster >> (layer->cluster_bits - QCOW2_SUBCLUSTER_BITS));
+		e->size = MIN(e->size, ((uint64_t)(sc + 1) << (layer->cluster_bits - QCOW2_SUBCLUSTER_BITS)) - in_cluster);
+		if (bitmap & (1ULL << (sc + 32)))
+			goto zero;
+		if (!(bitmap & (1ULL << sc)))
+			goto unallocated;
+	} else {
+		if ((layer->version >= 3) && (entry & QCOW2_FLAG_ZERO))
+			goto zero;
+		if (host == 0)
+			goto unallocated;
+	}
+	if ((host == 0) || (host % layer->cluster_size != 0)) {
+		uprintf("QCOW2: Invalid L2 entry 0x%016llx", entry);
+		return FALSE;
+	}
+	e->type = QCOW2_EXTENT_DATA;
+	e->offset = host + in_cluster;
+	return TRUE;
+
+unallocated:
+	if (layer->backing != NULL)
+		return GetExtent(layer->backing, offset, e->size, e);
+zero:
+	e->type = QCOW2_EXTENT_ZERO;
+	return TRUE;
+}
+
+static BOOL ReadCompressed(const qcow2_extent* e, uint8_t* buf)
+{
+	qcow2_layer* layer = e->layer;
+	int64_t r = -1;
+	DWORD size;
+
+	// Compressed clusters are usually read in full, so we only decompress them once
+	if (layer->cluster_offset != e->comp_offset) {
+		layer->cluster_offset = 0;
+		if (layer->compression_type != QCOW2_COMPRESSION_ZLIB) {
+			uprintf("QCOW2: zstd compressed clusters are not supported");
+			return FALSE;
+		}
+		// Compressed data may end before the last sector it is said to span, which can be past the end of the file
+		size = ReadUpTo(layer->h, e->comp_offset, layer->comp_buf, (DWORD)e->comp_size);
+		if (size != 0)
+			r = bled_uncompress_from_buffer_to_buffer((const char*)layer->comp_buf, size,
+				(char*)layer->cluster_buf, (size_t)layer->cluster_size, BLED_COMPRESSION_ZIP);
+		if (r != (int64_t)layer->cluster_size) {
+			uprintf("QCOW2: Could not decompress cluster at offset 0x%llx", e->comp_offset);
+			return FALSE;
+		}
+		layer->cluster_offset = e->comp_offset;
+	}
+	memcpy(buf, &layer->cluster_buf[e->offset], (size_t)e->size);
+	return TRUE;
+}
+
+// Read an area of the virtual disk, using a single read for data that is contiguous in the file
+static BOOL ReadGuest(qcow2_layer* top, uint64_t offset, uint8_t* buf, uint64_t size)
+{
+	qcow2_extent e;
+	HANDLE h = NULL;
+	uint64_t pos, read_offset = 0, read_size = 0;
+	uint8_t* read_buf = NULL;
+
+	for (pos = 0; pos < size; pos += e.size) {
+		if (!GetExtent(top, offset + pos, size - pos, &e))
+			return FALSE;
+		if ((e.type == QCOW2_EXTENT_DATA) && (read_size != 0) && (e.layer->h == h) && (e.offset == read_offset + read_size)) {
+			read_size += e.size;
+			continue;
+		}
+		if ((read_size != 0) && (!ReadAt(h, read_offset, read_buf, (DWORD)read_size)))
+			goto read_error;
+		read_size = 0;
+		switch (e.type) {
+		case QCOW2_EXTENT_DATA:
+			h = e.layer->h;
+			read_offset = e.offset;
+			read_size = e.size;
+			read_buf = &buf[pos];
+			break;
+		case QCOW2_EXTENT_COMPRESSED:
+			if (!ReadCompressed(&e, &buf[pos]))
+				return FALSE;
+			break;
+		default:
+			memset(&buf[pos], 0, (size_t)e.size);
+			break;
+		}
+	}
+	if ((read_size != 0) && (!ReadAt(h, read_offset, read_buf, (DWORD)read_size)))
+		goto read_error;
+	return TRUE;
+
+read_error:
+	uprintf("QCOW2: Could not read data at offset 0x%llx: %s", read_offset, WindowsErrorString());
+	return FALSE;
+}
+
+// Go through the L2 tables of an image, to find out how much data it holds
+static BOOL ScanLayer(qcow2_layer* layer, uint64_t* data_size, uint64_t* nb_compressed)
+{
+	uint64_t entry, bitmap, l2_offset;
+	uint32_t i, j, k;
+
+	for (i = 0; i < layer->l1_size; i++) {
+		l2_offset = layer->l1[i] & QCOW2_OFFSET_MASK;
+		if (l2_offset == 0)
+			continue;
+		if (!LoadL2(layer, l2_offset))
+			return FALSE;
+		for (j = 0; j < (1UL << layer->l2_bits); j++) {
+			entry = GetL2Entry(layer, j, &bitmap);
+			if (entry & QCOW2_FLAG_COMPRESSED) {
+				(*nb_compressed)++;
+				*data_size += layer->cluster_size;
+			} else if (layer->extended_l2) {
+				for (k = 0; k < (1UL << QCOW2_SUBCLUSTER_BITS); k++) {
+					if ((bitmap & (1ULL << k)) && !(bitmap & (1ULL << (k + 32))))
+						*data_size += layer->cluster_size >> QCOW2_SUBCLUSTER_BITS;
+				}
+			} else if (((entry & QCOW2_OFFSET_MASK) != 0) && !((layer->version >= 3) && (entry & QCOW2_FLAG_ZERO))) {
+				*data_size += layer->cluster_size;
+			}
+		}
+	}
+	return TRUE;
+}
+
+// Check if an image is a QCOW2 image we can write, and analyze its partition table
+BOOL IsQcow2Image(const char* path)
+{
+	qcow2_layer *top, *layer;
+	uint64_t data_size = 0, nb_compressed, size;
+	uint8_t* buf = NULL;
+	BOOL r = FALSE;
+
+	top = OpenLayer(path, NULL, "qcow2", 0);
+	if (top == NULL)
+		return FALSE;
+	for (layer = top; layer != NULL; layer = layer->backing) {
+		if (layer->is_raw) {
+			data_size += layer->size;
+			continue;
+		}
+		nb_compressed = 0;
+		if (!ScanLayer(layer, &data_size, &nb_compressed))
+			goto out;
+		if ((nb_compressed != 0) && (layer->compression_type != QCOW2_COMPRESSION_ZLIB)) {
+			uprintf("QCOW2: zstd compressed clusters are not supported");
+			goto out;
+		}
+	}
+	uprintf("Image is a QCOW2 v%d image, that requires %s once written", top->version,
+		SizeToHumanReadable(top->size, TRUE, FALSE));
+	uprintf("QCOW2: %s of allocated data", SizeToHumanReadable(data_size, TRUE, FALSE));
+	iso_report.is_qcow2 = TRUE;
+	iso_report.projected_size = top->size;
+
+	// Read the start of the disk, to find out if it's something we can boot
+	size = MIN(top->size, QCOW2_PROBE_SIZE);
+	buf = (uint8_t*)malloc((size_t)size);
+	if (buf == NULL) {
+		uprintf("QCOW2: Could not allocate buffer for image analysis");
+		goto out;
+	}
+	bled_init(_uprintf, NULL, NULL, NULL);
+	if (ReadGuest(top, 0, buf, size))
+		r = AnalyzeMBRBuffer(buf, (size_t)size, "QCOW2 image");
+	bled_exit();
+
+out:
+	safe_free(buf);
+	CloseLayers(top);
+	return r;
+}
+
+static BOOL WriteZeroes(int (*write_function)(int, const void*, unsigned int), uint64_t size)
+{
+	static const uint8_t zero[64 * 1024] = { 0 };
+	unsigned int len;
+
+	for (; size > 0; size -= len) {
+		len = (unsigned int)MIN(size, sizeof(zero));
+		if (write_function(-1, zero, len) != (int)len)
+			return FALSE;
+	}
+	return TRUE;
+}
+
+// Zero the output up to 'end'. Only whole sectors can be discarded, so anything that isn't
+// sector aligned, or that the drive won't discard for us, is written.
+static BOOL WriteZeroArea(uint64_t* pos, uint64_t end, DWORD sector_size,
+	int (*write_function)(int, const void*, unsigned int), BOOL (*discard_function)(uint64_t, uint64_t))
+{
+	uint64_t start = ((*pos + sector_size - 1) / sector_size) * sector_size;
+	uint64_t stop = (end / sector_size) * sector_size;
+
+	if ((discard_function != NULL) && (stop > start) && (stop - start >= QCOW2_MIN_DISCARD_SIZE)) {
+		if (!WriteZeroes(write_function, start - *pos))
+			return FALSE;
+		*pos = start;
+		if (discard_function(start, stop - start))
+			*pos = stop;
+		else if (IS_ERROR(FormatStatus))
+			return FALSE;
+	}
+	if (!WriteZeroes(write_function, end - *pos))
+		return FALSE;
+	*pos = end;
+	return TRUE;
+}
+
+/*
+ * Write a QCOW2 image, through the same buffered output as the one we use for compressed images:
+ * 'write_function' appends data to the output, 'seek_function' moves it, and 'discard_function',
+ * if not NULL, discards a sector aligned area that must read as zeroes and moves the output past
+ * it, or returns FALSE if the drive can't do that, in which case we write the zeroes ourselves.
+ * Writing resumes from the sector that contains 'resume'.
+ */
+BOOL WriteQcow2Image(HANDLE hSourceImage, const char* path, DWORD sector_size, uint64_t resume,
+	int (*write_function)(int, const void*, unsigned int), BOOL (*seek_function)(uint64_t),
+	BOOL (*discard_function)(uint64_t, uint64_t))
+{
+	qcow2_layer* top;
+	qcow2_extent e;
+	uint8_t* buf = NULL;
+	uint64_t pos, end;
+	DWORD LastRefresh = 0;
+	float format_percent;
+	BOOL r = FALSE;
+
+	bled_init(_uprintf, NULL, NULL, &FormatStatus);
+	top = OpenLayer(path, hSourceImage, "qcow2", 0);
+	if (top == NULL) {
+		FormatStatus = ERROR_SEVERITY_ERROR|FAC(FACILITY_STORAGE)|ERROR_INVALID_DATA;
+		goto out;
+	}
+	buf = (uint8_t*)malloc(QCOW2_RUN_SIZE);
+	if (buf == NULL) {
+		uprintf("QCOW2: Could not allocate buffer");
+		FormatStatus = ERROR_SEVERITY_ERROR|FAC(FACILITY_STORAGE)|ERROR_NOT_ENOUGH_MEMORY;
+		goto out;
+	}
+
+	// Skip whatever an interrupted write already took care of
+	pos = resume - (resume % sector_size);
+	if ((pos != 0) && (!seek_function(pos)))
+		goto out;
+
+	while (pos < top->size) {
+		if (IS_ERROR(FormatStatus))
+			goto out;
+		// Group areas that read as zeroes, or areas that hold data, into runs as large as we allow
+		if (!GetExtent(top, pos, MIN(top->size - pos, QCOW2_RUN_SIZE), &e))
+			goto read_error;
+		if (e.type == QCOW2_EXTENT_ZERO) {
+			for (end = pos + e.size; (end < top->size) && (end < pos + QCOW2_ZERO_RUN_SIZE); end += e.size) {
+				if (!GetExtent(top, end, MIN(top->size, pos + QCOW2_ZERO_RUN_SIZE) - end, &e))
+					goto read_error;
+				if (e.type != QCOW2_EXTENT_ZERO)
+					break;
+			}
+			if (!WriteZeroArea(&pos, end, sector_size, write_function, discard_function))
+				goto out;
+		} else {
+			for (end = pos + e.size; (end < top->size) && (end < pos + QCOW2_RUN_SIZE); end += e.size) {
+				if (!GetExtent(top, end, MIN(top->size, pos + QCOW2_RUN_SIZE) - end, &e))
+					goto read_error;
+				if (e.type == QCOW2_EXTENT_ZERO)
+					break;
+			}
+			if (!ReadGuest(top, pos, buf, end - pos))
+				goto read_error;
+			if (write_function(-1, buf, (unsigned int)(end - pos)) != (int)(end - pos))
+				goto out;
+			pos = end;
+		}
+		if (GetTickCount() > LastRefresh + 25) {
+			LastRefresh = GetTickCount();
+			format_percent = (100.0f*pos)/(1.0f*top->size);
+			PrintInfo(0, MSG_261, format_percent);
+			UpdateProgress(OP_FORMAT, format_percent);
+		}
+	}
+	r = TRUE;
+	goto out;
+
+read_error:
+	if (!IS_ERROR(FormatStatus))
+		FormatStatus = ERROR_SEVERITY_ERROR|FAC(FACILITY_STORAGE)|ERROR_READ_FAULT;
+out:
+	bled_exit();
+	safe_free(buf);
+	CloseLayers(top);
+	return r;
+}
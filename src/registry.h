@@ -39,6 +39,8 @@ extern "C" {
 #define REGKEY_INCLUDE_BETAS        "CheckForBetas"
 #define REGKEY_COMM_CHECK           "CommCheck"
 #define REGKEY_LOCALE               "Locale"
+#define REGKEY_WRITE_THROUGHPUT     "WriteThroughput"
+#define REGKEY_FILE_OVERHEAD        "FileWriteOverhead"
 
 /* Delete a registry key from <key_root>\Software and all its values
    If the key has subkeys, this call will fail. */
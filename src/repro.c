@@ -0,0 +1,504 @@
+/*
+ * Rufus: The Reliable USB Formatting Utility
+ * Reproducible output
+ * Copyright © 2015 Pete Batard <pete@akeo.ie>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Two runs of the same job normally never produce the same bytes on the drive, on
+ * account of the disk signature, GUIDs and volume serial numbers being random or
+ * time based, and of file timestamps being set to the time of the copy. When the
+ * reproducible mode is enabled:
+ * - the drive is erased beforehand, so that no leftover data remains in free space
+ * - every identifier we (or Windows) would pick at random is derived from a seed,
+ *   that is computed from the source image and the format parameters
+ * - once everything has been written, all timestamps are set to the date of the
+ *   source image, and the serial number of the file system is patched, along with
+ *   the timestamp of the volume label entry (FAT), with the volume dismounted
+ * - finally, the SHA-1 of the whole drive is computed, so that any other drive that
+ *   was created from the same job can be checked against it with a single hash.
+ * Files are always copied in the order in which they appear on the source, from a
+ * single thread, so the directory entries are always laid out in the same order.
+ * Note that, apart from its serial number, we have no control over the metadata
+ * that Windows writes on NTFS, UDF or ReFS, so only FAT and ext can be expected to
+ * be byte identical. Likewise, Windows may create a 'System Volume Information'
+ * folder, holding a random indexer GUID, on any volume it mounts. If we find it
+ * before dismounting, the hash is reported as not reproducible, as deleting the
+ * folder would still leave its traces in the file system. Identical output is not
+ * guaranteed either when Windows mounts the volume of an image we wrote as is.
+ */
+
+#include <windows.h>
+#include <windowsx.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "rufus.h"
+#include "msapi_utf8.h"
+#include "resource.h"
+#include "drive.h"
+
+#define REPRO_FINGERPRINT_SIZE      (64 * 1024)
+#define REPRO_HASH_BUFFER_SIZE      (1024 * 1024)
+#define FNV64_OFFSET                0xcbf29ce484222325ULL
+#define FNV64_PRIME                 0x100000001b3ULL
+// 2000.01.01 00:00:00 UTC, used when the source has no date we can use
+#define REPRO_DEFAULT_TIME          125911584000000000ULL
+#define FILETIME_UNIX_EPOCH         116444736000000000ULL
+#define SYSTEM_VOLUME_INFORMATION   L"System Volume Information"
+
+extern const char* FileSystemLabel[FS_MAX];
+
+BOOL enable_reproducible = FALSE;
+static uint64_t repro_seed;
+static uint64_t repro_time;
+
+static uint64_t fnv64(uint64_t h, const void* data, size_t len)
+{
+	const uint8_t* p = (const uint8_t*)data;
+
+	for (; len > 0; len--) {
+		h ^= *p++;
+		h *= FNV64_PRIME;
+	}
+	return h;
+}
+
+/* The splitmix64 finalizer, so that related inputs give unrelated outputs */
+static uint64_t mix64(uint64_t x)
+{
+	x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9ULL;
+	x = (x ^ (x >> 27)) * 0x94d049bb133111ebULL;
+	return x ^ (x >> 31);
+}
+
+static uint64_t Derive(const char* purpose, uint64_t index)
+{
+	uint64_t h = fnv64(FNV64_OFFSET, &repro_seed, sizeof(repro_seed));
+
+	h = fnv64(h, purpose, strlen(purpose));
+	h = fnv64(h, &index, sizeof(index));
+	return mix64(h);
+}
+
+/*
+ * Get the date of an ISO9660 image, from the modification date of its Primary Volume
+ * Descriptor, or from the creation date if the former isn't set.
+ */
+static BOOL GetIsoDate(const uint8_t* pvd, uint64_t* filetime)
+{
+	SYSTEMTIME st;
+	FILETIME ft;
+	const char* date;
+	int i, j, v[7];
+
+	if ((pvd[0] != 1) || (memcmp(&pvd[1], "CD001", 5) != 0))
+		return FALSE;
+	// "YYYYMMDDHHMMSScc" followed by the offset from GMT, in 15 minutes intervals
+	for (i = 0; i < 2; i++) {
+		date = (const char*)&pvd[(i == 0) ? 830 : 813];
+		memset(v, 0, sizeof(v));
+		for (j = 0; j < 16; j++) {
+			if ((date[j] < '0') || (date[j] > '9'))
+				break;
+			v[(j < 4) ? 0 : (j - 2) / 2] = v[(j < 4) ? 0 : (j - 2) / 2] * 10 + date[j] - '0';
+		}
+		if ((j < 16) || (v[0] < 1980))
+			continue;
+		memset(&st, 0, sizeof(st));
+		st.wYear = (WORD)v[0];
+		st.wMonth = (WORD)v[1];
+		st.wDay = (WORD)v[2];
+		st.wHour = (WORD)v[3];
+		st.wMinute = (WORD)v[4];
+		st.wSecond = (WORD)v[5];
+		if (!SystemTimeToFileTime(&st, &ft))
+			continue;
+		*filetime = ((uint64_t)ft.dwHighDateTime << 32) | ft.dwLowDateTime;
+		*filetime -= (int64_t)(int8_t)date[16] * 15 * 60 * 10000000LL;
+		return TRUE;
+	}
+	return FALSE;
+}
+
+/*
+ * Compute the seed, from which all the identifiers are derived, as well as the date we
+ * use for all timestamps. As hashing a multi GB image would take about as long as
+ * copying it, the source is fingerprinted from its size and its first and last 64 KB,
+ * which contain the partition tables, file system superblocks and, for ISOs, the volume
+ * descriptors along with their dates.
+ */
+void InitReproducible(const char* image, int fs, int pt, int bt, int dt)
+{
+	HANDLE hImage = INVALID_HANDLE_VALUE;
+	LARGE_INTEGER li;
+	SYSTEMTIME st;
+	FILETIME ft;
+	DWORD rSize, cluster_size;
+	uint64_t h = FNV64_OFFSET, disk_size = SelectedDrive.DiskSize;
+	uint8_t* buf = NULL;
+	char label[64];
+	int i;
+
+	repro_time = REPRO_DEFAULT_TIME;
+	h = fnv64(h, &fs, sizeof(fs));
+	h = fnv64(h, &pt, sizeof(pt));
+	h = fnv64(h, &bt, sizeof(bt));
+	h = fnv64(h, &dt, sizeof(dt));
+	h = fnv64(h, &disk_size, sizeof(disk_size));
+	cluster_size = (DWORD)ComboBox_GetItemData(hClusterSize, ComboBox_GetCurSel(hClusterSize));
+	h = fnv64(h, &cluster_size, sizeof(cluster_size));
+	GetWindowTextU(hLabel, label, sizeof(label));
+	h = fnv64(h, label, strlen(label));
+
+	if (image != NULL) {
+		hImage = CreateFileU(image, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, 0, NULL);
+		buf = (uint8_t*)calloc(REPRO_FINGERPRINT_SIZE, 1);
+		if ((hImage == INVALID_HANDLE_VALUE) || (buf == NULL) || (!GetFileSizeEx(hImage, &li))) {
+			uprintf("Could not fingerprint image for reproducible mode: %s", WindowsErrorString());
+		} else {
+			h = fnv64(h, &li.QuadPart, sizeof(li.QuadPart));
+			for (i = 0; i < 2; i++) {
+				if ((i == 1) && (li.QuadPart > REPRO_FINGERPRINT_SIZE)) {
+					li.QuadPart -= REPRO_FINGERPRINT_SIZE;
+					SetFilePointerEx(hImage, li, NULL, FILE_BEGIN);
+				}
+				if (!ReadFile(hImage, buf, REPRO_FINGERPRINT_SIZE, &rSize, NULL))
+					break;
+				h = fnv64(h, buf, rSize);
+				if ((i == 0) && (rSize >= 0x8000 + 2048) && (dt == DT_ISO))
+					GetIsoDate(&buf[0x8000], &repro_time);
+			}
+		}
+		safe_closehandle(hImage);
+		safe_free(buf);
+	}
+
+	repro_seed = mix64(h);
+	ft.dwLowDateTime = (DWORD)repro_time;
+	ft.dwHighDateTime = (DWORD)(repro_time >> 32);
+	FileTimeToSystemTime(&ft, &st);
+	uprintf("Reproducible mode: seed %016llX, timestamps set to %04d.%02d.%02d %02d:%02d:%02d",
+		repro_seed, st.wYear, st.wMonth, st.wDay, st.wHour, st.wMinute, st.wSecond);
+}
+
+DWORD GetReproducibleDword(const char* purpose)
+{
+	return (DWORD)Derive(purpose, 0);
+}
+
+/* Timestamps, in seconds since the Unix epoch */
+uint32_t GetReproducibleTime(void)
+{
+	return (uint32_t)((repro_time - FILETIME_UNIX_EPOCH) / 10000000);
+}
+
+/*
+ * Create a GUID, that is derived from the seed in reproducible mode, and random otherwise.
+ * The index is used to tell apart GUIDs that are created for the same purpose.
+ */
+void NewGuid(GUID* guid, const char* purpose, uint64_t index)
+{
+	uint64_t v[2];
+
+	if (!enable_reproducible) {
+		IGNORE_RETVAL(CoCreateGuid(guid));
+		return;
+	}
+	v[0] = Derive(purpose, 2 * index);
+	v[1] = Derive(purpose, 2 * index + 1);
+	memcpy(guid, v, sizeof(*guid));
+	// Make it look like a regular (version 4, variant 1) random GUID
+	guid->Data3 = (guid->Data3 & 0x0FFF) | 0x4000;
+	guid->Data4[0] = (guid->Data4[0] & 0x3F) | 0x80;
+}
+
+/*
+ * Set the creation, modification and access times of all the files and directories
+ * below path. Directories are processed after their content, since adding entries to
+ * them may update their timestamps.
+ */
+static void SetTimestamps(wchar_t* path, size_t len, const FILETIME* ft, uint32_t* nb_files)
+{
+	WIN32_FIND_DATAW wfd;
+	HANDLE hFind, hFile;
+	char name[MAX_PATH];
+	size_t n;
+
+	if (len + 2 >= MAX_PATH)
+		return;
+	wcscpy(&path[len], L"*");
+	hFind = FindFirstFileW(path, &wfd);
+	if (hFind == INVALID_HANDLE_VALUE)
+		return;
+	do {
+		if ((wcscmp(wfd.cFileName, L".") == 0) || (wcscmp(wfd.cFileName, L"..") == 0) ||
+			(_wcsicmp(wfd.cFileName, SYSTEM_VOLUME_INFORMATION) == 0))
+			continue;
+		n = wcslen(wfd.cFileName);
+		if (len + n + 2 >= MAX_PATH) {
+			wchar_to_utf8_no_alloc(wfd.cFileName, name, sizeof(name));
+			uprintf("Path is too long to set timestamps: %s", name);
+			continue;
+		}
+		wcscpy(&path[len], wfd.cFileName);
+		if (wfd.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY) {
+			wcscpy(&path[len + n], L"\\");
+			SetTimestamps(path, len + n + 1, ft, nb_files);
+			path[len + n] = 0;
+		}
+		hFile = CreateFileW(path, FILE_WRITE_ATTRIBUTES, FILE_SHARE_READ|FILE_SHARE_WRITE|FILE_SHARE_DELETE,
+			NULL, OPEN_EXISTING, FILE_FLAG_BACKUP_SEMANTICS, NULL);
+		if ((hFile == INVALID_HANDLE_VALUE) || (!SetFileTime(hFile, ft, ft, ft))) {
+			wchar_to_utf8_no_alloc(path, name, sizeof(name));
+			uprintf("Could not set timestamps of '%s': %s", name, WindowsErrorString());
+		} else
+			(*nb_files)++;
+		safe_closehandle(hFile);
+	} while (FindNextFileW(hFind, &wfd));
+	FindClose(hFind);
+}
+
+static BOOL ReadAt(HANDLE h, uint64_t offset, void* buf, DWORD size)
+{
+	LARGE_INTEGER li;
+	DWORD rSize;
+
+	li.QuadPart = offset;
+	return SetFilePointerEx(h, li, NULL, FILE_BEGIN) && ReadFile(h, buf, size, &rSize, NULL) && (rSize == size);
+}
+
+static BOOL WriteAt(HANDLE h, uint64_t offset, const void* buf, DWORD size)
+{
+	LARGE_INTEGER li;
+	DWORD wSize;
+
+	li.QuadPart = offset;
+	return SetFilePointerEx(h, li, NULL, FILE_BEGIN) && WriteFile(h, buf, size, &wSize, NULL) && (wSize == size);
+}
+
+/*
+ * The volume label of a FAT file system is stored as an entry of the root directory,
+ * which gets the time at which the file system was created.
+ */
+static BOOL PatchFATLabelEntry(HANDLE hVolume, const uint8_t* bs, BOOL fat32, DWORD SectorSize)
+{
+	const WORD BytesPerSec = *(WORD*)&bs[0x0b], RootEntCnt = *(WORD*)&bs[0x11];
+	const DWORD FATSz = fat32 ? *(DWORD*)&bs[0x24] : *(WORD*)&bs[0x16];
+	uint64_t offset = (uint64_t)*(WORD*)&bs[0x0e] + (uint64_t)bs[0x10] * FATSz;
+	DWORD size = fat32 ? bs[0x0d] * (DWORD)BytesPerSec : RootEntCnt * 32;
+	FILETIME ft;
+	WORD date, time;
+	uint8_t* buf;
+	DWORD i;
+	BOOL r = FALSE;
+
+	if (fat32)
+		offset += (uint64_t)(*(DWORD*)&bs[0x2c] - 2) * bs[0x0d];
+	offset *= BytesPerSec;
+	size = ((size + SectorSize - 1) / SectorSize) * SectorSize;
+	if ((BytesPerSec == 0) || (size == 0) || (size > 1024 * 1024))
+		return FALSE;
+	buf = (uint8_t*)_aligned_malloc(size, 0x1000);
+	if ((buf == NULL) || (!ReadAt(hVolume, offset, buf, size)))
+		goto out;
+	ft.dwLowDateTime = (DWORD)repro_time;
+	ft.dwHighDateTime = (DWORD)(repro_time >> 32);
+	FileTimeToDosDateTime(&ft, &date, &time);
+	for (i = 0; (i < size) && (buf[i] != 0); i += 32) {
+		if ((buf[i] == 0xe5) || (buf[i + 0x0b] != 0x08))
+			continue;
+		buf[i + 0x0d] = 0;
+		*(WORD*)&buf[i + 0x0e] = time;
+		*(WORD*)&buf[i + 0x10] = date;
+		*(WORD*)&buf[i + 0x12] = date;
+		*(WORD*)&buf[i + 0x16] = time;
+		*(WORD*)&buf[i + 0x18] = date;
+		r = WriteAt(hVolume, offset + (i / SectorSize) * SectorSize, &buf[(i / SectorSize) * SectorSize], SectorSize);
+		break;
+	}
+
+out:
+	_aligned_free(buf);
+	return r;
+}
+
+static uint32_t ExFATBootChecksum(const uint8_t* buf, DWORD size)
+{
+	uint32_t chk = 0;
+	DWORD i;
+
+	for (i = 0; i < size; i++) {
+		if ((i == 106) || (i == 107) || (i == 112))
+			continue;
+		chk = ((chk & 1) ? 0x80000000 : 0) + (chk >> 1) + buf[i];
+	}
+	return chk;
+}
+
+/*
+ * Set the serial number of the file system, in its boot record as well as in the backup
+ * copy, if any. The volume must be locked and dismounted.
+ */
+static BOOL PatchVolume(HANDLE hVolume, int fs, DWORD SectorSize)
+{
+	uint8_t* buf;
+	uint64_t backup = 0, serial = Derive("volume id", 0);
+	DWORD i, size = 12 * SectorSize, count;
+	BOOL r = FALSE, fat32 = FALSE;
+
+	buf = (uint8_t*)_aligned_malloc(size, 0x1000);
+	if ((buf == NULL) || (!ReadAt(hVolume, 0, buf, SectorSize)))
+		goto out;
+
+	switch (fs) {
+	case FS_FAT16:
+	case FS_FAT32:
+		if ((memcmp(&buf[0x52], "FAT32   ", 8) == 0) && (buf[0x42] == 0x29)) {
+			*(DWORD*)&buf[0x43] = (DWORD)serial;
+			backup = *(WORD*)&buf[0x32];
+			fat32 = TRUE;
+		} else if ((memcmp(&buf[0x36], "FAT", 3) == 0) && (buf[0x26] == 0x29)) {
+			*(DWORD*)&buf[0x27] = (DWORD)serial;
+		} else {
+			break;
+		}
+		if (!PatchFATLabelEntry(hVolume, buf, fat32, SectorSize))
+			uprintf("Could not set timestamp of the volume label");
+		r = WriteAt(hVolume, 0, buf, SectorSize) && ((backup == 0) ||
+			WriteAt(hVolume, backup * *(WORD*)&buf[0x0b], buf, SectorSize));
+		break;
+	case FS_NTFS:
+		if (memcmp(&buf[0x03], "NTFS    ", 8) != 0)
+			break;
+		memcpy(&buf[0x48], &serial, sizeof(serial));
+		// The backup boot sector is located right after the end of the file system
+		backup = *(uint64_t*)&buf[0x28] * *(WORD*)&buf[0x0b];
+		DeviceIoControl(hVolume, FSCTL_ALLOW_EXTENDED_DASD_IO, NULL, 0, NULL, 0, &count, NULL);
+		r = WriteAt(hVolume, 0, buf, SectorSize) && WriteAt(hVolume, backup, buf, SectorSize);
+		break;
+	case FS_EXFAT:
+		if ((memcmp(&buf[0x03], "EXFAT   ", 8) != 0) || ((1UL << buf[0x6c]) != SectorSize) ||
+			(!ReadAt(hVolume, 0, buf, size)))
+			break;
+		*(DWORD*)&buf[0x64] = (DWORD)serial;
+		// The boot region (and its backup) is 12 sectors, the last of which holds a checksum
+		count = ExFATBootChecksum(buf, 11 * SectorSize);
+		for (i = 0; i < SectorSize / 4; i++)
+			((DWORD*)&buf[11 * SectorSize])[i] = count;
+		r = WriteAt(hVolume, 0, buf, size) && WriteAt(hVolume, size, buf, size);
+		break;
+	default:
+		uprintf("Reproducible mode: serial number of %s file systems cannot be set", FileSystemLabel[fs]);
+		r = TRUE;
+		break;
+	}
+
+out:
+	_aligned_free(buf);
+	return r;
+}
+
+static BOOL HashDrive(HANDLE hDrive, uint64_t size, char* hash_str)
+{
+	sha1_ctx ctx;
+	uint8_t *buf, digest[20];
+	uint64_t pos;
+	DWORD rSize;
+	LARGE_INTEGER li;
+	BOOL r = FALSE;
+	int i;
+
+	buf = (uint8_t*)_aligned_malloc(REPRO_HASH_BUFFER_SIZE, 0x1000);
+	li.QuadPart = 0;
+	if ((buf == NULL) || (!SetFilePointerEx(hDrive, li, NULL, FILE_BEGIN)))
+		goto out;
+	sha1_init(&ctx);
+	for (pos = 0; pos < size; pos += rSize) {
+		if (IS_ERROR(FormatStatus))
+			goto out;
+		if ((!ReadFile(hDrive, buf, (DWORD)MIN(REPRO_HASH_BUFFER_SIZE, size - pos), &rSize, NULL)) || (rSize == 0)) {
+			uprintf("Could not read drive at offset 0x%llx: %s", pos, WindowsErrorString());
+			goto out;
+		}
+		sha1_update(&ctx, buf, rSize);
+	}
+	sha1_final(&ctx, digest);
+	for (i = 0; i < 20; i++)
+		sprintf(&hash_str[2 * i], "%02x", digest[i]);
+	r = TRUE;
+
+out:
+	_aligned_free(buf);
+	return r;
+}
+
+/*
+ * Once everything has been written, fix the timestamps and serial number of the file
+ * system (if we can access it, i.e. if drive_name is not NULL) and report the hash of
+ * the drive. Failing to do so is not an error, as the media is still perfectly usable.
+ */
+void FinalizeReproducible(HANDLE hPhysicalDrive, DWORD DriveIndex, const char* drive_name, int fs)
+{
+	const DWORD SectorSize = SelectedDrive.Geometry.BytesPerSector;
+	HANDLE hLogicalVolume = INVALID_HANDLE_VALUE;
+	wchar_t path[MAX_PATH];
+	uint64_t t = repro_time;
+	uint32_t nb_files = 0;
+	FILETIME ft;
+	DWORD size;
+	char hash_str[41];
+	BOOL reproducible = TRUE;
+
+	if (drive_name != NULL) {
+		ft.dwLowDateTime = (DWORD)t;
+		ft.dwHighDateTime = (DWORD)(t >> 32);
+		// FAT stores local time, so make sure we get the same values, whatever the time zone
+		if ((fs == FS_FAT16) || (fs == FS_FAT32) || (fs == FS_EXFAT))
+			LocalFileTimeToFileTime(&ft, &ft);
+		swprintf(path, MAX_PATH, L"%c:\\", drive_name[0]);
+		SetTimestamps(path, wcslen(path), &ft, &nb_files);
+		uprintf("Reproducible mode: set timestamps of %d files and directories", nb_files);
+
+		// Check right before locking the volume, after which Windows can no longer add to it
+		swprintf(path, MAX_PATH, L"%c:\\" SYSTEM_VOLUME_INFORMATION, drive_name[0]);
+		if (GetFileAttributesW(path) != INVALID_FILE_ATTRIBUTES) {
+			uprintf("Windows created a 'System Volume Information' folder on the volume");
+			reproducible = FALSE;
+		}
+
+		// Locking the volume flushes it, and the dismount ensures that Windows won't
+		// overwrite what we patch with the data it has cached
+		hLogicalVolume = GetLogicalHandle(DriveIndex, TRUE, TRUE);
+		if ((hLogicalVolume == INVALID_HANDLE_VALUE) || (hLogicalVolume == NULL) ||
+			(!DeviceIoControl(hLogicalVolume, FSCTL_DISMOUNT_VOLUME, NULL, 0, NULL, 0, &size, NULL))) {
+			uprintf("Could not dismount volume: %s", WindowsErrorString());
+			reproducible = FALSE;
+		} else if (!PatchVolume(hLogicalVolume, fs, SectorSize)) {
+			uprintf("Could not set volume serial number: %s", WindowsErrorString());
+			reproducible = FALSE;
+		}
+	}
+
+	// Hash the drive while the volume is still locked, so that nothing can get written to it
+	uprintf("Computing SHA-1 of the whole drive...");
+	if (HashDrive(hPhysicalDrive, SelectedDrive.DiskSize, hash_str))
+		uprintf("Drive SHA-1: %s%s", hash_str, reproducible ? "" : " (NOT REPRODUCIBLE)");
+	else if (!IS_ERROR(FormatStatus))
+		uprintf("Could not compute the drive SHA-1");
+	safe_unlockclose(hLogicalVolume);
+}
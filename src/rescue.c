@@ -0,0 +1,483 @@
+/*
+ * Rufus: The Reliable USB Formatting Utility
+ * Fault tolerant capture of failing drives
+ * Copyright © 2015 Pete Batard <pete@akeo.ie>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * This works along the same lines as GNU ddrescue: we first copy as much as we can
+ * from the drive, skipping ahead (further and further) whenever a read fails or is
+ * slow, since this is where a failing drive spends most of its time. We then go back
+ * for the areas we skipped, and finally read the blocks that failed one sector at a
+ * time, to salvage whatever we can around the bad sectors.
+ *
+ * The state of each area of the drive is kept in a map, that is saved alongside the
+ * image in a format similar to the one of ddrescue, so that an interrupted capture
+ * can be resumed. As the map is only of use with the drive it was created for, it
+ * also records the VID:PID, serial number and size of that drive, and an interrupted
+ * capture is only resumed when all of these match. The areas that could not be read
+ * are zeroed in the image.
+ */
+
+#include <windows.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "rufus.h"
+#include "msapi_utf8.h"
+#include "resource.h"
+#include "localization.h"
+
+#define RESCUE_BLOCK_SIZE           DD_BUFFER_SIZE
+#define RESCUE_MAX_SKIP_SIZE        (256 * 1024 * 1024)
+#define RESCUE_SLOW_READ_TIME       1000		// in ms, for a whole block
+#define RESCUE_MAP_SAVE_INTERVAL    5000		// in ms
+#define RESCUE_RETRY_PASSES         1
+#define RESCUE_MAP_DEVICE           "# device: "
+#define RESCUE_MAP_SIZE             "# size: "
+
+/* Area status, using the same characters as ddrescue */
+#define STATUS_UNTRIED              '?'
+#define STATUS_UNTRIMMED            '*'
+#define STATUS_UNSCRAPED            '/'
+#define STATUS_BAD                  '-'
+#define STATUS_GOOD                 '+'
+
+typedef struct {
+	uint64_t offset;
+	uint64_t size;
+	char status;
+} rescue_area;
+
+typedef struct {
+	rescue_area* area;
+	uint32_t nb;
+	uint32_t max;
+	uint64_t size;
+	HANDLE hSource;
+	HANDLE hDest;
+	DWORD sector_size;
+	uint8_t* buf;
+	const char* path;
+	const char* device_id;		// "VID:PID serial", or empty if we couldn't identify the drive
+	DWORD last_save;
+} rescue_map;
+
+BOOL enable_rescue = FALSE;
+static DWORD LastRescueRefresh;
+
+// Index of the area that contains offset
+static uint32_t find_area(const rescue_map* map, uint64_t offset)
+{
+	uint32_t lo = 0, hi = map->nb - 1, mid;
+
+	while (lo < hi) {
+		mid = (lo + hi + 1) / 2;
+		if (map->area[mid].offset <= offset)
+			lo = mid;
+		else
+			hi = mid - 1;
+	}
+	return lo;
+}
+
+// Set the status of [offset, offset + size), merging it with the neighbouring areas that have the same
+static BOOL set_status(rescue_map* map, uint64_t offset, uint64_t size, char status)
+{
+	rescue_area a[3], *area;
+	uint64_t start = offset, end = offset + size;
+	uint32_t first, last, k, n = 0;
+
+	if (size == 0)
+		return TRUE;
+	first = find_area(map, offset);
+	last = find_area(map, end - 1);
+	if (map->area[first].offset < offset) {
+		if (map->area[first].status == status) {
+			start = map->area[first].offset;
+		} else {
+			a[n].offset = map->area[first].offset;
+			a[n].size = offset - map->area[first].offset;
+			a[n++].status = map->area[first].status;
+		}
+	} else if ((first > 0) && (map->area[first - 1].status == status)) {
+		start = map->area[--first].offset;
+	}
+	k = n;
+	a[n].offset = start;
+	a[n++].status = status;
+	if (map->area[last].offset + map->area[last].size > end) {
+		if (map->area[last].status == status) {
+			end = map->area[last].offset + map->area[last].size;
+		} else {
+			a[n].offset = end;
+			a[n].size = map->area[last].offset + map->area[last].size - end;
+			a[n++].status = map->area[last].status;
+		}
+	} else if ((last + 1 < map->nb) && (map->area[last + 1].status == status)) {
+		last++;
+		end = map->area[last].offset + map->area[last].size;
+	}
+	a[k].size = end - start;
+
+	if (map->nb - (last - first + 1) + n > map->max) {
+		area = (rescue_area*)realloc(map->area, 2 * map->max * sizeof(rescue_area));
+		if (area == NULL)
+			return FALSE;
+		map->area = area;
+		map->max *= 2;
+	}
+	if (n != last - first + 1)
+		memmove(&map->area[first + n], &map->area[last + 1], (map->nb - last - 1) * sizeof(rescue_area));
+	memcpy(&map->area[first], a, n * sizeof(rescue_area));
+	map->nb = map->nb - (last - first + 1) + n;
+	return TRUE;
+}
+
+static uint64_t get_status_size(const rescue_map* map, char status)
+{
+	uint64_t size = 0;
+	uint32_t i;
+
+	for (i = 0; i < map->nb; i++) {
+		if (map->area[i].status == status)
+			size += map->area[i].size;
+	}
+	return size;
+}
+
+/*
+ * The map is a text file, with one "offset size status" line per area, that covers the
+ * whole drive, preceded by comments identifying the drive. An existing map that doesn't
+ * cover the whole drive, or that was created for another drive, is discarded.
+ */
+static BOOL load_map(rescue_map* map)
+{
+	FILE* fd;
+	char line[256], status;
+	uint64_t offset, size, device_size = 0;
+	BOOL same_device = FALSE;
+
+	map->nb = 0;
+	if (map->device_id[0] == 0) {
+		uprintf("Not using rescue map '%s', as this drive cannot be identified", map->path);
+		return FALSE;
+	}
+	fd = fopenU(map->path, "r");
+	if (fd == NULL)
+		return FALSE;
+	while (fgets(line, sizeof(line), fd) != NULL) {
+		if (strncmp(line, RESCUE_MAP_DEVICE, sizeof(RESCUE_MAP_DEVICE) - 1) == 0) {
+			line[strcspn(line, "\r\n")] = 0;
+			same_device = (strcmp(&line[sizeof(RESCUE_MAP_DEVICE) - 1], map->device_id) == 0);
+			continue;
+		}
+		if (strncmp(line, RESCUE_MAP_SIZE, sizeof(RESCUE_MAP_SIZE) - 1) == 0) {
+			if (sscanf(&line[sizeof(RESCUE_MAP_SIZE) - 1], "%llx", &device_size) != 1)
+				device_size = 0;
+			continue;
+		}
+		if ((line[0] == '#') || (line[0] == '\r') || (line[0] == '\n'))
+			continue;
+		if ((!same_device) || (device_size != map->size))
+			break;
+		if ( (sscanf(line, "%llx %llx %c", &offset, &size, &status) != 3) || (size == 0)
+		  || (strchr("?*/-+", status) == NULL) || (offset != ((map->nb == 0) ? 0 :
+			  map->area[map->nb - 1].offset + map->area[map->nb - 1].size)) )
+			break;
+		if (map->nb >= map->max) {
+			rescue_area* area = (rescue_area*)realloc(map->area, 2 * map->max * sizeof(rescue_area));
+			if (area == NULL)
+				break;
+			map->area = area;
+			map->max *= 2;
+		}
+		map->area[map->nb].offset = offset;
+		map->area[map->nb].size = size;
+		map->area[map->nb++].status = status;
+	}
+	fclose(fd);
+	if ( (!same_device) || (device_size != map->size) || (map->nb == 0)
+	  || (map->area[map->nb - 1].offset + map->area[map->nb - 1].size != map->size) ) {
+		uprintf("Ignoring rescue map '%s', as it does not match this drive", map->path);
+		map->nb = 0;
+		return FALSE;
+	}
+	return TRUE;
+}
+
+// Whatever the map says is good must have made it to the image before the map is saved
+static BOOL save_map(rescue_map* map)
+{
+	FILE* fd;
+	uint32_t i;
+
+	map->last_save = GetTickCount();
+	if (!FlushFileBuffers(map->hDest))
+		return FALSE;
+	fd = fopenU(map->path, "w");
+	if (fd == NULL) {
+		uprintf("Could not save rescue map '%s'", map->path);
+		return FALSE;
+	}
+	fprintf(fd, "# Rescue map, created by " APPLICATION_NAME "\n");
+	fprintf(fd, RESCUE_MAP_DEVICE "%s\n" RESCUE_MAP_SIZE "0x%llx\n", map->device_id, map->size);
+	fprintf(fd, "#     offset          size  status\n");
+	for (i = 0; i < map->nb; i++)
+		fprintf(fd, "0x%012llx  0x%012llx  %c\n", map->area[i].offset, map->area[i].size, map->area[i].status);
+	fclose(fd);
+	return TRUE;
+}
+
+static void rescue_progress(rescue_map* map)
+{
+	float percent;
+
+	if (GetTickCount() > map->last_save + RESCUE_MAP_SAVE_INTERVAL)
+		save_map(map);
+	if (GetTickCount() > LastRescueRefresh + 25) {
+		LastRescueRefresh = GetTickCount();
+		percent = (100.0f * (get_status_size(map, STATUS_GOOD) + get_status_size(map, STATUS_BAD))) / (1.0f * map->size);
+		PrintInfo(0, MSG_261, percent);
+		UpdateProgress(OP_FORMAT, percent);
+	}
+}
+
+static BOOL write_data(rescue_map* map, uint64_t offset, const void* buf, DWORD size)
+{
+	LARGE_INTEGER li;
+	DWORD wSize;
+
+	li.QuadPart = offset;
+	if ( (!SetFilePointerEx(map->hDest, li, NULL, FILE_BEGIN))
+	  || (!WriteFile(map->hDest, buf, size, &wSize, NULL)) || (wSize != size) ) {
+		uprintf("write error: %s", WindowsErrorString());
+		FormatStatus = ERROR_SEVERITY_ERROR|FAC(FACILITY_STORAGE)|ERROR_WRITE_FAULT;
+		return FALSE;
+	}
+	return TRUE;
+}
+
+/*
+ * Read a block from the source into the image and update its status. Returns 1 if
+ * the read was fine, 0 if it failed, 2 if it succeeded but was slow and -1 on error.
+ */
+static int rescue_block(rescue_map* map, uint64_t offset, DWORD size, char fail_status)
+{
+	LARGE_INTEGER li;
+	DWORD rSize, start_time = GetTickCount();
+
+	li.QuadPart = offset;
+	if ( (!SetFilePointerEx(map->hSource, li, NULL, FILE_BEGIN))
+	  || (!ReadFile(map->hSource, map->buf, size, &rSize, NULL)) || (rSize != size) )
+		return set_status(map, offset, size, fail_status) ? 0 : -1;
+	if ( (!write_data(map, offset, map->buf, size))
+	  || (!set_status(map, offset, size, STATUS_GOOD)) )
+		return -1;
+	return (GetTickCount() - start_time > RESCUE_SLOW_READ_TIME) ? 2 : 1;
+}
+
+/*
+ * Copy the areas that haven't been tried yet, in blocks. If skip is set, we jump over
+ * the data that follows a failed or slow read, doubling the jump every time, and only
+ * go back for it on the next pass.
+ */
+static BOOL copy_pass(rescue_map* map, BOOL skip)
+{
+	uint64_t offset, end, skip_size = RESCUE_BLOCK_SIZE;
+	uint32_t i;
+	int r;
+
+	for (offset = 0; offset < map->size; ) {
+		if (IS_ERROR(FormatStatus))
+			return FALSE;
+		i = find_area(map, offset);
+		if (map->area[i].status != STATUS_UNTRIED) {
+			offset = map->area[i].offset + map->area[i].size;
+			continue;
+		}
+		end = map->area[i].offset + map->area[i].size;
+		r = rescue_block(map, offset, (DWORD)MIN(RESCUE_BLOCK_SIZE, end - offset), STATUS_UNTRIMMED);
+		if (r < 0)
+			return FALSE;
+		offset += MIN(RESCUE_BLOCK_SIZE, end - offset);
+		if ((skip) && (r != 1)) {
+			offset = MIN(offset + skip_size, end);
+			skip_size = MIN(2 * skip_size, RESCUE_MAX_SKIP_SIZE);
+		} else if (r == 1) {
+			skip_size = RESCUE_BLOCK_SIZE;
+		}
+		rescue_progress(map);
+	}
+	return TRUE;
+}
+
+/*
+ * Read the blocks that failed one sector at a time, from both of their ends, until we
+ * hit a bad sector. What lies in between is left for the scraping pass.
+ */
+static BOOL trim_pass(rescue_map* map)
+{
+	uint64_t start, end, area_end;
+	uint32_t i;
+	int r;
+
+	for (i = 0; i < map->nb; i++) {
+		if (map->area[i].status != STATUS_UNTRIMMED)
+			continue;
+		start = map->area[i].offset;
+		end = area_end = start + map->area[i].size;
+		for (r = 1; (r > 0) && (start < end); start += map->sector_size) {
+			if (IS_ERROR(FormatStatus))
+				return FALSE;
+			r = rescue_block(map, start, map->sector_size, STATUS_BAD);
+		}
+		for (r = 1; (r > 0) && (start < end); end -= map->sector_size) {
+			if (IS_ERROR(FormatStatus))
+				return FALSE;
+			r = rescue_block(map, end - map->sector_size, map->sector_size, STATUS_BAD);
+		}
+		if ((r < 0) || (!set_status(map, start, end - start, STATUS_UNSCRAPED)))
+			return FALSE;
+		rescue_progress(map);
+		// The areas have changed, so carry on from the last one we just processed
+		i = find_area(map, area_end - 1);
+	}
+	return TRUE;
+}
+
+// Read all the sectors of the areas that have the given status, one at a time
+static BOOL sector_pass(rescue_map* map, char status)
+{
+	uint64_t offset;
+	uint32_t i;
+
+	for (offset = 0; offset < map->size; ) {
+		i = find_area(map, offset);
+		if (map->area[i].status != status) {
+			offset = map->area[i].offset + map->area[i].size;
+			continue;
+		}
+		if (IS_ERROR(FormatStatus))
+			return FALSE;
+		if (rescue_block(map, offset, map->sector_size, STATUS_BAD) < 0)
+			return FALSE;
+		offset += map->sector_size;
+		rescue_progress(map);
+	}
+	return TRUE;
+}
+
+/*
+ * Capture the content of a failing drive into an image, by getting as much data as
+ * possible as fast as possible, and then working our way around the bad areas.
+ */
+BOOL RescueCapture(HANDLE hSource, const char* device_id, uint64_t size, DWORD sector_size,
+	HANDLE hDest, const char* map_path)
+{
+	rescue_map map = { 0 };
+	LARGE_INTEGER li;
+	uint64_t bad_size = 0;
+	uint32_t i, pass, nb_bad = 0;
+	BOOL r = FALSE;
+
+	if ((size == 0) || (sector_size == 0) || (size % sector_size != 0) || (RESCUE_BLOCK_SIZE % sector_size != 0))
+		return FALSE;
+	map.size = size;
+	map.hSource = hSource;
+	map.hDest = hDest;
+	map.sector_size = sector_size;
+	map.path = map_path;
+	map.device_id = (device_id == NULL) ? "" : device_id;
+	map.max = 64;
+	map.area = (rescue_area*)malloc(map.max * sizeof(rescue_area));
+	map.buf = (uint8_t*)malloc(RESCUE_BLOCK_SIZE);
+	if ((map.area == NULL) || (map.buf == NULL)) {
+		FormatStatus = ERROR_SEVERITY_ERROR|FAC(FACILITY_STORAGE)|ERROR_NOT_ENOUGH_MEMORY;
+		goto out;
+	}
+	if (load_map(&map)) {
+		uprintf("Resuming capture from rescue map '%s' (%s already rescued)", map_path,
+			SizeToHumanReadable(get_status_size(&map, STATUS_GOOD), TRUE, FALSE));
+	} else {
+		map.nb = 1;
+		map.area[0].offset = 0;
+		map.area[0].size = size;
+		map.area[0].status = STATUS_UNTRIED;
+		// We are starting afresh, so make sure the image doesn't contain leftovers
+		li.QuadPart = 0;
+		if ((!SetFilePointerEx(hDest, li, NULL, FILE_BEGIN)) || (!SetEndOfFile(hDest)))
+			goto write_error;
+	}
+	li.QuadPart = size;
+	if ((!SetFilePointerEx(hDest, li, NULL, FILE_BEGIN)) || (!SetEndOfFile(hDest)))
+		goto write_error;
+	LastRescueRefresh = 0;
+	map.last_save = GetTickCount();
+
+	uprintf("Rescue pass 1: Copying, skipping over bad areas...");
+	if (!copy_pass(&map, TRUE))
+		goto out;
+	uprintf("Rescue pass 2: Copying skipped areas...");
+	if ((!copy_pass(&map, FALSE)) || (!save_map(&map)))
+		goto out;
+	uprintf("Rescue pass 3: Trimming failed blocks...");
+	if ((!trim_pass(&map)) || (!save_map(&map)))
+		goto out;
+	uprintf("Rescue pass 4: Scraping failed blocks...");
+	if ((!sector_pass(&map, STATUS_UNSCRAPED)) || (!save_map(&map)))
+		goto out;
+	for (pass = 0; (pass < RESCUE_RETRY_PASSES) && (get_status_size(&map, STATUS_BAD) != 0); pass++) {
+		uprintf("Rescue pass %d: Retrying bad sectors...", 5 + pass);
+		if ((!sector_pass(&map, STATUS_BAD)) || (!save_map(&map)))
+			goto out;
+	}
+
+	// Don't leave whatever happened to be in the image where the drive could not be read
+	memset(map.buf, 0, RESCUE_BLOCK_SIZE);
+	for (i = 0; i < map.nb; i++) {
+		if (map.area[i].status == STATUS_GOOD)
+			continue;
+		nb_bad++;
+		bad_size += map.area[i].size;
+		for (li.QuadPart = 0; (uint64_t)li.QuadPart < map.area[i].size; li.QuadPart += RESCUE_BLOCK_SIZE) {
+			if (!write_data(&map, map.area[i].offset + li.QuadPart, map.buf,
+				(DWORD)MIN(RESCUE_BLOCK_SIZE, map.area[i].size - li.QuadPart)))
+				goto out;
+		}
+	}
+	if (nb_bad == 0) {
+		uprintf("All data was rescued");
+		DeleteFileU(map_path);
+	} else {
+		uprintf("WARNING: %s in %d area(s) could not be read, and was zeroed in the image",
+			SizeToHumanReadable(bad_size, TRUE, FALSE), nb_bad);
+		uprintf("The rescue map was saved to '%s'", map_path);
+	}
+	r = TRUE;
+	goto out;
+
+write_error:
+	uprintf("Could not set the size of the image: %s", WindowsErrorString());
+	FormatStatus = ERROR_SEVERITY_ERROR|FAC(FACILITY_STORAGE)|ERROR_WRITE_FAULT;
+out:
+	if ((!r) && (map.nb != 0))
+		save_map(&map);
+	free(map.area);
+	free(map.buf);
+	return r;
+}
@@ -40,6 +40,8 @@
 #include "rufus.h"
 #include "drive.h"
 #include "registry.h"
+#include "multiboot.h"
+#include "wim.h"
 #include "localization.h"
 #include "bled/bled.h"
 #include "../res/grub/grub_version.h"
@@ -90,7 +92,7 @@ PF_DECL(ImageList_ReplaceIcon);
 PF_TYPE_DECL(WINAPI, BOOL, SHChangeNotifyDeregister, (ULONG));
 PF_TYPE_DECL(WINAPI, ULONG, SHChangeNotifyRegister, (HWND, int, LONG, UINT, int, const MY_SHChangeNotifyEntry*));
 
-const char* FileSystemLabel[FS_MAX] = { "FAT", "FAT32", "NTFS", "UDF", "exFAT", "ReFS" };
+const char* FileSystemLabel[FS_MAX] = { "FAT", "FAT32", "NTFS", "UDF", "exFAT", "ReFS", "ext2", "ext4" };
 // Number of steps for each FS for FCC_STRUCTURE_PROGRESS
 const int nb_steps[FS_MAX] = { 5, 5, 12, 1, 10 };
 static const char* PartitionTypeLabel[2] = { "MBR", "GPT" };
@@ -129,6 +131,7 @@ BOOL use_own_c32[NB_OLD_C32] = {FALSE, FALSE}, detect_fakes = TRUE, mbr_selected
 BOOL iso_op_in_progress = FALSE, format_op_in_progress = FALSE, right_to_left_mode = FALSE;
 BOOL enable_HDDs = FALSE, advanced_mode = TRUE, force_update = FALSE, use_fake_units = TRUE;
 BOOL allow_dual_uefi_bios = FALSE;
+uint64_t persistence_size = 0;
 int dialog_showing = 0;
 uint16_t rufus_version[4], embedded_sl_version[2];
 char embedded_sl_version_str[2][12] = { "?.??", "?.??" };
@@ -136,7 +139,7 @@ char embedded_sl_version_ext[2][32];
 char embedded_grub_version[] = GRUB4DOS_VERSION;
 char embedded_grub2_version[] = GRUB2_PACKAGE_VERSION;
 RUFUS_UPDATE update = { {0,0,0,0}, {0,0}, NULL, NULL};
-StrArray DriveID, DriveLabel;
+StrArray DriveID, DriveLabel, DriveHwID;
 extern char szStatusMessage[256];
 
 static HANDLE format_thid = NULL;
@@ -309,6 +312,13 @@ static BOOL DefineClusterSizes(void)
 				SelectedDrive.ClusterSize[FS_REFS].Default = 1;
 			}
 		}
+
+		// ext2/ext4 (we don't use the 64bit feature, so we are limited to 2^32 blocks)
+		if (SelectedDrive.DiskSize < 16*TB) {
+			SelectedDrive.ClusterSize[FS_EXT2].Allowed = 0x00001C00;
+			SelectedDrive.ClusterSize[FS_EXT2].Default = (SelectedDrive.DiskSize < 512*MB) ? 1024 : 4096;
+			SelectedDrive.ClusterSize[FS_EXT4] = SelectedDrive.ClusterSize[FS_EXT2];
+		}
 	}
 
 out:
@@ -468,7 +478,7 @@ static void SetFSFromISO(void)
 
 	// Syslinux and EFI have precedence over bootmgr (unless the user selected BIOS as target type)
 	if ((HAS_SYSLINUX(iso_report)) || (IS_REACTOS(iso_report)) || (iso_report.has_kolibrios) ||
-		((IS_EFI(iso_report)) && (bt == BT_UEFI) && (!iso_report.has_4GB_file))) {
+		(HAS_EL_TORITO_FLOPPY(iso_report)) || ((IS_EFI(iso_report)) && (bt == BT_UEFI) && (!iso_report.has_4GB_file))) {
 		if (fs_mask & (1<<FS_FAT32)) {
 			selected_fs = FS_FAT32;
 		} else if ((fs_mask & (1<<FS_FAT16)) && (!iso_report.has_kolibrios)) {
@@ -654,6 +664,9 @@ static void InitProgress(BOOL bOnlyFormat)
 		if (IsChecked(IDC_BADBLOCKS)) {
 			nb_slots[OP_BADBLOCKS] = -1;
 		}
+		if (enable_secure_erase || enable_reproducible) {
+			nb_slots[OP_ERASE] = -1;
+		}
 		if (IsChecked(IDC_BOOT)) {
 			// 1 extra slot for PBR writing
 			switch (selection_default) {
@@ -906,6 +919,7 @@ static void DisplayISOProps(void)
 	uprintf("  Has a >64 chars filename: %s", YesNo(iso_report.has_long_filename));
 	uprintf("  Has Symlinks: %s", YesNo(iso_report.has_symlinks));
 	uprintf("  Has a >4GB file: %s", YesNo(iso_report.has_4GB_file));
+	uprintf("  Has a >4GB install.wim: %s", YesNo(iso_report.has_4GB_wim));
 	uprintf("  Uses Bootmgr: %s", YesNo(iso_report.has_bootmgr));
 	uprintf("  Uses EFI: %s%s", YesNo(iso_report.has_efi || iso_report.has_win7_efi), (iso_report.has_win7_efi && (!iso_report.has_efi)) ? " (win7_x64)" : "");
 	uprintf("  Uses Grub 2: %s", YesNo(iso_report.has_grub2));
@@ -917,8 +931,44 @@ static void DisplayISOProps(void)
 		}
 	}
 	uprintf("  Uses KolibriOS: %s", YesNo(iso_report.has_kolibrios));
+	uprintf("  Supports persistence: %s%s", YesNo(HAS_PERSISTENCE(iso_report)),
+		iso_report.uses_casper ? " (casper)" : (iso_report.uses_debian_live ? " (Debian live)" : ""));
 	uprintf("  Uses ReactOS: %s", YesNo(IS_REACTOS(iso_report)));
 	uprintf("  Uses WinPE: %s%s", YesNo(IS_WINPE(iso_report.winpe)), (iso_report.uses_minint) ? " (with /minint)" : "");
+	uprintf("  Uses El Torito emulation: %s", HAS_EL_TORITO_FLOPPY(iso_report) ? "Floppy (will use FreeDOS)" :
+		(HAS_EL_TORITO_HDD(iso_report) ? "Hard disk" : "No"));
+}
+
+// Hybrid ISOs can either be extracted or written raw, and, provided that both produce a bootable
+// drive, we want to use whichever we expect to be the fastest.
+static void SelectHybridWriteMode(void)
+{
+	uint64_t raw_time = EstimateWriteTime(TRUE), extract_time = EstimateWriteTime(FALSE);
+
+	uprintf("Estimated write time: %d s as image, %d s as files",
+		(int)(raw_time/1000), (int)(extract_time/1000));
+	// Extraction produces a drive that the user can modify, so only switch if the gain is worth it
+	if (raw_time * 4 < extract_time * 3) {
+		uprintf("Hybrid ISO will be written as a disk image, as this should be faster");
+		iso_report.is_bootable_img = TRUE;
+		iso_report.projected_size = iso_report.src_size;
+	}
+}
+
+// Rebuild the image described by a zsync control file, which we then scan in its stead
+DWORD WINAPI ZsyncThread(LPVOID param)
+{
+	char* path;
+
+	path = ZsyncReconstruct(image_path);
+	safe_free(image_path);
+	image_path = path;
+	PostMessage(hMainDialog, UM_FORMAT_COMPLETED, 0, 0);
+	if (image_path != NULL) {
+		iso_provided = TRUE;
+		PostMessage(hMainDialog, WM_COMMAND, IDC_SELECT_ISO, 0);
+	}
+	ExitThread(0);
 }
 
 // The scanning process can be blocking for message processing => use a thread
@@ -926,13 +976,14 @@ DWORD WINAPI ISOScanThread(LPVOID param)
 {
 	int i;
 	BOOL r;
+	char multiboot_str[64];
 
 	if (image_path == NULL)
 		goto out;
 	PrintInfoDebug(0, MSG_202);
 	user_notified = FALSE;
 	EnableControls(FALSE);
-	r = ExtractISO(image_path, "", TRUE) || IsHDImage(image_path);
+	r = ScanImage(image_path);
 	EnableControls(TRUE);
 	if (!r) {
 		// TODO: is that needed?
@@ -942,14 +993,47 @@ DWORD WINAPI ISOScanThread(LPVOID param)
 		goto out;
 	}
 
+	if (enable_multiboot) {
+		// In multiboot mode, each ISO that gets selected is added to the list of images
+		// to copy, and the drive is made bootable with a Grub4DOS menu listing all of them
+		if (iso_report.is_bootable_img) {
+			uprintf("Multiboot: '%s' is a disk image and cannot be added", image_path);
+		} else {
+			DisplayISOProps();
+			if (AddMultibootImage(image_path)) {
+				CheckDlgButton(hMainDialog, IDC_BOOT, BST_CHECKED);
+				selection_default = DT_GRUB4DOS;
+				SendMessage(hMainDialog, WM_COMMAND, (CBN_SELCHANGE<<16) | IDC_FILESYSTEM,
+					ComboBox_GetCurSel(hFileSystem));
+				SetWindowTextU(hLabel, "MULTIBOOT");
+			}
+		}
+		// TODO: add a localized message
+		safe_sprintf(multiboot_str, sizeof(multiboot_str), "Multiboot: %d image(s), %s", nb_multiboot_images,
+			SizeToHumanReadable(GetMultibootSize(NULL), FALSE, FALSE));
+		PrintStatus(0, MSG_000, multiboot_str);
+		SendMessage(hMainDialog, WM_NEXTDLGCTL, (WPARAM)GetDlgItem(hMainDialog, IDC_START), TRUE);
+		goto out;
+	}
+
 	if (iso_report.is_bootable_img) {
-		uprintf("Using bootable %s image: '%s'", iso_report.is_vhd?"VHD":"disk", image_path);
+		uprintf("Using bootable %s image: '%s'", iso_report.is_vhd?"VHD":(iso_report.is_dmg?"DMG":(iso_report.is_qcow2?"QCOW2":"disk")), image_path);
 		selection_default = DT_IMG;
 	} else {
 		DisplayISOProps();
-	}
-	if ( (!iso_report.has_bootmgr) && (!HAS_SYSLINUX(iso_report)) && (!IS_WINPE(iso_report.winpe)) && (!IS_GRUB(iso_report))
-	  && (!iso_report.has_efi) && (!IS_REACTOS(iso_report) && (!iso_report.has_kolibrios) && (!iso_report.is_bootable_img)) ) {
+		if (iso_report.is_hybrid_img) {
+			SelectHybridWriteMode();
+			if (iso_report.is_bootable_img)
+				selection_default = DT_IMG;
+		} else if (HAS_EL_TORITO_HDD(iso_report)) {
+			// Nothing else in the ISO can boot, so we write its hard disk image, straight from the ISO
+			uprintf("Using El Torito hard disk image from '%s'", image_path);
+			iso_report.is_bootable_img = TRUE;
+			iso_report.projected_size = iso_report.el_torito_size;
+			selection_default = DT_IMG;
+		}
+	}
+	if ((!HAS_BOOT_FILES(iso_report)) && (!HAS_EL_TORITO_FLOPPY(iso_report)) && (!iso_report.is_bootable_img)) {
 		PrintInfo(0, MSG_081);
 		MessageBoxU(hMainDialog, lmprintf(MSG_082), lmprintf(MSG_081), MB_OK|MB_ICONINFORMATION|MB_IS_RTL);
 		safe_free(image_path);
@@ -957,7 +1041,8 @@ DWORD WINAPI ISOScanThread(LPVOID param)
 	} else {
 		// Enable bootable and set Target System and FS accordingly
 		CheckDlgButton(hMainDialog, IDC_BOOT, BST_CHECKED);
-		if (!iso_report.is_bootable_img) {
+		// Hybrid ISOs written as images still get the ISO settings, in case the user switches to ISO mode
+		if ((!iso_report.is_bootable_img) || (iso_report.is_hybrid_img)) {
 			SetTargetSystem();
 			SetFSFromISO();
 			SetMBRProps();
@@ -966,7 +1051,8 @@ DWORD WINAPI ISOScanThread(LPVOID param)
 			if (iso_report.label[0] != 0) {
 				SetWindowTextU(hLabel, iso_report.label);
 			}
-		} else {
+		}
+		if (iso_report.is_bootable_img) {
 			SendMessage(hMainDialog, WM_COMMAND, (CBN_SELCHANGE<<16) | IDC_FILESYSTEM,
 				ComboBox_GetCurSel(hFileSystem));
 		}
@@ -1077,6 +1163,7 @@ static BOOL BootCheck(void)
 	const char* syslinux = "syslinux";
 	const char* ldlinux_ext[3] = { "sys", "bss", "c32" };
 	char tmp[MAX_PATH], tmp2[MAX_PATH];
+	uint64_t largest;
 
 	syslinux_ldlinux_len[0] = 0; syslinux_ldlinux_len[1] = 0;
 	safe_free(grub2_buf);
@@ -1087,7 +1174,8 @@ static BOOL BootCheck(void)
 			MessageBoxU(hMainDialog, lmprintf(MSG_087), lmprintf(MSG_086), MB_OK|MB_ICONERROR|MB_IS_RTL);
 			return FALSE;
 		}
-		if ((size_check) && (iso_report.projected_size > (uint64_t)SelectedDrive.DiskSize)) {
+		if ((size_check) && (iso_report.projected_size + (((dt == DT_ISO) && HAS_PERSISTENCE(iso_report)) ?
+			persistence_size : 0) > (uint64_t)SelectedDrive.DiskSize)) {
 			// This ISO image is too big for the selected target
 			MessageBoxU(hMainDialog, lmprintf(MSG_089), lmprintf(MSG_088), MB_OK|MB_ICONERROR|MB_IS_RTL);
 			return FALSE;
@@ -1100,13 +1188,18 @@ static BOOL BootCheck(void)
 		}
 		fs = (int)ComboBox_GetItemData(hFileSystem, ComboBox_GetCurSel(hFileSystem));
 		bt = GETBIOSTYPE((int)ComboBox_GetItemData(hPartitionScheme, ComboBox_GetCurSel(hPartitionScheme)));
+		if ((enable_wintogo) && ((fs != FS_NTFS) || (!iso_report.has_install_wim))) {
+			// Windows To Go requires a Windows installation ISO and the NTFS file system
+			MessageBoxU(hMainDialog, lmprintf(MSG_265), lmprintf(MSG_090), MB_OK|MB_ICONERROR|MB_IS_RTL);
+			return FALSE;
+		}
 		if (bt == BT_UEFI) {
 			if (!IS_EFI(iso_report)) {
 				// Unsupported ISO
 				MessageBoxU(hMainDialog, lmprintf(MSG_091), lmprintf(MSG_090), MB_OK|MB_ICONERROR|MB_IS_RTL);
 				return FALSE;
 			}
-			if ((iso_report.has_win7_efi) && (!WimExtractCheck())) {
+			if ((iso_report.has_win7_efi) && (!enable_wintogo) && (!WimExtractCheck())) {
 				// Your platform cannot extract files from WIM archives => download 7-zip?
 				if (MessageBoxU(hMainDialog, lmprintf(MSG_102), lmprintf(MSG_101), MB_YESNO|MB_ICONERROR|MB_IS_RTL) == IDYES)
 					ShellExecuteA(hMainDialog, "open", SEVENZIP_URL, NULL, NULL, SW_SHOWNORMAL);
@@ -1126,13 +1219,16 @@ static BOOL BootCheck(void)
 			MessageBoxU(hMainDialog, lmprintf(MSG_189), lmprintf(MSG_099), MB_OK|MB_ICONERROR|MB_IS_RTL);
 			return FALSE;
 		} else if (((fs == FS_FAT16)||(fs == FS_FAT32)) && (!HAS_SYSLINUX(iso_report)) && (!allow_dual_uefi_bios) &&
-			(!IS_REACTOS(iso_report)) && (!iso_report.has_kolibrios) && (!IS_GRUB(iso_report))) {
+			(!IS_REACTOS(iso_report)) && (!iso_report.has_kolibrios) && (!IS_GRUB(iso_report)) &&
+			(!HAS_EL_TORITO_FLOPPY(iso_report))) {
 			// FAT/FAT32 can only be used for isolinux based ISO images or when the Target Type is UEFI
 			MessageBoxU(hMainDialog, lmprintf(MSG_098), lmprintf(MSG_090), MB_OK|MB_ICONERROR|MB_IS_RTL);
 			return FALSE;
 		}
-		if (((fs == FS_FAT16)||(fs == FS_FAT32)) && (iso_report.has_4GB_file)) {
+		if ( (((fs == FS_FAT16)||(fs == FS_FAT32)) && (iso_report.has_4GB_file)) ||
+			 ((fs == FS_FAT16) && (iso_report.has_4GB_wim)) ) {
 			// This ISO image contains a file larger than 4GB file (FAT32)
+			// NB: A large install.wim is fine on FAT32, as it gets split into .swm parts
 			MessageBoxU(hMainDialog, lmprintf(MSG_100), lmprintf(MSG_099), MB_OK|MB_ICONERROR|MB_IS_RTL);
 			return FALSE;
 		}
@@ -1320,6 +1416,19 @@ static BOOL BootCheck(void)
 			return FALSE;
 		}
 	} else if (dt == DT_GRUB4DOS) {
+		if (nb_multiboot_images > 0) {
+			fs = (int)ComboBox_GetItemData(hFileSystem, ComboBox_GetCurSel(hFileSystem));
+			if ((size_check) && (GetMultibootSize(&largest) > (uint64_t)SelectedDrive.DiskSize)) {
+				// The images are too big for the selected target
+				MessageBoxU(hMainDialog, lmprintf(MSG_089), lmprintf(MSG_088), MB_OK|MB_ICONERROR|MB_IS_RTL);
+				return FALSE;
+			}
+			if (((fs == FS_FAT16)||(fs == FS_FAT32)) && (largest >= 4294967296ULL)) {
+				// One of the images is larger than 4GB (FAT32)
+				MessageBoxU(hMainDialog, lmprintf(MSG_100), lmprintf(MSG_099), MB_OK|MB_ICONERROR|MB_IS_RTL);
+				return FALSE;
+			}
+		}
 		IGNORE_RETVAL(_chdirU(app_dir));
 		IGNORE_RETVAL(_mkdir(FILES_DIR));
 		IGNORE_RETVAL(_chdir(FILES_DIR));
@@ -1482,6 +1591,7 @@ void InitDialog(HWND hDlg)
 	// Create the string array
 	StrArrayCreate(&DriveID, MAX_DRIVES);
 	StrArrayCreate(&DriveLabel, MAX_DRIVES);
+	StrArrayCreate(&DriveHwID, MAX_DRIVES);
 	// Set various checkboxes
 	CheckDlgButton(hDlg, IDC_QUICKFORMAT, BST_CHECKED);
 	CheckDlgButton(hDlg, IDC_BOOT, BST_CHECKED);
@@ -1575,6 +1685,24 @@ static void PrintStatus2000(const char* str, BOOL val)
 	PrintStatus(2000, (val)?MSG_250:MSG_251, str);
 }
 
+// Cycle through the sizes we propose for the persistence partition of live Linux media
+static void TogglePersistence(void)
+{
+	const uint64_t persistence_sizes[] = { 0, 1ULL<<30, 2ULL<<30, 4ULL<<30, 8ULL<<30, 16ULL<<30 };
+	char str[64];
+	int i;
+
+	for (i=0; (i<ARRAYSIZE(persistence_sizes)-1) && (persistence_sizes[i] != persistence_size); i++);
+	persistence_size = persistence_sizes[(i+1) % ARRAYSIZE(persistence_sizes)];
+	// TODO: add a localized message
+	if (persistence_size == 0) {
+		PrintStatus2000("Persistence partition", FALSE);
+	} else {
+		safe_sprintf(str, sizeof(str), "Persistence partition: %s", SizeToHumanReadable(persistence_size, FALSE, FALSE));
+		PrintStatus(2000, MSG_000, str);
+	}
+}
+
 void ShowLanguageMenu(HWND hDlg)
 {
 	POINT pt;
@@ -1667,8 +1795,8 @@ static INT_PTR CALLBACK MainCallback(HWND hDlg, UINT message, WPARAM wParam, LPA
 	char tmp[128];
 	loc_cmd* lcmd = NULL;
 	// TODO: Add "*.img;*.vhd" / "All Supported Images" to the list below and use a generic "%s Image" in the .loc
-	EXT_DECL(img_ext, NULL, __VA_GROUP__("*.img", "*.vhd"), __VA_GROUP__(lmprintf(MSG_095), "VHD Image"));
-	EXT_DECL(iso_ext, NULL, __VA_GROUP__("*.iso"), __VA_GROUP__(lmprintf(MSG_036)));
+	EXT_DECL(img_ext, NULL, __VA_GROUP__("*.img", "*.vhd", "*.dmg", "*.qcow2", "*.zsync"), __VA_GROUP__(lmprintf(MSG_095), "VHD Image", "Apple Disk Image", "QCOW2 Image", "zsync control file"));
+	EXT_DECL(iso_ext, NULL, __VA_GROUP__("*.iso", "*.zsync"), __VA_GROUP__(lmprintf(MSG_036), "zsync control file"));
 
 	switch (message) {
 
@@ -1820,6 +1948,7 @@ static INT_PTR CALLBACK MainCallback(HWND hDlg, UINT message, WPARAM wParam, LPA
 			PostQuitMessage(0);
 			StrArrayDestroy(&DriveID);
 			StrArrayDestroy(&DriveLabel);
+			StrArrayDestroy(&DriveHwID);
 			DestroyAllTooltips();
 			DestroyWindow(hLogDlg);
 			GetWindowRect(hDlg, &relaunch_rc);
@@ -1984,7 +2113,7 @@ static INT_PTR CALLBACK MainCallback(HWND hDlg, UINT message, WPARAM wParam, LPA
 				}
 				break;
 			}
-			if ((fs == FS_EXFAT) || (fs == FS_UDF) || (fs == FS_REFS)) {
+			if ((fs == FS_EXFAT) || (fs == FS_UDF) || (fs == FS_REFS) || IS_EXT(fs)) {
 				if (IsWindowEnabled(hBoot)) {
 					// unlikely to be supported by BIOSes => don't bother
 					IGNORE_RETVAL(ComboBox_SetCurSel(hBootType, 0));
@@ -2052,6 +2181,32 @@ static INT_PTR CALLBACK MainCallback(HWND hDlg, UINT message, WPARAM wParam, LPA
 			selection_default = DT_ISO;
 			CreateTooltip(hSelectISO, image_path, -1);
 			FormatStatus = 0;
+			// Rebuilding the image from a zsync control file is run like a format operation, so
+			// that it can be cancelled, and the image is only scanned once it has been rebuilt
+			if (IsZsyncControlFile(image_path)) {
+				if (format_thid != NULL)
+					break;
+				format_op_in_progress = TRUE;
+				SendMessage(hProgress, PBM_SETSTATE, (WPARAM)PBST_NORMAL, 0);
+				SetTaskbarProgressState(TASKBAR_NORMAL);
+				SetTaskbarProgressValue(0, MAX_PROGRESS);
+				SendMessage(hProgress, PBM_SETPOS, 0, 0);
+				EnableControls(FALSE);
+				format_thid = CreateThread(NULL, 0, ZsyncThread, NULL, 0, NULL);
+				if (format_thid == NULL) {
+					uprintf("Unable to start zsync thread");
+					FormatStatus = ERROR_SEVERITY_ERROR|FAC(FACILITY_STORAGE)|APPERR(ERROR_CANT_START_THREAD);
+					PostMessage(hMainDialog, UM_FORMAT_COMPLETED, 0, 0);
+					break;
+				}
+				PrintInfo(0, -1);
+				timer = 0;
+				safe_sprintf(szTimer, sizeof(szTimer), "00:00:00");
+				SendMessageA(GetDlgItem(hMainDialog, IDC_STATUS), SB_SETTEXTA,
+					SBT_OWNERDRAW | 1, (LPARAM)szTimer);
+				SetTimer(hMainDialog, TID_APP_TIMER, 1000, ClockTimer);
+				break;
+			}
 			if (CreateThread(NULL, 0, ISOScanThread, NULL, 0, NULL) == NULL) {
 				uprintf("Unable to start ISO scanning thread");
 				FormatStatus = ERROR_SEVERITY_ERROR|FAC(FACILITY_STORAGE)|APPERR(ERROR_CANT_START_THREAD);
@@ -2520,6 +2675,15 @@ relaunch:
 			CheckDlgButton(hMainDialog, IDC_ENABLE_FIXED_DISKS, enable_HDDs?BST_CHECKED:BST_UNCHECKED);
 			continue;
 		}
+		// Alt-G => Toggle growing of the last partition after writing a disk image
+		// When enabled, the last partition of an image that is smaller than the drive, along
+		// with its FAT file system, is extended to the end of the drive.
+		if ((msg.message == WM_SYSKEYDOWN) && (msg.wParam == 'G')) {
+			enable_partition_grow = !enable_partition_grow;
+			// TODO: add a localized message
+			PrintStatus2000("Grow last partition", enable_partition_grow);
+			continue;
+		}
 		// Alt-I => Toggle ISO support
 		// This is useful if you have a dual ISO/DD image and you want to force Rufus to use
 		// DD-mode when writing the data.
@@ -2560,6 +2724,28 @@ relaunch:
 			PrintStatus2000(lmprintf(MSG_260), enable_ntfs_compression);
 			continue;
 		}
+		// Alt-M => Toggle multiboot mode
+		// In this mode, every ISO that is selected gets added to a list of images, which
+		// are then copied to the drive and booted from a Grub4DOS menu. Disabling it clears
+		// the list.
+		if ((msg.message == WM_SYSKEYDOWN) && (msg.wParam == 'M')) {
+			enable_multiboot = !enable_multiboot;
+			// Grub4DOS is only listed in advanced mode
+			if ((enable_multiboot) && (!advanced_mode))
+				ToggleAdvanced();
+			if (!enable_multiboot)
+				ClearMultibootImages();
+			// TODO: add a localized message
+			PrintStatus2000("Multiboot mode", enable_multiboot);
+			continue;
+		}
+		// Alt-P => Cycle through the sizes of the persistence partition
+		// When writing an Ubuntu (casper) or Debian live ISO, this adds a partition of the
+		// selected size at the end of the drive, which is then used for persistence.
+		if ((msg.message == WM_SYSKEYDOWN) && (msg.wParam == 'P')) {
+			TogglePersistence();
+			continue;
+		}
 		// Alt-R => Remove all the registry keys created by Rufus
 		if ((msg.message == WM_SYSKEYDOWN) && (msg.wParam == 'R')) {
 			PrintStatus(2000, DeleteRegistryKey(REGKEY_HKCU, COMPANY_NAME "\\" APPLICATION_NAME)?MSG_248:MSG_249);
@@ -2576,6 +2762,16 @@ relaunch:
 			GetUSBDevices(0);
 			continue;
 		}
+		// Alt-T => Toggle fault tolerant image capture
+		// When enabled, saving a drive to an image skips over areas that can't be read, and comes
+		// back to them once everything else has been copied. Progress is kept in a map alongside
+		// the image, so that the capture of a failing drive can be resumed.
+		if ((msg.message == WM_SYSKEYDOWN) && (msg.wParam == 'T')) {
+			enable_rescue = !enable_rescue;
+			// TODO: add a localized message
+			PrintStatus2000("Fault tolerant capture", enable_rescue);
+			continue;
+		}
 		// Alt-U => Use PROPER size units, instead of this whole Kibi/Gibi nonsense
 		if ((msg.message == WM_SYSKEYDOWN) && (msg.wParam == 'U')) {
 			use_fake_units = !use_fake_units;
@@ -2583,6 +2779,35 @@ relaunch:
 			GetUSBDevices(0);
 			continue;
 		}
+		// Alt-W => Toggle Windows To Go mode
+		// When enabled, the first image of the install.wim from a Windows installation ISO is
+		// applied directly to an NTFS drive, so that Windows boots from it, instead of the
+		// content of the ISO being copied.
+		if ((msg.message == WM_SYSKEYDOWN) && (msg.wParam == 'W')) {
+			enable_wintogo = !enable_wintogo;
+			PrintStatus2000(lmprintf(MSG_264), enable_wintogo);
+			continue;
+		}
+		// Alt-Y => Toggle reproducible output
+		// When enabled, the drive is erased, all identifiers and timestamps are derived from
+		// the source and format options rather than picked at random or from the current time,
+		// and the SHA-1 of the whole drive is reported once done, so that drives that were
+		// created from the same job can be checked to be identical.
+		if ((msg.message == WM_SYSKEYDOWN) && (msg.wParam == 'Y')) {
+			enable_reproducible = !enable_reproducible;
+			// TODO: add a localized message
+			PrintStatus2000("Reproducible output", enable_reproducible);
+			continue;
+		}
+		// Alt-Z => Toggle erasure of the whole drive before formatting
+		// When enabled, the drive is erased using ATA Security Erase or SCSI UNMAP if it
+		// supports them, or else by zeroing it, and the result is checked by sampling.
+		if ((msg.message == WM_SYSKEYDOWN) && (msg.wParam == 'Z')) {
+			enable_secure_erase = !enable_secure_erase;
+			// TODO: add a localized message
+			PrintStatus2000("Drive erasure", enable_secure_erase);
+			continue;
+		}
 		TranslateMessage(&msg);
 		DispatchMessage(&msg);
 	}
@@ -157,6 +157,7 @@ enum timer_type {
 enum action_type {
 	OP_ANALYZE_MBR,
 	OP_BADBLOCKS,
+	OP_ERASE,
 	OP_ZERO_MBR,
 	OP_PARTITION,
 	OP_FORMAT,
@@ -176,8 +177,11 @@ enum {
 	FS_UDF,
 	FS_EXFAT,
 	FS_REFS,
+	FS_EXT2,
+	FS_EXT4,
 	FS_MAX
 };
+#define IS_EXT(fs)      (((fs) == FS_EXT2) || ((fs) == FS_EXT4))
 
 enum dos_type {
 	DT_WINME = 0,
@@ -210,6 +214,8 @@ typedef struct {
 	char proposed_label[16];
 	int PartitionType;
 	int nPartitions;
+	uint64_t PartitionOffset[4];
+	uint64_t PartitionSize[4];
 	int FSType;
 	BOOL has_protective_mbr;
 	BOOL has_mbr_uefi_marker;
@@ -232,22 +238,41 @@ typedef struct {
 #define IS_EFI(r)       ((r.has_efi) || (r.has_win7_efi))
 #define IS_REACTOS(r)   (r.reactos_path[0] != 0)
 #define IS_GRUB(r)      ((r.has_grub2) || (r.has_grub4dos))
+#define HAS_PERSISTENCE(r) ((r.uses_casper) || (r.uses_debian_live))
+#define HAS_BOOT_FILES(r) ((r.has_bootmgr) || HAS_SYSLINUX(r) || IS_WINPE(r.winpe) || IS_GRUB(r) || \
+	(r.has_efi) || IS_REACTOS(r) || (r.has_kolibrios))
+#define HAS_EL_TORITO_FLOPPY(r) ((r.el_torito_type >= EL_TORITO_FLOPPY_1_2) && (r.el_torito_type <= EL_TORITO_FLOPPY_2_88))
+#define HAS_EL_TORITO_HDD(r) (r.el_torito_type == EL_TORITO_HDD)
+
+/* El Torito boot media types, as found in the boot catalog */
+enum el_torito_type {
+	EL_TORITO_NO_EMULATION = 0,
+	EL_TORITO_FLOPPY_1_2,
+	EL_TORITO_FLOPPY_1_44,
+	EL_TORITO_FLOPPY_2_88,
+	EL_TORITO_HDD
+};
 
 typedef struct {
 	char label[192];		/* 3*64 to account for UTF-8 */
 	char usb_label[192];	/* converted USB label for workaround */
 	char cfg_path[128];		/* path to the ISO's isolinux.cfg */
 	char reactos_path[128];	/* path to the ISO's freeldr.sys or setupldr.sys */
+	char kernel_path[64];	/* path to the casper/live kernel */
+	char initrd_path[64];	/* path to the casper/live initrd */
 	uint64_t projected_size;
 	uint64_t src_size;
+	uint32_t nb_files;
 	// TODO: use a bitmask and #define tests for the following
 	uint8_t winpe;
 	BOOL has_4GB_file;
+	BOOL has_4GB_wim;
 	BOOL has_long_filename;
 	BOOL has_symlinks;
 	BOOL has_bootmgr;
 	BOOL has_efi;
 	BOOL has_win7_efi;
+	BOOL has_install_wim;
 	BOOL has_autorun;
 	BOOL has_old_c32[NB_OLD_C32];
 	BOOL has_old_vesamenu;
@@ -255,10 +280,18 @@ typedef struct {
 	BOOL has_grub4dos;
 	BOOL has_grub2;
 	BOOL has_kolibrios;
+	BOOL uses_casper;
+	BOOL uses_debian_live;
 	BOOL uses_minint;
 	BOOL is_bootable_img;
+	BOOL is_hybrid_img;
 	BOOL compression_type;
 	BOOL is_vhd;
+	BOOL is_dmg;
+	BOOL is_qcow2;
+	uint8_t el_torito_type;		// Only set for ISOs that we can't boot through anything else
+	uint64_t el_torito_offset;	// Location of the El Torito boot image in the ISO
+	uint64_t el_torito_size;
 	uint16_t sl_version;	// Syslinux/Isolinux version
 	char sl_version_str[12];
 	char sl_version_ext[32];
@@ -269,6 +302,19 @@ typedef struct {
 #define SL_MAJOR(x) ((uint8_t)((x)>>8))
 #define SL_MINOR(x) ((uint8_t)(x))
 
+/* A part of a disk image that needs to be written */
+typedef struct {
+	uint64_t offset;
+	uint64_t size;
+} image_range;
+
+/* SHA-1 context, used for zsync and for the hash of the drive in reproducible mode */
+typedef struct {
+	uint32_t h[5];
+	uint64_t len;
+	uint8_t buf[64];
+} sha1_ctx;
+
 typedef struct {
 	uint16_t version[4];
 	uint32_t platform_min[2];		// minimum platform version required
@@ -340,7 +386,7 @@ extern DWORD syslinux_ldlinux_len[2];
 extern RUFUS_DRIVE_INFO SelectedDrive;
 extern const int nb_steps[FS_MAX];
 extern BOOL use_own_c32[NB_OLD_C32], detect_fakes, iso_op_in_progress, format_op_in_progress, right_to_left_mode;
-extern BOOL allow_dual_uefi_bios;
+extern BOOL allow_dual_uefi_bios, enable_partition_grow, enable_rescue, enable_secure_erase, enable_reproducible;
 extern RUFUS_ISO_REPORT iso_report;
 extern int64_t iso_blocking_status;
 extern uint16_t rufus_version[4], embedded_sl_version[2];
@@ -382,8 +428,12 @@ extern BOOL Notification(int type, const notification_info* more_info, char* tit
 extern BOOL Question(char* title, char* format, ...);
 extern SIZE GetTextSize(HWND hCtrl);
 extern BOOL ExtractDOS(const char* path);
+extern BOOL ExtractFreeDOS(const char* path);
+extern BOOL ExtractElToritoFloppy(const char* iso, const char* path);
 extern BOOL ExtractISO(const char* src_iso, const char* dest_dir, BOOL scan);
 extern int64_t ExtractISOFile(const char* iso, const char* iso_file, const char* dest_file, DWORD attributes);
+extern int64_t GetISOFileOffset(const char* iso, const char* iso_file, uint64_t* file_size);
+extern BOOL GetElToritoImage(const char* iso);
 extern BOOL InstallSyslinux(DWORD drive_index, char drive_letter, int fs);
 extern uint16_t GetSyslinuxVersion(char* buf, size_t buf_size, char** ext);
 extern BOOL CreateProgress(void);
@@ -393,10 +443,17 @@ extern BOOL FileIO(BOOL save, char* path, char** buffer, DWORD* size);
 extern unsigned char* GetResource(HMODULE module, char* name, char* type, const char* desc, DWORD* len, BOOL duplicate);
 extern DWORD GetResourceSize(HMODULE module, char* name, char* type, const char* desc);
 extern BOOL GetUSBDevices(DWORD devnum);
+extern uint16_t GetUSBVendorID(DWORD drive_index);
+extern uint64_t ScheduleUSBJobs(const DWORD* drive_index, int nb_drives, uint64_t size);
+extern DWORD GetNextUSBJob(void);
+extern void USBJobDone(DWORD drive_index);
 extern BOOL SetLGP(BOOL bRestore, BOOL* bExistingKey, const char* szPath, const char* szPolicy, DWORD dwValue);
 extern LONG GetEntryWidth(HWND hDropDown, const char* entry);
 extern DWORD DownloadFile(const char* url, const char* file, HWND hProgressDialog);
 extern HANDLE DownloadFileThreaded(const char* url, const char* file, HWND hProgressDialog);
+extern BOOL OpenRangeDownload(const char* url);
+extern DWORD DownloadRange(uint64_t offset, DWORD size, uint8_t* buf);
+extern void CloseRangeDownload(void);
 extern INT_PTR CALLBACK UpdateCallback(HWND hDlg, UINT message, WPARAM wParam, LPARAM lParam);
 extern BOOL SetUpdateCheck(void);
 extern BOOL CheckForUpdates(BOOL force);
@@ -410,7 +467,30 @@ extern char* replace_char(const char* src, const char c, const char* rep);
 extern void parse_update(char* buf, size_t len);
 extern BOOL WimExtractCheck(void);
 extern BOOL WimExtractFile(const char* wim_image, int index, const char* src, const char* dst);
-extern BOOL IsHDImage(const char* path);
+extern BOOL ScanImage(const char* path);
+extern image_range* GetImageRanges(HANDLE hImage, uint64_t image_size, DWORD sector_size, uint32_t* nb_ranges);
+extern BOOL GrowLastPartition(HANDLE hDrive, uint64_t disk_size);
+extern BOOL RescueCapture(HANDLE hSource, const char* device_id, uint64_t size, DWORD sector_size,
+	HANDLE hDest, const char* map_path);
+extern BOOL EraseDrive(HANDLE hDrive, uint16_t vid, uint64_t size, DWORD sector_size, BOOL zeroed);
+extern void InitReproducible(const char* image, int fs, int pt, int bt, int dt);
+extern DWORD GetReproducibleDword(const char* purpose);
+extern uint32_t GetReproducibleTime(void);
+extern void NewGuid(GUID* guid, const char* purpose, uint64_t index);
+extern void FinalizeReproducible(HANDLE hPhysicalDrive, DWORD DriveIndex, const char* drive_name, int fs);
+extern void sha1_init(sha1_ctx* ctx);
+extern void sha1_update(sha1_ctx* ctx, const uint8_t* data, size_t len);
+extern void sha1_final(sha1_ctx* ctx, uint8_t* digest);
+extern BOOL IsDmgImage(const char* path);
+extern BOOL WriteDmgImage(HANDLE hSourceImage, DWORD sector_size, uint64_t resume,
+	int (*write_function)(int, const void*, unsigned int), BOOL (*seek_function)(uint64_t));
+extern BOOL IsQcow2Image(const char* path);
+extern BOOL WriteQcow2Image(HANDLE hSourceImage, const char* path, DWORD sector_size, uint64_t resume,
+	int (*write_function)(int, const void*, unsigned int), BOOL (*seek_function)(uint64_t),
+	BOOL (*discard_function)(uint64_t, uint64_t));
+extern BOOL IsZsyncControlFile(const char* path);
+extern char* ZsyncReconstruct(const char* control_path);
+extern uint64_t EstimateWriteTime(BOOL raw);
 extern BOOL AppendVHDFooter(const char* vhd_path);
 extern int IsHDD(DWORD DriveIndex, uint16_t vid, uint16_t pid, const char* strid);
 
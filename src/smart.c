@@ -37,7 +37,6 @@
 #include "smart.h"
 #include "hdd_vs_ufd.h"
 
-#if defined(RUFUS_TEST)
 /* Helper functions */
 static uint8_t GetAtaDirection(uint8_t AtaCmd, uint8_t Features) {
 	// Far from complete -- only the commands we *may* use.
@@ -55,6 +54,9 @@ static uint8_t GetAtaDirection(uint8_t AtaCmd, uint8_t Features) {
 			return ATA_PASSTHROUGH_DATA_IN;
 		// fall through
 	case ATA_DATA_SET_MANAGEMENT:
+	case ATA_SECURITY_SET_PASSWORD:
+	case ATA_SECURITY_ERASE_UNIT:
+	case ATA_SECURITY_DISABLE_PASSWORD:
 		return ATA_PASSTHROUGH_DATA_OUT;
 	default:
 		return ATA_PASSTHROUGH_DATA_NONE;
@@ -102,8 +104,8 @@ const char* SptStrerr(int errcode)
  * Returns 0 (SPT_SUCCESS) on success, a positive SCSI Status in case of an SCSI error or negative otherwise.
  */
 
-BOOL ScsiPassthroughDirect(HANDLE hPhysical, uint8_t* Cdb, size_t CdbLen, uint8_t Direction,
-						   void* DataBuffer, size_t BufLen, uint32_t Timeout)
+int ScsiPassthroughDirect(HANDLE hPhysical, uint8_t* Cdb, size_t CdbLen, uint8_t Direction,
+						  void* DataBuffer, size_t BufLen, uint32_t Timeout)
 {
 	SCSI_PASS_THROUGH_DIRECT_WITH_BUFFER sptdwb = {{0}, 0, {0}};
 	DWORD err, size = sizeof(SCSI_PASS_THROUGH_DIRECT_WITH_BUFFER);
@@ -311,13 +313,42 @@ static int UsbCypressAtaPassthrough(HANDLE hPhysical, ATA_PASSTHROUGH_CMD* Comma
 
 /* The various bridges we will try, in order */
 AtaPassThroughType pt[] = {
-	{ SatAtaPassthrough, "SAT" },
-	{ UsbJmicronAtaPassthrough, "JMicron" },
-	{ UsbProlificAtaPassthrough, "Prolific" },
-	{ UsbSunPlusAtaPassthrough, "SunPlus" },
-	{ UsbCypressAtaPassthrough, "Cypress" },
+	{ SatAtaPassthrough, "SAT", 0 },
+	{ UsbJmicronAtaPassthrough, "JMicron", 0x152d },
+	{ UsbProlificAtaPassthrough, "Prolific", 0x067b },
+	{ UsbSunPlusAtaPassthrough, "SunPlus", 0x04fc },
+	{ UsbCypressAtaPassthrough, "Cypress", 0x04b4 },
 };
 
+/*
+ * Send an ATA command through an USB bridge. If Bridge is negative, the bridges we know
+ * of are tried in turn, and Bridge is set to the one that worked, so that the commands
+ * that follow can be sent the same way.
+ * Unknown vendor commands can hang or wedge other bridges, so besides SAT, we only try
+ * the vendor specific method that matches the Vendor ID of the USB device, if any.
+ */
+int AtaPassthrough(HANDLE hPhysical, uint16_t Vid, int* Bridge, ATA_PASSTHROUGH_CMD* Command,
+	void* DataBuffer, size_t BufLen, uint32_t Timeout)
+{
+	int i, r = SPT_ERROR_UNKNOWN_ERROR;
+
+	if ((*Bridge >= 0) && (*Bridge < ARRAYSIZE(pt)))
+		return pt[*Bridge].fn(hPhysical, Command, DataBuffer, BufLen, Timeout);
+
+	for (i=0; i<ARRAYSIZE(pt); i++) {
+		if ((pt[i].vid != 0) && (pt[i].vid != Vid))
+			continue;
+		r = pt[i].fn(hPhysical, Command, DataBuffer, BufLen, Timeout);
+		if (r == SPT_SUCCESS) {
+			uprintf("Using %s ATA passthrough\n", pt[i].type);
+			*Bridge = i;
+			break;
+		}
+	}
+	return r;
+}
+
+#if defined(RUFUS_TEST)
 BOOL Identify(HANDLE hPhysical)
 {
 	ATA_PASSTHROUGH_CMD Command = {0};
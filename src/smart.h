@@ -37,10 +37,18 @@
 #define ATA_IDENTIFY_PACKET_DEVICE      0xa1
 #define ATA_IDLE                        0xe3
 #define ATA_SMART_CMD                   0xb0
+#define ATA_SECURITY_SET_PASSWORD       0xf1
+#define ATA_SECURITY_ERASE_PREPARE      0xf3
+#define ATA_SECURITY_ERASE_UNIT         0xf4
 #define ATA_SECURITY_FREEZE_LOCK        0xf5
+#define ATA_SECURITY_DISABLE_PASSWORD   0xf6
 #define ATA_SET_FEATURES                0xef
 #define ATA_STANDBY_IMMEDIATE           0xe0
 #define SAT_ATA_PASSTHROUGH_12          0xa1
+#define SCSI_INQUIRY                    0x12
+#define SCSI_UNMAP                      0x42
+#define SCSI_SERVICE_ACTION_IN_16       0x9e
+#define SCSI_READ_CAPACITY_16           0x10	// Service action for the above
 // Non official pseudo commands
 #define USB_CYPRESS_ATA_PASSTHROUGH     0x24
 #define USB_JMICRON_ATA_PASSTHROUGH     0xdf
@@ -152,6 +160,7 @@ typedef BOOL (*AtaPassthroughFn_t)(
 typedef struct {
 	AtaPassthroughFn_t fn;
 	const char* type;
+	uint16_t vid;		// Vendor ID of the bridges that need this method, or 0 for the standard one
 } AtaPassThroughType;
 
 // From http://msdn.microsoft.com/en-us/library/windows/hardware/ff559006.aspx
@@ -405,3 +414,9 @@ typedef struct _IDENTIFY_DEVICE_DATA {
 	USHORT CheckSum :8;
 } IDENTIFY_DEVICE_DATA, *PIDENTIFY_DEVICE_DATA;
 #pragma pack()
+
+int ScsiPassthroughDirect(HANDLE hPhysical, uint8_t* Cdb, size_t CdbLen, uint8_t Direction,
+	void* DataBuffer, size_t BufLen, uint32_t Timeout);
+int AtaPassthrough(HANDLE hPhysical, uint16_t Vid, int* Bridge, ATA_PASSTHROUGH_CMD* Command,
+	void* DataBuffer, size_t BufLen, uint32_t Timeout);
+const char* SptStrerr(int errcode);
@@ -40,9 +40,16 @@
 #include "localization.h"
 #include "usb.h"
 
-extern StrArray DriveID, DriveLabel;
+extern StrArray DriveID, DriveLabel, DriveHwID;
 extern BOOL enable_HDDs, use_fake_units;
 
+static usb_hub_node usb_hub[MAX_USB_HUBS];
+static usb_dev_node usb_dev[MAX_DRIVES];
+static int nb_usb_hubs = 0, nb_usb_devs = 0;
+static uint64_t job_size = 0;
+static const uint32_t link_bandwidth[USB_SPEED_MAX] = USB_LINK_BANDWIDTH;
+static const uint32_t device_throughput[USB_SPEED_MAX] = USB_DEVICE_THROUGHPUT;
+
 /*
  * Get the VID, PID and current device speed
  */
@@ -104,6 +111,42 @@ out:
 	safe_closehandle(handle);
 }
 
+/*
+ * The upstream link of a root hub is the host controller itself, which we rate according to
+ * the fastest protocol its ports support. This requires the V2 connection IOCTL (Windows 8 or
+ * later), so we leave the speed unknown otherwise.
+ */
+static uint32_t GetRootHubSpeed(const char* hub_path)
+{
+	HANDLE handle;
+	DWORD size;
+	USB_NODE_CONNECTION_INFORMATION_EX_V2 conn_info_v2;
+	uint32_t speed = USB_SPEED_UNKNOWN;
+
+	if (nWindowsVersion < WINDOWS_8)
+		return USB_SPEED_UNKNOWN;
+	handle = CreateFileA(hub_path, GENERIC_WRITE, FILE_SHARE_WRITE, NULL, OPEN_EXISTING, FILE_FLAG_OVERLAPPED, NULL);
+	if (handle == INVALID_HANDLE_VALUE)
+		return USB_SPEED_UNKNOWN;
+	memset(&conn_info_v2, 0, sizeof(conn_info_v2));
+	size = sizeof(conn_info_v2);
+	conn_info_v2.ConnectionIndex = 1;
+	conn_info_v2.Length = size;
+	conn_info_v2.SupportedUsbProtocols.Usb110 = 1;
+	conn_info_v2.SupportedUsbProtocols.Usb200 = 1;
+	conn_info_v2.SupportedUsbProtocols.Usb300 = 1;
+	if (DeviceIoControl(handle, IOCTL_USB_GET_NODE_CONNECTION_INFORMATION_EX_V2, &conn_info_v2, size, &conn_info_v2, size, &size, NULL)) {
+		if (conn_info_v2.SupportedUsbProtocols.Usb300)
+			speed = USB_SPEED_SUPER_OR_LATER;
+		else if (conn_info_v2.SupportedUsbProtocols.Usb200)
+			speed = USB_SPEED_HIGH;
+		else if (conn_info_v2.SupportedUsbProtocols.Usb110)
+			speed = USB_SPEED_FULL;
+	}
+	CloseHandle(handle);
+	return speed;
+}
+
 static __inline BOOL IsVHD(const char* buffer)
 {
 	int i;
@@ -121,6 +164,146 @@ static __inline BOOL IsVHD(const char* buffer)
 	return FALSE;
 }
 
+/*
+ * Add a device to our USB topology
+ */
+static void AddUSBTopologyDevice(DWORD drive_index, int hub, uint32_t speed, uint16_t vid)
+{
+	if (nb_usb_devs >= MAX_DRIVES)
+		return;
+	usb_dev[nb_usb_devs].drive_index = drive_index;
+	usb_dev[nb_usb_devs].hub = ((hub >= 0) && (hub < nb_usb_hubs))?hub:-1;
+	usb_dev[nb_usb_devs].speed = (speed < USB_SPEED_MAX)?speed:USB_SPEED_UNKNOWN;
+	usb_dev[nb_usb_devs].vid = vid;
+	usb_dev[nb_usb_devs].state = USB_JOB_NONE;
+	nb_usb_devs++;
+}
+
+/*
+ * Report the devices that share the same hub, as they will compete for its upstream link
+ */
+static void PrintUSBTopology(void)
+{
+	int h, d, n;
+	char str[128];
+
+	for (h = 0; h < nb_usb_hubs; h++) {
+		str[0] = 0;
+		for (d = 0, n = 0; d < nb_usb_devs; d++) {
+			if (usb_dev[d].hub != h)
+				continue;
+			safe_sprintf(&str[strlen(str)], sizeof(str) - strlen(str), "%s%d", (n == 0)?"":", ",
+				usb_dev[d].drive_index - DRIVE_INDEX_MIN);
+			n++;
+		}
+		if (n > 1)
+			uprintf("Disks %s are connected to the same USB hub", str);
+	}
+}
+
+/*
+ * A job can start if, on each link upstream of the device, the throughput of the jobs already
+ * running there, plus the one of the device, still fits in the bandwidth of the link. A link
+ * that is idle always accepts a job, however slow it is.
+ */
+static BOOL CanStartJob(usb_dev_node* dev, const int* jobs, const uint32_t* load)
+{
+	int h;
+
+	for (h = dev->hub; h >= 0; h = usb_hub[h].parent) {
+		if ( (jobs[h] != 0)
+		  && (load[h] + device_throughput[dev->speed] > link_bandwidth[usb_hub[h].speed]) )
+			return FALSE;
+	}
+	return TRUE;
+}
+
+static void AddJob(usb_dev_node* dev, int* jobs, uint32_t* load, int inc)
+{
+	int h;
+
+	for (h = dev->hub; h >= 0; h = usb_hub[h].parent) {
+		jobs[h] += inc;
+		load[h] += inc * device_throughput[dev->speed];
+	}
+}
+
+/*
+ * Simulate the current schedule, by having each running job go at the speed of the device
+ * or of its share of the slowest upstream link, whichever is lower, and starting new jobs
+ * as soon as links free up. Returns the expected time for all the jobs to complete, in ms.
+ * NB: We don't know how far along the running jobs are, so they are counted as just started.
+ */
+static uint64_t SimulateUSBSchedule(void)
+{
+	int state[MAX_DRIVES], jobs[MAX_USB_HUBS];
+	uint32_t load[MAX_USB_HUBS];
+	double left[MAX_DRIVES], rate[MAX_DRIVES], t = 0.0, dt, r;
+	int d, h, running;
+
+	for (h = 0; h < nb_usb_hubs; h++) {
+		jobs[h] = usb_hub[h].jobs;
+		load[h] = usb_hub[h].load;
+	}
+	for (d = 0; d < nb_usb_devs; d++) {
+		state[d] = usb_dev[d].state;
+		left[d] = (double)job_size;
+	}
+
+	while (1) {
+		// Start as many of the pending jobs as the links allow
+		for (d = 0; d < nb_usb_devs; d++) {
+			if ((state[d] != USB_JOB_PENDING) || (!CanStartJob(&usb_dev[d], jobs, load)))
+				continue;
+			state[d] = USB_JOB_RUNNING;
+			AddJob(&usb_dev[d], jobs, load, 1);
+		}
+		// Find the throughput of each running job (in bytes/ms) and the next one to complete
+		dt = -1.0;
+		for (d = 0, running = 0; d < nb_usb_devs; d++) {
+			if (state[d] != USB_JOB_RUNNING)
+				continue;
+			running++;
+			rate[d] = device_throughput[usb_dev[d].speed];
+			for (h = usb_dev[d].hub; h >= 0; h = usb_hub[h].parent) {
+				r = (double)link_bandwidth[usb_hub[h].speed] / jobs[h];
+				if (r < rate[d])
+					rate[d] = r;
+			}
+			rate[d] = rate[d] * 1024.0 / 1000.0;
+			if ((dt < 0.0) || (left[d] / rate[d] < dt))
+				dt = left[d] / rate[d];
+		}
+		if (running == 0)
+			break;
+		t += dt;
+		for (d = 0; d < nb_usb_devs; d++) {
+			if (state[d] != USB_JOB_RUNNING)
+				continue;
+			left[d] -= dt * rate[d];
+			if (left[d] < 1.0) {
+				state[d] = USB_JOB_DONE;
+				AddJob(&usb_dev[d], jobs, load, -1);
+			}
+		}
+	}
+	return (uint64_t)t;
+}
+
+/*
+ * Return the Vendor ID of the USB device for drive_index, or 0 if unknown
+ */
+uint16_t GetUSBVendorID(DWORD drive_index)
+{
+	int d;
+
+	for (d = 0; d < nb_usb_devs; d++) {
+		if (usb_dev[d].drive_index == drive_index)
+			return usb_dev[d].vid;
+	}
+	return 0;
+}
+
 /*
  * Refresh the list of USB devices
  */
@@ -147,13 +330,17 @@ BOOL GetUSBDevices(DWORD devnum)
 	LONG maxwidth = 0;
 	int s, score, drive_number;
 	char drive_letters[27], *device_id, *devid_list = NULL, entry_msg[128];
-	char *label, *entry, buffer[MAX_PATH], str[128];
+	char *label, *entry, buffer[MAX_PATH], str[128], serial[128], hw_id[160];
 	usb_device_props props;
+	int hub;
 
 	IGNORE_RETVAL(ComboBox_ResetContent(hDeviceList));
 	StrArrayClear(&DriveID);
 	StrArrayClear(&DriveLabel);
+	StrArrayClear(&DriveHwID);
 	StrArrayCreate(&dev_if_path, 128);
+	nb_usb_hubs = 0;
+	nb_usb_devs = 0;
 
 	device_id = (char*)malloc(MAX_PATH);
 	if (device_id == NULL)
@@ -181,6 +368,14 @@ BOOL GetUSBDevices(DWORD devnum)
 						if (CM_Get_Child(&device_inst, dev_info_data.DevInst, 0) == CR_SUCCESS) {
 							device_id[0] = 0;
 							s = StrArrayAdd(&dev_if_path, devint_detail_data->DevicePath);
+							if ((s >= 0) && (s < MAX_USB_HUBS)) {
+								usb_hub[s].inst = dev_info_data.DevInst;
+								usb_hub[s].parent = -1;
+								usb_hub[s].speed = USB_SPEED_UNKNOWN;
+								usb_hub[s].jobs = 0;
+								usb_hub[s].load = 0;
+								nb_usb_hubs = s + 1;
+							}
 							if ((s>= 0) && (CM_Get_Device_IDA(device_inst, device_id, MAX_PATH, 0) == CR_SUCCESS)) {
 								if ((k = htab_hash(device_id, &htab_devid)) != 0) {
 									htab_devid.table[k].data = (void*)(uintptr_t)s;
@@ -203,6 +398,26 @@ BOOL GetUSBDevices(DWORD devnum)
 		}
 		SetupDiDestroyDeviceInfoList(dev_info);
 	}
+
+	// Link each hub to its upstream hub, and get the speed of that link, from the port of the
+	// upstream hub the hub is connected to. The parent of a root hub is the host controller.
+	for (s=0; s<nb_usb_hubs; s++) {
+		if (CM_Get_Parent(&parent_inst, usb_hub[s].inst, 0) == CR_SUCCESS) {
+			for (k=0; (int)k<nb_usb_hubs; k++) {
+				if ((usb_hub[k].inst == parent_inst) && ((int)k != s)) {
+					usb_hub[s].parent = (int)k;
+					break;
+				}
+			}
+		}
+		if (usb_hub[s].parent < 0) {
+			usb_hub[s].speed = GetRootHubSpeed(dev_if_path.String[s]);
+		} else if ((device_id != NULL) && (CM_Get_Device_IDA(usb_hub[s].inst, device_id, MAX_PATH, 0) == CR_SUCCESS)) {
+			memset(&props, 0, sizeof(props));
+			GetUSBProperties(dev_if_path.String[usb_hub[s].parent], device_id, &props);
+			usb_hub[s].speed = (props.speed < USB_SPEED_MAX)?props.speed:USB_SPEED_UNKNOWN;
+		}
+	}
 	free(device_id);
 
 	// Build a single list of Device IDs from all the storage enumerators we know of
@@ -261,6 +476,8 @@ BOOL GetUSBDevices(DWORD devnum)
 		// We can't use the friendly name to find if a drive is a VHD, as friendly name string gets translated
 		// according to your locale, so we poke the Hardware ID
 		memset(&props, 0, sizeof(props));
+		hub = -1;
+		serial[0] = 0;
 		memset(buffer, 0, sizeof(buffer));
 		props.is_VHD = SetupDiGetDeviceRegistryPropertyA(dev_info, &dev_info_data, SPDRP_HARDWAREID,
 			&datatype, (LPBYTE)buffer, sizeof(buffer), &size) && IsVHD(buffer);
@@ -281,9 +498,13 @@ BOOL GetUSBDevices(DWORD devnum)
 				  && (device_inst == dev_info_data.DevInst) ) {
 					// If we're not dealing with the USBSTOR part of our list, then this is an UASP device
 					props.is_UASP = ((((uintptr_t)device_id)+2) >= ((uintptr_t)devid_list)+list_size[0]);
+					// The ID is in the form USB\VID_xxxx&PID_xxxx\<serial number>
+					if (strrchr(device_id, '\\') != NULL)
+						safe_strcpy(serial, sizeof(serial), strrchr(device_id, '\\') + 1);
 					// Now get the properties of the device, and its Device ID, which we need to populate the properties
 					j = htab_hash(device_id, &htab_devid);
 					if (j > 0) {
+						hub = (int)(uintptr_t)htab_devid.table[j].data;
 						GetUSBProperties(dev_if_path.String[(uint32_t)htab_devid.table[j].data], device_id, &props);
 					}
 
@@ -428,8 +649,15 @@ BOOL GetUSBDevices(DWORD devnum)
 				// Must ensure that the combo box is UNSORTED for indexes to be the same
 				StrArrayAdd(&DriveID, buffer);
 				StrArrayAdd(&DriveLabel, label);
+				// What identifies this specific device, if we could find out
+				hw_id[0] = 0;
+				if ((!props.is_VHD) && ((props.vid != 0) || (props.pid != 0)) && (serial[0] != 0))
+					static_sprintf(hw_id, "%04X:%04X %s", props.vid, props.pid, serial);
+				StrArrayAdd(&DriveHwID, hw_id);
 
 				IGNORE_RETVAL(ComboBox_SetItemData(hDeviceList, ComboBox_AddStringU(hDeviceList, entry), drive_index));
+				if (!props.is_VHD)
+					AddUSBTopologyDevice(drive_index, hub, props.speed, (uint16_t)props.vid);
 				maxwidth = max(maxwidth, GetEntryWidth(hDeviceList, entry));
 				safe_closehandle(hDrive);
 				safe_free(devint_detail_data);
@@ -438,6 +666,7 @@ BOOL GetUSBDevices(DWORD devnum)
 		}
 	}
 	SetupDiDestroyDeviceInfoList(dev_info);
+	PrintUSBTopology();
 
 	// Adjust the Dropdown width to the maximum text size
 	SendMessage(hDeviceList, CB_SETDROPPEDWIDTH, (WPARAM)maxwidth, 0);
@@ -464,3 +693,76 @@ out:
 	htab_destroy(&htab_devid);
 	return r;
 }
+
+/*
+ * Schedule an operation writing 'size' bytes to each of the drives listed. Jobs are then started
+ * with GetNextUSBJob(), which only returns a drive if none of the links it depends on is already
+ * saturated, and must be reported with USBJobDone(), so that waiting jobs can take their place.
+ * Returns the expected time, in ms, for the whole operation to complete.
+ */
+uint64_t ScheduleUSBJobs(const DWORD* drive_index, int nb_drives, uint64_t size)
+{
+	int d, i, h;
+	uint64_t t;
+
+	for (h = 0; h < nb_usb_hubs; h++) {
+		usb_hub[h].jobs = 0;
+		usb_hub[h].load = 0;
+	}
+	for (d = 0; d < nb_usb_devs; d++) {
+		usb_dev[d].state = USB_JOB_NONE;
+		for (i = 0; i < nb_drives; i++) {
+			if (usb_dev[d].drive_index == drive_index[i]) {
+				usb_dev[d].state = USB_JOB_PENDING;
+				break;
+			}
+		}
+	}
+	job_size = size;
+	t = SimulateUSBSchedule();
+	uprintf("Expected completion time for %d drive(s): %d s", nb_drives, (int)(t/1000));
+	return t;
+}
+
+// Returns the index of the next drive to process, or 0 if none can be started at this stage
+DWORD GetNextUSBJob(void)
+{
+	int d, h, jobs[MAX_USB_HUBS];
+	uint32_t load[MAX_USB_HUBS];
+
+	for (h = 0; h < nb_usb_hubs; h++) {
+		jobs[h] = usb_hub[h].jobs;
+		load[h] = usb_hub[h].load;
+	}
+	for (d = 0; d < nb_usb_devs; d++) {
+		if ((usb_dev[d].state != USB_JOB_PENDING) || (!CanStartJob(&usb_dev[d], jobs, load)))
+			continue;
+		usb_dev[d].state = USB_JOB_RUNNING;
+		for (h = usb_dev[d].hub; h >= 0; h = usb_hub[h].parent) {
+			usb_hub[h].jobs++;
+			usb_hub[h].load += device_throughput[usb_dev[d].speed];
+		}
+		return usb_dev[d].drive_index;
+	}
+	return 0;
+}
+
+void USBJobDone(DWORD drive_index)
+{
+	int d, h, remaining = 0;
+
+	for (d = 0; d < nb_usb_devs; d++) {
+		if ((usb_dev[d].drive_index == drive_index) && (usb_dev[d].state == USB_JOB_RUNNING)) {
+			usb_dev[d].state = USB_JOB_DONE;
+			for (h = usb_dev[d].hub; h >= 0; h = usb_hub[h].parent) {
+				usb_hub[h].jobs--;
+				usb_hub[h].load -= device_throughput[usb_dev[d].speed];
+			}
+		}
+		if ((usb_dev[d].state == USB_JOB_PENDING) || (usb_dev[d].state == USB_JOB_RUNNING))
+			remaining++;
+	}
+	if (remaining != 0)
+		uprintf("%d drive(s) remaining, expected completion in at most %d s", remaining,
+			(int)(SimulateUSBSchedule()/1000));
+}
@@ -95,6 +95,7 @@ DECLSPEC_IMPORT CONFIGRET WINAPI CM_Get_Device_ID_ListA(PCSTR pszFilter, PCHAR B
 DECLSPEC_IMPORT CONFIGRET WINAPI CM_Locate_DevNodeA(PDEVINST pdnDevInst, DEVINSTID_A pDeviceID, ULONG ulFlags);
 DECLSPEC_IMPORT CONFIGRET WINAPI CM_Get_Child(PDEVINST pdnDevInst, DEVINST dnDevInst, ULONG ulFlags);
 DECLSPEC_IMPORT CONFIGRET WINAPI CM_Get_Sibling(PDEVINST pdnDevInst, DEVINST dnDevInst, ULONG ulFlags);
+DECLSPEC_IMPORT CONFIGRET WINAPI CM_Get_Parent(PDEVINST pdnDevInst, DEVINST dnDevInst, ULONG ulFlags);
 // This last one is unknown from MinGW32 and needs to be fetched from the DLL
 PF_TYPE_DECL(WINAPI, CONFIGRET, CM_Get_DevNode_Registry_PropertyA, (DEVINST, ULONG, PULONG, PVOID, PULONG, ULONG));
 
@@ -172,3 +173,36 @@ const GUID _GUID_DEVINTERFACE_USB_HUB =
 	{ 0xf18a0e88L, 0xc30c, 0x11d0, {0x88, 0x15, 0x00, 0xa0, 0xc9, 0x06, 0xbe, 0xd8} };
 
 #define DEVID_HTAB_SIZE		257
+
+/*
+ * USB topology, as seen during enumeration. This is used to schedule operations on
+ * multiple devices, so that devices that share an upstream link don't all compete for it.
+ */
+#define MAX_USB_HUBS		64
+
+typedef struct usb_hub_node {
+	DEVINST   inst;
+	int       parent;		// index of the upstream hub, or -1 for a root hub
+	uint32_t  speed;		// speed of the upstream link of this hub
+	int       jobs;			// number of scheduled jobs going through this hub
+	uint32_t  load;			// expected throughput of these jobs, in KB/s
+} usb_hub_node;
+
+typedef struct usb_dev_node {
+	DWORD     drive_index;
+	int       hub;			// index of the parent hub, or -1 if unknown
+	uint32_t  speed;
+	uint16_t  vid;
+	int       state;
+} usb_dev_node;
+
+enum usb_job_state {
+	USB_JOB_NONE = 0,
+	USB_JOB_PENDING,
+	USB_JOB_RUNNING,
+	USB_JOB_DONE
+};
+
+// Effective bandwidth of a link, and typical write throughput of a flash drive, in KB/s, per USB speed
+#define USB_LINK_BANDWIDTH		{ 35000, 150, 1000, 35000, 350000 }
+#define USB_DEVICE_THROUGHPUT	{ 15000, 50, 500, 15000, 60000 }
@@ -0,0 +1,436 @@
+/*
+ * Rufus: The Reliable USB Formatting Utility
+ * Post-write validation of the media
+ * Copyright © 2015 Pete Batard <pete@akeo.ie>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * A write that completed without I/O errors doesn't necessarily produce bootable
+ * media: Windows may not have picked up the partitions we created, a boot record may
+ * have been overwritten after we wrote it, or boot files may be missing. So, once we
+ * are done, we read back the metadata only (partition tables, boot region of the first
+ * partition and the presence of the boot files) and check it against what we meant to
+ * write. As this doesn't read any file data, it only takes a fraction of a second.
+ */
+
+#include <windows.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdarg.h>
+
+#include "rufus.h"
+#include "msapi_utf8.h"
+#include "resource.h"
+#include "drive.h"
+#include "br.h"
+#include "fat16.h"
+#include "fat32.h"
+#include "ntfs.h"
+
+#define VALIDATE_BOOT_REGION_SIZE   (32 * 1024)		/* covers the boot records and FAT32 backup */
+#define VALIDATE_MAX_ENTRIES_SIZE   (1024 * 1024)
+
+extern BOOL force_large_fat32;
+extern const char* FileSystemLabel[FS_MAX];
+
+static int nb_checks, nb_failed;
+
+static BOOL Check(BOOL pass, const char* format, ...)
+{
+	char msg[128];
+	va_list args;
+
+	va_start(args, format);
+	safe_vsnprintf(msg, sizeof(msg), format, args);
+	va_end(args);
+	msg[sizeof(msg) - 1] = 0;
+	uprintf("  %s: %s", msg, pass ? "PASS" : "FAIL");
+	nb_checks++;
+	if (!pass)
+		nb_failed++;
+	return pass;
+}
+
+static BOOL ReadAt(HANDLE h, uint64_t offset, void* buf, DWORD size)
+{
+	LARGE_INTEGER li;
+	DWORD rSize;
+
+	li.QuadPart = offset;
+	return SetFilePointerEx(h, li, NULL, FILE_BEGIN) && ReadFile(h, buf, size, &rSize, NULL) && (rSize == size);
+}
+
+/*
+ * Check a GPT header and its partition entries, as well as the partitions we created,
+ * if any. Returns the LBA of the other header, or 0 if this one is invalid.
+ */
+static uint64_t CheckGPT(HANDLE hDrive, DWORD SectorSize, uint64_t lba, const char* name, BOOL check_partitions)
+{
+	uint8_t *buf = NULL, *entries = NULL;
+	gpt_header* gpt;
+	gpt_entry* entry;
+	uint32_t crc, entries_size = 0;
+	uint64_t alternate = 0;
+	BOOL r;
+	int i;
+
+	buf = (uint8_t*)malloc(SectorSize);
+	if (buf == NULL)
+		return 0;
+	gpt = (gpt_header*)buf;
+	r = ReadAt(hDrive, lba * SectorSize, buf, SectorSize) && (memcmp(gpt->signature, GPT_HEADER_SIGNATURE, 8) == 0)
+		&& (gpt->header_size >= 92) && (gpt->header_size <= SectorSize) && (gpt->my_lba == lba);
+	if (r) {
+		crc = gpt->header_crc;
+		gpt->header_crc = 0;
+		r = (gpt_crc32(buf, gpt->header_size) == crc);
+		gpt->header_crc = crc;
+	}
+	if (!Check(r, "%s GPT header", name))
+		goto out;
+
+	entries_size = gpt->nb_partition_entries * gpt->partition_entry_size;
+	r = (gpt->partition_entry_size >= sizeof(gpt_entry)) && (entries_size <= VALIDATE_MAX_ENTRIES_SIZE);
+	if (r) {
+		entries = (uint8_t*)malloc((entries_size + SectorSize - 1) / SectorSize * SectorSize);
+		r = (entries != NULL) && ReadAt(hDrive, gpt->partition_entry_lba * SectorSize, entries,
+			(entries_size + SectorSize - 1) / SectorSize * SectorSize)
+			&& (gpt_crc32(entries, entries_size) == gpt->partition_entry_crc);
+	}
+	if (!Check(r, "%s GPT partition entries", name))
+		goto out;
+
+	for (i = 0; check_partitions && (i < SelectedDrive.nPartitions); i++) {
+		if ((uint32_t)i >= gpt->nb_partition_entries)
+			break;
+		entry = (gpt_entry*)&entries[i * gpt->partition_entry_size];
+		Check((entry->first_lba * SectorSize == SelectedDrive.PartitionOffset[i])
+			&& ((entry->last_lba + 1 - entry->first_lba) * SectorSize == SelectedDrive.PartitionSize[i]),
+			"%s GPT partition %d", name, i + 1);
+	}
+	alternate = gpt->alternate_lba;
+
+out:
+	free(entries);
+	free(buf);
+	return alternate;
+}
+
+// The partitions we created must be in the MBR, and be the ones Windows sees
+static void CheckPartitions(HANDLE hDrive, const uint8_t* mbr, int pt, int fs)
+{
+	const DWORD SectorSize = SelectedDrive.Geometry.BytesPerSector;
+	const mbr_partition* part = (const mbr_partition*)&mbr[0x1be];
+	BYTE layout[4096];
+	PDRIVE_LAYOUT_INFORMATION_EX DriveLayout = (PDRIVE_LAYOUT_INFORMATION_EX)(void*)layout;
+	uint8_t type;
+	uint64_t alternate;
+	DWORD i, j, size;
+	BOOL r;
+
+	if (pt == PARTITION_STYLE_GPT) {
+		Check(part[0].type == 0xee, "Protective MBR");
+		alternate = CheckGPT(hDrive, SectorSize, 1, "Primary", TRUE);
+		if (alternate != 0) {
+			Check(alternate == SelectedDrive.DiskSize / SectorSize - 1, "Backup GPT location");
+			CheckGPT(hDrive, SectorSize, alternate, "Backup", TRUE);
+		}
+	} else {
+		switch (fs) {
+		case FS_FAT16: type = 0x0e; break;
+		case FS_FAT32: type = 0x0c; break;
+		case FS_EXT2:
+		case FS_EXT4: type = 0x83; break;
+		default: type = 0x07; break;
+		}
+		for (i = 0; i < 4; i++) {
+			if (i >= (DWORD)SelectedDrive.nPartitions)
+				r = (part[i].type == 0);
+			else
+				r = ((uint64_t)part[i].lba_start * SectorSize == SelectedDrive.PartitionOffset[i])
+					&& ((uint64_t)part[i].nb_sectors * SectorSize == SelectedDrive.PartitionSize[i])
+					&& ((i != 0) || (part[i].type == type));
+			Check(r, "MBR partition %d", i + 1);
+		}
+		if (IsChecked(IDC_BOOT))
+			Check(part[0].boot_indicator >= 0x80, "Active partition");
+	}
+
+	// Catches a layout that Windows didn't (yet) pick up
+	r = DeviceIoControl(hDrive, IOCTL_DISK_GET_DRIVE_LAYOUT_EX, NULL, 0, layout, sizeof(layout), &size, NULL)
+		&& (size > 0) && (DriveLayout->PartitionStyle == (DWORD)pt);
+	for (i = 0; r && (i < (DWORD)SelectedDrive.nPartitions); i++) {
+		for (j = 0; j < DriveLayout->PartitionCount; j++) {
+			if ( (DriveLayout->PartitionEntry[j].StartingOffset.QuadPart == (LONGLONG)SelectedDrive.PartitionOffset[i])
+			  && (DriveLayout->PartitionEntry[j].PartitionLength.QuadPart == (LONGLONG)SelectedDrive.PartitionSize[i]) )
+				break;
+		}
+		r = (j < DriveLayout->PartitionCount);
+	}
+	Check(r, "Partition layout reported by Windows");
+}
+
+// Check the file system boot region of the first partition, and the boot record we wrote there
+static void CheckBootRegion(HANDLE hDrive, int bt, int fs, int dt)
+{
+	const DWORD SectorSize = SelectedDrive.Geometry.BytesPerSector;
+	const uint64_t offset = SelectedDrive.PartitionOffset[0];
+	BOOL r, use_large_fat32, use_freedos, check_backup = FALSE, backup_ok = FALSE;
+	uint8_t *buf, *backup = NULL;
+	uint64_t nb_sectors;
+	uint16_t bk, bps;
+	FILE fake_fd = { 0 };
+	int (*matches)(FILE*) = NULL;
+
+	buf = (uint8_t*)malloc(VALIDATE_BOOT_REGION_SIZE);
+	if (buf == NULL)
+		return;
+	if (!Check(ReadAt(hDrive, offset, buf, VALIDATE_BOOT_REGION_SIZE), "First partition is readable"))
+		goto out;
+	fake_fd._ptr = (char*)hDrive;
+	fake_fd._base = (char*)buf;
+	fake_fd._charbuf = VALIDATE_BOOT_REGION_SIZE;
+	fake_fd._bufsiz = SectorSize;
+
+	switch (fs) {
+	case FS_FAT16:
+		r = is_fat_16_fs(&fake_fd);
+		break;
+	case FS_FAT32:
+		r = is_fat_32_fs(&fake_fd);
+		bk = buf[0x32] | (buf[0x33] << 8);
+		// Syslinux only updates the primary boot sector, so we compare the BPB only
+		check_backup = TRUE;
+		backup_ok = r && (bk != 0) && ((uint32_t)(bk + 1) * SectorSize <= VALIDATE_BOOT_REGION_SIZE)
+			&& (memcmp(&buf[0x0b], &buf[bk * SectorSize + 0x0b], 0x5a - 0x0b) == 0);
+		break;
+	case FS_NTFS:
+		r = is_ntfs_fs(&fake_fd);
+		// The backup boot sector is in the sector that follows the volume
+		bps = buf[0x0b] | (buf[0x0c] << 8);
+		memcpy(&nb_sectors, &buf[0x28], sizeof(nb_sectors));
+		backup = (uint8_t*)malloc(SectorSize);
+		check_backup = TRUE;
+		backup_ok = r && (bps == SectorSize) && (backup != NULL) && ReadAt(hDrive, offset + nb_sectors * bps, backup, SectorSize)
+			&& (memcmp(&buf[0x0b], &backup[0x0b], 0x54 - 0x0b) == 0);
+		break;
+	case FS_EXFAT:
+		r = (memcmp(&buf[3], "EXFAT   ", 8) == 0);
+		break;
+	case FS_EXT2:
+	case FS_EXT4:
+		r = (buf[1024 + 0x38] == 0x53) && (buf[1024 + 0x39] == 0xef);
+		break;
+	default:
+		// Nothing we can easily check for UDF or ReFS
+		goto out;
+	}
+	Check(r, "%s boot region", FileSystemLabel[fs]);
+	if (check_backup)
+		Check(backup_ok, "%s backup boot sector", FileSystemLabel[fs]);
+	if ((!r) || (!IsChecked(IDC_BOOT)) || (bt == BT_UEFI))
+		goto out;
+
+	// Same choice of boot record as the one made when formatting
+	use_freedos = (dt == DT_FREEDOS) || ((dt == DT_ISO) && (HAS_EL_TORITO_FLOPPY(iso_report)));
+	use_large_fat32 = (fs == FS_FAT32) && ((SelectedDrive.DiskSize > LARGE_FAT32_SIZE) || (force_large_fat32));
+	if ((((dt == DT_WINME) || (dt == DT_FREEDOS) || (dt == DT_GRUB4DOS) || (dt == DT_GRUB2) || (dt == DT_REACTOS)) &&
+		(!use_large_fat32)) || ((dt == DT_ISO) && ((fs == FS_NTFS)||(iso_report.has_kolibrios||IS_GRUB(iso_report)||
+		HAS_EL_TORITO_FLOPPY(iso_report))))) {
+		switch (fs) {
+		case FS_FAT16:
+			matches = (use_freedos) ? entire_fat_16_fd_br_matches :
+				((dt == DT_REACTOS) ? entire_fat_16_ros_br_matches : entire_fat_16_br_matches);
+			break;
+		case FS_FAT32:
+			if (use_freedos)
+				matches = entire_fat_32_fd_br_matches;
+			else if (dt == DT_REACTOS)
+				matches = entire_fat_32_ros_br_matches;
+			else if ((dt == DT_ISO) && (iso_report.has_kolibrios))
+				matches = entire_fat_32_kos_br_matches;
+			else
+				matches = entire_fat_32_br_matches;
+			break;
+		case FS_NTFS:
+			matches = entire_ntfs_br_matches;
+			break;
+		}
+		if (matches == NULL)
+			goto out;
+		Check(matches(&fake_fd), "Partition boot record");
+		// We also write the FAT32 backup boot record
+		if (fs == FS_FAT32) {
+			fake_fd._cnt = 6 * SectorSize;
+			Check(matches(&fake_fd), "Backup partition boot record");
+		}
+	} else if (((dt == DT_SYSLINUX_V4) || (dt == DT_SYSLINUX_V6) || ((dt == DT_ISO) && (!allow_dual_uefi_bios)))
+		&& ((fs == FS_FAT16) || (fs == FS_FAT32))) {
+		Check(is_br(&fake_fd) && (memcmp(&buf[3], "SYSLINUX", 8) == 0), "Syslinux partition boot record");
+	}
+
+out:
+	free(backup);
+	free(buf);
+}
+
+static BOOL FileExists(const char* drive_name, const char* path, uint64_t* size)
+{
+	char file[MAX_PATH];
+	WIN32_FILE_ATTRIBUTE_DATA attr;
+	BOOL r;
+
+	static_sprintf(file, "%c:\\%s", drive_name[0], path);
+	{
+		wconvert(file);
+		r = GetFileAttributesExW(wfile, GetFileExInfoStandard, &attr);
+		wfree(file);
+	}
+	r = r && !(attr.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY);
+	if ((r) && (size != NULL))
+		*size = ((uint64_t)attr.nFileSizeHigh << 32) | attr.nFileSizeLow;
+	return r;
+}
+
+static void CheckFile(const char* drive_name, const char* path)
+{
+	uint64_t size = 0;
+
+	Check(FileExists(drive_name, path, &size) && (size != 0), "Boot file '%s'", path);
+}
+
+// Check that the files needed to boot are present, and that Syslinux is of the version we installed
+static void CheckBootFiles(const char* drive_name, int bt, int fs, int dt)
+{
+	char path[MAX_PATH], *buf = NULL, *ext;
+	uint16_t version, sl_version = 0;
+	uint64_t size = 0;
+	FILE* fd;
+
+	switch (dt) {
+	case DT_WINME:
+		CheckFile(drive_name, "IO.SYS");
+		CheckFile(drive_name, "COMMAND.COM");
+		break;
+	case DT_FREEDOS:
+		CheckFile(drive_name, "KERNEL.SYS");
+		CheckFile(drive_name, "COMMAND.COM");
+		break;
+	case DT_GRUB4DOS:
+		CheckFile(drive_name, "grldr");
+		break;
+	case DT_SYSLINUX_V4:
+	case DT_SYSLINUX_V6:
+		sl_version = embedded_sl_version[(dt == DT_SYSLINUX_V6) ? 1 : 0];
+		break;
+	case DT_ISO:
+		if (iso_report.has_bootmgr)
+			CheckFile(drive_name, "bootmgr");
+		if ((iso_report.has_kolibrios) && (fs == FS_FAT32))
+			CheckFile(drive_name, "MTLD_F32");
+		if (HAS_EL_TORITO_FLOPPY(iso_report)) {
+			CheckFile(drive_name, "KERNEL.SYS");
+			CheckFile(drive_name, "COMMAND.COM");
+		}
+		if ((bt == BT_UEFI) && (IS_EFI(iso_report))) {
+			WIN32_FIND_DATAW wfd;
+			HANDLE hFind;
+			static_sprintf(path, "%c:\\efi\\boot\\boot*.efi", drive_name[0]);
+			{
+				wconvert(path);
+				hFind = FindFirstFileW(wpath, &wfd);
+				wfree(path);
+			}
+			Check(hFind != INVALID_HANDLE_VALUE, "EFI boot loader");
+			if (hFind != INVALID_HANDLE_VALUE)
+				FindClose(hFind);
+		}
+		if ( (bt != BT_UEFI) && (HAS_SYSLINUX(iso_report)) && (!allow_dual_uefi_bios)
+		  && ((fs == FS_FAT16) || (fs == FS_FAT32)) )
+			sl_version = iso_report.sl_version;
+		break;
+	}
+
+	if (sl_version == 0)
+		return;
+	if (!Check(FileExists(drive_name, "ldlinux.sys", &size) && (size != 0) && (size < 1024 * 1024),
+		"Boot file 'ldlinux.sys'"))
+		return;
+	static_sprintf(path, "%c:\\ldlinux.sys", drive_name[0]);
+	fd = fopenU(path, "rb");
+	buf = (char*)malloc((size_t)size);
+	if ((fd != NULL) && (buf != NULL) && (fread(buf, 1, (size_t)size, fd) == (size_t)size)) {
+		version = GetSyslinuxVersion(buf, (size_t)size, &ext);
+		Check(SL_MAJOR(version) == SL_MAJOR(sl_version), "Syslinux version (%d.%02d)", SL_MAJOR(version), SL_MINOR(version));
+	} else {
+		Check(FALSE, "Syslinux version");
+	}
+	if (fd != NULL)
+		fclose(fd);
+	free(buf);
+	// Syslinux 5.0 and later also need ldlinux.c32
+	if (SL_MAJOR(sl_version) >= 5)
+		CheckFile(drive_name, "ldlinux.c32");
+}
+
+/*
+ * Read back the metadata of the media we just created, and check that it is bootable.
+ * drive_name is NULL when there is no file system we can access. For DT_IMG, we can only
+ * check that what was written is self consistent.
+ */
+BOOL ValidateDrive(HANDLE hPhysicalDrive, const char* drive_name, int pt, int bt, int fs, int dt)
+{
+	const DWORD SectorSize = SelectedDrive.Geometry.BytesPerSector;
+	DWORD start_time = GetTickCount();
+	uint8_t* mbr;
+	FILE fake_fd = { 0 };
+
+	nb_checks = 0;
+	nb_failed = 0;
+	mbr = (uint8_t*)malloc(SectorSize);
+	if (mbr == NULL)
+		return FALSE;
+	uprintf("Validating the media...");
+	if (!Check(ReadAt(hPhysicalDrive, 0, mbr, SectorSize), "First sector is readable"))
+		goto out;
+	fake_fd._ptr = (char*)hPhysicalDrive;
+	fake_fd._base = (char*)mbr;
+	fake_fd._charbuf = SectorSize;
+	fake_fd._bufsiz = SectorSize;
+	Check(is_br(&fake_fd), "Boot signature (0x55AA)");
+
+	if (dt == DT_IMG) {
+		if (((mbr_partition*)&mbr[0x1be])->type == 0xee)
+			CheckGPT(hPhysicalDrive, SectorSize, 1, "Primary", FALSE);
+		goto out;
+	}
+
+	CheckPartitions(hPhysicalDrive, mbr, pt, fs);
+	if ((pt == PARTITION_STYLE_MBR) && (IsChecked(IDC_BOOT)))
+		Check(((bt == BT_UEFI) && (!allow_dual_uefi_bios)) == (is_zero_mbr(&fake_fd) != 0), "MBR boot code");
+	CheckBootRegion(hPhysicalDrive, bt, fs, dt);
+	if ((drive_name != NULL) && (IsChecked(IDC_BOOT)))
+		CheckBootFiles(drive_name, bt, fs, dt);
+
+out:
+	free(mbr);
+	uprintf("Validation %s: %d of %d checks passed (%d ms)", (nb_failed == 0) ? "PASSED" : "FAILED",
+		nb_checks - nb_failed, nb_checks, GetTickCount() - start_time);
+	if (nb_failed != 0)
+		FormatStatus = ERROR_SEVERITY_ERROR|FAC(FACILITY_STORAGE)|ERROR_INVALID_DATA;
+	return (nb_failed == 0);
+}
@@ -58,6 +58,20 @@
 
 #define SECONDS_SINCE_JAN_1ST_2000			946684800
 
+#define MAX_COMPRESSED_PROBE_SIZE			(2 * 1024 * 1024)	// How much of a compressed image we decompress for analysis
+#define ISO_SYSTEM_AREA_SIZE				(32 * 1024)			// Where isohybrid images store their MBR and GPT
+#define PROBE_HEAD_SIZE						(64 * 1024)			// Enough for the ISO volume descriptors and a GPT
+#define PROBE_SECTOR_SIZE					2048
+#define GPT_MAX_ENTRIES						128
+#define IMAGE_RANGE_MIN_GAP					(1024 * 1024)		// Free space gaps smaller than this are written anyway
+#define FAT_CHUNK_SIZE						(12 * 64 * 1024)	// Must be a multiple of 12 bytes, for FAT12
+#define EXT_MAX_GDT_SIZE					(64 * 1024 * 1024)
+#define EXT_SUPER_MAGIC						0xEF53
+#define EXT_FEATURE_INCOMPAT_META_BG		0x0010
+#define EXT_FEATURE_INCOMPAT_64BIT			0x0080
+#define EXT_FEATURE_RO_COMPAT_BIGALLOC		0x0200
+#define EXT_BG_BLOCK_UNINIT					0x0002
+
 /*
  * VHD Fixed HD footer (Big Endian)
  * http://download.microsoft.com/download/f/f/e/ffef50a5-07dd-4cf8-aaa3-442c0673a029/Virtual%20Hard%20Disk%20Format%20Spec_10_18_06.doc
@@ -90,8 +104,99 @@ typedef struct vhd_footer {
 	uint8_t		saved_state;
 	uint8_t		reserved[427];
 } vhd_footer;
+
+// The part of a FAT boot sector that we need (Little Endian)
+typedef struct fat_bpb {
+	uint8_t		jump[3];
+	char		oem_name[8];
+	uint16_t	bytes_per_sector;
+	uint8_t		sectors_per_cluster;
+	uint16_t	reserved_sectors;
+	uint8_t		nb_fats;
+	uint16_t	root_entries;
+	uint16_t	total_sectors_16;
+	uint8_t		media;
+	uint16_t	fat_size_16;
+	uint16_t	sectors_per_track;
+	uint16_t	nb_heads;
+	uint32_t	hidden_sectors;
+	uint32_t	total_sectors_32;
+	// FAT32 only
+	uint32_t	fat_size_32;
+	uint16_t	ext_flags;
+	uint16_t	fs_version;
+	uint32_t	root_cluster;
+	uint16_t	fs_info;
+	uint16_t	backup_boot_sector;
+} fat_bpb;
+
+// Same for the ext2/3/4 superblock (Little Endian)
+typedef struct ext_superblock {
+	uint32_t	inodes_count;
+	uint32_t	blocks_count_lo;
+	uint32_t	r_blocks_count_lo;
+	uint32_t	free_blocks_count_lo;
+	uint32_t	free_inodes_count;
+	uint32_t	first_data_block;
+	uint32_t	log_block_size;
+	uint32_t	log_cluster_size;
+	uint32_t	blocks_per_group;
+	uint32_t	clusters_per_group;
+	uint32_t	inodes_per_group;
+	uint32_t	mtime;
+	uint32_t	wtime;
+	uint16_t	mnt_count;
+	uint16_t	max_mnt_count;
+	uint16_t	magic;
+	uint8_t		reserved1[34];
+	uint32_t	feature_compat;
+	uint32_t	feature_incompat;
+	uint32_t	feature_ro_compat;
+	uint8_t		reserved2[150];
+	uint16_t	desc_size;
+	uint8_t		reserved3[80];
+	uint32_t	blocks_count_hi;
+	uint8_t		reserved4[684];
+} ext_superblock;
 #pragma pack(pop)
 
+// What we can tell about an image from reading its first and last few sectors once
+typedef struct image_probe {
+	uint64_t	size;
+	uint8_t*	head;
+	DWORD		head_size;
+	uint8_t		tail[sizeof(vhd_footer)];
+	int			magic_index;		// index in file_assoc[], or -1 if not compressed
+	BOOL		is_iso9660;
+	BOOL		is_udf;
+	BOOL		has_el_torito;
+	BOOL		has_mbr;
+	BOOL		has_gpt;
+	BOOL		is_vhd;
+	BOOL		is_vhdx;
+	BOOL		is_dmg;
+	BOOL		is_qcow2;
+} image_probe;
+
+// FAT geometry, in sectors unless noted otherwise
+typedef struct fat_info {
+	uint32_t	bytes_per_sector;
+	uint32_t	sectors_per_cluster;
+	uint32_t	nb_fats;
+	uint32_t	fat_size;
+	uint64_t	fat_start;
+	uint64_t	data_start;
+	uint64_t	total_sectors;
+	uint32_t	nb_clusters;
+	int			bits;
+} fat_info;
+
+typedef struct range_list {
+	image_range*	range;
+	uint32_t		nb;
+	uint32_t		max;
+} range_list;
+
 // WIM API Prototypes
 #define WIM_GENERIC_READ	GENERIC_READ
 #define WIM_OPEN_EXISTING	OPEN_EXISTING
@@ -102,6 +207,7 @@ PF_TYPE_DECL(WINAPI, BOOL, WIMExtractImagePath, (HANDLE, PWSTR, PWSTR, DWORD));
 PF_TYPE_DECL(WINAPI, BOOL, WIMCloseHandle, (HANDLE));
 PF_TYPE_DECL(RPC_ENTRY, RPC_STATUS, UuidCreate, (UUID __RPC_FAR*));
 
+BOOL enable_partition_grow = FALSE;
 static BOOL has_wimgapi = FALSE, has_7z = FALSE;
 static char sevenzip_path[MAX_PATH];
 static const char conectix_str[] = VHD_FOOTER_COOKIE;
@@ -215,102 +321,916 @@ out:
 typedef struct {
 	const char* ext;
 	bled_compression_type type;
+	const char* magic;
+	size_t magic_len;
 } comp_assoc;
 
-static comp_assoc blah[] = {
-	{ ".xz", BLED_COMPRESSION_XZ },
-	{ ".gz", BLED_COMPRESSION_GZIP },
-	{ ".lzma", BLED_COMPRESSION_LZMA },
-	{ ".bz2", BLED_COMPRESSION_BZIP2 },
-	{ ".Z", BLED_COMPRESSION_LZW },
+static comp_assoc file_assoc[] = {
+	{ ".xz", BLED_COMPRESSION_XZ, "\xFD\x37\x7A\x58\x5A\x00", 6 },
+	{ ".gz", BLED_COMPRESSION_GZIP, "\x1F\x8B", 2 },
+	{ ".lzma", BLED_COMPRESSION_LZMA, NULL, 0 },	// .lzma streams don't have a signature
+	{ ".bz2", BLED_COMPRESSION_BZIP2, "BZh", 3 },
+	{ ".Z", BLED_COMPRESSION_LZW, "\x1F\x9D", 2 },
 };
 
-// For now we consider that an image that matches a known extension is bootable
-// TODO: uncompress header and check for bootable flag
-BOOL IsCompressedBootableImage(const char* path)
+// .lzma has no magic, so the best we can do is check that the header looks sensible:
+// a properties byte < 9*5*5, followed by a dictionary size and an uncompressed size
+// that is either unknown (-1) or not outlandish.
+static BOOL IsLzmaHeader(const uint8_t* buf)
+{
+	uint64_t size = *((uint64_t*)&buf[5]);
+
+	return (buf[0] < 9*5*5) && ((size == 0xFFFFFFFFFFFFFFFFULL) || (size < (1ULL << 48)));
+}
+
+// Compute the size that an image really requires on the target, from its MBR/GPT.
+// Returns 0 if it cannot be determined.
+static uint64_t GetImageExtent(const uint8_t* buf, size_t size)
+{
+	const mbr_partition* part = (const mbr_partition*)&buf[0x1BE];
+	const gpt_header* gpt = (const gpt_header*)&buf[512];
+	const gpt_entry* entry;
+	const uint8_t zero_guid[16] = { 0 };
+	uint64_t extent = 0, end, offset;
+	BOOL has_protective_mbr = FALSE;
+	uint32_t i;
+
+	if ((size < 512) || (buf[0x1FE] != 0x55) || (buf[0x1FF] != 0xAA))
+		return 0;
+
+	for (i = 0; i < 4; i++) {
+		if (part[i].type == 0)
+			continue;
+		if (part[i].type == 0xEE) {
+			// The protective partition usually covers the whole original disk
+			has_protective_mbr = TRUE;
+			continue;
+		}
+		end = ((uint64_t)part[i].lba_start + part[i].nb_sectors) * 512;
+		if (end > extent)
+			extent = end;
+	}
+
+	if ((has_protective_mbr) && (size >= 1024) && (memcmp(gpt->signature, GPT_HEADER_SIGNATURE, 8) == 0)
+	  && (gpt->partition_entry_size >= sizeof(gpt_entry))) {
+		for (i = 0; i < gpt->nb_partition_entries; i++) {
+			offset = gpt->partition_entry_lba * 512 + (uint64_t)i * gpt->partition_entry_size;
+			if (offset + sizeof(gpt_entry) > size)
+				break;
+			entry = (const gpt_entry*)&buf[offset];
+			if (memcmp(entry->type_guid, zero_guid, sizeof(zero_guid)) == 0)
+				continue;
+			end = (entry->last_lba + 1) * 512;
+			if (end > extent)
+				extent = end;
+		}
+		// The backup GPT is located at the very end of the image
+		if (gpt->alternate_lba > gpt->my_lba) {
+			end = (gpt->alternate_lba + 1) * 512;
+			if (end > extent)
+				extent = end;
+		}
+	}
+
+	return extent;
+}
+
+// Identify the compression format from the data signature, rather than trust the extension.
+// Returns the index in file_assoc[], or -1 if the data doesn't look compressed.
+static int GetCompressionIndex(const char* path, const uint8_t* header, int* ext_index)
 {
-	char* p;
+	const char* p;
 	int i;
 
+	*ext_index = -1;
+	for (p = &path[strlen(path)-1]; (*p != '.') && (p != path); p--);
+	if (p != path) {
+		for (i = 0; i<ARRAYSIZE(file_assoc); i++) {
+			if (strcmp(p, file_assoc[i].ext) == 0) {
+				*ext_index = i;
+				break;
+			}
+		}
+	}
+
+	for (i = 0; i<ARRAYSIZE(file_assoc); i++) {
+		if ((file_assoc[i].magic != NULL) && (memcmp(header, file_assoc[i].magic, file_assoc[i].magic_len) == 0))
+			return i;
+	}
+	if ((*ext_index >= 0) && (file_assoc[*ext_index].type == BLED_COMPRESSION_LZMA) && (IsLzmaHeader(header)))
+		return *ext_index;
+	return -1;
+}
+
+// Decompress the first few MB of a compressed image, to check if it is bootable and find how
+// large it is once uncompressed. This lets us reject mislabelled or non bootable images
+// right away, instead of finding out after the target has been wiped.
+static BOOL IsCompressedBootableImage(const char* path, const image_probe* probe)
+{
+	uint8_t* buf = NULL;
+	int ext_index, magic_index;
+	int64_t dc;
+	uint64_t extent;
+	BOOL r = FALSE;
+
 	iso_report.compression_type = BLED_COMPRESSION_NONE;
-	for (p = (char*)&path[strlen(path)-1]; (*p != '.') && (p != path); p--);
 
-	if (p == path)
+	magic_index = GetCompressionIndex(path, probe->head, &ext_index);
+	if (magic_index < 0) {
+		if (ext_index >= 0)
+			uprintf("Image has a '%s' extension, but does not contain %s compressed data",
+				file_assoc[ext_index].ext, &file_assoc[ext_index].ext[1]);
 		return FALSE;
+	}
+	if ((ext_index >= 0) && (ext_index != magic_index))
+		uprintf("Image has a '%s' extension, but contains %s compressed data",
+			file_assoc[ext_index].ext, &file_assoc[magic_index].ext[1]);
+	iso_report.compression_type = file_assoc[magic_index].type;
 
-	for (i = 0; i<ARRAYSIZE(blah); i++) {
-		if (strcmp(p, blah[i].ext) == 0) {
-			iso_report.compression_type = blah[i].type;
-			return TRUE;
-		}
+	buf = (uint8_t*)malloc(MAX_COMPRESSED_PROBE_SIZE);
+	if (buf == NULL) {
+		uprintf("Could not allocate buffer for compressed image analysis");
+		goto out;
+	}
+	bled_init(_uprintf, NULL, NULL, NULL);
+	dc = bled_uncompress_to_buffer(path, (char*)buf, MAX_COMPRESSED_PROBE_SIZE, iso_report.compression_type);
+	bled_exit();
+	if (dc < 512) {
+		uprintf("Could not decompress %s image header", &file_assoc[magic_index].ext[1]);
+		goto out;
 	}
 
-	return FALSE;
+	r = AnalyzeMBRBuffer(buf, (size_t)dc, "Compressed image");
+	if (!r)
+		goto out;
+	extent = GetImageExtent(buf, (size_t)dc);
+	if (extent != 0) {
+		iso_report.projected_size = extent;
+		uprintf("Compressed image requires %s once uncompressed", SizeToHumanReadable(extent, TRUE, FALSE));
+	} else if (dc < MAX_COMPRESSED_PROBE_SIZE) {
+		// The whole image fitted in our buffer
+		iso_report.projected_size = (uint64_t)dc;
+	}
+
+out:
+	safe_free(buf);
+	return r;
 }
 
+// Check whether an ISO is also a disk image (isohybrid), that can be written raw instead of
+// having its content extracted. For the raw write to be as good as an extraction, the image
+// must have boot code in its MBR and, if the ISO supports EFI, an EFI System Partition.
+static BOOL IsHybridISO(const image_probe* probe)
+{
+	const uint8_t esp_guid[16] = { 0x28, 0x73, 0x2A, 0xC1, 0x1F, 0xF8, 0xD2, 0x11,
+		0xBA, 0x4B, 0x00, 0xA0, 0xC9, 0x3E, 0xC9, 0x3B };
+	const uint8_t* buf = probe->head;
+	const mbr_partition* part;
+	const gpt_header* gpt;
+	const gpt_entry* entry;
+	uint64_t extent, offset;
+	DWORD size = MIN(probe->head_size, ISO_SYSTEM_AREA_SIZE);
+	BOOL has_esp = FALSE, r = FALSE;
+	uint32_t i;
+
+	// Regular ISOs have an empty system area, and therefore no partition table
+	if ((!probe->has_mbr) || (size < 1024))
+		return FALSE;
+	extent = GetImageExtent(buf, size);
+	if ((extent == 0) || (extent > probe->size))
+		return FALSE;
+	for (i = 0; (i < 440) && (buf[i] == 0); i++);
+	if (i >= 440) {
+		uprintf("ISO has a partition table, but no MBR boot code");
+		return FALSE;
+	}
+
+	part = (const mbr_partition*)&buf[0x1BE];
+	gpt = (const gpt_header*)&buf[512];
+	for (i = 0; i < 4; i++) {
+		if (part[i].type == 0xEF)
+			has_esp = TRUE;
+	}
+	if ((!has_esp) && (memcmp(gpt->signature, GPT_HEADER_SIGNATURE, 8) == 0)
+	  && (gpt->partition_entry_size >= sizeof(gpt_entry))) {
+		for (i = 0; i < gpt->nb_partition_entries; i++) {
+			offset = gpt->partition_entry_lba * 512 + (uint64_t)i * gpt->partition_entry_size;
+			if (offset + sizeof(gpt_entry) > size)
+				break;
+			entry = (const gpt_entry*)&buf[offset];
+			if (memcmp(entry->type_guid, esp_guid, sizeof(esp_guid)) == 0) {
+				has_esp = TRUE;
+				break;
+			}
+		}
+	}
+	if ((IS_EFI(iso_report)) && (!has_esp)) {
+		uprintf("ISO has a partition table, but no EFI System Partition");
+		return FALSE;
+	}
+
+	r = AnalyzeMBRBuffer(buf, size, "Hybrid ISO");
+	if (r)
+		iso_report.src_size = probe->size;
+	return r;
+}
 
-BOOL IsHDImage(const char* path)
+static BOOL IsHDImage(const char* path, const image_probe* probe)
 {
-	HANDLE handle = INVALID_HANDLE_VALUE;
-	LARGE_INTEGER liImageSize;
-	vhd_footer* footer = NULL;
-	DWORD size;
+	vhd_footer footer;
 	size_t i;
 	uint32_t checksum, old_checksum;
-	LARGE_INTEGER ptr;
 
+	iso_report.src_size = probe->size;
+	iso_report.projected_size = iso_report.src_size;
+
+	if (probe->is_vhdx) {
+		uprintf("VHDX images are not supported");
+		return FALSE;
+	}
+	if (probe->is_dmg) {
+		iso_report.is_bootable_img = IsDmgImage(path);
+		return iso_report.is_bootable_img;
+	}
+	if (probe->is_qcow2) {
+		iso_report.is_bootable_img = IsQcow2Image(path);
+		return iso_report.is_bootable_img;
+	}
+	iso_report.is_bootable_img = IsCompressedBootableImage(path, probe);
+	if (iso_report.compression_type == BLED_COMPRESSION_NONE)
+		iso_report.is_bootable_img = AnalyzeMBRBuffer(probe->head, probe->head_size, "Image");
+
+	if ((iso_report.compression_type == BLED_COMPRESSION_NONE) && (probe->is_vhd)) {
+		memcpy(&footer, probe->tail, sizeof(footer));
+		iso_report.projected_size -= sizeof(vhd_footer);
+		if ( (bswap_uint32(footer.file_format_version) != VHD_FOOTER_FILE_FORMAT_V1_0)
+		  || (bswap_uint32(footer.disk_type) != VHD_FOOTER_TYPE_FIXED_HARD_DISK)) {
+			uprintf("Unsupported type of VHD image");
+			iso_report.is_bootable_img = FALSE;
+			return FALSE;
+		}
+		// Might as well validate the checksum while we're at it
+		old_checksum = bswap_uint32(footer.checksum);
+		footer.checksum = 0;
+		for (checksum=0, i=0; i<sizeof(vhd_footer); i++)
+			checksum += ((uint8_t*)&footer)[i];
+		checksum = ~checksum;
+		if (checksum != old_checksum)
+			uprintf("Warning: VHD footer seems corrupted (checksum: %04X, expected: %04X)", old_checksum, checksum);
+		// Need to remove the footer from our payload
+		uprintf("Image is a Fixed Hard Disk VHD file");
+		iso_report.is_vhd = TRUE;
+	}
+
+	return iso_report.is_bootable_img;
+}
+
+// Read the start and the end of an image, and run all our detectors against these
+static BOOL ReadImageProbe(const char* path, image_probe* probe)
+{
+	const char* vrs_id[] = { "BEA01", "NSR02", "NSR03" };
+	const char el_torito_id[] = "EL TORITO SPECIFICATION";
+	HANDLE handle;
+	LARGE_INTEGER li;
+	DWORD size = 0;
+	uint8_t* sector;
+	int ext_index;
+	size_t i, j;
+	BOOL r = FALSE;
+
+	memset(probe, 0, sizeof(image_probe));
+	probe->magic_index = -1;
 	handle = CreateFileU(path, GENERIC_READ, FILE_SHARE_READ, NULL,
 		OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
 	if (handle == INVALID_HANDLE_VALUE) {
 		uprintf("Could not open image '%s'", path);
+		return FALSE;
+	}
+	// Zero filled, so that the detectors never need to check how much was actually read
+	probe->head = (uint8_t*)calloc(1, PROBE_HEAD_SIZE);
+	if (probe->head == NULL)
+		goto out;
+	if (!GetFileSizeEx(handle, &li)) {
+		uprintf("Could not get image size: %s", WindowsErrorString());
+		goto out;
+	}
+	probe->size = (uint64_t)li.QuadPart;
+	if (!ReadFile(handle, probe->head, PROBE_HEAD_SIZE, &probe->head_size, NULL)) {
+		uprintf("Could not read image: %s", WindowsErrorString());
 		goto out;
 	}
+	if (probe->size > probe->head_size) {
+		li.QuadPart = probe->size - sizeof(probe->tail);
+		if ( (!SetFilePointerEx(handle, li, NULL, FILE_BEGIN))
+		  || (!ReadFile(handle, probe->tail, sizeof(probe->tail), &size, NULL)) || (size != sizeof(probe->tail)) ) {
+			uprintf("Could not read the end of the image: %s", WindowsErrorString());
+			goto out;
+		}
+	} else if (probe->size >= 2 * sizeof(probe->tail)) {
+		memcpy(probe->tail, &probe->head[probe->size - sizeof(probe->tail)], sizeof(probe->tail));
+	}
+	r = TRUE;
 
-	iso_report.is_bootable_img = IsCompressedBootableImage(path);
-	if (iso_report.compression_type == BLED_COMPRESSION_NONE)
-		iso_report.is_bootable_img = AnalyzeMBR(handle, "Image");
+	// The ISO9660 and UDF volume descriptors start at sector 16, and El Torito's boot
+	// record must be at sector 17
+	for (i = 16; (i + 1) * PROBE_SECTOR_SIZE <= probe->head_size; i++) {
+		sector = &probe->head[i * PROBE_SECTOR_SIZE];
+		if (memcmp(&sector[1], "CD001", 5) == 0) {
+			if (sector[0] == 1)
+				probe->is_iso9660 = TRUE;
+			if ((i == 17) && (sector[0] == 0) && (memcmp(&sector[7], el_torito_id, sizeof(el_torito_id) - 1) == 0))
+				probe->has_el_torito = TRUE;
+			continue;
+		}
+		for (j = 0; j < ARRAYSIZE(vrs_id); j++) {
+			if (memcmp(&sector[1], vrs_id[j], 5) == 0)
+				break;
+		}
+		if (j >= ARRAYSIZE(vrs_id))
+			break;
+		if (j > 0)
+			probe->is_udf = TRUE;
+	}
+	probe->has_mbr = (probe->head[0x1FE] == 0x55) && (probe->head[0x1FF] == 0xAA);
+	probe->has_gpt = (memcmp(&probe->head[512], GPT_HEADER_SIGNATURE, 8) == 0);
+	probe->is_vhd = (memcmp(((vhd_footer*)probe->tail)->cookie, conectix_str, sizeof(((vhd_footer*)probe->tail)->cookie)) == 0);
+	probe->is_vhdx = (memcmp(probe->head, "vhdxfile", 8) == 0);
+	probe->is_dmg = (memcmp(probe->tail, "koly", 4) == 0);
+	probe->is_qcow2 = (memcmp(probe->head, "QFI\xfb", 4) == 0);
+	probe->magic_index = GetCompressionIndex(path, probe->head, &ext_index);
 
-	if (!GetFileSizeEx(handle, &liImageSize)) {
-		uprintf("Could not get image size: %s", WindowsErrorString());
+out:
+	if (!r)
+		safe_free(probe->head);
+	safe_closehandle(handle);
+	return r;
+}
+
+// Identify an image from a single read of its start and end, before handing it over to
+// the scanner that can process it, so that we don't reopen slow media for every format
+BOOL ScanImage(const char* path)
+{
+	image_probe probe;
+	BOOL r = FALSE;
+
+	memset(&iso_report, 0, sizeof(iso_report));
+	if (!ReadImageProbe(path, &probe))
+		return FALSE;
+	uprintf("Image signatures:%s%s%s%s%s%s%s%s%s%s%s", probe.is_iso9660?" ISO9660":"", probe.is_udf?" UDF":"",
+		probe.has_el_torito?" El-Torito":"", probe.has_mbr?" MBR":"", probe.has_gpt?" GPT":"",
+		probe.is_vhd?" VHD":"", probe.is_vhdx?" VHDX":"", probe.is_dmg?" DMG":"", probe.is_qcow2?" QCOW2":"",
+		(probe.magic_index >= 0)?" Compressed":"", (probe.is_iso9660 || probe.is_udf || probe.has_mbr || probe.is_vhd ||
+		probe.is_vhdx || probe.is_dmg || probe.is_qcow2 || (probe.magic_index >= 0))?"":" None");
+
+	if (probe.is_iso9660 || probe.is_udf) {
+		r = ExtractISO(path, "", TRUE);
+		if (r)
+			iso_report.is_hybrid_img = IsHybridISO(&probe);
+		// Only fall back to an El Torito emulation image if there is nothing else we can boot
+		if ((r) && (probe.has_el_torito) && (!iso_report.is_hybrid_img) && (!HAS_BOOT_FILES(iso_report)))
+			GetElToritoImage(path);
+	}
+	// Images that are not ISOs, or that we failed to process as such, may still be disk images
+	if (!r)
+		r = IsHDImage(path, &probe);
+	free(probe.head);
+	return r;
+}
+
+/*
+ * Partition aware image writing
+ */
+static BOOL ReadAt(HANDLE h, uint64_t offset, void* buf, DWORD size)
+{
+	LARGE_INTEGER li;
+	DWORD rd;
+
+	li.QuadPart = offset;
+	return SetFilePointerEx(h, li, NULL, FILE_BEGIN) && ReadFile(h, buf, size, &rd, NULL) && (rd == size);
+}
+
+static BOOL WriteAt(HANDLE h, uint64_t offset, const void* buf, DWORD size)
+{
+	LARGE_INTEGER li;
+	DWORD wr;
+
+	li.QuadPart = offset;
+	if (SetFilePointerEx(h, li, NULL, FILE_BEGIN) && WriteFile(h, buf, size, &wr, NULL) && (wr == size))
+		return TRUE;
+	uprintf("Could not write %d bytes at offset %lld: %s", size, offset, WindowsErrorString());
+	return FALSE;
+}
+
+uint32_t gpt_crc32(const uint8_t* buf, size_t len)
+{
+	uint32_t crc = 0xFFFFFFFF;
+	size_t i;
+	int j;
+
+	for (i = 0; i < len; i++) {
+		crc ^= buf[i];
+		for (j = 0; j < 8; j++)
+			crc = (crc >> 1) ^ (0xEDB88320 & (0 - (crc & 1)));
+	}
+	return ~crc;
+}
+
+// Ranges are added in increasing order, and merged when they are close enough
+static BOOL AddRange(range_list* list, uint64_t offset, uint64_t size)
+{
+	image_range* r;
+
+	if (size == 0)
+		return TRUE;
+	if (list->nb > 0) {
+		r = &list->range[list->nb - 1];
+		if (offset <= r->offset + r->size + IMAGE_RANGE_MIN_GAP) {
+			if (offset + size > r->offset + r->size)
+				r->size = offset + size - r->offset;
+			return TRUE;
+		}
+	}
+	if (list->nb >= list->max) {
+		list->max = (list->max == 0) ? 64 : 2 * list->max;
+		r = (image_range*)realloc(list->range, list->max * sizeof(image_range));
+		if (r == NULL)
+			return FALSE;
+		list->range = r;
+	}
+	list->range[list->nb].offset = offset;
+	list->range[list->nb++].size = size;
+	return TRUE;
+}
+
+static BOOL ParseFatBootSector(const uint8_t* buf, fat_info* fi)
+{
+	const fat_bpb* bpb = (const fat_bpb*)buf;
+	uint64_t fat_entries;
+
+	memset(fi, 0, sizeof(fat_info));
+	if ( (buf[0x1FE] != 0x55) || (buf[0x1FF] != 0xAA) || (bpb->bytes_per_sector < 512) || (bpb->bytes_per_sector > 4096)
+	  || (bpb->bytes_per_sector & (bpb->bytes_per_sector - 1)) || (bpb->sectors_per_cluster == 0)
+	  || (bpb->sectors_per_cluster & (bpb->sectors_per_cluster - 1)) || (bpb->reserved_sectors == 0)
+	  || (bpb->nb_fats == 0) || (bpb->nb_fats > 2) )
+		return FALSE;
+	fi->bytes_per_sector = bpb->bytes_per_sector;
+	fi->sectors_per_cluster = bpb->sectors_per_cluster;
+	fi->fat_start = bpb->reserved_sectors;
+	fi->fat_size = (bpb->fat_size_16 != 0) ? bpb->fat_size_16 : bpb->fat_size_32;
+	fi->total_sectors = (bpb->total_sectors_16 != 0) ? bpb->total_sectors_16 : bpb->total_sectors_32;
+	fi->nb_fats = bpb->nb_fats;
+	fi->data_start = fi->fat_start + (uint64_t)fi->nb_fats * fi->fat_size +
+		((uint64_t)bpb->root_entries * 32 + fi->bytes_per_sector - 1) / fi->bytes_per_sector;
+	if ((fi->fat_size == 0) || (fi->total_sectors <= fi->data_start))
+		return FALSE;
+	fi->nb_clusters = (uint32_t)((fi->total_sectors - fi->data_start) / fi->sectors_per_cluster);
+	fi->bits = (fi->nb_clusters < 4085) ? 12 : ((fi->nb_clusters < 65525) ? 16 : 32);
+	// FAT32 has no root directory area, and a FAT that is large enough for all the clusters
+	fat_entries = (uint64_t)fi->fat_size * fi->bytes_per_sector * 8 / fi->bits;
+	if ( ((fi->bits == 32) && ((bpb->fat_size_16 != 0) || (bpb->root_entries != 0)))
+	  || (fat_entries < (uint64_t)fi->nb_clusters + 2) )
+		return FALSE;
+	return TRUE;
+}
+
+// Only the clusters that are marked as used in the first FAT need to be written
+static BOOL AddFatRanges(HANDLE hImage, uint64_t start, uint64_t size, range_list* list)
+{
+	fat_info fi;
+	uint8_t buf[512], *fat = NULL;
+	uint64_t offset, fat_bytes, data_offset, cluster_size, pos;
+	uint32_t c, n, first, chunk_entries, value;
+	BOOL r = FALSE;
+
+	if ((!ReadAt(hImage, start, buf, sizeof(buf))) || (!ParseFatBootSector(buf, &fi)))
+		return FALSE;
+	data_offset = fi.data_start * fi.bytes_per_sector;
+	cluster_size = (uint64_t)fi.sectors_per_cluster * fi.bytes_per_sector;
+	if (data_offset + (uint64_t)fi.nb_clusters * cluster_size > size)
+		return FALSE;
+	fat = (uint8_t*)malloc(FAT_CHUNK_SIZE);
+	if (fat == NULL)
+		return FALSE;
+	// The reserved sectors, FATs and root directory are always written
+	if (!AddRange(list, start, data_offset))
 		goto out;
+	// FAT_CHUNK_SIZE is a multiple of 3 bytes, so that FAT12 chunks start on an even entry
+	chunk_entries = (uint32_t)((uint64_t)FAT_CHUNK_SIZE * 8 / fi.bits);
+	fat_bytes = ((uint64_t)fi.nb_clusters + 2) * fi.bits / 8 + 1;
+	for (first = 0; first < fi.nb_clusters + 2; first += chunk_entries) {
+		if (IS_ERROR(FormatStatus))
+			goto out;
+		pos = (uint64_t)first * fi.bits / 8;
+		memset(fat, 0, FAT_CHUNK_SIZE);
+		if (!ReadAt(hImage, start + fi.fat_start * fi.bytes_per_sector + pos, fat,
+			(DWORD)MIN(FAT_CHUNK_SIZE, fat_bytes - pos)))
+			goto out;
+		n = MIN(chunk_entries, fi.nb_clusters + 2 - first);
+		for (c = (first == 0) ? 2 : 0; c < n; c++) {
+			switch (fi.bits) {
+			case 12:
+				value = fat[c * 3 / 2] | (fat[c * 3 / 2 + 1] << 8);
+				value = (c & 1) ? (value >> 4) : (value & 0xFFF);
+				break;
+			case 16:
+				value = ((uint16_t*)fat)[c];
+				break;
+			default:
+				value = ((uint32_t*)fat)[c] & 0x0FFFFFFF;
+				break;
+			}
+			if (value == 0)
+				continue;
+			offset = start + data_offset + (uint64_t)(first + c - 2) * cluster_size;
+			if (!AddRange(list, offset, cluster_size))
+				goto out;
+		}
 	}
-	iso_report.projected_size = (uint64_t)liImageSize.QuadPart;
+	r = TRUE;
 
-	size = sizeof(vhd_footer);
-	if ((iso_report.compression_type == BLED_COMPRESSION_NONE) && (iso_report.projected_size >= (512 + size))) {
-		footer = (vhd_footer*)malloc(size);
-		ptr.QuadPart = iso_report.projected_size - size;
-		if ( (footer == NULL) || (!SetFilePointerEx(handle, ptr, NULL, FILE_BEGIN)) ||
-			 (!ReadFile(handle, footer, size, &size, NULL)) || (size != sizeof(vhd_footer)) ) {
-			uprintf("Could not read VHD footer");
+out:
+	free(fat);
+	return r;
+}
+
+// Same for ext2/3/4, using the block bitmaps
+static BOOL AddExtRanges(HANDLE hImage, uint64_t start, uint64_t size, range_list* list)
+{
+	ext_superblock sb;
+	uint8_t *gdt = NULL, *bitmap = NULL, *desc;
+	uint64_t block_size, nb_blocks, gdt_size, block, bitmap_block, i;
+	uint32_t g, nb_groups, desc_size, nb;
+	BOOL r = FALSE;
+
+	if ((!ReadAt(hImage, start + 1024, &sb, sizeof(sb))) || (sb.magic != EXT_SUPER_MAGIC) || (sb.log_block_size > 6))
+		return FALSE;
+	// We don't bother with bigalloc or meta_bg, which few images use
+	if ((sb.feature_incompat & EXT_FEATURE_INCOMPAT_META_BG) || (sb.feature_ro_compat & EXT_FEATURE_RO_COMPAT_BIGALLOC))
+		return FALSE;
+	block_size = 1024ULL << sb.log_block_size;
+	nb_blocks = sb.blocks_count_lo;
+	desc_size = 32;
+	if (sb.feature_incompat & EXT_FEATURE_INCOMPAT_64BIT) {
+		nb_blocks |= (uint64_t)sb.blocks_count_hi << 32;
+		desc_size = sb.desc_size;
+	}
+	if ( (sb.blocks_per_group == 0) || (sb.blocks_per_group > 8 * block_size) || (desc_size < 32)
+	  || (desc_size > block_size) || (nb_blocks <= sb.first_data_block) || (nb_blocks * block_size > size) )
+		return FALSE;
+	nb_groups = (uint32_t)((nb_blocks - sb.first_data_block + sb.blocks_per_group - 1) / sb.blocks_per_group);
+	gdt_size = (uint64_t)nb_groups * desc_size;
+	if (gdt_size > EXT_MAX_GDT_SIZE)
+		return FALSE;
+	gdt = (uint8_t*)malloc((size_t)gdt_size);
+	bitmap = (uint8_t*)malloc((size_t)block_size);
+	if ( (gdt == NULL) || (bitmap == NULL)
+	  || (!ReadAt(hImage, start + (sb.first_data_block + 1) * block_size, gdt, (DWORD)gdt_size)) )
+		goto out;
+
+	for (g = 0; g < nb_groups; g++) {
+		if (IS_ERROR(FormatStatus))
 			goto out;
+		desc = &gdt[(size_t)g * desc_size];
+		block = sb.first_data_block + (uint64_t)g * sb.blocks_per_group;
+		nb = (uint32_t)MIN(sb.blocks_per_group, nb_blocks - block);
+		// Groups with an uninitialized bitmap may still hold metadata, so write them whole
+		if (*((uint16_t*)&desc[18]) & EXT_BG_BLOCK_UNINIT) {
+			if (!AddRange(list, start + block * block_size, nb * block_size))
+				goto out;
+			continue;
 		}
-		if (memcmp(footer->cookie, conectix_str, sizeof(footer->cookie)) == 0) {
-			iso_report.projected_size -= sizeof(vhd_footer);
-			if ( (bswap_uint32(footer->file_format_version) != VHD_FOOTER_FILE_FORMAT_V1_0)
-			  || (bswap_uint32(footer->disk_type) != VHD_FOOTER_TYPE_FIXED_HARD_DISK)) {
-				uprintf("Unsupported type of VHD image");
-				iso_report.is_bootable_img = FALSE;
+		bitmap_block = *((uint32_t*)&desc[0]);
+		if (desc_size >= 64)
+			bitmap_block |= (uint64_t)*((uint32_t*)&desc[0x20]) << 32;
+		if ((bitmap_block >= nb_blocks) || (!ReadAt(hImage, start + bitmap_block * block_size, bitmap, (DWORD)block_size)))
+			goto out;
+		for (i = 0; i < nb; i++) {
+			if ((bitmap[i / 8] & (1 << (i % 8))) && (!AddRange(list, start + (block + i) * block_size, block_size)))
 				goto out;
-			}
-			// Might as well validate the checksum while we're at it
-			old_checksum = bswap_uint32(footer->checksum);
-			footer->checksum = 0;
-			for (checksum=0, i=0; i<sizeof(vhd_footer); i++)
-				checksum += ((uint8_t*)footer)[i];
-			checksum = ~checksum;
-			if (checksum != old_checksum)
-				uprintf("Warning: VHD footer seems corrupted (checksum: %04X, expected: %04X)", old_checksum, checksum);
-			// Need to remove the footer from our payload
-			uprintf("Image is a Fixed Hard Disk VHD file");
-			iso_report.is_vhd = TRUE;
 		}
 	}
+	// Blocks that come before the first data block (the boot sector for 1K blocks)
+	r = (sb.first_data_block == 0) || AddRange(list, start, sb.first_data_block * block_size);
 
 out:
-	safe_free(footer);
-	safe_closehandle(handle);
-	return iso_report.is_bootable_img;
+	free(gdt);
+	free(bitmap);
+	return r;
+}
+
+static int range_cmp(const void* p1, const void* p2)
+{
+	const image_range* r1 = (const image_range*)p1;
+	const image_range* r2 = (const image_range*)p2;
+
+	return (r1->offset < r2->offset) ? -1 : ((r1->offset > r2->offset) ? 1 : 0);
+}
+
+/*
+ * Work out which parts of a disk image actually need to be written, by leaving out the
+ * free space of the FAT and ext file systems it contains. Everything else, including
+ * the gaps between partitions, is written as is. Returns NULL if the image should just
+ * be written in full, or an array of ranges, aligned to the sector size, to be freed.
+ */
+image_range* GetImageRanges(HANDLE hImage, uint64_t image_size, DWORD sector_size, uint32_t* nb_ranges)
+{
+	const uint8_t zero_guid[16] = { 0 };
+	image_range part[4 + GPT_MAX_ENTRIES], *r;
+	range_list list = { 0 };
+	uint8_t* buf = NULL;
+	const mbr_partition* mbr;
+	const gpt_header* gpt;
+	const gpt_entry* entry;
+	uint64_t offset, end, total = 0;
+	uint32_t i, nb_parts = 0;
+	BOOL has_protective_mbr = FALSE;
+
+	*nb_ranges = 0;
+	buf = (uint8_t*)malloc(PROBE_HEAD_SIZE);
+	if ((buf == NULL) || (image_size < PROBE_HEAD_SIZE) || (!ReadAt(hImage, 0, buf, PROBE_HEAD_SIZE))
+	  || (buf[0x1FE] != 0x55) || (buf[0x1FF] != 0xAA))
+		goto out;
+
+	mbr = (const mbr_partition*)&buf[0x1BE];
+	gpt = (const gpt_header*)&buf[512];
+	for (i = 0; i < 4; i++) {
+		if (mbr[i].type == 0)
+			continue;
+		if (mbr[i].type == 0xEE) {
+			has_protective_mbr = TRUE;
+			continue;
+		}
+		part[nb_parts].offset = (uint64_t)mbr[i].lba_start * 512;
+		part[nb_parts++].size = (uint64_t)mbr[i].nb_sectors * 512;
+	}
+	if (has_protective_mbr) {
+		if ( (memcmp(gpt->signature, GPT_HEADER_SIGNATURE, 8) != 0) || (gpt->partition_entry_size < sizeof(gpt_entry))
+		  || (gpt->nb_partition_entries > GPT_MAX_ENTRIES) || (gpt->partition_entry_lba * 512 +
+			  (uint64_t)gpt->nb_partition_entries * gpt->partition_entry_size > PROBE_HEAD_SIZE) )
+			goto out;
+		for (i = 0; i < gpt->nb_partition_entries; i++) {
+			entry = (const gpt_entry*)&buf[gpt->partition_entry_lba * 512 + (uint64_t)i * gpt->partition_entry_size];
+			if ((memcmp(entry->type_guid, zero_guid, sizeof(zero_guid)) == 0) || (entry->last_lba < entry->first_lba))
+				continue;
+			part[nb_parts].offset = entry->first_lba * 512;
+			part[nb_parts++].size = (entry->last_lba - entry->first_lba + 1) * 512;
+		}
+	}
+	if (nb_parts == 0)
+		goto out;
+
+	// Overlapping partitions (as found in hybrid ISOs) or ones that extend beyond the image
+	// mean that this isn't a regular disk image, so we don't try anything clever with it
+	qsort(part, nb_parts, sizeof(image_range), range_cmp);
+	for (i = 0, end = 0; i < nb_parts; i++) {
+		if ((part[i].offset < MAX(end, 512)) || (part[i].offset + part[i].size > image_size))
+			goto out;
+		end = part[i].offset + part[i].size;
+	}
+
+	for (i = 0, end = 0; i < nb_parts; i++) {
+		if (!AddRange(&list, end, part[i].offset - end))
+			goto out;
+		if ( (!AddFatRanges(hImage, part[i].offset, part[i].size, &list))
+		  && (!AddExtRanges(hImage, part[i].offset, part[i].size, &list))
+		  && (!AddRange(&list, part[i].offset, part[i].size)) )
+			goto out;
+		end = part[i].offset + part[i].size;
+	}
+	if (!AddRange(&list, end, image_size - end))
+		goto out;
+
+	// The file system ranges can overlap the ones that were added after them
+	qsort(list.range, list.nb, sizeof(image_range), range_cmp);
+	for (i = 0; i < list.nb; i++) {
+		offset = (list.range[i].offset / sector_size) * sector_size;
+		end = MIN(list.range[i].offset + list.range[i].size, image_size);
+		end = ((end + sector_size - 1) / sector_size) * sector_size;
+		if ((*nb_ranges > 0) && (offset <= list.range[*nb_ranges - 1].offset + list.range[*nb_ranges - 1].size)) {
+			r = &list.range[*nb_ranges - 1];
+			r->size = MAX(r->offset + r->size, end) - r->offset;
+		} else {
+			list.range[*nb_ranges].offset = offset;
+			list.range[(*nb_ranges)++].size = end - offset;
+		}
+	}
+	for (i = 0; i < *nb_ranges; i++)
+		total += list.range[i].size;
+	uprintf("Image has %s of data to write, out of %s", SizeToHumanReadable(total, TRUE, FALSE),
+		SizeToHumanReadable(image_size, TRUE, FALSE));
+	free(buf);
+	return list.range;
+
+out:
+	*nb_ranges = 0;
+	free(list.range);
+	free(buf);
+	return NULL;
+}
+
+// Zero the FAT entries of the clusters that we add, in all the FATs
+static BOOL ClearFatEntries(HANDLE hDrive, uint64_t start, const fat_info* fi, uint32_t from, uint32_t to)
+{
+	uint8_t* buf;
+	uint64_t pos, end, sector, len;
+	uint32_t i;
+	BOOL r = FALSE;
+
+	buf = (uint8_t*)malloc(FAT_CHUNK_SIZE);
+	if (buf == NULL)
+		return FALSE;
+	for (i = 0; i < fi->nb_fats; i++) {
+		pos = (fi->fat_start + (uint64_t)i * fi->fat_size) * fi->bytes_per_sector + (uint64_t)from * fi->bits / 8;
+		end = (fi->fat_start + (uint64_t)i * fi->fat_size) * fi->bytes_per_sector + (uint64_t)to * fi->bits / 8;
+		while (pos < end) {
+			sector = (pos / fi->bytes_per_sector) * fi->bytes_per_sector;
+			len = MIN(FAT_CHUNK_SIZE, ((end - sector + fi->bytes_per_sector - 1) / fi->bytes_per_sector) * fi->bytes_per_sector);
+			if (!ReadAt(hDrive, start + sector, buf, (DWORD)len))
+				goto out;
+			memset(&buf[pos - sector], 0, (size_t)MIN(len - (pos - sector), end - pos));
+			if (!WriteAt(hDrive, start + sector, buf, (DWORD)len))
+				goto out;
+			pos = sector + len;
+		}
+	}
+	r = TRUE;
+
+out:
+	free(buf);
+	return r;
+}
+
+// A FAT file system can be grown, for as long as its FATs have room for the new clusters
+static void GrowFatFileSystem(HANDLE hDrive, uint64_t start, uint64_t size)
+{
+	fat_info fi;
+	fat_bpb* bpb;
+	uint8_t buf[4096], fsinfo[4096];
+	uint64_t max_clusters, total;
+	uint16_t s[2];
+	int i;
+
+	if ((!ReadAt(hDrive, start, buf, 512)) || (!ParseFatBootSector(buf, &fi)) || (fi.bits == 12))
+		return;
+	bpb = (fat_bpb*)buf;
+	if ((fi.bytes_per_sector > 512) && (!ReadAt(hDrive, start, buf, fi.bytes_per_sector)))
+		return;
+	max_clusters = (uint64_t)fi.fat_size * fi.bytes_per_sector * 8 / fi.bits - 2;
+	max_clusters = MIN(max_clusters, (fi.bits == 16) ? 65524 : 0x0FFFFFF5);
+	max_clusters = MIN(max_clusters, (size / fi.bytes_per_sector - fi.data_start) / fi.sectors_per_cluster);
+	if (max_clusters <= fi.nb_clusters) {
+		uprintf("The FAT%d file system cannot be grown", fi.bits);
+		return;
+	}
+	if (!ClearFatEntries(hDrive, start, &fi, fi.nb_clusters + 2, (uint32_t)max_clusters + 2))
+		return;
+	total = fi.data_start + max_clusters * fi.sectors_per_cluster;
+	if ((fi.bits == 16) && (bpb->total_sectors_16 != 0) && (total < 0x10000)) {
+		bpb->total_sectors_16 = (uint16_t)total;
+	} else {
+		bpb->total_sectors_16 = 0;
+		bpb->total_sectors_32 = (uint32_t)total;
+	}
+
+	// FAT32 also has a backup boot sector, and FS Information Sectors with a free cluster count
+	s[0] = 0;
+	s[1] = ((fi.bits == 32) && (bpb->backup_boot_sector != 0) && (bpb->backup_boot_sector != 0xFFFF)) ? bpb->backup_boot_sector : 0;
+	for (i = 0; i < 2; i++) {
+		if ((i > 0) && (s[i] == 0))
+			break;
+		if (!WriteAt(hDrive, start + (uint64_t)s[i] * fi.bytes_per_sector, buf, fi.bytes_per_sector))
+			return;
+		if ( (fi.bits == 32) && (bpb->fs_info != 0) && (bpb->fs_info != 0xFFFF)
+		  && (ReadAt(hDrive, start + (uint64_t)(s[i] + bpb->fs_info) * fi.bytes_per_sector, fsinfo, fi.bytes_per_sector))
+		  && (*((uint32_t*)&fsinfo[0]) == 0x41615252) && (*((uint32_t*)&fsinfo[484]) == 0x61417272) ) {
+			*((uint32_t*)&fsinfo[488]) = 0xFFFFFFFF;
+			if (!WriteAt(hDrive, start + (uint64_t)(s[i] + bpb->fs_info) * fi.bytes_per_sector, fsinfo, fi.bytes_per_sector))
+				return;
+		}
+	}
+	uprintf("Grew the FAT%d file system to %s", fi.bits,
+		SizeToHumanReadable(total * fi.bytes_per_sector, TRUE, FALSE));
+}
+
+/*
+ * Once an image that is smaller than the drive has been written, extend its last
+ * partition, along with the file system it contains if it is FAT, to the end of the
+ * drive. For GPT, this also means moving the backup GPT to the end of the drive.
+ * ext file systems are left for resize2fs, which most distros run on first boot.
+ * ISOHybrid images are never modified, whatever their partition scheme, as their
+ * partitions overlap the ISO9660 file system, which we must not break.
+ */
+BOOL GrowLastPartition(HANDLE hDrive, uint64_t disk_size)
+{
+	const uint8_t zero_guid[16] = { 0 };
+	uint8_t* buf = NULL, backup[512];
+	mbr_partition* mbr;
+	gpt_header* gpt;
+	gpt_entry *entry, *last_entry = NULL;
+	ext_superblock sb;
+	uint64_t nb_sectors = disk_size / 512, start, end = 0, entries_size, entries_sectors, alternate, last_usable;
+	uint32_t i, crc;
+	int last = -1;
+	BOOL r = FALSE;
+
+	buf = (uint8_t*)malloc(PROBE_HEAD_SIZE);
+	if ((buf == NULL) || (!ReadAt(hDrive, 0, buf, PROBE_HEAD_SIZE)) || (buf[0x1FE] != 0x55) || (buf[0x1FF] != 0xAA))
+		goto out;
+	if (memcmp(&buf[ISO_SYSTEM_AREA_SIZE + 1], "CD001", 5) == 0) {
+		uprintf("Not growing the last partition, as the image is an ISOHybrid one");
+		goto out;
+	}
+	mbr = (mbr_partition*)&buf[0x1BE];
+	gpt = (gpt_header*)&buf[512];
+	for (i = 0; i < 4; i++) {
+		if ((mbr[i].type != 0) && ((uint64_t)mbr[i].lba_start + mbr[i].nb_sectors > end)) {
+			end = (uint64_t)mbr[i].lba_start + mbr[i].nb_sectors;
+			last = i;
+		}
+	}
+	if (last < 0)
+		goto out;
+
+	if (mbr[last].type != 0xEE) {
+		// Extended partitions would need their last logical partition grown instead
+		if ((mbr[last].type == 0x05) || (mbr[last].type == 0x0F) || (mbr[last].type == 0x85)) {
+			uprintf("Not growing the last partition, as it is an extended one");
+			goto out;
+		}
+		start = mbr[last].lba_start;
+		// A partition that starts at 0 spans the whole image, so we leave it alone
+		if (start == 0)
+			goto out;
+		if (MIN(nb_sectors, 0xFFFFFFFF) <= end) {
+			r = TRUE;
+			goto out;
+		}
+		end = MIN(nb_sectors, 0xFFFFFFFF);
+		mbr[last].nb_sectors = (uint32_t)(end - start);
+		// LBA addressing only
+		mbr[last].chs_end[0] = 0xFE;
+		mbr[last].chs_end[1] = 0xFF;
+		mbr[last].chs_end[2] = 0xFF;
+		if (!WriteAt(hDrive, 0, buf, 512))
+			goto out;
+	} else {
+		entries_size = (uint64_t)gpt->nb_partition_entries * gpt->partition_entry_size;
+		if ( (memcmp(gpt->signature, GPT_HEADER_SIGNATURE, 8) != 0) || (gpt->header_size < 92) || (gpt->header_size > 512)
+		  || (gpt->partition_entry_size < sizeof(gpt_entry)) || (gpt->my_lba != 1) || (gpt->partition_entry_lba < 2)
+		  || (gpt->partition_entry_lba * 512 + entries_size > PROBE_HEAD_SIZE)
+		  || (gpt_crc32(&buf[gpt->partition_entry_lba * 512], (size_t)entries_size) != gpt->partition_entry_crc) )
+			goto out;
+		for (i = 0; i < gpt->nb_partition_entries; i++) {
+			entry = (gpt_entry*)&buf[gpt->partition_entry_lba * 512 + (uint64_t)i * gpt->partition_entry_size];
+			if ( (memcmp(entry->type_guid, zero_guid, sizeof(zero_guid)) != 0)
+			  && ((last_entry == NULL) || (entry->last_lba > last_entry->last_lba)) )
+				last_entry = entry;
+		}
+		entries_sectors = (entries_size + 511) / 512;
+		alternate = nb_sectors - 1;
+		last_usable = alternate - entries_sectors - 1;
+		if ((last_entry == NULL) || (last_entry->last_lba > gpt->last_usable_lba))
+			goto out;
+		if (last_usable <= last_entry->last_lba) {
+			r = TRUE;
+			goto out;
+		}
+		start = last_entry->first_lba;
+		end = last_usable + 1;
+		last_entry->last_lba = last_usable;
+		mbr[last].nb_sectors = (uint32_t)MIN(nb_sectors - 1, 0xFFFFFFFF);
+		gpt->alternate_lba = alternate;
+		gpt->last_usable_lba = last_usable;
+		gpt->partition_entry_crc = gpt_crc32(&buf[gpt->partition_entry_lba * 512], (size_t)entries_size);
+		gpt->header_crc = 0;
+		crc = gpt_crc32((uint8_t*)gpt, gpt->header_size);
+		gpt->header_crc = crc;
+		// The backup header comes last, after its copy of the partition entries
+		memset(backup, 0, sizeof(backup));
+		memcpy(backup, gpt, gpt->header_size);
+		gpt = (gpt_header*)backup;
+		gpt->my_lba = alternate;
+		gpt->alternate_lba = 1;
+		gpt->partition_entry_lba = alternate - entries_sectors;
+		gpt->header_crc = 0;
+		crc = gpt_crc32(backup, gpt->header_size);
+		gpt->header_crc = crc;
+		gpt = (gpt_header*)&buf[512];
+		if ( (!WriteAt(hDrive, (alternate - entries_sectors) * 512, &buf[gpt->partition_entry_lba * 512], (DWORD)(entries_sectors * 512)))
+		  || (!WriteAt(hDrive, alternate * 512, backup, sizeof(backup)))
+		  || (!WriteAt(hDrive, 0, buf, (DWORD)((gpt->partition_entry_lba + entries_sectors) * 512))) )
+			goto out;
+	}
+	uprintf("Grew the last partition to %s", SizeToHumanReadable((end - start) * 512, TRUE, FALSE));
+	r = TRUE;
+
+	GrowFatFileSystem(hDrive, start * 512, (end - start) * 512);
+	if ((ReadAt(hDrive, start * 512 + 1024, &sb, sizeof(sb))) && (sb.magic == EXT_SUPER_MAGIC))
+		uprintf("The ext file system it contains can be grown with resize2fs");
+
+out:
+	free(buf);
+	return r;
 }
 
 // Find out if we have any way to extract WIM files on this platform
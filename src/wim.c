@@ -0,0 +1,1095 @@
+/*
+ * Rufus: The Reliable USB Formatting Utility
+ * Native WIM image support
+ * Copyright © 2014 Pete Batard <pete@akeo.ie>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * This is a minimal native implementation of the parts of the WIM format that we
+ * need to apply a Windows installation image onto an NTFS volume, for Windows To Go.
+ * wimgapi can only do that on recent versions of Windows, and 7-Zip does not restore
+ * security descriptors, reparse points or hard links, all of which Windows needs.
+ *
+ * Only the XPRESS and LZX compression methods, which are the ones used by the WIMs
+ * that Microsoft distributes, are supported. Solid (LZMS compressed .esd) and split
+ * WIMs are not. We can however split a WIM ourselves, so that an install.wim that is
+ * larger than 4 GB can still be written to FAT32, as install.swm, install2.swm, ...
+ *
+ * Resources are processed in the order in which they appear in the WIM, so that the
+ * source is read sequentially, and the decompression of their chunks is distributed
+ * between worker threads. As most files fit in a single chunk, the worker threads
+ * also write those directly, so that file creation on the target (which is what NTFS
+ * is slowest at) also happens in parallel. The directory tree is created beforehand,
+ * and once all the data has been written, hard links are created and the timestamps,
+ * attributes and security descriptors of all the files are restored in a single pass.
+ *
+ * The parsing of the WIM and of its metadata, as well as the decompression, are in
+ * wim_parse.c, which doesn't depend on Windows. This file applies what they describe.
+ */
+
+#include <windows.h>
+#include <winioctl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <io.h>
+
+#include "rufus.h"
+#include "msapi_utf8.h"
+#include "resource.h"
+#include "localization.h"
+#include "wim.h"
+
+#define WIM_BATCH_CHUNKS            128
+#define WIM_SPLIT_BUFFER_SIZE       (4 * 1024 * 1024)
+#define le16(p)                     ((uint16_t)((p)[0] | ((p)[1] << 8)))
+
+BOOL enable_wintogo = FALSE;
+
+/*
+ * Boot files that also get written to where the firmware expects them, along with their
+ * original, when they are encountered during the apply. The BCD is created afterwards.
+ */
+static const wchar_t* bootmgr_src = L"Windows\\Boot\\PCAT\\bootmgr";
+static const wchar_t* bootmgr_dst = L"bootmgr";
+static const wchar_t* bootmgfw_src = L"Windows\\Boot\\EFI\\bootmgfw.efi";
+static const wchar_t* efi_boot_dir[] = { L"efi", L"efi\\boot" };
+
+// Read callback for WimOpen(), when the WIM is read from a file handle
+static bool wim_read_handle(void* ctx, uint64_t offset, void* buf, uint32_t size)
+{
+	LARGE_INTEGER li;
+	DWORD rd;
+
+	li.QuadPart = offset;
+	if ( (!SetFilePointerEx((HANDLE)ctx, li, NULL, FILE_BEGIN))
+	  || (!ReadFile((HANDLE)ctx, buf, size, &rd, NULL)) || (rd != size) ) {
+		uprintf("WIM: Could not read %d bytes at offset %lld: %s\n", size, offset, WindowsErrorString());
+		return false;
+	}
+	return true;
+}
+
+/*
+ * Splitting into .swm parts
+ */
+
+static __inline void wim_set_reshdr(WIM_RESHDR* reshdr, uint64_t offset, uint64_t size, uint8_t flags)
+{
+	int i;
+
+	for (i=0; i<7; i++)
+		reshdr->size[i] = (uint8_t)(size >> (8*i));
+	reshdr->flags = flags;
+	reshdr->offset = offset;
+	reshdr->original_size = size;
+}
+
+static BOOL wim_write_at(HANDLE h, uint64_t offset, const void* buf, uint32_t size)
+{
+	LARGE_INTEGER li;
+	DWORD wr;
+
+	li.QuadPart = offset;
+	return SetFilePointerEx(h, li, NULL, FILE_BEGIN) && WriteFile(h, buf, size, &wr, NULL) && (wr == size);
+}
+
+// Copy a resource, as is, from the source WIM to the current position of h
+static BOOL wim_copy_resource(WIM_INFO* wim, HANDLE h, const WIM_RESHDR* reshdr, uint8_t* buf, wim_progress_t progress)
+{
+	uint64_t pos, size = WIM_RESHDR_SIZE(*reshdr);
+	uint32_t len;
+	DWORD wr;
+
+	for (pos=0; pos<size; pos+=len) {
+		if (IS_ERROR(FormatStatus))
+			return FALSE;
+		len = (uint32_t)MIN(size - pos, WIM_SPLIT_BUFFER_SIZE);
+		if (!WimRead(wim, reshdr->offset + pos, buf, len))
+			return FALSE;
+		if ((!WriteFile(h, buf, len, &wr, NULL)) || (wr != len))
+			return FALSE;
+		if (progress != NULL)
+			progress(len);
+	}
+	return TRUE;
+}
+
+static BOOL wim_write_part(WIM_INFO* wim, const char* path, uint16_t part_number, uint16_t total_parts,
+	WIM_LOOKUP_ENTRY** entries, uint32_t nb_entries, uint8_t* buf, wim_progress_t progress)
+{
+	BOOL r = FALSE;
+	HANDLE h;
+	WIM_HEADER hdr;
+	WIM_LOOKUP_ENTRY* lookup;
+	uint64_t offset = WIM_HEADER_SIZE, size;
+	uint32_t i;
+
+	lookup = (WIM_LOOKUP_ENTRY*)calloc(MAX(nb_entries, 1), sizeof(WIM_LOOKUP_ENTRY));
+	if (lookup == NULL)
+		return FALSE;
+	h = CreateFileU(path, GENERIC_WRITE, FILE_SHARE_READ, NULL, CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL);
+	if (h == INVALID_HANDLE_VALUE) {
+		uprintf("WIM: Could not create '%s': %s\n", path, WindowsErrorString());
+		free(lookup);
+		return FALSE;
+	}
+	uprintf("Writing: %s\n", path);
+
+	memcpy(&hdr, &wim->hdr, sizeof(hdr));
+	hdr.flags |= WIM_HDR_FLAG_SPANNED;
+	hdr.part_number = part_number;
+	hdr.total_parts = total_parts;
+	memset(&hdr.boot_metadata, 0, sizeof(hdr.boot_metadata));
+	memset(&hdr.integrity, 0, sizeof(hdr.integrity));
+
+	// The header is only filled once everything else has been written, so that an
+	// interrupted part doesn't look like a valid one
+	memset(buf, 0, WIM_HEADER_SIZE);
+	if (!wim_write_at(h, 0, buf, WIM_HEADER_SIZE))
+		goto out;
+	for (i=0; i<nb_entries; i++) {
+		size = WIM_RESHDR_SIZE(entries[i]->reshdr);
+		if (!wim_copy_resource(wim, h, &entries[i]->reshdr, buf, progress))
+			goto out;
+		memcpy(&lookup[i], entries[i], sizeof(WIM_LOOKUP_ENTRY));
+		lookup[i].reshdr.offset = offset;
+		lookup[i].part_number = part_number;
+		if ( (part_number == 1) && (wim->hdr.boot_index != 0) &&
+			 (entries[i]->reshdr.offset == wim->hdr.boot_metadata.offset) )
+			memcpy(&hdr.boot_metadata, &lookup[i].reshdr, sizeof(WIM_RESHDR));
+		offset += size;
+	}
+
+	// Each part only lists the resources it contains
+	size = (uint64_t)nb_entries * sizeof(WIM_LOOKUP_ENTRY);
+	if ((size != 0) && (!wim_write_at(h, offset, lookup, (uint32_t)size)))
+		goto out;
+	wim_set_reshdr(&hdr.lookup_table, offset, size, 0);
+	offset += size;
+
+	// And they all get a copy of the XML data
+	if (!wim_copy_resource(wim, h, &wim->hdr.xml_data, buf, NULL))
+		goto out;
+	memcpy(&hdr.xml_data, &wim->hdr.xml_data, sizeof(WIM_RESHDR));
+	hdr.xml_data.offset = offset;
+
+	r = wim_write_at(h, 0, &hdr, sizeof(hdr));
+
+out:
+	if ((!r) && (!IS_ERROR(FormatStatus)))
+		uprintf("WIM: Could not write '%s': %s\n", path, WindowsErrorString());
+	CloseHandle(h);
+	free(lookup);
+	return r;
+}
+
+/*
+ * Split a WIM into parts of at most part_size bytes, named after dst with a .swm
+ * extension (install.swm, install2.swm, ...). The resources are copied straight
+ * from the source, without being recompressed.
+ */
+BOOL WimSplit(WIM_INFO* wim, const char* dst, uint64_t part_size, wim_progress_t progress)
+{
+	BOOL r = FALSE;
+	WIM_LOOKUP_ENTRY** entries = NULL;
+	uint8_t* buf = NULL;
+	uint16_t* part = NULL;
+	uint32_t i, j, n, nb_entries = 0, nb_parts;
+	char path[MAX_PATH], *ext;
+
+	if (safe_strlen(dst) + 8 >= sizeof(path)) {
+		uprintf("WIM: Destination path is too long\n");
+		return FALSE;
+	}
+	entries = (WIM_LOOKUP_ENTRY**)calloc(MAX(wim->nb_lookup, 1), sizeof(WIM_LOOKUP_ENTRY*));
+	part = (uint16_t*)calloc(MAX(wim->nb_lookup, 1), sizeof(uint16_t));
+	buf = (uint8_t*)malloc(WIM_SPLIT_BUFFER_SIZE);
+	if ((entries == NULL) || (part == NULL) || (buf == NULL))
+		goto out;
+	// Work out the parts beforehand, since each one needs to know how many there are
+	nb_parts = WimGetSplitLayout(wim, part_size, entries, part, &nb_entries);
+	if (nb_parts == 0)
+		goto out;
+	uprintf("Splitting WIM into %d parts\n", nb_parts);
+
+	for (i=0, j=1; j<=nb_parts; j++) {
+		safe_strcpy(path, sizeof(path), dst);
+		ext = strrchr(path, '.');
+		if ((ext == NULL) || (strchr(ext, '/') != NULL) || (strchr(ext, '\\') != NULL))
+			ext = &path[strlen(path)];
+		if (j == 1)
+			safe_strcpy(ext, sizeof(path) - (ext - path), ".swm");
+		else
+			safe_sprintf(ext, sizeof(path) - (ext - path), "%d.swm", j);
+		for (n=0; (i+n<nb_entries) && (part[i+n]==j); n++);
+		if (!wim_write_part(wim, path, (uint16_t)j, (uint16_t)nb_parts, &entries[i], n, buf, progress))
+			goto out;
+		i += n;
+	}
+	r = TRUE;
+
+out:
+	free(entries);
+	free(part);
+	free(buf);
+	return r;
+}
+
+/*
+ * Image application
+ */
+typedef struct {
+	wchar_t* path;					// NULL for the unnamed data stream of the dentry
+	uint32_t dentry;
+	uint32_t next;					// next target of the same resource, or WIM_NONE
+	BOOL is_reparse;
+} wim_target;
+
+typedef struct {
+	uint32_t lookup;
+	uint64_t src;					// offset of the compressed chunk in the WIM
+	uint32_t in_offset, in_size;
+	uint32_t out_offset, out_size;
+	BOOL first, last;
+	BOOL write;						// single chunk resource, written by the worker thread
+} wim_job;
+
+struct wim_apply;
+typedef void (*wim_task)(struct wim_apply*);
+
+typedef struct {
+	struct wim_apply* a;
+	int id;
+} wim_worker_param;
+
+typedef struct wim_apply {
+	WIM_INFO* wim;
+	WIM_METADATA m;
+	wchar_t** path;					// per dentry
+	wim_target* target;
+	uint32_t nb_targets, max_targets;
+	uint32_t* first_target;			// per lookup table entry
+	size_t root_len;
+	const wchar_t* efi_boot_dst;
+	// Worker threads
+	int nb_threads;
+	HANDLE thread[WIM_MAX_THREADS], start[WIM_MAX_THREADS], done[WIM_MAX_THREADS];
+	wim_worker_param param[WIM_MAX_THREADS];
+	wim_task task;
+	volatile LONG next_item;
+	LONG nb_items;
+	volatile LONG error;
+	volatile LONG nb_warnings;
+	BOOL quit;
+	wim_job* job;
+	uint8_t *in_buf, *out_buf;
+} wim_apply;
+
+static void wim_error(const char* msg, const wchar_t* path)
+{
+	DWORD err = GetLastError();
+	char* upath = wchar_to_utf8(path);
+
+	SetLastError(err);
+	uprintf("WIM: %s '%s': %s\n", msg, upath, WindowsErrorString());
+	safe_free(upath);
+}
+
+// Non fatal errors, that we only report a few of
+static void wim_warning(wim_apply* a, const char* msg, const wchar_t* path)
+{
+	if (InterlockedIncrement(&a->nb_warnings) <= 10)
+		wim_error(msg, path);
+}
+
+// Join a path and a UTF-16LE name from the metadata, with the given separator
+static wchar_t* wim_join_path(const wchar_t* dir, wchar_t sep, const uint8_t* name, size_t name_nbytes)
+{
+	size_t i, len = wcslen(dir);
+	wchar_t* path = (wchar_t*)malloc((len + name_nbytes/2 + 2) * sizeof(wchar_t));
+
+	if (path == NULL)
+		return NULL;
+	memcpy(path, dir, len * sizeof(wchar_t));
+	if ((len == 0) || (path[len-1] != L'\\') || (sep != L'\\'))
+		path[len++] = sep;
+	// Names were validated when the metadata was parsed
+	for (i=0; i<name_nbytes/2; i++)
+		path[len++] = (wchar_t)le16(&name[2*i]);
+	path[len] = 0;
+	return path;
+}
+
+// Return a path relative to the root of the target
+static wchar_t* wim_root_path(wim_apply* a, const wchar_t* relpath)
+{
+	wchar_t* path = (wchar_t*)malloc((wcslen(a->path[0]) + wcslen(relpath) + 1) * sizeof(wchar_t));
+
+	if (path != NULL) {
+		wcscpy(path, a->path[0]);
+		wcscat(path, relpath);
+	}
+	return path;
+}
+
+// Work out the full path of each dentry, which always comes after its parent directory
+static BOOL wim_build_paths(wim_apply* a, const wchar_t* root)
+{
+	uint32_t i;
+
+	a->path = (wchar_t**)calloc(a->m.nb_dentries, sizeof(wchar_t*));
+	if (a->path == NULL)
+		return FALSE;
+	a->path[0] = (wchar_t*)malloc((wcslen(root) + 2) * sizeof(wchar_t));
+	if (a->path[0] == NULL)
+		return FALSE;
+	wcscpy(a->path[0], root);
+	wcscat(a->path[0], L"\\");
+	for (i=1; i<a->m.nb_dentries; i++) {
+		a->path[i] = wim_join_path(a->path[a->m.dentry[i].parent], L'\\', a->m.dentry[i].name, a->m.dentry[i].name_nbytes);
+		if (a->path[i] == NULL)
+			return FALSE;
+	}
+	return TRUE;
+}
+
+static BOOL wim_add_target(wim_apply* a, const uint8_t* hash, uint32_t dentry, wchar_t* path, BOOL is_reparse)
+{
+	uint32_t lookup = WimFindResource(a->wim, hash);
+	wim_target* t;
+
+	if ((lookup == WIM_NONE) || (a->wim->lookup[lookup].reshdr.flags & WIM_RESHDR_FLAG_METADATA)) {
+		wim_error("Missing data for", a->path[dentry]);
+		free(path);
+		return FALSE;
+	}
+	if (a->nb_targets >= a->max_targets) {
+		a->max_targets = (a->max_targets == 0) ? 4096 : 2 * a->max_targets;
+		t = (wim_target*)realloc(a->target, a->max_targets * sizeof(wim_target));
+		if (t == NULL) {
+			free(path);
+			return FALSE;
+		}
+		a->target = t;
+	}
+	t = &a->target[a->nb_targets];
+	t->path = path;
+	t->dentry = dentry;
+	t->is_reparse = is_reparse;
+	t->next = a->first_target[lookup];
+	a->first_target[lookup] = a->nb_targets++;
+	return TRUE;
+}
+
+// Work out what needs to be written where. Hard links only get their primary written.
+static BOOL wim_build_targets(wim_apply* a, BOOL boot)
+{
+	uint32_t i, k;
+	const wchar_t* relpath;
+	wchar_t* path;
+	wim_stream* stream;
+
+	for (i=0; i<a->m.nb_dentries; i++) {
+		wim_dentry* d = &a->m.dentry[i];
+		if ((d->primary != WIM_NONE) && (d->primary != i))
+			continue;
+		if ((d->data_hash != NULL) && (!(d->attributes & FILE_ATTRIBUTE_DIRECTORY))) {
+			if (!wim_add_target(a, d->data_hash, i, NULL, FALSE))
+				return FALSE;
+			relpath = &a->path[i][a->root_len + 1];
+			path = NULL;
+			if ((boot) && (_wcsicmp(relpath, bootmgr_src) == 0))
+				path = wim_root_path(a, bootmgr_dst);
+			else if ((boot) && (_wcsicmp(relpath, bootmgfw_src) == 0))
+				path = wim_root_path(a, a->efi_boot_dst);
+			if ((path != NULL) && (!wim_add_target(a, d->data_hash, i, path, FALSE)))
+				return FALSE;
+		}
+		if (d->reparse_hash != NULL) {
+			if (!wim_add_target(a, d->reparse_hash, i, NULL, TRUE))
+				return FALSE;
+		}
+		// Named (alternate) data streams
+		for (k=0; k<d->nb_streams; k++) {
+			stream = &a->m.stream[d->first_stream + k];
+			path = wim_join_path(a->path[i], L':', stream->name, stream->name_nbytes);
+			if ((path == NULL) || (!wim_add_target(a, stream->hash, i, path, FALSE)))
+				return FALSE;
+		}
+	}
+	return TRUE;
+}
+
+static BOOL wim_write_file(const wchar_t* path, const uint8_t* data, uint32_t size)
+{
+	HANDLE h;
+	DWORD wr;
+	BOOL r;
+
+	h = CreateFileW(path, GENERIC_WRITE, FILE_SHARE_READ, NULL, OPEN_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL);
+	if (h == INVALID_HANDLE_VALUE) {
+		wim_error("Could not create", path);
+		return FALSE;
+	}
+	r = (size == 0) || (WriteFile(h, data, size, &wr, NULL) && (wr == size));
+	if (!r)
+		wim_error("Could not write", path);
+	CloseHandle(h);
+	return r;
+}
+
+static BOOL wim_set_reparse_point(wim_apply* a, uint32_t dentry, const uint8_t* data, uint32_t size)
+{
+	HANDLE h;
+	DWORD rd;
+	BOOL r = FALSE;
+	wim_dentry* d = &a->m.dentry[dentry];
+	uint8_t* buf = NULL;
+
+	if (size > MAXIMUM_REPARSE_DATA_BUFFER_SIZE - 8)
+		goto out;
+	// The WIM only stores the reparse data, so we need to recreate the header
+	buf = (uint8_t*)malloc(size + 8);
+	if (buf == NULL)
+		goto out;
+	*((uint32_t*)&buf[0]) = d->reparse_tag;
+	*((uint16_t*)&buf[4]) = (uint16_t)size;
+	*((uint16_t*)&buf[6]) = d->reparse_reserved;
+	memcpy(&buf[8], data, size);
+	h = CreateFileW(a->path[dentry], GENERIC_WRITE, 0, NULL, OPEN_EXISTING,
+		FILE_FLAG_BACKUP_SEMANTICS | FILE_FLAG_OPEN_REPARSE_POINT, NULL);
+	if (h != INVALID_HANDLE_VALUE) {
+		r = DeviceIoControl(h, FSCTL_SET_REPARSE_POINT, buf, size + 8, NULL, 0, &rd, NULL);
+		CloseHandle(h);
+	}
+
+out:
+	if (!r)
+		wim_error("Could not set reparse point for", a->path[dentry]);
+	free(buf);
+	return r;
+}
+
+// Write the data of a resource that fits in a single chunk to all its targets
+static BOOL wim_write_resource(wim_apply* a, uint32_t lookup, const uint8_t* data, uint32_t size)
+{
+	uint32_t t;
+
+	for (t=a->first_target[lookup]; t!=WIM_NONE; t=a->target[t].next) {
+		if (a->target[t].is_reparse) {
+			if (!wim_set_reparse_point(a, a->target[t].dentry, data, size))
+				return FALSE;
+		} else {
+			if (!wim_write_file((a->target[t].path != NULL) ? a->target[t].path :
+				a->path[a->target[t].dentry], data, size))
+				return FALSE;
+		}
+	}
+	return TRUE;
+}
+
+// Worker task: decompress the chunks from the current batch
+static void wim_process_jobs(wim_apply* a)
+{
+	LONG i;
+	wim_job* job;
+
+	while ((i = InterlockedIncrement(&a->next_item) - 1) < a->nb_items) {
+		job = &a->job[i];
+		if (!WimDecompressChunk(a->wim->compression, &a->in_buf[job->in_offset], job->in_size,
+			&a->out_buf[job->out_offset], job->out_size)) {
+			uprintf("WIM: Could not decompress chunk at offset %lld\n", job->src);
+			InterlockedExchange(&a->error, 1);
+		} else if ((job->write) && (!wim_write_resource(a, job->lookup, &a->out_buf[job->out_offset], job->out_size))) {
+			InterlockedExchange(&a->error, 1);
+		}
+	}
+}
+
+// Worker task: restore the attributes, timestamps and security descriptors
+static void wim_restore_metadata(wim_apply* a)
+{
+	LONG i;
+	HANDLE h;
+	DWORD access, attr;
+	SECURITY_INFORMATION si;
+	wim_dentry* d;
+	wchar_t* path;
+
+	while ((i = InterlockedIncrement(&a->next_item) - 1) < a->nb_items) {
+		d = &a->m.dentry[i];
+		path = a->path[i];
+		// Hard links share their metadata with their primary
+		if ((d->primary != WIM_NONE) && (d->primary != (uint32_t)i))
+			continue;
+		// Attributes must be set first, as the security descriptor may not let us do it
+		if (i != 0) {
+			attr = d->attributes & (FILE_ATTRIBUTE_READONLY | FILE_ATTRIBUTE_HIDDEN | FILE_ATTRIBUTE_SYSTEM |
+				FILE_ATTRIBUTE_ARCHIVE | FILE_ATTRIBUTE_NOT_CONTENT_INDEXED | FILE_ATTRIBUTE_OFFLINE);
+			if (!SetFileAttributesW(path, (attr == 0) ? FILE_ATTRIBUTE_NORMAL : attr))
+				wim_warning(a, "Could not set attributes for", path);
+		}
+		access = FILE_WRITE_ATTRIBUTES | WRITE_DAC | WRITE_OWNER | ACCESS_SYSTEM_SECURITY;
+		h = CreateFileW(path, access, FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE, NULL,
+			OPEN_EXISTING, FILE_FLAG_BACKUP_SEMANTICS | FILE_FLAG_OPEN_REPARSE_POINT, NULL);
+		if (h == INVALID_HANDLE_VALUE) {
+			// Setting the SACL requires SeSecurityPrivilege
+			access &= ~ACCESS_SYSTEM_SECURITY;
+			h = CreateFileW(path, access, FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE, NULL,
+				OPEN_EXISTING, FILE_FLAG_BACKUP_SEMANTICS | FILE_FLAG_OPEN_REPARSE_POINT, NULL);
+		}
+		if (h == INVALID_HANDLE_VALUE) {
+			wim_warning(a, "Could not open", path);
+			continue;
+		}
+		if ((i != 0) && (!SetFileTime(h, (FILETIME*)&d->times[0], (FILETIME*)&d->times[1], (FILETIME*)&d->times[2])))
+			wim_warning(a, "Could not set timestamps for", path);
+		if ((d->security_id >= 0) && ((uint32_t)d->security_id < a->m.nb_sd)) {
+			si = OWNER_SECURITY_INFORMATION | GROUP_SECURITY_INFORMATION | DACL_SECURITY_INFORMATION;
+			if (access & ACCESS_SYSTEM_SECURITY)
+				si |= SACL_SECURITY_INFORMATION;
+			if ( (!SetKernelObjectSecurity(h, si, (PSECURITY_DESCRIPTOR)a->m.sd[d->security_id]))
+			  && ((!(si & SACL_SECURITY_INFORMATION)) ||
+				  (!SetKernelObjectSecurity(h, si & ~SACL_SECURITY_INFORMATION, (PSECURITY_DESCRIPTOR)a->m.sd[d->security_id]))) )
+				wim_warning(a, "Could not set security descriptor for", path);
+		}
+		CloseHandle(h);
+	}
+}
+
+static DWORD WINAPI wim_worker_thread(LPVOID param)
+{
+	wim_apply* a = ((wim_worker_param*)param)->a;
+	int id = ((wim_worker_param*)param)->id;
+
+	while (TRUE) {
+		WaitForSingleObject(a->start[id], INFINITE);
+		if (a->quit)
+			break;
+		a->task(a);
+		SetEvent(a->done[id]);
+	}
+	return 0;
+}
+
+static BOOL wim_start_threads(wim_apply* a)
+{
+	SYSTEM_INFO sysinfo;
+	int i;
+
+	GetSystemInfo(&sysinfo);
+	a->nb_threads = MIN(MAX((int)sysinfo.dwNumberOfProcessors, 1), WIM_MAX_THREADS);
+	for (i=0; i<a->nb_threads; i++) {
+		a->param[i].a = a;
+		a->param[i].id = i;
+		a->start[i] = CreateEvent(NULL, FALSE, FALSE, NULL);
+		a->done[i] = CreateEvent(NULL, FALSE, FALSE, NULL);
+		if ((a->start[i] == NULL) || (a->done[i] == NULL))
+			return FALSE;
+		a->thread[i] = CreateThread(NULL, 0, wim_worker_thread, &a->param[i], 0, NULL);
+		if (a->thread[i] == NULL) {
+			uprintf("WIM: Could not start worker thread: %s\n", WindowsErrorString());
+			return FALSE;
+		}
+	}
+	return TRUE;
+}
+
+static void wim_stop_threads(wim_apply* a)
+{
+	int i;
+
+	a->quit = TRUE;
+	for (i=0; i<a->nb_threads; i++) {
+		if (a->thread[i] != NULL) {
+			SetEvent(a->start[i]);
+			WaitForSingleObject(a->thread[i], INFINITE);
+		}
+		safe_closehandle(a->thread[i]);
+		safe_closehandle(a->start[i]);
+		safe_closehandle(a->done[i]);
+	}
+}
+
+// Run a task on all the worker threads and wait for them to complete it
+static BOOL wim_run_task(wim_apply* a, wim_task task, LONG nb_items)
+{
+	int i;
+
+	a->task = task;
+	a->nb_items = nb_items;
+	a->next_item = 0;
+	for (i=0; i<a->nb_threads; i++)
+		SetEvent(a->start[i]);
+	WaitForMultipleObjects(a->nb_threads, a->done, TRUE, INFINITE);
+	return !a->error;
+}
+
+// Create the directories, as well as the files that have no data to write
+static BOOL wim_create_tree(wim_apply* a, BOOL boot)
+{
+	uint32_t i;
+	HANDLE h;
+	wchar_t* path;
+
+	for (i=1; i<a->m.nb_dentries; i++) {
+		wim_dentry* d = &a->m.dentry[i];
+		if (d->attributes & FILE_ATTRIBUTE_DIRECTORY) {
+			if ((!CreateDirectoryW(a->path[i], NULL)) && (GetLastError() != ERROR_ALREADY_EXISTS)) {
+				wim_error("Could not create directory", a->path[i]);
+				return FALSE;
+			}
+		} else if ((d->data_hash == NULL) && ((d->primary == WIM_NONE) || (d->primary == i))) {
+			h = CreateFileW(a->path[i], GENERIC_WRITE, FILE_SHARE_READ, NULL, CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL);
+			if (h == INVALID_HANDLE_VALUE) {
+				wim_error("Could not create", a->path[i]);
+				return FALSE;
+			}
+			CloseHandle(h);
+		}
+	}
+	for (i=0; (boot) && (i<ARRAYSIZE(efi_boot_dir)); i++) {
+		path = wim_root_path(a, efi_boot_dir[i]);
+		if (path == NULL)
+			return FALSE;
+		if ((!CreateDirectoryW(path, NULL)) && (GetLastError() != ERROR_ALREADY_EXISTS)) {
+			wim_error("Could not create directory", path);
+			free(path);
+			return FALSE;
+		}
+		free(path);
+	}
+	return TRUE;
+}
+
+// Decompress and write the current batch of chunks
+static BOOL wim_flush_batch(wim_apply* a, LONG nb_jobs, HANDLE* handle, uint32_t* nb_handles)
+{
+	LONG i, j;
+	uint32_t k, t;
+	uint64_t size;
+	DWORD wr;
+	LARGE_INTEGER li;
+	wim_job* job;
+
+	// Read the compressed data, coalescing the chunks that are contiguous in the WIM
+	for (i=0; i<nb_jobs; i=j) {
+		size = a->job[i].in_size;
+		for (j=i+1; (j<nb_jobs) && (a->job[j].src == a->job[i].src + size); j++)
+			size += a->job[j].in_size;
+		if ((size != 0) && (!WimRead(a->wim, a->job[i].src, &a->in_buf[a->job[i].in_offset], (uint32_t)size)))
+			return FALSE;
+	}
+
+	if (!wim_run_task(a, wim_process_jobs, nb_jobs))
+		return FALSE;
+
+	// Resources that span multiple chunks are written here, sequentially
+	for (i=0; i<nb_jobs; i++) {
+		job = &a->job[i];
+		if (job->write)
+			continue;
+		if (job->first) {
+			*nb_handles = 0;
+			for (t=a->first_target[job->lookup]; t!=WIM_NONE; t=a->target[t].next) {
+				const wchar_t* path = (a->target[t].path != NULL) ? a->target[t].path : a->path[a->target[t].dentry];
+				if (a->target[t].is_reparse) {
+					uprintf("WIM: Invalid reparse data size\n");
+					return FALSE;
+				}
+				handle[*nb_handles] = CreateFileW(path, GENERIC_WRITE, FILE_SHARE_READ, NULL, OPEN_ALWAYS,
+					FILE_ATTRIBUTE_NORMAL | FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+				if (handle[*nb_handles] == INVALID_HANDLE_VALUE) {
+					wim_error("Could not create", path);
+					return FALSE;
+				}
+				// Preallocate the file, to limit fragmentation
+				li.QuadPart = a->wim->lookup[job->lookup].reshdr.original_size;
+				if (SetFilePointerEx(handle[*nb_handles], li, NULL, FILE_BEGIN))
+					SetEndOfFile(handle[*nb_handles]);
+				li.QuadPart = 0;
+				SetFilePointerEx(handle[*nb_handles], li, NULL, FILE_BEGIN);
+				(*nb_handles)++;
+			}
+		}
+		for (k=0; k<*nb_handles; k++) {
+			if ((!WriteFile(handle[k], &a->out_buf[job->out_offset], job->out_size, &wr, NULL)) || (wr != job->out_size)) {
+				uprintf("WIM: Could not write data: %s\n", WindowsErrorString());
+				return FALSE;
+			}
+		}
+		if (job->last) {
+			for (k=0; k<*nb_handles; k++)
+				safe_closehandle(handle[k]);
+			*nb_handles = 0;
+		}
+	}
+	return TRUE;
+}
+
+// Stream all the resources we need, in the order they appear in the WIM
+static BOOL wim_write_data(wim_apply* a)
+{
+	BOOL r = FALSE;
+	uint32_t i, c, n, nb_res = 0, nb_handles = 0, max_handles = 1, nb_targets, in_used = 0, out_used = 0;
+	uint64_t *offsets = NULL, total = 0, done = 0;
+	LONG j, nb_jobs = 0;
+	wim_sort_entry* res;
+	HANDLE* handle = NULL;
+	WIM_RESHDR* reshdr;
+
+	res = (wim_sort_entry*)malloc(a->wim->nb_lookup * sizeof(wim_sort_entry));
+	if (res == NULL)
+		return FALSE;
+	for (i=0; i<a->wim->nb_lookup; i++) {
+		if (a->first_target[i] == WIM_NONE)
+			continue;
+		res[nb_res].key = a->wim->lookup[i].reshdr.offset;
+		res[nb_res++].index = i;
+		total += a->wim->lookup[i].reshdr.original_size;
+		for (nb_targets=0, c=a->first_target[i]; c!=WIM_NONE; c=a->target[c].next)
+			nb_targets++;
+		max_handles = MAX(max_handles, nb_targets);
+	}
+	qsort(res, nb_res, sizeof(wim_sort_entry), WimSortCmp);
+
+	handle = (HANDLE*)calloc(max_handles, sizeof(HANDLE));
+	a->job = (wim_job*)calloc(WIM_BATCH_CHUNKS, sizeof(wim_job));
+	a->in_buf = (uint8_t*)malloc(WIM_BATCH_CHUNKS * a->wim->chunk_size);
+	a->out_buf = (uint8_t*)malloc(WIM_BATCH_CHUNKS * a->wim->chunk_size);
+	if ((handle == NULL) || (a->job == NULL) || (a->in_buf == NULL) || (a->out_buf == NULL))
+		goto out;
+
+	for (i=0; i<nb_res; i++) {
+		reshdr = &a->wim->lookup[res[i].index].reshdr;
+		offsets = WimGetChunkOffsets(a->wim, reshdr, &n);
+		if (offsets == NULL)
+			goto out;
+		for (c=0; c<MAX(n, 1); c++) {
+			if (nb_jobs >= WIM_BATCH_CHUNKS) {
+				if (!wim_flush_batch(a, nb_jobs, handle, &nb_handles))
+					goto out;
+				for (j=0; j<nb_jobs; j++)
+					done += a->job[j].out_size;
+				nb_jobs = 0;
+				in_used = 0;
+				out_used = 0;
+				UpdateProgress(OP_DOS, 100.0f*done/total);
+				if (IS_ERROR(FormatStatus))
+					goto out;
+			}
+			a->job[nb_jobs].lookup = res[i].index;
+			a->job[nb_jobs].src = reshdr->offset + offsets[c];
+			a->job[nb_jobs].in_offset = in_used;
+			a->job[nb_jobs].in_size = (n == 0) ? 0 : (uint32_t)(offsets[c+1] - offsets[c]);
+			a->job[nb_jobs].out_offset = out_used;
+			a->job[nb_jobs].out_size = (n == 0) ? 0 :
+				(uint32_t)MIN(a->wim->chunk_size, reshdr->original_size - (uint64_t)c * a->wim->chunk_size);
+			a->job[nb_jobs].first = (c == 0);
+			a->job[nb_jobs].last = (c + 1 >= n);
+			a->job[nb_jobs].write = (n <= 1);
+			in_used += a->job[nb_jobs].in_size;
+			out_used += a->job[nb_jobs].out_size;
+			nb_jobs++;
+		}
+		safe_free(offsets);
+	}
+	if ((nb_jobs != 0) && (!wim_flush_batch(a, nb_jobs, handle, &nb_handles)))
+		goto out;
+	UpdateProgress(OP_DOS, 100.0f);
+	r = TRUE;
+
+out:
+	for (i=0; i<nb_handles; i++)
+		safe_closehandle(handle[i]);
+	safe_free(offsets);
+	safe_free(handle);
+	safe_free(a->job);
+	safe_free(a->in_buf);
+	safe_free(a->out_buf);
+	free(res);
+	return r;
+}
+
+static BOOL wim_create_links(wim_apply* a)
+{
+	uint32_t i;
+
+	for (i=0; i<a->m.nb_dentries; i++) {
+		if ((a->m.dentry[i].primary == WIM_NONE) || (a->m.dentry[i].primary == i))
+			continue;
+		if (!CreateHardLinkW(a->path[i], a->path[a->m.dentry[i].primary], NULL)) {
+			wim_error("Could not create hard link", a->path[i]);
+			return FALSE;
+		}
+	}
+	return TRUE;
+}
+
+// Restoring owners and SACLs requires these privileges, which elevated processes have but don't enable
+static void wim_enable_privileges(void)
+{
+	const char* privilege[] = { SE_BACKUP_NAME, SE_RESTORE_NAME, SE_SECURITY_NAME, SE_TAKE_OWNERSHIP_NAME };
+	HANDLE token;
+	TOKEN_PRIVILEGES tp;
+	int i;
+
+	if (!OpenProcessToken(GetCurrentProcess(), TOKEN_ADJUST_PRIVILEGES | TOKEN_QUERY, &token)) {
+		uprintf("WIM: Could not open process token: %s\n", WindowsErrorString());
+		return;
+	}
+	for (i=0; i<ARRAYSIZE(privilege); i++) {
+		tp.PrivilegeCount = 1;
+		tp.Privileges[0].Attributes = SE_PRIVILEGE_ENABLED;
+		if ( (!LookupPrivilegeValueA(NULL, privilege[i], &tp.Privileges[0].Luid))
+		  || (!AdjustTokenPrivileges(token, FALSE, &tp, 0, NULL, NULL)) || (GetLastError() != ERROR_SUCCESS) )
+			uprintf("WIM: Could not enable %s\n", privilege[i]);
+	}
+	CloseHandle(token);
+}
+
+// Get the name and architecture of an image from the XML data
+static void wim_get_image_info(WIM_INFO* wim, int index, char* name, size_t name_size, int* arch)
+{
+	uint8_t* xml = WimReadResource(wim, &wim->hdr.xml_data);
+	wchar_t* wxml = NULL;
+	char *uxml = NULL, *p, *q, tag[32];
+	size_t i, len;
+
+	*arch = -1;
+	safe_strcpy(name, name_size, "");
+	if (xml == NULL)
+		return;
+	len = (size_t)wim->hdr.xml_data.original_size / 2;
+	wxml = (wchar_t*)malloc((len + 1) * sizeof(wchar_t));
+	if (wxml == NULL)
+		goto out;
+	for (i=0; i<len; i++)
+		wxml[i] = (wchar_t)le16(&xml[2*i]);
+	wxml[len] = 0;
+	uxml = wchar_to_utf8(wxml);
+	if (uxml == NULL)
+		goto out;
+	safe_sprintf(tag, sizeof(tag), "<IMAGE INDEX=\"%d\">", index);
+	p = strstr(uxml, tag);
+	if (p == NULL)
+		goto out;
+	q = strstr(p, "</IMAGE>");
+	if (q != NULL)
+		*q = 0;
+	q = strstr(p, "<ARCH>");
+	if (q != NULL)
+		*arch = atoi(&q[6]);
+	q = strstr(p, "<NAME>");
+	if (q != NULL) {
+		q += 6;
+		p = strchr(q, '<');
+		if (p != NULL)
+			*p = 0;
+		safe_strcpy(name, name_size, q);
+	}
+
+out:
+	free(uxml);
+	free(wxml);
+	free(xml);
+}
+
+/*
+ * Apply image 'index' (starting at 1) of a WIM to the 'dst' directory, which must
+ * be on NTFS. If 'boot' is set, the boot manager files are also copied to the root.
+ */
+BOOL WimApplyImage(WIM_INFO* wim, int index, const char* dst, BOOL boot)
+{
+	BOOL r = FALSE;
+	wim_apply a;
+	wchar_t *wdst = NULL, *root = NULL;
+	char name[128];
+	uint32_t i;
+	int arch;
+
+	memset(&a, 0, sizeof(a));
+	a.wim = wim;
+	if (!WimReadMetadata(wim, index, &a.m))
+		return FALSE;
+	wim_get_image_info(wim, index, name, sizeof(name), &arch);
+	uprintf("Applying image %d ('%s') to %s\n", index, name, dst);
+	switch (arch) {
+	case 0:
+		a.efi_boot_dst = L"efi\\boot\\bootia32.efi";
+		break;
+	case 5:
+		a.efi_boot_dst = L"efi\\boot\\bootarm.efi";
+		break;
+	case 12:
+		a.efi_boot_dst = L"efi\\boot\\bootaa64.efi";
+		break;
+	default:
+		a.efi_boot_dst = L"efi\\boot\\bootx64.efi";
+		break;
+	}
+
+	a.first_target = (uint32_t*)malloc(wim->nb_lookup * sizeof(uint32_t));
+	if (a.first_target == NULL)
+		goto out;
+	for (i=0; i<wim->nb_lookup; i++)
+		a.first_target[i] = WIM_NONE;
+
+	// Use a \\?\ path, as some paths from the image are longer than MAX_PATH
+	wdst = utf8_to_wchar(dst);
+	if (wdst == NULL)
+		goto out;
+	if ((wcslen(wdst) != 0) && (wdst[wcslen(wdst) - 1] == L'\\'))
+		wdst[wcslen(wdst) - 1] = 0;
+	root = (wchar_t*)malloc((wcslen(wdst) + 5) * sizeof(wchar_t));
+	if (root == NULL)
+		goto out;
+	wcscpy(root, L"\\\\?\\");
+	wcscat(root, wdst);
+	a.root_len = wcslen(root);
+	if ((!wim_build_paths(&a, root)) || (!wim_build_targets(&a, boot)))
+		goto out;
+	uprintf("  %d files and directories, %d streams\n", a.m.nb_dentries, a.nb_targets);
+
+	wim_enable_privileges();
+	if ( (!wim_start_threads(&a)) || (!wim_create_tree(&a, boot)) || (!wim_write_data(&a))
+	  || (!wim_create_links(&a)) || (!wim_run_task(&a, wim_restore_metadata, a.m.nb_dentries)) )
+		goto out;
+	if (a.nb_warnings != 0)
+		uprintf("WIM: %d files could not have all their metadata restored\n", a.nb_warnings);
+	r = TRUE;
+
+out:
+	wim_stop_threads(&a);
+	for (i=0; (a.path != NULL) && (i<a.m.nb_dentries); i++)
+		free(a.path[i]);
+	for (i=0; i<a.nb_targets; i++)
+		free(a.target[i].path);
+	free(a.path);
+	free(a.target);
+	free(a.first_target);
+	WimFreeMetadata(&a.m);
+	free(root);
+	free(wdst);
+	return r;
+}
+
+/*
+ * Create the BCD and finalize the boot files. There is no way around bcdboot for that,
+ * so we try the one from the image we just applied first, as it is the most likely to
+ * know how to set it up, then the system one.
+ */
+static BOOL wim_run_bcdboot(char drive_letter)
+{
+	STARTUPINFOA si = {0};
+	PROCESS_INFORMATION pi = {0};
+	char path[MAX_PATH], cmdline[MAX_PATH];
+	DWORD code = 1;
+	int i;
+
+	safe_sprintf(cmdline, sizeof(cmdline), "bcdboot.exe %c:\\Windows /s %c: /f ALL", drive_letter, drive_letter);
+	for (i=0; (i<3) && (code != 0); i++) {
+		switch (i) {
+		case 0:
+			safe_sprintf(path, sizeof(path), "%c:\\Windows\\System32\\bcdboot.exe", drive_letter);
+			break;
+		case 1:
+			// We are a 32-bit process, so System32 may be redirected
+			GetSystemWindowsDirectoryA(path, sizeof(path));
+			safe_strcat(path, sizeof(path), "\\Sysnative\\bcdboot.exe");
+			break;
+		default:
+			GetSystemDirectoryA(path, sizeof(path));
+			safe_strcat(path, sizeof(path), "\\bcdboot.exe");
+			break;
+		}
+		if (_access(path, 0) == -1)
+			continue;
+		si.cb = sizeof(si);
+		uprintf("Running: %s (%s)\n", cmdline, path);
+		if (!CreateProcessU(path, cmdline, NULL, NULL, FALSE, CREATE_NO_WINDOW, NULL, NULL, &si, &pi)) {
+			uprintf("  Could not launch bcdboot: %s\n", WindowsErrorString());
+			continue;
+		}
+		WaitForSingleObject(pi.hProcess, INFINITE);
+		if (!GetExitCodeProcess(pi.hProcess, &code))
+			code = 1;
+		CloseHandle(pi.hProcess);
+		CloseHandle(pi.hThread);
+		if (code != 0)
+			uprintf("  bcdboot returned error %d\n", code);
+	}
+	return (code == 0);
+}
+
+// Apply the first image of the install.wim from a Windows ISO onto an NTFS drive, for Windows To Go
+BOOL ApplyWindowsToGo(const char* image, const char* drive_name)
+{
+	BOOL r = FALSE;
+	char dst[] = "?:";
+	int64_t offset;
+	uint64_t size = 0;
+	HANDLE hImage;
+	WIM_INFO wim;
+
+	memset(&wim, 0, sizeof(wim));
+	dst[0] = drive_name[0];
+	// Read the WIM straight from the ISO, rather than extracting it first
+	offset = GetISOFileOffset(image, "/sources/install.wim", &size);
+	if (offset < 0)
+		return FALSE;
+	hImage = CreateFileU(image, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+	if (hImage == INVALID_HANDLE_VALUE) {
+		uprintf("Could not open image '%s': %s\n", image, WindowsErrorString());
+		return FALSE;
+	}
+	uprintf("Opening: %s/sources/install.wim (%s)\n", image, SizeToHumanReadable(size, FALSE, FALSE));
+	if ((!WimOpen(&wim, wim_read_handle, hImage, (uint64_t)offset)) || (!WimApplyImage(&wim, 1, dst, TRUE)))
+		goto out;
+	UpdateProgress(OP_FINALIZE, -1.0f);
+	r = wim_run_bcdboot(dst[0]);
+
+out:
+	WimClose(&wim);
+	CloseHandle(hImage);
+	return r;
+}
+
+// Split the install.wim from an ISO into .swm parts that fit on FAT32
+BOOL SplitWindowsImage(const char* image, const char* dst, wim_progress_t progress)
+{
+	BOOL r = FALSE;
+	int64_t offset;
+	uint64_t size = 0;
+	HANDLE hImage;
+	WIM_INFO wim;
+
+	memset(&wim, 0, sizeof(wim));
+	offset = GetISOFileOffset(image, "/sources/install.wim", &size);
+	if (offset < 0)
+		return FALSE;
+	hImage = CreateFileU(image, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+	if (hImage == INVALID_HANDLE_VALUE) {
+		uprintf("Could not open image '%s': %s\n", image, WindowsErrorString());
+		return FALSE;
+	}
+	if (WimOpen(&wim, wim_read_handle, hImage, (uint64_t)offset))
+		r = WimSplit(&wim, dst, WIM_SPLIT_PART_SIZE, progress);
+	WimClose(&wim);
+	CloseHandle(hImage);
+	return r;
+}
@@ -0,0 +1,36 @@
+/*
+ * Rufus: The Reliable USB Formatting Utility
+ * Native WIM image support
+ * Copyright © 2014 Pete Batard <pete@akeo.ie>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <windows.h>
+#include <stdint.h>
+#include "wim_parse.h"
+
+#pragma once
+
+#define WIM_MAX_THREADS                 8
+#define WIM_SPLIT_PART_SIZE             (4000 * 1024 * 1024ULL)
+
+typedef void (*wim_progress_t)(const uint64_t nb_bytes);
+
+extern BOOL enable_wintogo;
+
+BOOL WimSplit(WIM_INFO* wim, const char* dst, uint64_t part_size, wim_progress_t progress);
+BOOL WimApplyImage(WIM_INFO* wim, int index, const char* dst, BOOL boot);
+BOOL ApplyWindowsToGo(const char* image, const char* drive_name);
+BOOL SplitWindowsImage(const char* image, const char* dst, wim_progress_t progress);
@@ -0,0 +1,1008 @@
+/*
+ * Rufus: The Reliable USB Formatting Utility
+ * WIM image parsing and decompression
+ * Copyright © 2014 Pete Batard <pete@akeo.ie>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "wim_parse.h"
+
+#ifdef RUFUS_DEBUG
+extern void _uprintf(const char *format, ...);
+#define uprintf(...) _uprintf(__VA_ARGS__)
+#else
+#define uprintf(...)
+#endif
+
+#define WIM_MAX_RESOURCE_SIZE       (512 * 1024 * 1024)
+#define WIM_MAX_STREAM_SIZE         (64 * 1024 * 1024 * 1024ULL)
+#define WIM_MAX_DEPTH               256
+#define WIM_DENTRY_DISK_SIZE        102
+#define WIM_STREAM_DISK_SIZE        38
+#define ALIGN8(x)                   (((x) + 7) & ~7ULL)
+#ifndef MIN
+#define MIN(a,b)                    (((a) < (b)) ? (a) : (b))
+#endif
+#ifndef MAX
+#define MAX(a,b)                    (((a) > (b)) ? (a) : (b))
+#endif
+
+#define HUFF_TABLEBITS              10
+#define HUFF_MAX_LEN                16
+#define HUFF_MAX_SYMS               512
+
+#define LZX_NUM_CHARS               256
+#define LZX_NUM_OFFSET_SLOTS        30		// For a 32 KB window
+#define LZX_MAIN_SYMS               (LZX_NUM_CHARS + 8 * LZX_NUM_OFFSET_SLOTS)
+#define LZX_LEN_SYMS                249
+#define LZX_PRETREE_SYMS            20
+#define LZX_ALIGNED_SYMS            8
+#define LZX_MIN_MATCH               2
+#define LZX_DEFAULT_BLOCK_SIZE      32768
+#define LZX_WIM_MAGIC_FILESIZE      12000000
+#define LZX_BLOCKTYPE_VERBATIM      1
+#define LZX_BLOCKTYPE_ALIGNED       2
+#define LZX_BLOCKTYPE_UNCOMPRESSED  3
+
+#define XPRESS_MIN_MATCH            3
+
+#define le16(p)                     ((uint16_t)((p)[0] | ((p)[1] << 8)))
+#define le32(p)                     ((uint32_t)le16(p) | ((uint32_t)le16((p) + 2) << 16))
+#define le64(p)                     ((uint64_t)le32(p) | ((uint64_t)le32((p) + 4) << 32))
+
+/*
+ * Canonical Huffman decoding, as used by both XPRESS and LZX. Codes of up to
+ * HUFF_TABLEBITS bits are looked up directly, longer ones are decoded by length.
+ */
+typedef struct {
+	uint16_t table[1 << HUFF_TABLEBITS];	// (symbol << 5) | length
+	uint16_t count[HUFF_MAX_LEN + 1];
+	uint16_t index[HUFF_MAX_LEN + 1];
+	uint32_t first[HUFF_MAX_LEN + 1];
+	uint16_t sorted[HUFF_MAX_SYMS];
+} huffman_table;
+
+static bool huffman_build(huffman_table* h, const uint8_t* lens, int nb_syms)
+{
+	int i, j, len;
+	uint16_t offs[HUFF_MAX_LEN + 1], entry;
+	uint32_t code, left;
+
+	memset(h->count, 0, sizeof(h->count));
+	for (i=0; i<nb_syms; i++) {
+		if (lens[i] > HUFF_MAX_LEN)
+			return false;
+		h->count[lens[i]]++;
+	}
+	h->count[0] = 0;
+
+	// Reject over-subscribed codes (incomplete ones are fine, as long as unused)
+	left = 1;
+	for (len=1; len<=HUFF_MAX_LEN; len++) {
+		left <<= 1;
+		if (h->count[len] > left)
+			return false;
+		left -= h->count[len];
+	}
+
+	code = 0;
+	j = 0;
+	for (len=1; len<=HUFF_MAX_LEN; len++) {
+		h->first[len] = code;
+		h->index[len] = (uint16_t)j;
+		offs[len] = (uint16_t)j;
+		code = (code + h->count[len]) << 1;
+		j += h->count[len];
+	}
+	for (i=0; i<nb_syms; i++) {
+		if (lens[i] != 0)
+			h->sorted[offs[lens[i]]++] = (uint16_t)i;
+	}
+
+	memset(h->table, 0, sizeof(h->table));
+	for (len=1; len<=HUFF_TABLEBITS; len++) {
+		for (i=0; i<h->count[len]; i++) {
+			entry = (uint16_t)((h->sorted[h->index[len] + i] << 5) | len);
+			code = (h->first[len] + i) << (HUFF_TABLEBITS - len);
+			for (j=0; j<(1 << (HUFF_TABLEBITS - len)); j++)
+				h->table[code + j] = entry;
+		}
+	}
+	return true;
+}
+
+// Decode a symbol from the next 16 bits of the stream (MSB first) or return -1
+static __inline int huffman_decode(const huffman_table* h, uint32_t peek, int* len)
+{
+	int l;
+	uint32_t code;
+	uint16_t entry = h->table[peek >> (16 - HUFF_TABLEBITS)];
+
+	if (entry & 0x1f) {
+		*len = entry & 0x1f;
+		return entry >> 5;
+	}
+	for (l=HUFF_TABLEBITS+1; l<=HUFF_MAX_LEN; l++) {
+		code = peek >> (16 - l);
+		if (code - h->first[l] < h->count[l]) {
+			*len = l;
+			return h->sorted[h->index[l] + code - h->first[l]];
+		}
+	}
+	return -1;
+}
+
+/*
+ * XPRESS (LZ77 + Huffman) decompression, as described in [MS-XCA] section 2.2.4
+ */
+static bool xpress_decompress(const uint8_t* in, uint32_t in_size, uint8_t* out, uint32_t out_size)
+{
+	huffman_table h;
+	uint8_t lens[HUFF_MAX_SYMS];
+	uint8_t *o = out, *end = out + out_size;
+	uint32_t i, pos, next_bits, length, offset;
+	int extra, sym, len, nbits;
+
+	if (in_size < 256 + 4)
+		return false;
+	for (i=0; i<256; i++) {
+		lens[2*i] = in[i] & 0x0f;
+		lens[2*i+1] = in[i] >> 4;
+	}
+	if (!huffman_build(&h, lens, HUFF_MAX_SYMS))
+		return false;
+
+// Past the end of the input, we feed zeroes, so that the last symbols can be decoded
+#define XPRESS_REFILL() do { if (extra < 0) {									\
+	next_bits |= (uint32_t)((pos + 2 <= in_size)?le16(&in[pos]):0) << (-extra);	\
+	extra += 16; pos += 2; } } while (0)
+
+	next_bits = ((uint32_t)le16(&in[256]) << 16) | le16(&in[258]);
+	pos = 260;
+	extra = 16;
+	while (o < end) {
+		sym = huffman_decode(&h, next_bits >> 16, &len);
+		if (sym < 0)
+			return false;
+		next_bits <<= len;
+		extra -= len;
+		XPRESS_REFILL();
+		if (sym < 256) {
+			*o++ = (uint8_t)sym;
+			continue;
+		}
+		sym -= 256;
+		length = sym & 0x0f;
+		nbits = sym >> 4;
+		if (length == 0x0f) {
+			if (pos >= in_size)
+				return false;
+			length += in[pos++];
+			if (length == 0x0f + 0xff) {
+				if (pos + 2 > in_size)
+					return false;
+				length = le16(&in[pos]);
+				pos += 2;
+			}
+		}
+		length += XPRESS_MIN_MATCH;
+		offset = (nbits == 0) ? 0 : (next_bits >> (32 - nbits));
+		offset |= 1 << nbits;
+		next_bits <<= nbits;
+		extra -= nbits;
+		XPRESS_REFILL();
+		if ((offset > (uint32_t)(o - out)) || (length > (uint32_t)(end - o)))
+			return false;
+		// Matches can overlap with their output, so copy bytewise
+		for (i=0; i<length; i++, o++)
+			*o = *(o - offset);
+	}
+#undef XPRESS_REFILL
+	return true;
+}
+
+/*
+ * LZX decompression, as used in WIMs: each chunk is compressed independently with
+ * a window that is the size of the chunk, and there is no stream header, as E8
+ * translation is always enabled with a fixed "file size". See [MS-PATCH].
+ */
+static const uint32_t lzx_offset_base[LZX_NUM_OFFSET_SLOTS] = {
+	0, 1, 2, 3, 4, 6, 8, 12, 16, 24, 32, 48, 64, 96, 128, 192, 256, 384, 512, 768,
+	1024, 1536, 2048, 3072, 4096, 6144, 8192, 12288, 16384, 24576
+};
+static const uint8_t lzx_extra_bits[LZX_NUM_OFFSET_SLOTS] = {
+	0, 0, 0, 0, 1, 1, 2, 2, 3, 3, 4, 4, 5, 5, 6, 6, 7, 7, 8, 8,
+	9, 9, 10, 10, 11, 11, 12, 12, 13, 13
+};
+
+// The bitstream consists of 16-bit little endian words, read MSB first
+typedef struct {
+	const uint8_t* data;
+	uint32_t size;
+	uint32_t pos;
+	uint32_t bitbuf;
+	int bitsleft;
+} lzx_bitstream;
+
+static __inline void lzx_ensure_bits(lzx_bitstream* bs, int n)
+{
+	while (bs->bitsleft < n) {
+		bs->bitbuf |= (uint32_t)((bs->pos + 2 <= bs->size)?le16(&bs->data[bs->pos]):0) << (16 - bs->bitsleft);
+		bs->pos += 2;
+		bs->bitsleft += 16;
+	}
+}
+
+static __inline uint32_t lzx_read_bits(lzx_bitstream* bs, int n)
+{
+	uint32_t r;
+
+	if (n == 0)
+		return 0;
+	lzx_ensure_bits(bs, n);
+	r = bs->bitbuf >> (32 - n);
+	bs->bitbuf <<= n;
+	bs->bitsleft -= n;
+	return r;
+}
+
+static __inline int lzx_read_sym(lzx_bitstream* bs, const huffman_table* h)
+{
+	int sym, len;
+
+	lzx_ensure_bits(bs, 16);
+	sym = huffman_decode(h, bs->bitbuf >> 16, &len);
+	if (sym >= 0) {
+		bs->bitbuf <<= len;
+		bs->bitsleft -= len;
+	}
+	return sym;
+}
+
+// Read code lengths, which are delta encoded against the ones from the previous block
+static bool lzx_read_lens(lzx_bitstream* bs, uint8_t* lens, int nb_syms)
+{
+	huffman_table pretree;
+	uint8_t prelens[LZX_PRETREE_SYMS], val;
+	int i, j, sym, run;
+
+	for (i=0; i<LZX_PRETREE_SYMS; i++)
+		prelens[i] = (uint8_t)lzx_read_bits(bs, 4);
+	if (!huffman_build(&pretree, prelens, LZX_PRETREE_SYMS))
+		return false;
+
+	for (i=0; i<nb_syms; ) {
+		sym = lzx_read_sym(bs, &pretree);
+		if (sym < 0)
+			return false;
+		if (sym < 17) {
+			lens[i] = (uint8_t)((lens[i] + 17 - sym) % 17);
+			i++;
+			continue;
+		}
+		if (sym == 17) {
+			run = 4 + lzx_read_bits(bs, 4);
+			val = 0;
+		} else if (sym == 18) {
+			run = 20 + lzx_read_bits(bs, 5);
+			val = 0;
+		} else {
+			run = 4 + lzx_read_bits(bs, 1);
+			sym = lzx_read_sym(bs, &pretree);
+			if ((sym < 0) || (sym > 16))
+				return false;
+			val = (uint8_t)((lens[i] + 17 - sym) % 17);
+		}
+		if (i + run > nb_syms)
+			return false;
+		for (j=0; j<run; j++)
+			lens[i++] = val;
+	}
+	return true;
+}
+
+static bool lzx_decompress(const uint8_t* in, uint32_t in_size, uint8_t* out, uint32_t out_size)
+{
+	lzx_bitstream bs = { in, in_size, 0, 0, 0 };
+	huffman_table main_tree, len_tree, aligned_tree;
+	uint8_t main_lens[LZX_MAIN_SYMS], len_lens[LZX_LEN_SYMS], aligned_lens[LZX_ALIGNED_SYMS];
+	uint8_t *o = out, *end = out + out_size, *block_end;
+	uint32_t i, r[3] = { 1, 1, 1 }, block_size, length, offset, consumed;
+	int block_type, sym, slot, nbits;
+	int32_t abs_offset;
+
+	memset(main_lens, 0, sizeof(main_lens));
+	memset(len_lens, 0, sizeof(len_lens));
+
+	while (o < end) {
+		block_type = lzx_read_bits(&bs, 3);
+		block_size = lzx_read_bits(&bs, 1) ? LZX_DEFAULT_BLOCK_SIZE : lzx_read_bits(&bs, 16);
+		if ((block_size == 0) || (block_size > (uint32_t)(end - o)))
+			return false;
+		block_end = o + block_size;
+
+		switch (block_type) {
+		case LZX_BLOCKTYPE_ALIGNED:
+			for (i=0; i<LZX_ALIGNED_SYMS; i++)
+				aligned_lens[i] = (uint8_t)lzx_read_bits(&bs, 3);
+			if (!huffman_build(&aligned_tree, aligned_lens, LZX_ALIGNED_SYMS))
+				return false;
+			// Fall through
+		case LZX_BLOCKTYPE_VERBATIM:
+			if ( (!lzx_read_lens(&bs, main_lens, LZX_NUM_CHARS))
+			  || (!lzx_read_lens(&bs, &main_lens[LZX_NUM_CHARS], LZX_MAIN_SYMS - LZX_NUM_CHARS))
+			  || (!huffman_build(&main_tree, main_lens, LZX_MAIN_SYMS))
+			  || (!lzx_read_lens(&bs, len_lens, LZX_LEN_SYMS))
+			  || (!huffman_build(&len_tree, len_lens, LZX_LEN_SYMS)) )
+				return false;
+			while (o < block_end) {
+				sym = lzx_read_sym(&bs, &main_tree);
+				if (sym < 0)
+					return false;
+				if (sym < LZX_NUM_CHARS) {
+					*o++ = (uint8_t)sym;
+					continue;
+				}
+				sym -= LZX_NUM_CHARS;
+				slot = sym >> 3;
+				length = (sym & 7) + LZX_MIN_MATCH;
+				if ((sym & 7) == 7) {
+					sym = lzx_read_sym(&bs, &len_tree);
+					if (sym < 0)
+						return false;
+					length += sym;
+				}
+				if (slot < 3) {
+					// Repeated offset: swap with the most recent one
+					offset = r[slot];
+					r[slot] = r[0];
+					r[0] = offset;
+				} else {
+					nbits = lzx_extra_bits[slot];
+					if ((block_type == LZX_BLOCKTYPE_ALIGNED) && (nbits >= 3)) {
+						offset = lzx_offset_base[slot] + (lzx_read_bits(&bs, nbits - 3) << 3);
+						sym = lzx_read_sym(&bs, &aligned_tree);
+						if (sym < 0)
+							return false;
+						offset += sym;
+					} else {
+						offset = lzx_offset_base[slot] + lzx_read_bits(&bs, nbits);
+					}
+					offset -= 2;
+					r[2] = r[1];
+					r[1] = r[0];
+					r[0] = offset;
+				}
+				if ((offset == 0) || (offset > (uint32_t)(o - out)) || (length > (uint32_t)(block_end - o)))
+					return false;
+				for (i=0; i<length; i++, o++)
+					*o = *(o - offset);
+			}
+			if (bs.pos > in_size + 4)
+				return false;
+			break;
+		case LZX_BLOCKTYPE_UNCOMPRESSED:
+			// Skip to the next 16-bit boundary, or 16 bits further if we're already on one
+			lzx_ensure_bits(&bs, 1);
+			consumed = bs.pos * 8 - bs.bitsleft;
+			bs.pos = (consumed / 16 + 1) * 2;
+			bs.bitbuf = 0;
+			bs.bitsleft = 0;
+			if (bs.pos + 12 + block_size > in_size)
+				return false;
+			for (i=0; i<3; i++, bs.pos += 4)
+				r[i] = le32(&in[bs.pos]);
+			memcpy(o, &in[bs.pos], block_size);
+			o += block_size;
+			bs.pos += block_size + (block_size & 1);
+			break;
+		default:
+			return false;
+		}
+	}
+
+	// Undo the E8 (x86 CALL) translation
+	if (out_size <= 10)
+		return true;
+	for (i=0; i<out_size-10; ) {
+		if (out[i] != 0xE8) {
+			i++;
+			continue;
+		}
+		abs_offset = (int32_t)le32(&out[i+1]);
+		if ((abs_offset >= -(int32_t)i) && (abs_offset < LZX_WIM_MAGIC_FILESIZE)) {
+			offset = (uint32_t)((abs_offset >= 0) ? abs_offset - (int32_t)i : abs_offset + LZX_WIM_MAGIC_FILESIZE);
+			out[i+1] = (uint8_t)offset;
+			out[i+2] = (uint8_t)(offset >> 8);
+			out[i+3] = (uint8_t)(offset >> 16);
+			out[i+4] = (uint8_t)(offset >> 24);
+		}
+		i += 5;
+	}
+	return true;
+}
+
+// Decompress a single chunk. Chunks that didn't compress are stored as is.
+bool WimDecompressChunk(int compression, const uint8_t* in, uint32_t in_size, uint8_t* out, uint32_t out_size)
+{
+	if (in_size == out_size) {
+		memcpy(out, in, out_size);
+		return true;
+	}
+	if (in_size > out_size)
+		return false;
+	switch (compression) {
+	case WIM_COMPRESSION_XPRESS:
+		return xpress_decompress(in, in_size, out, out_size);
+	case WIM_COMPRESSION_LZX:
+		return lzx_decompress(in, in_size, out, out_size);
+	default:
+		return false;
+	}
+}
+
+bool WimRead(WIM_INFO* wim, uint64_t offset, void* buf, uint32_t size)
+{
+	return wim->read(wim->ctx, wim->base + offset, buf, size);
+}
+
+/*
+ * Return an array of nb_chunks + 1 offsets, relative to the start of the resource,
+ * such that chunk i is located between offsets[i] and offsets[i+1].
+ */
+uint64_t* WimGetChunkOffsets(WIM_INFO* wim, const WIM_RESHDR* reshdr, uint32_t* nb_chunks)
+{
+	uint64_t *offsets, size = WIM_RESHDR_SIZE(*reshdr), table_size;
+	uint8_t* table = NULL;
+	uint32_t i, n, entry_size;
+	bool compressed = (reshdr->flags & WIM_RESHDR_FLAG_COMPRESSED) && (wim->compression != WIM_COMPRESSION_NONE);
+
+	// The chunk table has the offsets of all the chunks but the first, from the end of the table
+	entry_size = (reshdr->original_size > 0xFFFFFFFFULL) ? 8 : 4;
+	n = (uint32_t)((reshdr->original_size + wim->chunk_size - 1) / wim->chunk_size);
+	table_size = (n == 0) ? 0 : (uint64_t)(n - 1) * entry_size;
+	// Validate the sizes before we allocate anything based on them
+	if ( (reshdr->original_size > WIM_MAX_STREAM_SIZE)
+	  || ((compressed) && (n != 0) && (table_size >= size))
+	  || ((!compressed) && (size != reshdr->original_size)) ) {
+		uprintf("WIM: Invalid size for resource at offset %lld\n", reshdr->offset);
+		return NULL;
+	}
+	offsets = (uint64_t*)calloc(n + 1, sizeof(uint64_t));
+	if (offsets == NULL)
+		return NULL;
+	*nb_chunks = n;
+	if (n == 0)
+		return offsets;
+
+	if (!compressed) {
+		for (i=0; i<n; i++)
+			offsets[i] = (uint64_t)i * wim->chunk_size;
+		offsets[n] = size;
+		return offsets;
+	}
+
+	if (table_size != 0) {
+		table = (uint8_t*)malloc((size_t)table_size);
+		if ((table == NULL) || (!WimRead(wim, reshdr->offset, table, (uint32_t)table_size)))
+			goto error;
+	}
+	offsets[0] = table_size;
+	for (i=1; i<n; i++)
+		offsets[i] = table_size + ((entry_size == 8) ? le64(&table[(i-1)*8]) : le32(&table[(i-1)*4]));
+	offsets[n] = size;
+	for (i=0; i<n; i++) {
+		if ( (offsets[i+1] <= offsets[i]) || (offsets[i+1] - offsets[i] >
+			 MIN(wim->chunk_size, reshdr->original_size - (uint64_t)i * wim->chunk_size)) )
+			goto error;
+	}
+	free(table);
+	return offsets;
+
+error:
+	uprintf("WIM: Invalid chunk table for resource at offset %lld\n", reshdr->offset);
+	free(table);
+	free(offsets);
+	return NULL;
+}
+
+// Read a whole resource into memory (used for the lookup table, XML data and metadata)
+uint8_t* WimReadResource(WIM_INFO* wim, const WIM_RESHDR* reshdr)
+{
+	uint8_t *buf = NULL, *cbuf = NULL;
+	uint64_t *offsets = NULL, size = WIM_RESHDR_SIZE(*reshdr);
+	uint32_t i, n, usize;
+
+	if ((reshdr->original_size > WIM_MAX_RESOURCE_SIZE) || (size > WIM_MAX_RESOURCE_SIZE)) {
+		uprintf("WIM: Resource at offset %lld is too large\n", reshdr->offset);
+		return NULL;
+	}
+	offsets = WimGetChunkOffsets(wim, reshdr, &n);
+	buf = (uint8_t*)malloc((size_t)reshdr->original_size + 1);
+	cbuf = (uint8_t*)malloc((size_t)size + 1);
+	if ((offsets == NULL) || (buf == NULL) || (cbuf == NULL) || (!WimRead(wim, reshdr->offset, cbuf, (uint32_t)size)))
+		goto error;
+	for (i=0; i<n; i++) {
+		usize = (uint32_t)MIN(wim->chunk_size, reshdr->original_size - (uint64_t)i * wim->chunk_size);
+		if (!WimDecompressChunk(wim->compression, &cbuf[offsets[i]], (uint32_t)(offsets[i+1] - offsets[i]),
+			&buf[(size_t)i * wim->chunk_size], usize)) {
+			uprintf("WIM: Could not decompress resource at offset %lld\n", reshdr->offset);
+			goto error;
+		}
+	}
+	free(offsets);
+	free(cbuf);
+	return buf;
+
+error:
+	free(offsets);
+	free(cbuf);
+	free(buf);
+	return NULL;
+}
+
+static int wim_hash_cmp(const void* p1, const void* p2)
+{
+	return memcmp((*(WIM_LOOKUP_ENTRY**)p1)->hash, (*(WIM_LOOKUP_ENTRY**)p2)->hash, 20);
+}
+
+bool WimOpen(WIM_INFO* wim, wim_read_t read, void* ctx, uint64_t base)
+{
+	uint32_t i;
+
+	memset(wim, 0, sizeof(WIM_INFO));
+	wim->read = read;
+	wim->ctx = ctx;
+	wim->base = base;
+	if (!WimRead(wim, 0, &wim->hdr, sizeof(wim->hdr)))
+		return false;
+	if ((memcmp(wim->hdr.magic, WIM_MAGIC, sizeof(wim->hdr.magic)) != 0) || (wim->hdr.header_size != WIM_HEADER_SIZE)) {
+		uprintf("WIM: Invalid header\n");
+		return false;
+	}
+	if ((wim->hdr.total_parts != 1) || (wim->hdr.flags & WIM_HDR_FLAG_SPANNED)) {
+		uprintf("WIM: Split WIMs are not supported\n");
+		return false;
+	}
+	if (!(wim->hdr.flags & WIM_HDR_FLAG_COMPRESSION)) {
+		wim->compression = WIM_COMPRESSION_NONE;
+	} else if (wim->hdr.flags & WIM_HDR_FLAG_COMPRESS_LZX) {
+		wim->compression = WIM_COMPRESSION_LZX;
+	} else if (wim->hdr.flags & WIM_HDR_FLAG_COMPRESS_XPRESS) {
+		wim->compression = WIM_COMPRESSION_XPRESS;
+	} else {
+		uprintf("WIM: Unsupported compression (flags 0x%08X)\n", wim->hdr.flags);
+		return false;
+	}
+	wim->chunk_size = (wim->hdr.chunk_size == 0) ? WIM_DEFAULT_CHUNK_SIZE : wim->hdr.chunk_size;
+	// Our LZX decoder only handles the 32 KB window that Microsoft uses
+	if ( (wim->chunk_size > WIM_MAX_CHUNK_SIZE) || (wim->chunk_size & (wim->chunk_size - 1)) ||
+		 ((wim->compression == WIM_COMPRESSION_LZX) && (wim->chunk_size != WIM_DEFAULT_CHUNK_SIZE)) ) {
+		uprintf("WIM: Unsupported chunk size %d\n", wim->chunk_size);
+		return false;
+	}
+
+	wim->lookup = (WIM_LOOKUP_ENTRY*)WimReadResource(wim, &wim->hdr.lookup_table);
+	if (wim->lookup == NULL)
+		return false;
+	wim->nb_lookup = (uint32_t)(wim->hdr.lookup_table.original_size / sizeof(WIM_LOOKUP_ENTRY));
+	wim->sorted = (WIM_LOOKUP_ENTRY**)malloc(MAX(wim->nb_lookup, 1) * sizeof(WIM_LOOKUP_ENTRY*));
+	if (wim->sorted == NULL) {
+		WimClose(wim);
+		return false;
+	}
+	for (i=0; i<wim->nb_lookup; i++) {
+		if (wim->lookup[i].reshdr.flags & WIM_RESHDR_FLAG_SOLID) {
+			uprintf("WIM: Solid (ESD) WIMs are not supported\n");
+			WimClose(wim);
+			return false;
+		}
+		wim->sorted[i] = &wim->lookup[i];
+	}
+	qsort(wim->sorted, wim->nb_lookup, sizeof(WIM_LOOKUP_ENTRY*), wim_hash_cmp);
+	return true;
+}
+
+void WimClose(WIM_INFO* wim)
+{
+	free(wim->lookup);
+	free(wim->sorted);
+	wim->lookup = NULL;
+	wim->sorted = NULL;
+	wim->nb_lookup = 0;
+}
+
+// Return the lookup table index of the resource with the given hash, or WIM_NONE
+uint32_t WimFindResource(WIM_INFO* wim, const uint8_t* hash)
+{
+	WIM_LOOKUP_ENTRY key, *pkey = &key, **r;
+
+	memcpy(key.hash, hash, sizeof(key.hash));
+	r = (WIM_LOOKUP_ENTRY**)bsearch(&pkey, wim->sorted, wim->nb_lookup, sizeof(WIM_LOOKUP_ENTRY*), wim_hash_cmp);
+	return (r == NULL) ? WIM_NONE : (uint32_t)(*r - wim->lookup);
+}
+
+int WimSortCmp(const void* p1, const void* p2)
+{
+	const wim_sort_entry *e1 = (const wim_sort_entry*)p1, *e2 = (const wim_sort_entry*)p2;
+
+	if (e1->key != e2->key)
+		return (e1->key < e2->key) ? -1 : 1;
+	return (e1->index < e2->index) ? -1 : ((e1->index > e2->index) ? 1 : 0);
+}
+
+/*
+ * Image metadata
+ */
+static bool wim_is_zero_hash(const uint8_t* hash)
+{
+	int i;
+
+	for (i=0; i<20; i++) {
+		if (hash[i] != 0)
+			return false;
+	}
+	return true;
+}
+
+// Don't let a crafted image write outside of the target, or to a stream we didn't intend
+static bool wim_is_valid_name(const uint8_t* name, size_t name_nbytes)
+{
+	size_t i;
+	uint16_t c;
+
+	if ( (name_nbytes == 0) || (name_nbytes & 1) || ((name_nbytes <= 4) && (le16(name) == '.') &&
+		 ((name_nbytes == 2) || (le16(&name[2]) == '.'))) )
+		return false;
+	for (i=0; i<name_nbytes/2; i++) {
+		c = le16(&name[2*i]);
+		if ((c == 0) || (c == '\\') || (c == '/') || (c == ':'))
+			return false;
+	}
+	return true;
+}
+
+static uint32_t wim_add_dentry(WIM_METADATA* m, const uint8_t* p, uint32_t parent, const uint8_t* name, uint16_t name_nbytes)
+{
+	wim_dentry* d;
+	int i;
+
+	// Each dentry uses at least WIM_DENTRY_DISK_SIZE bytes of its own in the metadata
+	if (m->nb_dentries >= m->meta_size / WIM_DENTRY_DISK_SIZE)
+		return WIM_NONE;
+	if (m->nb_dentries >= m->max_dentries) {
+		m->max_dentries = (m->max_dentries == 0) ? 4096 : 2 * m->max_dentries;
+		d = (wim_dentry*)realloc(m->dentry, m->max_dentries * sizeof(wim_dentry));
+		if (d == NULL)
+			return WIM_NONE;
+		m->dentry = d;
+	}
+	d = &m->dentry[m->nb_dentries];
+	memset(d, 0, sizeof(wim_dentry));
+	d->parent = parent;
+	d->name = name;
+	d->name_nbytes = name_nbytes;
+	d->attributes = le32(&p[8]);
+	d->security_id = (int32_t)le32(&p[12]);
+	for (i=0; i<3; i++)
+		d->times[i] = le64(&p[40 + 8*i]);
+	d->primary = WIM_NONE;
+	d->first_stream = m->nb_streams;
+	if (d->attributes & WIM_ATTRIBUTE_REPARSE_POINT) {
+		if (!wim_is_zero_hash(&p[64]))
+			d->reparse_hash = &p[64];
+		d->reparse_tag = le32(&p[88]);
+		d->reparse_reserved = le16(&p[92]);
+	} else {
+		if (!wim_is_zero_hash(&p[64]))
+			d->data_hash = &p[64];
+		d->link_group = le64(&p[88]);
+	}
+	return m->nb_dentries++;
+}
+
+static bool wim_add_stream(WIM_METADATA* m, const uint8_t* name, uint16_t name_nbytes, const uint8_t* hash)
+{
+	wim_stream* s;
+
+	if (!wim_is_valid_name(name, name_nbytes))
+		return false;
+	if (m->nb_streams >= m->max_streams) {
+		m->max_streams = (m->max_streams == 0) ? 256 : 2 * m->max_streams;
+		s = (wim_stream*)realloc(m->stream, m->max_streams * sizeof(wim_stream));
+		if (s == NULL)
+			return false;
+		m->stream = s;
+	}
+	s = &m->stream[m->nb_streams++];
+	s->name = name;
+	s->name_nbytes = name_nbytes;
+	s->hash = hash;
+	return true;
+}
+
+// Parse the extra stream entries of a dentry and return the offset past them
+static uint64_t wim_parse_streams(WIM_METADATA* m, uint32_t index, uint64_t offset, uint16_t nb_streams)
+{
+	uint64_t len;
+	uint16_t i, name_nbytes;
+	const uint8_t* p;
+	bool found_reparse = false;
+
+	for (i=0; i<nb_streams; i++) {
+		if (offset + WIM_STREAM_DISK_SIZE > m->meta_size)
+			return 0;
+		p = &m->meta[offset];
+		len = le64(p);
+		name_nbytes = le16(&p[36]);
+		if ((len < WIM_STREAM_DISK_SIZE) || (offset + len > m->meta_size) || (WIM_STREAM_DISK_SIZE + name_nbytes > len))
+			return 0;
+		if (!wim_is_zero_hash(&p[16])) {
+			if (name_nbytes != 0) {
+				if (!wim_add_stream(m, &p[WIM_STREAM_DISK_SIZE], name_nbytes, &p[16]))
+					return 0;
+				m->dentry[index].nb_streams++;
+			// Unnamed streams may also be stored here, in which case the first one of a
+			// reparse point is its reparse data, and the other is the data stream
+			} else if ((m->dentry[index].attributes & WIM_ATTRIBUTE_REPARSE_POINT) && (!found_reparse)) {
+				m->dentry[index].reparse_hash = &p[16];
+				found_reparse = true;
+			} else {
+				m->dentry[index].data_hash = &p[16];
+			}
+		}
+		offset += ALIGN8(len);
+	}
+	return offset;
+}
+
+/*
+ * Mark the dentry at offset as parsed, and return false if it already was, so that
+ * subdir offsets that point back into a directory we've already seen can't loop.
+ */
+static __inline bool wim_visit(uint8_t* visited, uint64_t offset)
+{
+	uint64_t i = offset / 8;
+
+	if (visited[i / 8] & (1 << (i % 8)))
+		return false;
+	visited[i / 8] |= 1 << (i % 8);
+	return true;
+}
+
+// Parse the dentries of a directory, starting at offset, recursively
+static bool wim_parse_dir(WIM_METADATA* m, uint8_t* visited, uint64_t offset, uint32_t parent, int depth)
+{
+	uint64_t len, subdir;
+	uint32_t index;
+	uint16_t name_nbytes;
+	const uint8_t* p;
+
+	if (depth > WIM_MAX_DEPTH)
+		return false;
+	while (true) {
+		if (offset + 8 > m->meta_size)
+			return false;
+		p = &m->meta[offset];
+		len = le64(p);
+		// A zero length entry marks the end of the directory
+		if (len <= 8)
+			return true;
+		if ((len < WIM_DENTRY_DISK_SIZE) || (offset + len > m->meta_size) || (!wim_visit(visited, offset)))
+			return false;
+		name_nbytes = le16(&p[100]);
+		if ((WIM_DENTRY_DISK_SIZE + name_nbytes > len) || (!wim_is_valid_name(&p[WIM_DENTRY_DISK_SIZE], name_nbytes)))
+			return false;
+		index = wim_add_dentry(m, p, parent, &p[WIM_DENTRY_DISK_SIZE], name_nbytes);
+		if (index == WIM_NONE)
+			return false;
+		subdir = le64(&p[16]);
+		offset = wim_parse_streams(m, index, offset + ALIGN8(len), le16(&p[96]));
+		if (offset == 0)
+			return false;
+		if ((m->dentry[index].attributes & WIM_ATTRIBUTE_DIRECTORY) && (subdir != 0)) {
+			if (!wim_parse_dir(m, visited, subdir, index, depth + 1))
+				return false;
+		}
+	}
+}
+
+// Work out the hard link groups, which only apply to files
+static bool wim_link_dentries(WIM_METADATA* m)
+{
+	uint32_t i, j, nb_links = 0;
+	wim_sort_entry* link = (wim_sort_entry*)malloc(MAX(m->nb_dentries, 1) * sizeof(wim_sort_entry));
+
+	if (link == NULL)
+		return false;
+	for (i=0; i<m->nb_dentries; i++) {
+		if ((m->dentry[i].link_group != 0) && (!(m->dentry[i].attributes & WIM_ATTRIBUTE_DIRECTORY))) {
+			link[nb_links].key = m->dentry[i].link_group;
+			link[nb_links++].index = i;
+		}
+	}
+	qsort(link, nb_links, sizeof(wim_sort_entry), WimSortCmp);
+	for (i=0; i<nb_links; i=j) {
+		for (j=i+1; (j<nb_links) && (link[j].key == link[i].key); j++)
+			m->dentry[link[j].index].primary = link[i].index;
+		if (j > i + 1)
+			m->dentry[link[i].index].primary = link[i].index;
+	}
+	free(link);
+	return true;
+}
+
+static bool wim_parse_metadata(WIM_METADATA* m)
+{
+	uint64_t offset, size, sd_len;
+	uint32_t i;
+	size_t sd_total = 0;
+	uint8_t* visited = NULL;
+	bool r = false;
+
+	// Security data
+	if (m->meta_size < 8)
+		return false;
+	sd_len = le32(&m->meta[0]);
+	m->nb_sd = le32(&m->meta[4]);
+	if ((sd_len > m->meta_size) || (8 + (uint64_t)m->nb_sd * 8 > MAX(sd_len, 8)))
+		return false;
+	m->sd = (uint8_t**)calloc(m->nb_sd + 1, sizeof(uint8_t*));
+	offset = 8 + (uint64_t)m->nb_sd * 8;
+	for (i=0; i<m->nb_sd; i++) {
+		size = le64(&m->meta[8 + 8*i]);
+		if ((size > sd_len) || (offset + size > sd_len))
+			return false;
+		sd_total += (size_t)ALIGN8(size);
+		offset += size;
+	}
+	// Security descriptors must be aligned, so copy them
+	m->sd_data = (uint8_t*)malloc(sd_total + 8);
+	if ((m->sd == NULL) || (m->sd_data == NULL))
+		return false;
+	offset = 8 + (uint64_t)m->nb_sd * 8;
+	sd_total = 0;
+	for (i=0; i<m->nb_sd; i++) {
+		size = le64(&m->meta[8 + 8*i]);
+		m->sd[i] = &m->sd_data[sd_total];
+		memcpy(m->sd[i], &m->meta[offset], (size_t)size);
+		sd_total += (size_t)ALIGN8(size);
+		offset += size;
+	}
+
+	// Root directory
+	offset = MAX(ALIGN8(sd_len), 8);
+	if (offset + WIM_DENTRY_DISK_SIZE > m->meta_size)
+		return false;
+	// One bit for each of the 8 byte aligned offsets a dentry can start at
+	visited = (uint8_t*)calloc((size_t)(m->meta_size / 64) + 1, 1);
+	if (visited == NULL)
+		return false;
+	wim_visit(visited, offset);
+	if (wim_add_dentry(m, &m->meta[offset], WIM_NONE, NULL, 0) != 0)
+		goto out;
+	if (wim_parse_streams(m, 0, offset + ALIGN8(le64(&m->meta[offset])), le16(&m->meta[offset + 96])) == 0)
+		goto out;
+	offset = le64(&m->meta[offset + 16]);
+	if ((offset != 0) && (!wim_parse_dir(m, visited, offset, 0, 0)))
+		goto out;
+	r = wim_link_dentries(m);
+
+out:
+	free(visited);
+	return r;
+}
+
+/*
+ * Read and parse the metadata of image 'index' (starting at 1), into the directory
+ * tree, hard link groups, named streams and security descriptors it describes.
+ */
+bool WimReadMetadata(WIM_INFO* wim, int index, WIM_METADATA* m)
+{
+	WIM_RESHDR* metadata = NULL;
+	uint32_t i;
+	int n = 0;
+
+	memset(m, 0, sizeof(WIM_METADATA));
+	for (i=0; i<wim->nb_lookup; i++) {
+		if ((wim->lookup[i].reshdr.flags & WIM_RESHDR_FLAG_METADATA) && (++n == index)) {
+			metadata = &wim->lookup[i].reshdr;
+			break;
+		}
+	}
+	if (metadata == NULL) {
+		uprintf("WIM: Image %d not found\n", index);
+		return false;
+	}
+	m->meta = WimReadResource(wim, metadata);
+	m->meta_size = metadata->original_size;
+	if ((m->meta == NULL) || (!wim_parse_metadata(m))) {
+		uprintf("WIM: Invalid metadata for image %d\n", index);
+		WimFreeMetadata(m);
+		return false;
+	}
+	return true;
+}
+
+void WimFreeMetadata(WIM_METADATA* m)
+{
+	free(m->dentry);
+	free(m->stream);
+	free(m->sd);
+	free(m->sd_data);
+	free(m->meta);
+	memset(m, 0, sizeof(WIM_METADATA));
+}
+
+/*
+ * Splitting into .swm parts
+ */
+
+// Metadata resources go first, as they all need to be in the first part, then everything else in WIM order
+static int wim_split_cmp(const void* p1, const void* p2)
+{
+	const WIM_RESHDR* r1 = &(*(WIM_LOOKUP_ENTRY**)p1)->reshdr;
+	const WIM_RESHDR* r2 = &(*(WIM_LOOKUP_ENTRY**)p2)->reshdr;
+
+	if ((r1->flags ^ r2->flags) & WIM_RESHDR_FLAG_METADATA)
+		return (r1->flags & WIM_RESHDR_FLAG_METADATA) ? -1 : 1;
+	return (r1->offset < r2->offset) ? -1 : ((r1->offset > r2->offset) ? 1 : 0);
+}
+
+/*
+ * Work out the parts of a split WIM that are at most part_size bytes each. 'entries'
+ * and 'part', which must be able to hold wim->nb_lookup elements, are filled with the
+ * resources to copy, in order, and the part (starting at 1) each goes to. Resources
+ * don't need to be decompressed, but they can't be split either.
+ * Returns the number of parts, or 0 on error.
+ */
+uint32_t WimGetSplitLayout(WIM_INFO* wim, uint64_t part_size, WIM_LOOKUP_ENTRY** entries, uint16_t* part, uint32_t* nb_entries)
+{
+	uint64_t size, base_size, used;
+	uint32_t i, nb_parts = 1;
+
+	*nb_entries = 0;
+	for (i=0; i<wim->nb_lookup; i++) {
+		if (!(wim->lookup[i].reshdr.flags & WIM_RESHDR_FLAG_FREE))
+			entries[(*nb_entries)++] = &wim->lookup[i];
+	}
+	qsort(entries, *nb_entries, sizeof(WIM_LOOKUP_ENTRY*), wim_split_cmp);
+
+	// Every part has a header and a copy of the XML data
+	base_size = WIM_HEADER_SIZE + WIM_RESHDR_SIZE(wim->hdr.xml_data);
+	used = base_size;
+	for (i=0; i<*nb_entries; i++) {
+		size = WIM_RESHDR_SIZE(entries[i]->reshdr) + sizeof(WIM_LOOKUP_ENTRY);
+		if ((used + size > part_size) && (used != base_size) && !(entries[i]->reshdr.flags & WIM_RESHDR_FLAG_METADATA)) {
+			nb_parts++;
+			used = base_size;
+		}
+		if (used + size > part_size) {
+			uprintf("WIM: Resource at offset %lld is too large to be split\n", entries[i]->reshdr.offset);
+			return 0;
+		}
+		if (nb_parts > 0xFFFF) {
+			uprintf("WIM: Too many parts\n");
+			return 0;
+		}
+		used += size;
+		part[i] = (uint16_t)nb_parts;
+	}
+	return nb_parts;
+}
+
@@ -0,0 +1,174 @@
+/*
+ * Rufus: The Reliable USB Formatting Utility
+ * WIM image parsing and decompression
+ * Copyright © 2014 Pete Batard <pete@akeo.ie>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * This part of our WIM support has no dependency on Windows, so that it can be built
+ * and tested on any platform, against WIM files: the WIM is read through a callback,
+ * and the names it returns are the UTF-16LE ones from the image.
+ */
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+#pragma once
+
+#define WIM_MAGIC                       "MSWIM\0\0\0"
+#define WIM_HEADER_SIZE                 208
+#define WIM_DEFAULT_CHUNK_SIZE          32768
+#define WIM_MAX_CHUNK_SIZE              65536
+
+/* Header flags */
+#define WIM_HDR_FLAG_COMPRESSION        0x00000002
+#define WIM_HDR_FLAG_SPANNED            0x00000008
+#define WIM_HDR_FLAG_COMPRESS_XPRESS    0x00020000
+#define WIM_HDR_FLAG_COMPRESS_LZX       0x00040000
+#define WIM_HDR_FLAG_COMPRESS_LZMS      0x00080000
+
+/* Resource header flags */
+#define WIM_RESHDR_FLAG_FREE            0x01
+#define WIM_RESHDR_FLAG_METADATA        0x02
+#define WIM_RESHDR_FLAG_COMPRESSED      0x04
+#define WIM_RESHDR_FLAG_SPANNED         0x08
+#define WIM_RESHDR_FLAG_SOLID           0x10
+
+#define WIM_RESHDR_SIZE(r)              ((uint64_t)(r).size[0] | ((uint64_t)(r).size[1] << 8) | \
+	((uint64_t)(r).size[2] << 16) | ((uint64_t)(r).size[3] << 24) | ((uint64_t)(r).size[4] << 32) | \
+	((uint64_t)(r).size[5] << 40) | ((uint64_t)(r).size[6] << 48))
+
+enum wim_compression_type {
+	WIM_COMPRESSION_NONE = 0,
+	WIM_COMPRESSION_XPRESS,
+	WIM_COMPRESSION_LZX,
+};
+
+/*
+ * On-disk structures (Little Endian)
+ * See http://www.microsoft.com/en-us/download/details.aspx?id=13096 (WIM file format)
+ */
+#pragma pack(push, 1)
+typedef struct {
+	uint8_t		size[7];		/* size of the resource in the WIM (56 bits) */
+	uint8_t		flags;
+	uint64_t	offset;
+	uint64_t	original_size;
+} WIM_RESHDR;
+
+typedef struct {
+	char		magic[8];
+	uint32_t	header_size;
+	uint32_t	version;
+	uint32_t	flags;
+	uint32_t	chunk_size;
+	uint8_t		guid[16];
+	uint16_t	part_number;
+	uint16_t	total_parts;
+	uint32_t	image_count;
+	WIM_RESHDR	lookup_table;
+	WIM_RESHDR	xml_data;
+	WIM_RESHDR	boot_metadata;
+	uint32_t	boot_index;
+	WIM_RESHDR	integrity;
+	uint8_t		unused[60];
+} WIM_HEADER;
+
+typedef struct {
+	WIM_RESHDR	reshdr;
+	uint16_t	part_number;
+	uint32_t	refcount;
+	uint8_t		hash[20];
+} WIM_LOOKUP_ENTRY;
+#pragma pack(pop)
+
+#define WIM_NONE                        0xFFFFFFFF
+
+/* The attributes we need to know about, which are the same as Windows' */
+#define WIM_ATTRIBUTE_DIRECTORY         0x00000010
+#define WIM_ATTRIBUTE_REPARSE_POINT     0x00000400
+
+/* Read 'size' bytes at 'offset' from the file or device that contains the WIM */
+typedef bool (*wim_read_t)(void* ctx, uint64_t offset, void* buf, uint32_t size);
+
+typedef struct {
+	wim_read_t			read;
+	void*				ctx;
+	uint64_t			base;			/* offset of the WIM in the above */
+	WIM_HEADER			hdr;
+	WIM_LOOKUP_ENTRY*	lookup;
+	WIM_LOOKUP_ENTRY**	sorted;			/* lookup table entries, sorted by hash */
+	uint32_t			nb_lookup;
+	uint32_t			chunk_size;
+	int					compression;
+} WIM_INFO;
+
+/*
+ * The directory tree of an image. Entries are listed depth first, so that
+ * a directory always comes before its content, and the root is entry 0.
+ */
+typedef struct {
+	uint32_t parent;				/* index of the parent directory, or WIM_NONE for the root */
+	const uint8_t* name;			/* UTF-16LE, not NUL terminated (NULL for the root) */
+	uint16_t name_nbytes;
+	const uint8_t* data_hash;		/* unnamed data stream */
+	const uint8_t* reparse_hash;	/* reparse point data */
+	uint64_t times[3];				/* creation, last access, last write */
+	uint64_t link_group;
+	uint32_t attributes;
+	int32_t security_id;
+	uint32_t reparse_tag;
+	uint16_t reparse_reserved;
+	uint32_t primary;				/* first entry of the hard link group, or WIM_NONE */
+	uint32_t first_stream;			/* named data streams, in WIM_METADATA.stream[] */
+	uint32_t nb_streams;
+} wim_dentry;
+
+typedef struct {
+	const uint8_t* name;			/* UTF-16LE, not NUL terminated */
+	uint16_t name_nbytes;
+	const uint8_t* hash;
+} wim_stream;
+
+typedef struct {
+	uint8_t* meta;					/* the metadata resource, that the above point into */
+	uint64_t meta_size;
+	uint8_t** sd;					/* security descriptors (8 byte aligned) */
+	uint8_t* sd_data;
+	uint32_t nb_sd;
+	wim_dentry* dentry;
+	uint32_t nb_dentries, max_dentries;
+	wim_stream* stream;
+	uint32_t nb_streams, max_streams;
+} WIM_METADATA;
+
+typedef struct {
+	uint64_t key;
+	uint32_t index;
+} wim_sort_entry;
+
+bool WimOpen(WIM_INFO* wim, wim_read_t read, void* ctx, uint64_t base);
+void WimClose(WIM_INFO* wim);
+bool WimRead(WIM_INFO* wim, uint64_t offset, void* buf, uint32_t size);
+uint64_t* WimGetChunkOffsets(WIM_INFO* wim, const WIM_RESHDR* reshdr, uint32_t* nb_chunks);
+uint8_t* WimReadResource(WIM_INFO* wim, const WIM_RESHDR* reshdr);
+bool WimDecompressChunk(int compression, const uint8_t* in, uint32_t in_size, uint8_t* out, uint32_t out_size);
+uint32_t WimFindResource(WIM_INFO* wim, const uint8_t* hash);
+bool WimReadMetadata(WIM_INFO* wim, int index, WIM_METADATA* m);
+void WimFreeMetadata(WIM_METADATA* m);
+uint32_t WimGetSplitLayout(WIM_INFO* wim, uint64_t part_size, WIM_LOOKUP_ENTRY** entries, uint16_t* part, uint32_t* nb_entries);
+int WimSortCmp(const void* p1, const void* p2);
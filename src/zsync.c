@@ -0,0 +1,649 @@
+/*
+ * Rufus: The Reliable USB Formatting Utility
+ * zsync image reconstruction
+ * Copyright © 2015 Pete Batard <pete@akeo.ie>
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Most of a new release of a distro image is usually identical to the previous one,
+ * that users tend to still have lying around. So, rather than download the whole of
+ * the new image, we can use a zsync control file, that lists the checksums of each of
+ * its blocks, to find the ones we already have, and only download the rest.
+ *
+ * The control file is the one produced by zsyncmake (see http://zsync.moria.org.uk/):
+ * a set of "Key: Value" header lines, followed by a blank line, and then, for each
+ * block of the target, the last bytes of its big endian rolling checksum and the first
+ * bytes of its MD4. The last block is padded with zeros. Compressed (Z-URL) targets are
+ * not supported.
+ *
+ * The older image(s) we use as seed are the target itself, if it exists, and the file
+ * with the same extension and the closest name to the target, from the directory of the
+ * control file. The missing data is then downloaded from the target's URL which, when
+ * relative, designates a file located alongside the control file.
+ */
+
+#include <windows.h>
+#include <commctrl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "rufus.h"
+#include "msapi_utf8.h"
+#include "resource.h"
+#include "localization.h"
+
+#define ZSYNC_MAGIC                 "zsync:"
+#define ZSYNC_SCAN_SIZE             (1024 * 1024)
+#define ZSYNC_FETCH_SIZE            (4 * 1024 * 1024)
+#define ZSYNC_MAX_BLOCK_SIZE        (64 * 1024)
+#define ZSYNC_PART_EXT              ".part"
+
+typedef struct {
+	uint16_t a;
+	uint16_t b;
+} rsum;
+
+typedef struct {
+	char filename[MAX_PATH];
+	char* url;
+	uint64_t length;
+	uint32_t blocksize;
+	uint32_t nb_blocks;
+	uint32_t nb_known;
+	int seq_matches;
+	int rsum_bytes;
+	int checksum_bytes;
+	uint16_t a_mask;
+	BOOL has_sha1;
+	uint8_t sha1[20];
+	rsum* rsum;
+	uint8_t* checksum;
+	uint8_t* known;
+	uint32_t* hash;
+	uint32_t* next;
+	uint32_t hash_mask;
+	HANDLE hDest;
+} zsync_info;
+
+/*
+ * MD4 (RFC 1320)
+ */
+#define ROL32(x, n) (((x) << (n)) | ((x) >> (32 - (n))))
+
+static void md4_transform(uint32_t* h, const uint8_t* p)
+{
+	static const uint8_t r2[16] = { 0, 4, 8, 12, 1, 5, 9, 13, 2, 6, 10, 14, 3, 7, 11, 15 };
+	static const uint8_t r3[16] = { 0, 8, 4, 12, 2, 10, 6, 14, 1, 9, 5, 13, 3, 11, 7, 15 };
+	static const uint8_t s[3][4] = { { 3, 7, 11, 19 }, { 3, 5, 9, 13 }, { 3, 9, 11, 15 } };
+	uint32_t x[16], a = h[0], b = h[1], c = h[2], d = h[3], t;
+	int i;
+
+	for (i = 0; i < 16; i++)
+		x[i] = p[4*i] | (p[4*i + 1] << 8) | (p[4*i + 2] << 16) | ((uint32_t)p[4*i + 3] << 24);
+	for (i = 0; i < 48; i++) {
+		if (i < 16)
+			t = a + ((b & c) | (~b & d)) + x[i];
+		else if (i < 32)
+			t = a + ((b & c) | (b & d) | (c & d)) + x[r2[i - 16]] + 0x5a827999;
+		else
+			t = a + (b ^ c ^ d) + x[r3[i - 32]] + 0x6ed9eba1;
+		a = d; d = c; c = b;
+		b = ROL32(t, s[i / 16][i % 4]);
+	}
+	h[0] += a; h[1] += b; h[2] += c; h[3] += d;
+}
+
+static void md4(const uint8_t* data, size_t len, uint8_t* digest)
+{
+	uint32_t h[4] = { 0x67452301, 0xefcdab89, 0x98badcfe, 0x10325476 };
+	uint64_t bits = (uint64_t)len * 8;
+	uint8_t buf[128];
+	size_t i, n;
+
+	for (i = 0; i + 64 <= len; i += 64)
+		md4_transform(h, &data[i]);
+	n = len - i;
+	memcpy(buf, &data[i], n);
+	buf[n++] = 0x80;
+	memset(&buf[n], 0, sizeof(buf) - n);
+	n = (n <= 56) ? 64 : 128;
+	for (i = 0; i < 8; i++)
+		buf[n - 8 + i] = (uint8_t)(bits >> (8 * i));
+	md4_transform(h, buf);
+	if (n == 128)
+		md4_transform(h, &buf[64]);
+	for (i = 0; i < 16; i++)
+		digest[i] = (uint8_t)(h[i / 4] >> (8 * (i % 4)));
+}
+
+/*
+ * The rolling checksum from rsync, as used by zsync
+ */
+static __inline rsum calc_rsum(const uint8_t* data, uint32_t len)
+{
+	rsum r = { 0, 0 };
+
+	for (; len > 0; len--) {
+		r.a += *data;
+		r.b += (uint16_t)(len * *data++);
+	}
+	return r;
+}
+
+static __inline uint32_t rsum_hash(const zsync_info* z, rsum r)
+{
+	return ((((uint32_t)(r.a & z->a_mask) << 16) | r.b) * 2654435761U >> 8) & z->hash_mask;
+}
+
+static __inline BOOL rsum_match(const zsync_info* z, rsum r, uint32_t block)
+{
+	return ((r.a & z->a_mask) == z->rsum[block].a) && (r.b == z->rsum[block].b);
+}
+
+static BOOL ReadAt(HANDLE h, uint64_t offset, void* buf, DWORD size, DWORD* read)
+{
+	LARGE_INTEGER li;
+
+	li.QuadPart = offset;
+	return SetFilePointerEx(h, li, NULL, FILE_BEGIN) && ReadFile(h, buf, size, read, NULL);
+}
+
+static BOOL WriteBlock(zsync_info* z, uint32_t block, const uint8_t* data)
+{
+	LARGE_INTEGER li;
+	DWORD size, wSize;
+
+	li.QuadPart = (uint64_t)block * z->blocksize;
+	size = (DWORD)MIN(z->blocksize, z->length - li.QuadPart);
+	if ( (!SetFilePointerEx(z->hDest, li, NULL, FILE_BEGIN))
+	  || (!WriteFile(z->hDest, data, size, &wSize, NULL)) || (wSize != size) ) {
+		uprintf("Could not write block %d: %s", block, WindowsErrorString());
+		FormatStatus = ERROR_SEVERITY_ERROR|FAC(FACILITY_STORAGE)|ERROR_WRITE_FAULT;
+		return FALSE;
+	}
+	z->known[block] = 1;
+	z->nb_known++;
+	return TRUE;
+}
+
+static void SetProgress(uint64_t done, uint64_t total)
+{
+	if (total == 0)
+		return;
+	SendMessage(hProgress, PBM_SETPOS, (WPARAM)(MAX_PROGRESS*((1.0f*done)/(1.0f*total))), 0);
+	SetTaskbarProgressValue(done, total);
+}
+
+BOOL IsZsyncControlFile(const char* path)
+{
+	FILE* fd;
+	char magic[sizeof(ZSYNC_MAGIC) - 1];
+	BOOL r;
+
+	fd = fopenU(path, "rb");
+	if (fd == NULL)
+		return FALSE;
+	r = (fread(magic, 1, sizeof(magic), fd) == sizeof(magic)) && (memcmp(magic, ZSYNC_MAGIC, sizeof(magic)) == 0);
+	fclose(fd);
+	return r;
+}
+
+static BOOL ReadControlFile(zsync_info* z, const char* path)
+{
+	FILE* fd;
+	char line[1024], *val, *p;
+	uint8_t buf[20];
+	uint32_t i, j, h;
+	BOOL has_zurl = FALSE, r = FALSE;
+
+	fd = fopenU(path, "rb");
+	if (fd == NULL) {
+		uprintf("Could not open zsync control file '%s'", path);
+		return FALSE;
+	}
+	while (fgets(line, sizeof(line), fd) != NULL) {
+		line[strcspn(line, "\r\n")] = 0;
+		if (line[0] == 0)
+			break;
+		val = strchr(line, ':');
+		if (val == NULL)
+			continue;
+		for (*val++ = 0; *val == ' '; val++);
+		if (strcmp(line, "Filename") == 0) {
+			// Never write anywhere but alongside the control file
+			for (p = &val[strlen(val)]; (p != val) && (p[-1] != '/') && (p[-1] != '\\'); p--);
+			safe_strcpy(z->filename, sizeof(z->filename), p);
+		} else if ((strcmp(line, "URL") == 0) && (z->url == NULL)) {
+			z->url = safe_strdup(val);
+		} else if (strcmp(line, "Z-URL") == 0) {
+			has_zurl = TRUE;
+		} else if (strcmp(line, "Blocksize") == 0) {
+			z->blocksize = (uint32_t)atoi(val);
+		} else if (strcmp(line, "Length") == 0) {
+			sscanf(val, "%llu", &z->length);
+		} else if (strcmp(line, "Hash-Lengths") == 0) {
+			sscanf(val, "%d,%d,%d", &z->seq_matches, &z->rsum_bytes, &z->checksum_bytes);
+		} else if ((strcmp(line, "SHA-1") == 0) && (strlen(val) == 2 * sizeof(z->sha1))) {
+			for (i = 0; i < sizeof(z->sha1); i++) {
+				sscanf(&val[2 * i], "%2x", &j);
+				z->sha1[i] = (uint8_t)j;
+			}
+			z->has_sha1 = TRUE;
+		}
+	}
+	if (z->url == NULL) {
+		uprintf("zsync: %s", has_zurl ? "Compressed targets are not supported" : "No URL for the target");
+		goto out;
+	}
+	if ( (z->filename[0] == 0) || (z->length == 0) || (z->blocksize == 0) || (z->blocksize > ZSYNC_MAX_BLOCK_SIZE)
+	  || ((z->blocksize & (z->blocksize - 1)) != 0) || (z->seq_matches < 1) || (z->seq_matches > 2)
+	  || (z->rsum_bytes < 2) || (z->rsum_bytes > 4) || (z->checksum_bytes < 3) || (z->checksum_bytes > 16) ) {
+		uprintf("zsync: Invalid or unsupported control file header");
+		goto out;
+	}
+	z->nb_blocks = (uint32_t)((z->length + z->blocksize - 1) / z->blocksize);
+	z->a_mask = (z->rsum_bytes < 3) ? 0 : ((z->rsum_bytes == 3) ? 0xff : 0xffff);
+	for (z->hash_mask = 1; z->hash_mask < z->nb_blocks; z->hash_mask <<= 1);
+	z->hash_mask--;
+	z->rsum = (rsum*)malloc(z->nb_blocks * sizeof(rsum));
+	z->checksum = (uint8_t*)malloc((size_t)z->nb_blocks * z->checksum_bytes);
+	z->known = (uint8_t*)calloc(z->nb_blocks, 1);
+	z->next = (uint32_t*)malloc(z->nb_blocks * sizeof(uint32_t));
+	z->hash = (uint32_t*)malloc((z->hash_mask + 1) * sizeof(uint32_t));
+	if ((z->rsum == NULL) || (z->checksum == NULL) || (z->known == NULL) || (z->next == NULL) || (z->hash == NULL))
+		goto out;
+	memset(z->hash, 0xff, (z->hash_mask + 1) * sizeof(uint32_t));
+
+	// Only the last rsum_bytes of each (big endian) rolling checksum are stored
+	memset(buf, 0, sizeof(buf));
+	for (i = 0; i < z->nb_blocks; i++) {
+		if ( (fread(&buf[4 - z->rsum_bytes], 1, z->rsum_bytes, fd) != (size_t)z->rsum_bytes)
+		  || (fread(&z->checksum[(size_t)i * z->checksum_bytes], 1, z->checksum_bytes, fd) != (size_t)z->checksum_bytes) ) {
+			uprintf("zsync: Control file is truncated");
+			goto out;
+		}
+		z->rsum[i].a = (buf[0] << 8) | buf[1];
+		z->rsum[i].b = (buf[2] << 8) | buf[3];
+	}
+	// Chain the blocks with the same hash, in reverse, so that lookups return them in order
+	for (i = z->nb_blocks; i > 0; i--) {
+		h = rsum_hash(z, z->rsum[i - 1]);
+		z->next[i - 1] = z->hash[h];
+		z->hash[h] = i - 1;
+	}
+	r = TRUE;
+
+out:
+	fclose(fd);
+	return r;
+}
+
+/*
+ * Check whether the data at buf, for which we have the rolling checksum r, matches
+ * any of the blocks we're missing, and write it to all of the ones it does. If the
+ * control file says so, a block only counts as matched if the next one also does,
+ * which is what allows the checksums to be stored in fewer bytes.
+ */
+static int MatchBlock(zsync_info* z, const uint8_t* buf, uint32_t len, rsum r)
+{
+	uint8_t digest[16], next_digest[16];
+	BOOL has_digest = FALSE, has_next_digest = FALSE;
+	uint32_t i;
+	int matched = 0;
+
+	for (i = z->hash[rsum_hash(z, r)]; i != 0xffffffff; i = z->next[i]) {
+		if ((z->known[i]) || (!rsum_match(z, r, i)))
+			continue;
+		if (!has_digest) {
+			md4(buf, z->blocksize, digest);
+			has_digest = TRUE;
+		}
+		if (memcmp(digest, &z->checksum[(size_t)i * z->checksum_bytes], z->checksum_bytes) != 0)
+			continue;
+		if ((z->seq_matches > 1) && (i + 1 < z->nb_blocks)) {
+			if (len < 2 * z->blocksize)
+				continue;
+			if (!has_next_digest) {
+				md4(&buf[z->blocksize], z->blocksize, next_digest);
+				has_next_digest = TRUE;
+			}
+			if ( (!rsum_match(z, calc_rsum(&buf[z->blocksize], z->blocksize), i + 1))
+			  || (memcmp(next_digest, &z->checksum[(size_t)(i + 1) * z->checksum_bytes], z->checksum_bytes) != 0) )
+				continue;
+			if ((!z->known[i + 1]) && (!WriteBlock(z, i + 1, &buf[z->blocksize])))
+				return -1;
+		}
+		if (!WriteBlock(z, i, buf))
+			return -1;
+		matched++;
+	}
+	return matched;
+}
+
+/*
+ * Look for the blocks we're missing anywhere in a seed file, using a rolling checksum.
+ */
+static BOOL ScanSeed(zsync_info* z, const char* path)
+{
+	HANDLE hSeed;
+	LARGE_INTEGER seed_size;
+	uint8_t* buf = NULL;
+	uint64_t offset = 0;
+	uint32_t bs = z->blocksize, pos = 0, len = 0, prev_known = z->nb_known;
+	DWORD rSize;
+	BOOL eof = FALSE, r = FALSE, roll = FALSE;
+	rsum rs = { 0, 0 };
+	uint8_t c;
+	int m;
+
+	hSeed = CreateFileU(path, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+	if (hSeed == INVALID_HANDLE_VALUE)
+		return FALSE;
+	if (!GetFileSizeEx(hSeed, &seed_size))
+		seed_size.QuadPart = 0;
+	uprintf("zsync: Looking for blocks in '%s'...", path);
+	PrintInfo(0, MSG_202);
+	SetProgress(0, seed_size.QuadPart);
+	// Room for a scan chunk, as well as the two blocks we may need to look at
+	buf = (uint8_t*)malloc(ZSYNC_SCAN_SIZE + 2 * bs);
+	if (buf == NULL)
+		goto out;
+
+	while (z->nb_known < z->nb_blocks) {
+		if (IS_ERROR(FormatStatus))
+			goto out;
+		// Refill the buffer when we run out of data to look ahead
+		if ((!eof) && (len - pos < 2 * bs)) {
+			memmove(buf, &buf[pos], len - pos);
+			len -= pos;
+			pos = 0;
+			if (!ReadAt(hSeed, offset, &buf[len], ZSYNC_SCAN_SIZE, &rSize)) {
+				uprintf("zsync: Could not read '%s': %s", path, WindowsErrorString());
+				goto out;
+			}
+			offset += rSize;
+			len += rSize;
+			SetProgress(MIN(offset, (uint64_t)seed_size.QuadPart), seed_size.QuadPart);
+			// The last block of the target is padded with zeros, so pad the end of the seed too
+			if (rSize == 0) {
+				eof = TRUE;
+				memset(&buf[len], 0, bs);
+				len += bs;
+			}
+		}
+		if (len - pos < bs)
+			break;
+		if (roll) {
+			// Slide the window one byte forward
+			rs.a += buf[pos + bs - 1] - c;
+			rs.b += rs.a - (uint16_t)(bs * c);
+		} else {
+			rs = calc_rsum(&buf[pos], bs);
+		}
+		m = MatchBlock(z, &buf[pos], len - pos, rs);
+		if (m < 0)
+			goto out;
+		// Skip over the data we just matched
+		if (m > 0) {
+			pos += bs;
+			roll = FALSE;
+		} else {
+			// Keep the byte that leaves the window, as a refill may move it out of the buffer
+			c = buf[pos++];
+			roll = TRUE;
+		}
+	}
+	uprintf("zsync: Found %d block(s) in '%s'", z->nb_known - prev_known, path);
+	r = TRUE;
+
+out:
+	free(buf);
+	safe_closehandle(hSeed);
+	return r;
+}
+
+/*
+ * Use the file from the control file's directory that has the same extension as the
+ * target and the longest name in common with it, as a seed.
+ */
+static char* FindSeed(const char* dir, const char* target)
+{
+	WIN32_FIND_DATAW wfd;
+	HANDLE hFind;
+	char pattern[MAX_PATH], *name, *seed = NULL;
+	const char* ext = strrchr(target, '.');
+	size_t i, best = 0;
+
+	if (ext == NULL)
+		return NULL;
+	static_sprintf(pattern, "%s*%s", dir, ext);
+	{
+		wconvert(pattern);
+		hFind = FindFirstFileW(wpattern, &wfd);
+		wfree(pattern);
+	}
+	if (hFind == INVALID_HANDLE_VALUE)
+		return NULL;
+	do {
+		if (wfd.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY)
+			continue;
+		name = wchar_to_utf8(wfd.cFileName);
+		if ((name != NULL) && (_stricmp(name, target) != 0)) {
+			for (i = 0; (name[i] != 0) && (tolower(name[i]) == tolower(target[i])); i++);
+			if (i > best) {
+				best = i;
+				safe_free(seed);
+				seed = (char*)malloc(strlen(dir) + strlen(name) + 1);
+				if (seed != NULL) {
+					strcpy(seed, dir);
+					strcat(seed, name);
+				}
+			}
+		}
+		safe_free(name);
+	} while (FindNextFileW(hFind, &wfd));
+	FindClose(hFind);
+	return seed;
+}
+
+/*
+ * Get the data for the blocks we couldn't find locally from the source, which is
+ * either a remote URL or a file, and check it against the block checksums.
+ */
+static BOOL FetchMissingBlocks(zsync_info* z, const char* source)
+{
+	HANDLE hSource = INVALID_HANDLE_VALUE;
+	BOOL remote = (strstr(source, "://") != NULL), r = FALSE;
+	uint32_t i, j, k, nb, max_nb = ZSYNC_FETCH_SIZE / z->blocksize, nb_missing = z->nb_blocks - z->nb_known;
+	uint64_t offset, fetched = 0;
+	DWORD size, rSize;
+	uint8_t *buf = NULL, digest[16];
+
+	if (nb_missing == 0)
+		return TRUE;
+	uprintf("zsync: Getting %d missing block(s) (%s) from %s", nb_missing,
+		SizeToHumanReadable((uint64_t)nb_missing * z->blocksize, FALSE, FALSE), source);
+	if (remote) {
+		// All the ranges we need are requested over the same connection
+		if (!OpenRangeDownload(source))
+			goto out;
+	} else {
+		hSource = CreateFileU(source, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, 0, NULL);
+		if (hSource == INVALID_HANDLE_VALUE) {
+			uprintf("zsync: Could not open '%s': %s", source, WindowsErrorString());
+			goto out;
+		}
+	}
+	buf = (uint8_t*)malloc(max_nb * z->blocksize);
+	if (buf == NULL)
+		goto out;
+
+	for (i = 0; i < z->nb_blocks; i += nb) {
+		if (IS_ERROR(FormatStatus))
+			goto out;
+		if (z->known[i]) {
+			nb = 1;
+			continue;
+		}
+		// Get as many consecutive missing blocks as we can at once
+		for (nb = 1; (i + nb < z->nb_blocks) && (nb < max_nb) && (!z->known[i + nb]); nb++);
+		offset = (uint64_t)i * z->blocksize;
+		size = (DWORD)MIN((uint64_t)nb * z->blocksize, z->length - offset);
+		if (remote)
+			rSize = DownloadRange(offset, size, buf);
+		else if (!ReadAt(hSource, offset, buf, size, &rSize))
+			rSize = 0;
+		if (rSize != size) {
+			uprintf("zsync: Could not get data at offset 0x%llx from %s", offset, source);
+			if (!IS_ERROR(FormatStatus))
+				FormatStatus = ERROR_SEVERITY_ERROR|FAC(FACILITY_STORAGE)|ERROR_READ_FAULT;
+			goto out;
+		}
+		memset(&buf[size], 0, nb * z->blocksize - size);
+		for (j = 0; j < nb; j++) {
+			k = i + j;
+			md4(&buf[j * z->blocksize], z->blocksize, digest);
+			if (memcmp(digest, &z->checksum[(size_t)k * z->checksum_bytes], z->checksum_bytes) != 0) {
+				uprintf("zsync: Block %d from %s does not match its checksum", k, source);
+				goto out;
+			}
+			if (!WriteBlock(z, k, &buf[j * z->blocksize]))
+				goto out;
+		}
+		fetched += nb;
+		SetProgress(fetched, nb_missing);
+		PrintInfo(0, MSG_241, (100.0f * fetched) / (1.0f * nb_missing));
+	}
+	r = TRUE;
+
+out:
+	if (remote)
+		CloseRangeDownload();
+	free(buf);
+	safe_closehandle(hSource);
+	return r;
+}
+
+static BOOL CheckTarget(zsync_info* z)
+{
+	sha1_ctx ctx;
+	uint8_t *buf, digest[20];
+	uint64_t offset;
+	DWORD rSize;
+	BOOL r = FALSE;
+
+	if (!z->has_sha1)
+		return TRUE;
+	buf = (uint8_t*)malloc(ZSYNC_SCAN_SIZE);
+	if (buf == NULL)
+		return FALSE;
+	sha1_init(&ctx);
+	for (offset = 0; offset < z->length; offset += rSize) {
+		if (IS_ERROR(FormatStatus))
+			goto out;
+		if ( (!ReadAt(z->hDest, offset, buf, (DWORD)MIN(ZSYNC_SCAN_SIZE, z->length - offset), &rSize))
+		  || (rSize == 0) )
+			goto out;
+		sha1_update(&ctx, buf, rSize);
+		SetProgress(offset + rSize, z->length);
+	}
+	sha1_final(&ctx, digest);
+	r = (memcmp(digest, z->sha1, sizeof(digest)) == 0);
+
+out:
+	if ((!r) && (!IS_ERROR(FormatStatus)))
+		uprintf("zsync: The SHA-1 of the reconstructed image does not match the expected one");
+	free(buf);
+	return r;
+}
+
+/*
+ * Reconstruct the image described by a zsync control file, next to it, and return
+ * its path, which must be freed by the caller, or NULL on error.
+ */
+char* ZsyncReconstruct(const char* control_path)
+{
+	zsync_info z = { 0 };
+	LARGE_INTEGER li;
+	char dir[MAX_PATH], target[MAX_PATH], part[MAX_PATH], source[MAX_PATH], *seed = NULL, *p;
+	const char* src;
+	BOOL r = FALSE, created = FALSE;
+
+	z.hDest = INVALID_HANDLE_VALUE;
+	part[0] = 0;
+	if (!ReadControlFile(&z, control_path))
+		goto out;
+	safe_strcpy(dir, sizeof(dir), control_path);
+	for (p = &dir[strlen(dir)]; (p != dir) && (p[-1] != '\\') && (p[-1] != '/'); p--);
+	*p = 0;
+	static_sprintf(target, "%s%s", dir, z.filename);
+	static_sprintf(part, "%s%s", target, ZSYNC_PART_EXT);
+	// Relative URLs point to files located alongside the control file
+	if ((strstr(z.url, "://") == NULL) && (z.url[0] != '\\') && (z.url[0] != '/') && (z.url[1] != ':')) {
+		static_sprintf(source, "%s%s", dir, z.url);
+		src = source;
+	} else {
+		src = z.url;
+	}
+	uprintf("zsync: Reconstructing '%s' (%s, %d blocks of %d bytes)", target,
+		SizeToHumanReadable(z.length, FALSE, FALSE), z.nb_blocks, z.blocksize);
+
+	z.hDest = CreateFileU(part, GENERIC_READ|GENERIC_WRITE, FILE_SHARE_READ, NULL, CREATE_ALWAYS,
+		FILE_ATTRIBUTE_NORMAL, NULL);
+	created = (z.hDest != INVALID_HANDLE_VALUE);
+	li.QuadPart = z.length;
+	if ( (z.hDest == INVALID_HANDLE_VALUE) || (!SetFilePointerEx(z.hDest, li, NULL, FILE_BEGIN))
+	  || (!SetEndOfFile(z.hDest)) ) {
+		uprintf("zsync: Could not create '%s': %s", part, WindowsErrorString());
+		goto out;
+	}
+
+	ScanSeed(&z, target);
+	seed = FindSeed(dir, z.filename);
+	if ((seed != NULL) && (z.nb_known < z.nb_blocks))
+		ScanSeed(&z, seed);
+	if (IS_ERROR(FormatStatus))
+		goto out;
+	uprintf("zsync: %d of %d blocks were found locally", z.nb_known, z.nb_blocks);
+	if ((!FetchMissingBlocks(&z, src)) || (!CheckTarget(&z)))
+		goto out;
+	safe_closehandle(z.hDest);
+	if (!MoveFileExU(part, target, MOVEFILE_REPLACE_EXISTING)) {
+		uprintf("zsync: Could not rename '%s': %s", part, WindowsErrorString());
+		goto out;
+	}
+	uprintf("zsync: Successfully reconstructed '%s'", target);
+	r = TRUE;
+
+out:
+	if (!r) {
+		safe_closehandle(z.hDest);
+		// The .part file may already be closed, if we failed to rename it
+		if (created)
+			DeleteFileU(part);
+		if (!IS_ERROR(FormatStatus))
+			FormatStatus = ERROR_SEVERITY_ERROR|FAC(FACILITY_STORAGE)|ERROR_INVALID_DATA;
+	}
+	safe_free(seed);
+	safe_free(z.url);
+	safe_free(z.rsum);
+	safe_free(z.checksum);
+	safe_free(z.known);
+	safe_free(z.hash);
+	safe_free(z.next);
+	return r ? safe_strdup(target) : NULL;
+}